@@ -61,6 +61,9 @@ gboolean g_dbus_set_disconnect_function(DBusConnection *connection,
 
 typedef void (* GDBusDestroyFunction) (void *user_data);
 
+typedef void (* GDBusFlushFunction) (DBusConnection *connection,
+						DBusMessage *message);
+
 typedef DBusMessage * (* GDBusMethodFunction) (DBusConnection *connection,
 					DBusMessage *message, void *user_data);
 
@@ -222,6 +225,7 @@ struct GDBusSecurityTable {
 
 void g_dbus_set_flags(int flags);
 int g_dbus_get_flags(void);
+void g_dbus_set_flush_function(GDBusFlushFunction function);
 
 gboolean g_dbus_register_interface(DBusConnection *connection,
 					const char *path, const char *name,
@@ -85,6 +85,7 @@ struct property_data {
 };
 
 static int global_flags = 0;
+static GDBusFlushFunction flush_function = NULL;
 static struct generic_data *root;
 static GSList *pending = NULL;
 
@@ -1478,10 +1479,13 @@ DBusMessage *g_dbus_create_reply(DBusMessage *message, int type, ...)
 	return reply;
 }
 
-static void g_dbus_flush(DBusConnection *connection)
+static void g_dbus_flush(DBusConnection *connection, DBusMessage *message)
 {
 	GSList *l;
 
+	if (flush_function)
+		flush_function(connection, message);
+
 	for (l = pending; l;) {
 		struct generic_data *data = l->data;
 
@@ -1510,7 +1514,7 @@ gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message)
 	}
 
 	/* Flush pending signal to guarantee message order */
-	g_dbus_flush(connection);
+	g_dbus_flush(connection, message);
 
 	result = dbus_connection_send(connection, message, NULL);
 
@@ -1527,7 +1531,7 @@ gboolean g_dbus_send_message_with_reply(DBusConnection *connection,
 	dbus_bool_t ret;
 
 	/* Flush pending signal to guarantee message order */
-	g_dbus_flush(connection);
+	g_dbus_flush(connection, message);
 
 	ret = dbus_connection_send_with_reply(connection, message, call,
 								timeout);
@@ -1843,3 +1847,8 @@ int g_dbus_get_flags(void)
 {
 	return global_flags;
 }
+
+void g_dbus_set_flush_function(GDBusFlushFunction function)
+{
+	flush_function = function;
+}
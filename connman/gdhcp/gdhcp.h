@@ -236,6 +236,7 @@ void g_dhcp_server_set_save_lease(GDHCPServer *dhcp_server,
 				GDHCPSaveLeaseFunc func, gpointer user_data);
 void g_dhcp_server_set_lease_added_cb(GDHCPServer *dhcp_server,
 							GDHCPLeaseAddedCb cb);
+int g_dhcp_server_set_lease_file(GDHCPServer *dhcp_server, const char *path);
 
 int dhcp_get_random(uint64_t *val);
 void dhcp_cleanup_random(void);
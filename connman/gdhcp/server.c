@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
@@ -48,6 +49,14 @@
 /* 5 minutes  */
 #define OFFER_TIME (5*60)
 
+#define LONG_BITS (sizeof(unsigned long) * 8)
+
+#define LEASE_JOURNAL_MAGIC	0x4c454153
+/* seconds lease changes are collected before they are written */
+#define LEASE_JOURNAL_DELAY	1
+/* stale records tolerated on top of twice the number of leases */
+#define LEASE_JOURNAL_SLACK	64
+
 struct _GDHCPServer {
 	int ref_count;
 	GDHCPType type;
@@ -61,21 +70,45 @@ struct _GDHCPServer {
 	int listener_sockfd;
 	guint listener_watch;
 	GIOChannel *listener_channel;
-	GList *lease_list;
+	GPtrArray *lease_heap;	/* leases ordered by expiry time */
 	GHashTable *nip_lease_hash;
+	GHashTable *mac_lease_hash;
+	unsigned long *nip_bitmap;
+	uint32_t nip_cursor;	/* where the next free address search starts */
 	GHashTable *option_hash; /* Options send to client */
 	GDHCPSaveLeaseFunc save_lease_func;
 	GDHCPLeaseAddedCb lease_added_cb;
 	GDHCPDebugFunc debug_func;
 	gpointer debug_data;
+	char *lease_file;
+	int lease_fd;
+	GByteArray *lease_journal; /* records waiting to be written */
+	guint lease_journal_timeout;
+	unsigned int lease_records; /* records in the file */
 };
 
 struct dhcp_lease {
 	time_t expire;
 	uint32_t lease_nip;
 	uint8_t lease_mac[ETH_ALEN];
+	guint heap_index;
+};
+
+enum {
+	LEASE_RECORD_ADD = 1,
+	LEASE_RECORD_REMOVE = 2,
 };
 
+struct lease_record {
+	uint32_t magic;
+	uint8_t op;
+	uint8_t mac[ETH_ALEN];
+	uint8_t reserved;
+	uint32_t nip;		/* host byte order */
+	uint32_t checksum;
+	int64_t expire;
+} __attribute__((packed));
+
 #include "log.h"
 
 static struct connman_debug_desc gdhcp_server_debug CONNMAN_DEBUG_ATTR = {
@@ -110,28 +143,178 @@ static inline void _debug(GDHCPServer *server, const char *format, ...)
 	va_end(ap);
 }
 
+static guint mac_hash(gconstpointer key)
+{
+	const uint8_t *mac = key;
+
+	/* The last bytes differ the most between clients of one vendor */
+	return (mac[0] << 8 | mac[1]) ^
+		(mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5]);
+}
+
+static gboolean mac_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, ETH_ALEN) == 0;
+}
+
 static struct dhcp_lease *find_lease_by_mac(GDHCPServer *dhcp_server,
 						const uint8_t *mac)
 {
-	GList *list;
+	return g_hash_table_lookup(dhcp_server->mac_lease_hash, mac);
+}
+
+/*
+ * The leases are kept in a binary min-heap ordered by expiry time,
+ * so the lease that expires first is always the root.
+ */
+static void lease_heap_set(GDHCPServer *dhcp_server, guint index,
+					struct dhcp_lease *lease)
+{
+	dhcp_server->lease_heap->pdata[index] = lease;
+	lease->heap_index = index;
+}
+
+static void lease_heap_up(GDHCPServer *dhcp_server, guint index)
+{
+	GPtrArray *heap = dhcp_server->lease_heap;
+	struct dhcp_lease *lease = heap->pdata[index], *parent;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	while (index > 0) {
+		parent = heap->pdata[(index - 1) / 2];
+		if (parent->expire <= lease->expire)
+			break;
 
-		if (memcmp(lease->lease_mac, mac, ETH_ALEN) == 0)
-			return lease;
+		lease_heap_set(dhcp_server, index, parent);
+		index = (index - 1) / 2;
 	}
 
-	return NULL;
+	lease_heap_set(dhcp_server, index, lease);
 }
 
-static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+static void lease_heap_down(GDHCPServer *dhcp_server, guint index)
+{
+	GPtrArray *heap = dhcp_server->lease_heap;
+	struct dhcp_lease *lease = heap->pdata[index], *child;
+	guint next;
+
+	while ((next = 2 * index + 1) < heap->len) {
+		if (next + 1 < heap->len &&
+				((struct dhcp_lease *) heap->pdata[next + 1])->expire <
+				((struct dhcp_lease *) heap->pdata[next])->expire)
+			next++;
+
+		child = heap->pdata[next];
+		if (lease->expire <= child->expire)
+			break;
+
+		lease_heap_set(dhcp_server, index, child);
+		index = next;
+	}
+
+	lease_heap_set(dhcp_server, index, lease);
+}
+
+static void lease_heap_insert(GDHCPServer *dhcp_server,
+					struct dhcp_lease *lease)
+{
+	g_ptr_array_add(dhcp_server->lease_heap, lease);
+	lease_heap_up(dhcp_server, dhcp_server->lease_heap->len - 1);
+}
+
+static void lease_heap_remove(GDHCPServer *dhcp_server,
+					struct dhcp_lease *lease)
+{
+	GPtrArray *heap = dhcp_server->lease_heap;
+	guint index = lease->heap_index;
+	struct dhcp_lease *last;
+
+	last = g_ptr_array_remove_index(heap, heap->len - 1);
+	if (last == lease)
+		return;
+
+	lease_heap_set(dhcp_server, index, last);
+	lease_heap_up(dhcp_server, index);
+	lease_heap_down(dhcp_server, last->heap_index);
+}
+
+static bool is_reserved_nip(uint32_t nip)
+{
+	/* e.g. 192.168.55.0 and 192.168.55.255 */
+	return (nip & 0xff) == 0 || (nip & 0xff) == 0xff;
+}
+
+/* One bit per address of the range, set while the address is leased */
+static void nip_bitmap_set(GDHCPServer *dhcp_server, uint32_t nip, bool used)
+{
+	uint32_t bit;
+
+	if (!dhcp_server->nip_bitmap || is_reserved_nip(nip))
+		return;
+
+	if (nip < dhcp_server->start_ip || nip > dhcp_server->end_ip)
+		return;
+
+	bit = nip - dhcp_server->start_ip;
+
+	if (used)
+		dhcp_server->nip_bitmap[bit / LONG_BITS] |=
+						1UL << (bit % LONG_BITS);
+	else
+		dhcp_server->nip_bitmap[bit / LONG_BITS] &=
+						~(1UL << (bit % LONG_BITS));
+}
+
+static uint32_t nip_bitmap_find_free(GDHCPServer *dhcp_server,
+					uint32_t from, uint32_t to)
+{
+	unsigned long word;
+	uint32_t bit = from;
+
+	while (bit < to) {
+		/* Bits below the starting one count as used */
+		word = dhcp_server->nip_bitmap[bit / LONG_BITS] |
+					((1UL << (bit % LONG_BITS)) - 1);
+		if (word != ~0UL) {
+			bit = bit - bit % LONG_BITS + __builtin_ctzl(~word);
+			return bit < to ? bit : to;
+		}
+
+		bit = bit - bit % LONG_BITS + LONG_BITS;
+	}
+
+	return to;
+}
+
+static void lease_link(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	g_hash_table_insert(dhcp_server->nip_lease_hash,
+				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	g_hash_table_replace(dhcp_server->mac_lease_hash,
+				lease->lease_mac, lease);
+	nip_bitmap_set(dhcp_server, lease->lease_nip, true);
+	lease_heap_insert(dhcp_server, lease);
+}
+
+static void lease_unlink(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
 {
-	dhcp_server->lease_list =
-			g_list_remove(dhcp_server->lease_list, lease);
+	gpointer nip = GINT_TO_POINTER((int) lease->lease_nip);
 
-	g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease->lease_nip));
+	if (g_hash_table_lookup(dhcp_server->nip_lease_hash, nip) == lease) {
+		g_hash_table_remove(dhcp_server->nip_lease_hash, nip);
+		nip_bitmap_set(dhcp_server, lease->lease_nip, false);
+	}
+
+	if (g_hash_table_lookup(dhcp_server->mac_lease_hash,
+					lease->lease_mac) == lease)
+		g_hash_table_remove(dhcp_server->mac_lease_hash,
+					lease->lease_mac);
+
+	lease_heap_remove(dhcp_server, lease);
+}
+
+static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	lease_unlink(dhcp_server, lease);
 	g_free(lease);
 }
 
@@ -163,29 +346,18 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	debug(dhcp_server, "lease_mac %p lease_nip %p", lease_mac, lease_nip);
 
 	if (lease_nip) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_nip);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) ntohl(yiaddr)));
-
-		if (!lease_mac)
-			*lease = lease_nip;
-		else if (lease_nip != lease_mac) {
+		lease_unlink(dhcp_server, lease_nip);
+
+		if (lease_mac && lease_nip != lease_mac)
 			remove_lease(dhcp_server, lease_mac);
-			*lease = lease_nip;
-		} else
-			*lease = lease_nip;
+
+		*lease = lease_nip;
 
 		return 0;
 	}
 
 	if (lease_mac) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_mac);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease_mac->lease_nip));
+		lease_unlink(dhcp_server, lease_mac);
 		*lease = lease_mac;
 
 		return 0;
@@ -198,14 +370,6 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	return 0;
 }
 
-static gint compare_expire(gconstpointer a, gconstpointer b)
-{
-	const struct dhcp_lease *lease1 = a;
-	const struct dhcp_lease *lease2 = b;
-
-	return lease2->expire - lease1->expire;
-}
-
 static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 					const uint8_t *chaddr, uint32_t yiaddr)
 {
@@ -226,11 +390,7 @@ static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 	else
 		lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
-
-	g_hash_table_insert(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	lease_link(dhcp_server, lease);
 
 	return lease;
 }
@@ -257,43 +417,66 @@ static bool is_expired_lease(struct dhcp_lease *lease)
 	return false;
 }
 
-static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
+static uint32_t find_free_nip(GDHCPServer *dhcp_server,
 					const uint8_t *safe_mac)
 {
-	uint32_t ip_addr;
-	struct dhcp_lease *lease;
-	GList *list;
-	ip_addr = dhcp_server->start_ip;
-	for (; ip_addr <= dhcp_server->end_ip; ip_addr++) {
-		/* e.g. 192.168.55.0 */
-		if ((ip_addr & 0xff) == 0)
-			continue;
+	uint32_t size, start, bit, ip_addr;
 
-		/* e.g. 192.168.55.255 */
-		if ((ip_addr & 0xff) == 0xff)
-			continue;
+	if (!dhcp_server->nip_bitmap)
+		return 0;
 
-		lease = find_lease_by_nip(dhcp_server, ip_addr);
-		if (lease)
-			continue;
+	size = dhcp_server->end_ip - dhcp_server->start_ip + 1;
+	start = dhcp_server->nip_cursor < size ? dhcp_server->nip_cursor : 0;
+
+	/*
+	 * Continue after the address handed out last time and wrap
+	 * around once, so that released addresses are not reused
+	 * right away.
+	 */
+	for (bit = nip_bitmap_find_free(dhcp_server, start, size); ;
+			bit = nip_bitmap_find_free(dhcp_server, bit + 1, size)) {
+		if (bit == size) {
+			if (start == 0)
+				break;
+
+			size = start;
+			start = 0;
+			bit = nip_bitmap_find_free(dhcp_server, 0, size);
+			if (bit == size)
+				break;
+		}
+
+		ip_addr = dhcp_server->start_ip + bit;
 
-		if (arp_check(htonl(ip_addr), safe_mac))
+		if (arp_check(htonl(ip_addr), safe_mac)) {
+			dhcp_server->nip_cursor = bit + 1;
 			return ip_addr;
+		}
 	}
 
-	/* The last lease is the oldest one */
-	list = g_list_last(dhcp_server->lease_list);
-	if (!list)
-		return 0;
+	return 0;
+}
 
-	lease = list->data;
-	if (!lease)
+static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
+					const uint8_t *safe_mac)
+{
+	struct dhcp_lease *lease;
+	uint32_t ip_addr;
+
+	ip_addr = find_free_nip(dhcp_server, safe_mac);
+	if (ip_addr)
+		return ip_addr;
+
+	/* The root of the heap is the oldest lease */
+	if (dhcp_server->lease_heap->len == 0)
 		return 0;
 
-	 if (!is_expired_lease(lease))
+	lease = g_ptr_array_index(dhcp_server->lease_heap, 0);
+
+	if (!is_expired_lease(lease))
 		return 0;
 
-	 if (!arp_check(lease->lease_nip, safe_mac))
+	if (!arp_check(lease->lease_nip, safe_mac))
 		return 0;
 
 	return lease->lease_nip;
@@ -302,32 +485,311 @@ static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 static void lease_set_expire(GDHCPServer *dhcp_server,
 			struct dhcp_lease *lease, uint32_t expire)
 {
-	dhcp_server->lease_list = g_list_remove(dhcp_server->lease_list, lease);
-
 	lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
+	lease_heap_up(dhcp_server, lease->heap_index);
+	lease_heap_down(dhcp_server, lease->heap_index);
 }
 
 static void destroy_lease_table(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	guint i;
 
 	g_hash_table_destroy(dhcp_server->nip_lease_hash);
+	g_hash_table_destroy(dhcp_server->mac_lease_hash);
 
 	dhcp_server->nip_lease_hash = NULL;
+	dhcp_server->mac_lease_hash = NULL;
+
+	for (i = 0; i < dhcp_server->lease_heap->len; i++)
+		g_free(g_ptr_array_index(dhcp_server->lease_heap, i));
+
+	g_ptr_array_free(dhcp_server->lease_heap, TRUE);
+
+	dhcp_server->lease_heap = NULL;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	g_free(dhcp_server->nip_bitmap);
 
-		g_free(lease);
+	dhcp_server->nip_bitmap = NULL;
+}
+
+static uint32_t lease_record_checksum(const struct lease_record *record)
+{
+	struct lease_record copy = *record;
+	const uint8_t *data = (const uint8_t *) &copy;
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	copy.checksum = 0;
+
+	/* FNV-1a */
+	for (i = 0; i < sizeof(copy); i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
 	}
 
-	g_list_free(dhcp_server->lease_list);
+	return hash;
+}
 
-	dhcp_server->lease_list = NULL;
+static void lease_record_init(struct lease_record *record, uint8_t op,
+					const struct dhcp_lease *lease)
+{
+	memset(record, 0, sizeof(*record));
+
+	record->magic = LEASE_JOURNAL_MAGIC;
+	record->op = op;
+	memcpy(record->mac, lease->lease_mac, ETH_ALEN);
+	record->nip = lease->lease_nip;
+	record->expire = lease->expire;
+	record->checksum = lease_record_checksum(record);
 }
+
+static int lease_journal_write(int fd, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+	ssize_t written;
+
+	while (len > 0) {
+		written = write(fd, ptr, len);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		ptr += written;
+		len -= written;
+	}
+
+	return 0;
+}
+
+/*
+ * Write the leases that are still valid into a new file and move it
+ * over the journal, so the journal never grows without bounds.
+ */
+static int lease_journal_compact(GDHCPServer *dhcp_server)
+{
+	struct lease_record record;
+	GByteArray *snapshot;
+	time_t now = time(NULL);
+	unsigned int count = 0;
+	char *tmp;
+	guint i;
+	int fd, err;
+
+	snapshot = g_byte_array_new();
+
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		struct dhcp_lease *lease = dhcp_server->lease_heap->pdata[i];
+
+		if (lease->expire <= now)
+			continue;
+
+		lease_record_init(&record, LEASE_RECORD_ADD, lease);
+		g_byte_array_append(snapshot, (guint8 *) &record,
+							sizeof(record));
+		count++;
+	}
+
+	tmp = g_strdup_printf("%s.tmp", dhcp_server->lease_file);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	err = lease_journal_write(fd, snapshot->data, snapshot->len);
+	if (!err && fsync(fd) < 0)
+		err = -errno;
+
+	close(fd);
+
+	if (!err && rename(tmp, dhcp_server->lease_file) < 0)
+		err = -errno;
+
+	if (err < 0) {
+		unlink(tmp);
+		goto out;
+	}
+
+	if (dhcp_server->lease_fd >= 0)
+		close(dhcp_server->lease_fd);
+
+	dhcp_server->lease_fd = open(dhcp_server->lease_file,
+				O_WRONLY | O_APPEND | O_CLOEXEC);
+	dhcp_server->lease_records = count;
+
+	/* The pending records are part of the snapshot */
+	g_byte_array_set_size(dhcp_server->lease_journal, 0);
+
+	debug(dhcp_server, "lease journal compacted to %u records", count);
+
+out:
+	g_free(tmp);
+	g_byte_array_free(snapshot, TRUE);
+
+	return err;
+}
+
+static void lease_journal_flush(GDHCPServer *dhcp_server)
+{
+	GByteArray *journal = dhcp_server->lease_journal;
+	unsigned int records;
+	int err;
+
+	if (!dhcp_server->lease_file)
+		return;
+
+	records = dhcp_server->lease_records +
+			journal->len / sizeof(struct lease_record);
+
+	if (dhcp_server->lease_fd < 0 || records >
+			2 * dhcp_server->lease_heap->len + LEASE_JOURNAL_SLACK) {
+		err = lease_journal_compact(dhcp_server);
+		if (err < 0)
+			debug(dhcp_server, "cannot compact lease journal %s",
+							strerror(-err));
+		return;
+	}
+
+	if (journal->len == 0)
+		return;
+
+	err = lease_journal_write(dhcp_server->lease_fd, journal->data,
+							journal->len);
+	if (!err && fdatasync(dhcp_server->lease_fd) < 0)
+		err = -errno;
+
+	if (err < 0) {
+		/* Start from a fresh file on the next flush */
+		debug(dhcp_server, "cannot write lease journal %s",
+							strerror(-err));
+		close(dhcp_server->lease_fd);
+		dhcp_server->lease_fd = -1;
+		return;
+	}
+
+	dhcp_server->lease_records = records;
+	g_byte_array_set_size(journal, 0);
+}
+
+static gboolean lease_journal_timeout(gpointer user_data)
+{
+	GDHCPServer *dhcp_server = user_data;
+
+	dhcp_server->lease_journal_timeout = 0;
+
+	lease_journal_flush(dhcp_server);
+
+	return FALSE;
+}
+
+/*
+ * Changes are only queued here and written together a bit later,
+ * so the answer to the client does not wait for the disk.
+ */
+static void lease_journal_append(GDHCPServer *dhcp_server, uint8_t op,
+					const struct dhcp_lease *lease)
+{
+	struct lease_record record;
+
+	if (!dhcp_server->lease_file)
+		return;
+
+	lease_record_init(&record, op, lease);
+	g_byte_array_append(dhcp_server->lease_journal, (guint8 *) &record,
+							sizeof(record));
+
+	if (dhcp_server->lease_journal_timeout == 0)
+		dhcp_server->lease_journal_timeout =
+			g_timeout_add_seconds(LEASE_JOURNAL_DELAY,
+					lease_journal_timeout, dhcp_server);
+}
+
+static void lease_journal_replay(GDHCPServer *dhcp_server)
+{
+	const struct lease_record *record;
+	struct dhcp_lease *lease;
+	time_t now = time(NULL);
+	unsigned int count = 0, stale = 0;
+	gchar *contents = NULL;
+	gsize length = 0, offset;
+
+	if (!g_file_get_contents(dhcp_server->lease_file, &contents,
+							&length, NULL))
+		return;
+
+	for (offset = 0; offset + sizeof(*record) <= length;
+					offset += sizeof(*record)) {
+		record = (const struct lease_record *) (contents + offset);
+
+		/* A torn write at the end of the file stops the replay */
+		if (record->magic != LEASE_JOURNAL_MAGIC ||
+				record->checksum !=
+					lease_record_checksum(record))
+			break;
+
+		count++;
+
+		lease = find_lease_by_mac(dhcp_server, record->mac);
+
+		if (record->op == LEASE_RECORD_REMOVE ||
+						record->expire <= now) {
+			if (lease && lease->lease_nip == record->nip)
+				remove_lease(dhcp_server, lease);
+			continue;
+		}
+
+		/* The pool may have moved since the lease was handed out */
+		if (record->nip < dhcp_server->start_ip ||
+				record->nip > dhcp_server->end_ip) {
+			stale++;
+			continue;
+		}
+
+		add_lease(dhcp_server, record->expire, record->mac,
+						htonl(record->nip));
+	}
+
+	debug(dhcp_server, "replayed %u lease records, %u leases, %u outside "
+			"the pool", count, dhcp_server->lease_heap->len, stale);
+
+	dhcp_server->lease_records = count;
+
+	g_free(contents);
+
+	/*
+	 * Anything after the last good record, and leases from another
+	 * pool, are dropped by compacting
+	 */
+	if (offset != length || stale > 0) {
+		lease_journal_compact(dhcp_server);
+		return;
+	}
+
+	dhcp_server->lease_fd = open(dhcp_server->lease_file,
+					O_WRONLY | O_APPEND | O_CLOEXEC);
+}
+
+static void lease_journal_close(GDHCPServer *dhcp_server)
+{
+	if (dhcp_server->lease_journal_timeout > 0) {
+		g_source_remove(dhcp_server->lease_journal_timeout);
+		dhcp_server->lease_journal_timeout = 0;
+	}
+
+	if (dhcp_server->lease_file && dhcp_server->started)
+		lease_journal_compact(dhcp_server);
+
+	if (dhcp_server->lease_fd >= 0) {
+		close(dhcp_server->lease_fd);
+		dhcp_server->lease_fd = -1;
+	}
+}
+
 static uint32_t get_interface_address(int index)
 {
 	struct ifreq ifr;
@@ -400,6 +862,10 @@ GDHCPServer *g_dhcp_server_new(GDHCPType type,
 
 	dhcp_server->nip_lease_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
+	dhcp_server->mac_lease_hash = g_hash_table_new(mac_hash, mac_equal);
+	dhcp_server->lease_heap = g_ptr_array_new();
+	dhcp_server->lease_journal = g_byte_array_new();
+	dhcp_server->lease_fd = -1;
 	dhcp_server->option_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
 
@@ -596,13 +1062,13 @@ static void send_offer(GDHCPServer *dhcp_server,
 
 static void save_lease(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	guint i;
 
 	if (!dhcp_server->save_lease_func)
 		return;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		struct dhcp_lease *lease = dhcp_server->lease_heap->pdata[i];
 		dhcp_server->save_lease_func(lease->lease_mac,
 					lease->lease_nip, lease->expire);
 	}
@@ -611,6 +1077,7 @@ static void save_lease(GDHCPServer *dhcp_server)
 static void send_ACK(GDHCPServer *dhcp_server,
 		struct dhcp_packet *client_packet, uint32_t dest)
 {
+	struct dhcp_lease *lease;
 	struct dhcp_packet packet;
 	uint32_t lease_time_sec;
 	struct in_addr addr;
@@ -630,7 +1097,9 @@ static void send_ACK(GDHCPServer *dhcp_server,
 
 	send_packet_to_client(dhcp_server, &packet);
 
-	add_lease(dhcp_server, 0, packet.chaddr, packet.yiaddr);
+	lease = add_lease(dhcp_server, 0, packet.chaddr, packet.yiaddr);
+	if (lease)
+		lease_journal_append(dhcp_server, LEASE_RECORD_ADD, lease);
 
 	if (dhcp_server->lease_added_cb)
 		dhcp_server->lease_added_cb(packet.chaddr, packet.yiaddr);
@@ -739,8 +1208,11 @@ static gboolean listener_event(GIOChannel *channel, GIOCondition condition,
 		if (!lease)
 			break;
 
-		if (requested_nip == lease->lease_nip)
+		if (requested_nip == lease->lease_nip) {
+			lease_journal_append(dhcp_server,
+					LEASE_RECORD_REMOVE, lease);
 			remove_lease(dhcp_server, lease);
+		}
 
 		break;
 	case DHCPRELEASE:
@@ -752,9 +1224,12 @@ static gboolean listener_event(GIOChannel *channel, GIOCondition condition,
 		if (!lease)
 			break;
 
-		if (packet.ciaddr == lease->lease_nip)
+		if (packet.ciaddr == lease->lease_nip) {
 			lease_set_expire(dhcp_server, lease,
 					time(NULL));
+			lease_journal_append(dhcp_server,
+					LEASE_RECORD_ADD, lease);
+		}
 		break;
 	case DHCPINFORM:
 		debug(dhcp_server, "Received INFORM");
@@ -774,6 +1249,9 @@ int g_dhcp_server_start(GDHCPServer *dhcp_server)
 	if (dhcp_server->started)
 		return 0;
 
+	if (dhcp_server->lease_file && dhcp_server->lease_fd < 0)
+		lease_journal_replay(dhcp_server);
+
 	listener_sockfd = dhcp_l3_socket(SERVER_PORT,
 					dhcp_server->interface, AF_INET);
 	if (listener_sockfd < 0)
@@ -846,6 +1324,29 @@ void g_dhcp_server_set_lease_added_cb(GDHCPServer *dhcp_server,
 	dhcp_server->lease_added_cb = cb;
 }
 
+/*
+ * Leases are kept in an append only journal in path. The journal is
+ * read back when the server starts, so clients get their address back
+ * after a restart.
+ */
+int g_dhcp_server_set_lease_file(GDHCPServer *dhcp_server, const char *path)
+{
+	if (!dhcp_server)
+		return -EINVAL;
+
+	if (dhcp_server->started)
+		return -EBUSY;
+
+	lease_journal_close(dhcp_server);
+
+	g_free(dhcp_server->lease_file);
+	dhcp_server->lease_file = g_strdup(path);
+	dhcp_server->lease_records = 0;
+	g_byte_array_set_size(dhcp_server->lease_journal, 0);
+
+	return 0;
+}
+
 GDHCPServer *g_dhcp_server_ref(GDHCPServer *dhcp_server)
 {
 	if (!dhcp_server)
@@ -861,6 +1362,8 @@ void g_dhcp_server_stop(GDHCPServer *dhcp_server)
 	/* Save leases, before stop; load them before start */
 	save_lease(dhcp_server);
 
+	lease_journal_close(dhcp_server);
+
 	if (dhcp_server->listener_watch > 0) {
 		g_source_remove(dhcp_server->listener_watch);
 		dhcp_server->listener_watch = 0;
@@ -885,6 +1388,9 @@ void g_dhcp_server_unref(GDHCPServer *dhcp_server)
 
 	destroy_lease_table(dhcp_server);
 
+	g_byte_array_free(dhcp_server->lease_journal, TRUE);
+	g_free(dhcp_server->lease_file);
+
 	g_free(dhcp_server->interface);
 
 	g_free(dhcp_server);
@@ -894,6 +1400,8 @@ int g_dhcp_server_set_ip_range(GDHCPServer *dhcp_server,
 		const char *start_ip, const char *end_ip)
 {
 	struct in_addr _host_addr;
+	uint32_t size, words, bit;
+	guint i;
 
 	if (inet_aton(start_ip, &_host_addr) == 0)
 		return -ENXIO;
@@ -905,6 +1413,33 @@ int g_dhcp_server_set_ip_range(GDHCPServer *dhcp_server,
 
 	dhcp_server->end_ip = ntohl(_host_addr.s_addr);
 
+	if (dhcp_server->end_ip < dhcp_server->start_ip)
+		return -EINVAL;
+
+	size = dhcp_server->end_ip - dhcp_server->start_ip + 1;
+	words = (size + LONG_BITS - 1) / LONG_BITS;
+
+	g_free(dhcp_server->nip_bitmap);
+	dhcp_server->nip_bitmap = g_new0(unsigned long, words);
+	dhcp_server->nip_cursor = 0;
+
+	/* Addresses that are never handed out count as used */
+	for (bit = size; bit < words * LONG_BITS; bit++)
+		dhcp_server->nip_bitmap[bit / LONG_BITS] |=
+						1UL << (bit % LONG_BITS);
+
+	for (bit = 0; bit < size; bit++) {
+		if (is_reserved_nip(dhcp_server->start_ip + bit))
+			dhcp_server->nip_bitmap[bit / LONG_BITS] |=
+						1UL << (bit % LONG_BITS);
+	}
+
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		struct dhcp_lease *lease = dhcp_server->lease_heap->pdata[i];
+
+		nip_bitmap_set(dhcp_server, lease->lease_nip, true);
+	}
+
 	return 0;
 }
 
@@ -60,6 +60,7 @@ static int find_method_call_by_caller(gconstpointer a, gconstpointer b)
 }
 
 static GSList *property_calls;
+static GSList *batch_calls;
 
 struct property_call_data {
 	gpointer caller;
@@ -83,11 +84,29 @@ static int find_property_call_by_caller(gconstpointer a, gconstpointer b)
 	return property_call->caller != caller;
 }
 
+struct batch_entry {
+	struct batch_call_data *batch;
+	DBusPendingCall *pending_call;
+	DBusMessage *reply;
+	void *user_data;
+};
+
+struct batch_call_data {
+	gpointer caller;
+	unsigned int count;
+	unsigned int pending;
+	struct batch_entry *entries;
+	supplicant_dbus_property_function function;
+	supplicant_dbus_batch_function done;
+	void *user_data;
+};
+
 void supplicant_dbus_setup(DBusConnection *conn)
 {
 	connection = conn;
 	method_calls = NULL;
 	property_calls = NULL;
+	batch_calls = NULL;
 }
 
 void supplicant_dbus_array_foreach(DBusMessageIter *iter,
@@ -149,8 +168,51 @@ void supplicant_dbus_property_foreach(DBusMessageIter *iter,
 	}
 }
 
+static void batch_call_free(struct batch_call_data *batch)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		struct batch_entry *entry = &batch->entries[i];
+
+		if (entry->pending_call) {
+			dbus_pending_call_cancel(entry->pending_call);
+			dbus_pending_call_unref(entry->pending_call);
+		}
+
+		if (entry->reply)
+			dbus_message_unref(entry->reply);
+	}
+
+	g_free(batch->entries);
+	g_free(batch);
+}
+
+static void batch_call_cancel_all(gpointer caller)
+{
+	GSList *list, *next;
+
+	for (list = batch_calls; list; list = next) {
+		struct batch_call_data *batch = list->data;
+
+		next = list->next;
+
+		if (batch->caller != caller)
+			continue;
+
+		batch_calls = g_slist_delete_link(batch_calls, list);
+
+		if (batch->done)
+			batch->done(-ECANCELED, batch->user_data);
+
+		batch_call_free(batch);
+	}
+}
+
 void supplicant_dbus_property_call_cancel_all(gpointer caller)
 {
+	batch_call_cancel_all(caller);
+
 	while (property_calls) {
 		struct property_call_data *property_call;
 		GSList *elem = g_slist_find_custom(property_calls, caller,
@@ -259,10 +321,10 @@ static void property_get_reply(DBusPendingCall *call, void *user_data)
 	reply = dbus_pending_call_steal_reply(call);
 
 	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_ERROR)
-		goto done;
+		goto fail;
 
 	if (!dbus_message_iter_init(reply, &iter))
-		goto done;
+		goto fail;
 
 	if (dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_VARIANT) {
 		DBusMessageIter variant;
@@ -272,13 +334,151 @@ static void property_get_reply(DBusPendingCall *call, void *user_data)
 		if (property_call->function)
 			property_call->function(NULL, &variant,
 						property_call->user_data);
+
+		goto done;
 	}
+
+fail:
+	/* The caller still has to learn that the value did not come */
+	if (property_call->function)
+		property_call->function(NULL, NULL, property_call->user_data);
+
 done:
 	dbus_message_unref(reply);
 
 	dbus_pending_call_unref(call);
 }
 
+static void batch_call_complete(struct batch_call_data *batch)
+{
+	unsigned int i;
+
+	batch_calls = g_slist_remove(batch_calls, batch);
+
+	for (i = 0; i < batch->count; i++) {
+		struct batch_entry *entry = &batch->entries[i];
+		DBusMessageIter iter;
+
+		if (!entry->reply)
+			continue;
+
+		if (dbus_message_get_type(entry->reply) ==
+						DBUS_MESSAGE_TYPE_ERROR)
+			continue;
+
+		if (!dbus_message_iter_init(entry->reply, &iter))
+			continue;
+
+		supplicant_dbus_property_foreach(&iter, batch->function,
+							entry->user_data);
+
+		if (batch->function)
+			batch->function(NULL, NULL, entry->user_data);
+	}
+
+	if (batch->done)
+		batch->done(0, batch->user_data);
+
+	batch_call_free(batch);
+}
+
+static void batch_get_all_reply(DBusPendingCall *call, void *user_data)
+{
+	struct batch_entry *entry = user_data;
+	struct batch_call_data *batch = entry->batch;
+
+	entry->reply = dbus_pending_call_steal_reply(call);
+
+	dbus_pending_call_unref(call);
+	entry->pending_call = NULL;
+
+	if (--batch->pending == 0)
+		batch_call_complete(batch);
+}
+
+/*
+ * Sends GetAll for all the paths at once without waiting for the
+ * replies in between. The replies are kept until the last one has
+ * arrived, then function is called for the properties of each path
+ * in order, followed by done. Paths whose GetAll fails are skipped.
+ */
+int supplicant_dbus_property_get_all_batch(const char *interface,
+				const char **paths, void **user_data_list,
+				unsigned int count,
+				supplicant_dbus_property_function function,
+				supplicant_dbus_batch_function done,
+				void *user_data, gpointer caller)
+{
+	struct batch_call_data *batch;
+	unsigned int i;
+
+	if (!connection)
+		return -EINVAL;
+
+	if (!interface || !paths || count == 0)
+		return -EINVAL;
+
+	batch = g_try_new0(struct batch_call_data, 1);
+	if (!batch)
+		return -ENOMEM;
+
+	batch->entries = g_try_new0(struct batch_entry, count);
+	if (!batch->entries) {
+		g_free(batch);
+		return -ENOMEM;
+	}
+
+	batch->caller = caller;
+	batch->count = count;
+	batch->function = function;
+	batch->done = done;
+	batch->user_data = user_data;
+
+	for (i = 0; i < count; i++) {
+		struct batch_entry *entry = &batch->entries[i];
+		DBusMessage *message;
+		DBusPendingCall *call = NULL;
+
+		entry->batch = batch;
+		entry->user_data = user_data_list[i];
+
+		message = dbus_message_new_method_call(SUPPLICANT_SERVICE,
+					paths[i], DBUS_INTERFACE_PROPERTIES,
+					"GetAll");
+		if (!message)
+			continue;
+
+		dbus_message_set_auto_start(message, FALSE);
+
+		dbus_message_append_args(message, DBUS_TYPE_STRING,
+						&interface, NULL);
+
+		if (!dbus_connection_send_with_reply(connection, message,
+							&call, TIMEOUT) ||
+				!call) {
+			dbus_message_unref(message);
+			continue;
+		}
+
+		entry->pending_call = call;
+		batch->pending++;
+
+		dbus_pending_call_set_notify(call, batch_get_all_reply,
+								entry, NULL);
+
+		dbus_message_unref(message);
+	}
+
+	if (batch->pending == 0) {
+		batch_call_free(batch);
+		return -EIO;
+	}
+
+	batch_calls = g_slist_prepend(batch_calls, batch);
+
+	return 0;
+}
+
 int supplicant_dbus_property_get(const char *path, const char *interface,
 				const char *method,
 				supplicant_dbus_property_function function,
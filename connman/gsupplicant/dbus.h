@@ -37,6 +37,8 @@ typedef void (*supplicant_dbus_setup_function) (DBusMessageIter *iter,
 typedef void (*supplicant_dbus_result_function) (const char *error,
 				DBusMessageIter *iter, void *user_data);
 
+typedef void (*supplicant_dbus_batch_function) (int result, void *user_data);
+
 void supplicant_dbus_property_append_array(DBusMessageIter *iter,
 				const char *key, int type,
 				supplicant_dbus_array_function function,
@@ -56,6 +58,14 @@ int supplicant_dbus_property_get_all(const char *path, const char *interface,
 				supplicant_dbus_property_function function,
 				void *user_data, gpointer caller);
 
+int supplicant_dbus_property_get_all_batch(const char *interface,
+				const char **paths, void **user_data_list,
+				unsigned int count,
+				supplicant_dbus_property_function function,
+				supplicant_dbus_batch_function done,
+				void *user_data, gpointer caller);
+
+/* function is called with a NULL iter when the value cannot be read */
 int supplicant_dbus_property_get(const char *path, const char *interface,
 				const char *method,
 				supplicant_dbus_property_function function,
@@ -167,6 +167,8 @@ struct _GSupplicantInterface {
 	dbus_bool_t ready;
 	GSupplicantState state;
 	dbus_bool_t scanning;
+	bool batching;
+	bool batch_pending;
 	GSupplicantInterfaceCallback scan_callback;
 	void *scan_data;
 	int apscan;
@@ -179,6 +181,8 @@ struct _GSupplicantInterface {
 	GHashTable *peer_table;
 	GHashTable *group_table;
 	GHashTable *bss_mapping;
+	GSList *new_bss;
+	GHashTable *pending_bss;
 	void *data;
 	const char *pending_peer_path;
 };
@@ -450,6 +454,56 @@ static void callback_scan_finished(GSupplicantInterface *interface)
 	callbacks_pointer->scan_finished(interface);
 }
 
+/*
+ * While a scan is running and its results are being fetched, network
+ * updates are not reported one by one. They are delivered as a single
+ * list of all the networks of the interface once the scan is done.
+ */
+static void start_network_batch(GSupplicantInterface *interface)
+{
+	if (!callbacks_pointer || !callbacks_pointer->scan_results)
+		return;
+
+	interface->batching = true;
+}
+
+static bool batch_network_update(GSupplicantInterface *interface)
+{
+	if (!interface->batching)
+		return false;
+
+	interface->batch_pending = true;
+
+	return true;
+}
+
+static void flush_network_batch(GSupplicantInterface *interface)
+{
+	GList *networks;
+
+	if (!interface->batching)
+		return;
+
+	interface->batching = false;
+
+	if (!interface->batch_pending)
+		return;
+
+	interface->batch_pending = false;
+
+	if (!callbacks_pointer || !callbacks_pointer->scan_results)
+		return;
+
+	networks = g_hash_table_get_values(interface->network_table);
+
+	SUPPLICANT_DBG("interface %p networks %d", interface,
+						g_list_length(networks));
+
+	callbacks_pointer->scan_results(interface, networks);
+
+	g_list_free(networks);
+}
+
 static void callback_network_added(GSupplicantNetwork *network)
 {
 	if (!callbacks_pointer)
@@ -458,6 +512,9 @@ static void callback_network_added(GSupplicantNetwork *network)
 	if (!callbacks_pointer->network_added)
 		return;
 
+	if (batch_network_update(network->interface))
+		return;
+
 	callbacks_pointer->network_added(network);
 }
 
@@ -469,6 +526,9 @@ static void callback_network_removed(GSupplicantNetwork *network)
 	if (!callbacks_pointer->network_removed)
 		return;
 
+	if (batch_network_update(network->interface))
+		return;
+
 	callbacks_pointer->network_removed(network);
 }
 
@@ -481,6 +541,9 @@ static void callback_network_changed(GSupplicantNetwork *network,
 	if (!callbacks_pointer->network_changed)
 		return;
 
+	if (batch_network_update(network->interface))
+		return;
+
 	callbacks_pointer->network_changed(network, property);
 }
 
@@ -546,7 +609,12 @@ static void remove_interface(gpointer data)
 {
 	GSupplicantInterface *interface = data;
 
+	/* Networks going away with the interface are reported right away */
+	interface->batching = false;
+	interface->batch_pending = false;
+
 	g_hash_table_destroy(interface->bss_mapping);
+	g_hash_table_destroy(interface->pending_bss);
 	g_hash_table_destroy(interface->network_table);
 	g_hash_table_destroy(interface->peer_table);
 	g_hash_table_destroy(interface->group_table);
@@ -1903,6 +1971,10 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 			return NULL;
 	}
 
+	/* Properties are being fetched already */
+	if (g_hash_table_lookup(interface->pending_bss, path))
+		return NULL;
+
 	bss = g_try_new0(struct g_supplicant_bss, 1);
 	if (!bss)
 		return NULL;
@@ -1937,24 +2009,140 @@ static void interface_bss_added_with_keys(DBusMessageIter *iter,
 		SUPPLICANT_DBG("add_or_replace_bss_to_network failed");
 }
 
+struct bss_fetch {
+	GSupplicantInterface *interface;
+	char *interface_path;
+	unsigned int count;
+	struct g_supplicant_bss **bss;
+};
+
+static bool bss_fetch_finish(GSupplicantInterface *interface,
+					struct g_supplicant_bss *bss)
+{
+	if (!interface)
+		return false;
+
+	if (g_hash_table_lookup(interface->pending_bss, bss->path) != bss)
+		return false;
+
+	g_hash_table_remove(interface->pending_bss, bss->path);
+
+	return true;
+}
+
+static void bss_fetch_done(int result, void *user_data)
+{
+	struct bss_fetch *fetch = user_data;
+	GSupplicantInterface *interface;
+	bool batching;
+	unsigned int i;
+
+	SUPPLICANT_DBG("result %d count %u", result, fetch->count);
+
+	interface = g_hash_table_lookup(interface_table, fetch->interface_path);
+	if (interface != fetch->interface)
+		interface = NULL;
+
+	if (result < 0 || !interface) {
+		for (i = 0; i < fetch->count; i++) {
+			bss_fetch_finish(interface, fetch->bss[i]);
+			remove_bss(fetch->bss[i]);
+		}
+
+		goto done;
+	}
+
+	/* Networks of a single fetch are reported as one batch */
+	batching = interface->batching;
+	start_network_batch(interface);
+
+	for (i = 0; i < fetch->count; i++) {
+		struct g_supplicant_bss *bss = fetch->bss[i];
+
+		/* Removed while its properties were fetched */
+		if (!bss_fetch_finish(interface, bss)) {
+			remove_bss(bss);
+			continue;
+		}
+
+		bss_compute_security(bss);
+		if (add_or_replace_bss_to_network(bss) < 0) {
+			SUPPLICANT_DBG("add_or_replace_bss_to_network failed");
+			remove_bss(bss);
+		}
+	}
+
+	if (!batching)
+		flush_network_batch(interface);
+
+done:
+	g_free(fetch->interface_path);
+	g_free(fetch->bss);
+	g_free(fetch);
+}
+
+/*
+ * Fetches the properties of the BSSs collected by
+ * interface_bss_added_without_keys() with one pipelined request.
+ */
+static void interface_bss_fetch(GSupplicantInterface *interface)
+{
+	struct bss_fetch *fetch;
+	const char **paths;
+	GSList *list;
+	unsigned int i;
+	int err;
+
+	if (!interface->new_bss)
+		return;
+
+	interface->new_bss = g_slist_reverse(interface->new_bss);
+
+	fetch = g_new0(struct bss_fetch, 1);
+	fetch->interface = interface;
+	fetch->interface_path = g_strdup(interface->path);
+	fetch->count = g_slist_length(interface->new_bss);
+	fetch->bss = g_new0(struct g_supplicant_bss *, fetch->count);
+
+	paths = g_new0(const char *, fetch->count);
+
+	for (list = interface->new_bss, i = 0; list; list = list->next, i++) {
+		fetch->bss[i] = list->data;
+		paths[i] = fetch->bss[i]->path;
+	}
+
+	g_slist_free(interface->new_bss);
+	interface->new_bss = NULL;
+
+	SUPPLICANT_DBG("interface %p fetching %u BSSs", interface,
+							fetch->count);
+
+	err = supplicant_dbus_property_get_all_batch(
+					SUPPLICANT_INTERFACE ".BSS",
+					paths, (void **) fetch->bss,
+					fetch->count, bss_property,
+					bss_fetch_done, fetch, interface);
+
+	g_free(paths);
+
+	if (err < 0)
+		bss_fetch_done(err, fetch);
+}
+
 static void interface_bss_added_without_keys(DBusMessageIter *iter,
 						void *user_data)
 {
+	GSupplicantInterface *interface = user_data;
 	struct g_supplicant_bss *bss;
 
 	SUPPLICANT_DBG("");
 
-	bss = interface_bss_added(iter, user_data);
+	bss = interface_bss_added(iter, interface);
 	if (!bss)
 		return;
 
-	supplicant_dbus_property_get_all(bss->path,
-					SUPPLICANT_INTERFACE ".BSS",
-					bss_property, bss, NULL);
-
-	bss_compute_security(bss);
-	if (add_or_replace_bss_to_network(bss) < 0)
-			SUPPLICANT_DBG("add_or_replace_bss_to_network failed");
+	interface->new_bss = g_slist_prepend(interface->new_bss, bss);
+	g_hash_table_replace(interface->pending_bss, bss->path, bss);
 }
 
 static void update_signal(gpointer key, gpointer value,
@@ -1991,6 +2179,10 @@ static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 	if (!path)
 		return;
 
+	/* Gone before its properties arrived, bss_fetch_done() drops it */
+	if (g_hash_table_remove(interface->pending_bss, path))
+		return;
+
 	network = g_hash_table_lookup(interface->bss_mapping, path);
 	if (!network)
 		return;
@@ -2092,6 +2284,15 @@ static void interface_property(const char *key, DBusMessageIter *iter,
 		dbus_message_iter_get_basic(iter, &scanning);
 		interface->scanning = scanning;
 
+		/*
+		 * A scan can end without ScanDone, the updates held back
+		 * since it started must not wait for the next scan.
+		 */
+		if (interface->scanning)
+			start_network_batch(interface);
+		else
+			flush_network_batch(interface);
+
 		if (interface->ready) {
 			if (interface->scanning)
 				callback_scan_started(interface);
@@ -2129,6 +2330,7 @@ static void interface_property(const char *key, DBusMessageIter *iter,
 		}
 	} else if (g_strcmp0(key, "CurrentBSS") == 0) {
 		interface_bss_added_without_keys(iter, interface);
+		interface_bss_fetch(interface);
 	} else if (g_strcmp0(key, "CurrentNetwork") == 0) {
 #ifdef NET_MAPPING_TABLE_MAKES_SENSE
 		interface_network_added(iter, interface);
@@ -2137,6 +2339,7 @@ static void interface_property(const char *key, DBusMessageIter *iter,
 		supplicant_dbus_array_foreach(iter,
 					interface_bss_added_without_keys,
 					interface);
+		interface_bss_fetch(interface);
 	} else if (g_strcmp0(key, "Blobs") == 0) {
 		/* Nothing */
 	} else if (g_strcmp0(key, "Networks") == 0) {
@@ -2170,6 +2373,8 @@ static void scan_network_update(DBusMessageIter *iter, void *user_data)
 	network = g_hash_table_lookup(interface->bss_mapping, path);
 	if (network)
 		callback_network_added(network);
+	else
+		interface_bss_added_without_keys(iter, interface);
 }
 
 static void scan_bss_data(const char *key, DBusMessageIter *iter,
@@ -2177,9 +2382,28 @@ static void scan_bss_data(const char *key, DBusMessageIter *iter,
 {
 	GSupplicantInterface *interface = user_data;
 
-	if (iter)
-		supplicant_dbus_array_foreach(iter, scan_network_update,
-						interface);
+	/* The BSSs could not be read, the scan has no results */
+	if (!iter) {
+		flush_network_batch(interface);
+
+		if (interface->scan_callback)
+			interface->scan_callback(-EIO, interface,
+						interface->scan_data);
+
+		interface->scan_callback = NULL;
+		interface->scan_data = NULL;
+
+		return;
+	}
+
+	start_network_batch(interface);
+
+	supplicant_dbus_array_foreach(iter, scan_network_update, interface);
+
+	flush_network_batch(interface);
+
+	/* BSSs which were not announced yet are added once fetched */
+	interface_bss_fetch(interface);
 
 	if (interface->scan_callback)
 		interface->scan_callback(0, interface, interface->scan_data);
@@ -2206,6 +2430,8 @@ static GSupplicantInterface *interface_alloc(const char *path)
 					g_str_equal, NULL, remove_group);
 	interface->bss_mapping = g_hash_table_new_full(g_str_hash, g_str_equal,
 								NULL, NULL);
+	interface->pending_bss = g_hash_table_new_full(g_str_hash, g_str_equal,
+								NULL, NULL);
 
 	g_hash_table_replace(interface_table, interface->path, interface);
 
@@ -2422,6 +2648,8 @@ static void signal_scan_done(const char *path, DBusMessageIter *iter)
 	 * and update the network details accordingly
 	 */
 	if (!success) {
+		flush_network_batch(interface);
+
 		if (interface->scan_callback)
 			interface->scan_callback(-EIO, interface,
 						interface->scan_data);
@@ -2432,8 +2660,10 @@ static void signal_scan_done(const char *path, DBusMessageIter *iter)
 		return;
 	}
 
-	supplicant_dbus_property_get(path, SUPPLICANT_INTERFACE ".Interface",
-				"BSSs", scan_bss_data, interface, interface);
+	/* The batch is delivered by scan_bss_data() */
+	if (supplicant_dbus_property_get(path, SUPPLICANT_INTERFACE ".Interface",
+				"BSSs", scan_bss_data, interface, interface) < 0)
+		flush_network_batch(interface);
 }
 
 static void signal_bss_added(const char *path, DBusMessageIter *iter)
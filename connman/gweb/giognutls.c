@@ -468,3 +468,41 @@ GIOChannel *g_io_channel_gnutls_new(int fd)
 
 	return channel;
 }
+
+GByteArray *g_io_channel_gnutls_get_session(GIOChannel *channel)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+	GByteArray *session;
+	gnutls_datum_t data;
+
+	if (!gnutls_channel->established)
+		return NULL;
+
+	if (gnutls_session_get_data2(gnutls_channel->session, &data) < 0)
+		return NULL;
+
+	session = g_byte_array_sized_new(data.size);
+	g_byte_array_append(session, data.data, data.size);
+
+	gnutls_free(data.data);
+
+	return session;
+}
+
+bool g_io_channel_gnutls_set_session(GIOChannel *channel,
+						GByteArray *session)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+
+	DBG("channel %p size %u", channel, session->len);
+
+	return gnutls_session_set_data(gnutls_channel->session,
+					session->data, session->len) == 0;
+}
+
+bool g_io_channel_gnutls_session_resumed(GIOChannel *channel)
+{
+	GIOGnuTLSChannel *gnutls_channel = (GIOGnuTLSChannel *) channel;
+
+	return gnutls_session_is_resumed(gnutls_channel->session) != 0;
+}
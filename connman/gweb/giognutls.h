@@ -26,3 +26,8 @@
 bool g_io_channel_supports_tls(void);
 
 GIOChannel *g_io_channel_gnutls_new(int fd);
+
+GByteArray *g_io_channel_gnutls_get_session(GIOChannel *channel);
+bool g_io_channel_gnutls_set_session(GIOChannel *channel,
+						GByteArray *session);
+bool g_io_channel_gnutls_session_resumed(GIOChannel *channel);
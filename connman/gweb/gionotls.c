@@ -34,3 +34,19 @@ GIOChannel *g_io_channel_gnutls_new(int fd)
 {
 	return NULL;
 }
+
+GByteArray *g_io_channel_gnutls_get_session(GIOChannel *channel)
+{
+	return NULL;
+}
+
+bool g_io_channel_gnutls_set_session(GIOChannel *channel,
+						GByteArray *session)
+{
+	return false;
+}
+
+bool g_io_channel_gnutls_session_resumed(GIOChannel *channel)
+{
+	return false;
+}
@@ -38,6 +38,9 @@
 
 #include "gresolv.h"
 
+#define RESOLV_CACHE_SIZE	64
+#define RESOLV_CACHE_MAX_TTL	3600
+
 struct sort_result {
 	int precedence;
 	int src_scope;
@@ -72,10 +75,30 @@ struct resolv_lookup {
 	guint ipv4_status;
 	guint ipv6_status;
 
+	char *hostname;
+	char *key;
+	guint32 ttl;
+	gint64 expire;
+	bool sorted;
+	guint idle;
+
+	struct resolv_lookup *leader;
+	GSList *followers;
+
 	GResolvResultFunc result_func;
 	gpointer result_data;
 };
 
+struct resolv_cache_entry {
+	int nr_results;
+	struct sort_result *results;
+
+	guint ipv4_status;
+	guint ipv6_status;
+
+	gint64 expire;
+};
+
 struct resolv_query {
 	GResolv *resolv;
 
@@ -116,6 +139,13 @@ struct _GResolv {
 	gpointer debug_data;
 };
 
+/*
+ * Shared by all GResolv instances. Entries are keyed by the hostname,
+ * the interface, the address family and the nameservers used.
+ */
+static GHashTable *resolv_cache = NULL;
+static GHashTable *pending_lookups = NULL;
+
 #include "log.h"
 
 static struct connman_debug_desc gresolv_debug CONNMAN_DEBUG_ATTR = {
@@ -165,11 +195,25 @@ static void destroy_query(struct resolv_query *query)
 	g_free(query);
 }
 
+static void hand_over_followers(struct resolv_lookup *lookup);
+
 static void destroy_lookup(struct resolv_lookup *lookup)
 {
 	debug(lookup->resolv, "lookup %p id %d ipv4 %p ipv6 %p",
 		lookup, lookup->id, lookup->ipv4_query, lookup->ipv6_query);
 
+	if (lookup->idle > 0)
+		g_source_remove(lookup->idle);
+
+	if (lookup->leader)
+		lookup->leader->followers =
+			g_slist_remove(lookup->leader->followers, lookup);
+
+	if (lookup->key && pending_lookups &&
+			g_hash_table_lookup(pending_lookups,
+						lookup->key) == lookup)
+		g_hash_table_remove(pending_lookups, lookup->key);
+
 	if (lookup->ipv4_query) {
 		g_queue_remove(lookup->resolv->query_queue,
 						lookup->ipv4_query);
@@ -182,7 +226,12 @@ static void destroy_lookup(struct resolv_lookup *lookup)
 		destroy_query(lookup->ipv6_query);
 	}
 
+	if (lookup->followers)
+		hand_over_followers(lookup);
+
 	g_free(lookup->results);
+	g_free(lookup->hostname);
+	g_free(lookup->key);
 	g_free(lookup);
 }
 
@@ -482,6 +531,204 @@ static void rfc3484_sort_results(struct resolv_lookup *lookup)
 			sizeof(struct sort_result), rfc3484_compare);
 }
 
+static void free_cache_entry(gpointer data)
+{
+	struct resolv_cache_entry *entry = data;
+
+	g_free(entry->results);
+	g_free(entry);
+}
+
+static bool same_source(const struct sort_result *one,
+				const struct sort_result *two)
+{
+	if (one->reachable != two->reachable)
+		return false;
+
+	if (!one->reachable)
+		return true;
+
+	if (one->src.sa.sa_family != two->src.sa.sa_family)
+		return false;
+
+	if (one->src.sa.sa_family == AF_INET)
+		return !memcmp(&one->src.sin.sin_addr, &two->src.sin.sin_addr,
+							sizeof(struct in_addr));
+
+	return !memcmp(&one->src.sin6.sin6_addr, &two->src.sin6.sin6_addr,
+						sizeof(struct in6_addr));
+}
+
+/*
+ * The cached order was sorted for the source addresses in use at the
+ * time, it is only reused while the same ones would be picked.
+ */
+static bool cached_order_valid(struct resolv_lookup *lookup)
+{
+	struct sort_result res;
+	int i;
+
+	for (i = 0; i < lookup->nr_results; i++) {
+		memset(&res, 0, sizeof(res));
+		res.dst = lookup->results[i].dst;
+		find_srcaddr(&res);
+
+		if (!same_source(&res, &lookup->results[i]))
+			return false;
+	}
+
+	return true;
+}
+
+static bool cache_lookup(struct resolv_lookup *lookup, const char *key)
+{
+	struct resolv_cache_entry *entry;
+
+	if (!resolv_cache)
+		return false;
+
+	entry = g_hash_table_lookup(resolv_cache, key);
+	if (!entry)
+		return false;
+
+	if (entry->expire <= g_get_monotonic_time() / G_USEC_PER_SEC) {
+		g_hash_table_remove(resolv_cache, key);
+		return false;
+	}
+
+	lookup->results = g_try_malloc(sizeof(struct sort_result) *
+							entry->nr_results);
+	if (!lookup->results)
+		return false;
+
+	memcpy(lookup->results, entry->results,
+			sizeof(struct sort_result) * entry->nr_results);
+	lookup->nr_results = entry->nr_results;
+	lookup->ipv4_status = entry->ipv4_status;
+	lookup->ipv6_status = entry->ipv6_status;
+	lookup->expire = entry->expire;
+	lookup->sorted = cached_order_valid(lookup);
+
+	return true;
+}
+
+static void trim_cache(gint64 now)
+{
+	struct resolv_cache_entry *entry;
+	GHashTableIter iter;
+	gpointer key, value, oldest = NULL;
+	gint64 expire = 0;
+
+	g_hash_table_iter_init(&iter, resolv_cache);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		entry = value;
+
+		if (entry->expire <= now) {
+			g_hash_table_iter_remove(&iter);
+			continue;
+		}
+
+		if (!oldest || entry->expire < expire) {
+			oldest = key;
+			expire = entry->expire;
+		}
+	}
+
+	if (oldest && g_hash_table_size(resolv_cache) >= RESOLV_CACHE_SIZE)
+		g_hash_table_remove(resolv_cache, oldest);
+}
+
+static void cache_store(struct resolv_lookup *lookup,
+					GResolvResultStatus status)
+{
+	struct resolv_cache_entry *entry;
+	gint64 now = g_get_monotonic_time() / G_USEC_PER_SEC;
+
+	if (!lookup->key || lookup->nr_results == 0 ||
+				status != G_RESOLV_RESULT_STATUS_SUCCESS)
+		return;
+
+	/* Do not remember answers where one of the queries failed */
+	if (lookup->ipv4_status != G_RESOLV_RESULT_STATUS_SUCCESS ||
+			lookup->ipv6_status != G_RESOLV_RESULT_STATUS_SUCCESS)
+		return;
+
+	if (lookup->expire == 0) {
+		if (lookup->ttl == 0)
+			return;
+
+		lookup->expire = now + lookup->ttl;
+	}
+
+	if (!resolv_cache)
+		resolv_cache = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, free_cache_entry);
+
+	if (!g_hash_table_lookup(resolv_cache, lookup->key) &&
+			g_hash_table_size(resolv_cache) >= RESOLV_CACHE_SIZE)
+		trim_cache(now);
+
+	entry = g_try_new0(struct resolv_cache_entry, 1);
+	if (!entry)
+		return;
+
+	entry->results = g_try_malloc(sizeof(struct sort_result) *
+							lookup->nr_results);
+	if (!entry->results) {
+		g_free(entry);
+		return;
+	}
+
+	memcpy(entry->results, lookup->results,
+			sizeof(struct sort_result) * lookup->nr_results);
+	entry->nr_results = lookup->nr_results;
+	entry->ipv4_status = lookup->ipv4_status;
+	entry->ipv6_status = lookup->ipv6_status;
+	entry->expire = lookup->expire;
+
+	g_hash_table_replace(resolv_cache, g_strdup(lookup->key), entry);
+
+	debug(lookup->resolv, "cached %s for %d seconds", lookup->hostname,
+						(int) (lookup->expire - now));
+}
+
+static void sort_and_return_results(struct resolv_lookup *lookup);
+
+static gboolean complete_lookup(gpointer user_data)
+{
+	struct resolv_lookup *lookup = user_data;
+
+	lookup->idle = 0;
+
+	sort_and_return_results(lookup);
+
+	return FALSE;
+}
+
+static void complete_followers(struct resolv_lookup *lookup)
+{
+	struct resolv_lookup *follower;
+	GSList *list;
+
+	for (list = lookup->followers; list; list = list->next) {
+		follower = list->data;
+
+		follower->leader = NULL;
+		follower->results = g_memdup(lookup->results,
+				sizeof(struct sort_result) * lookup->nr_results);
+		if (follower->results)
+			follower->nr_results = lookup->nr_results;
+		follower->ipv4_status = lookup->ipv4_status;
+		follower->ipv6_status = lookup->ipv6_status;
+		follower->sorted = true;
+
+		follower->idle = g_idle_add(complete_lookup, follower);
+	}
+
+	g_slist_free(lookup->followers);
+	lookup->followers = NULL;
+}
+
 static void sort_and_return_results(struct resolv_lookup *lookup)
 {
 	char buf[INET6_ADDRSTRLEN + 1];
@@ -496,7 +743,8 @@ static void sort_and_return_results(struct resolv_lookup *lookup)
 
 	memset(buf, 0, INET6_ADDRSTRLEN + 1);
 
-	rfc3484_sort_results(lookup);
+	if (!lookup->sorted)
+		rfc3484_sort_results(lookup);
 
 	for (i = 0; i < lookup->nr_results; i++) {
 		if (lookup->results[i].dst.sa.sa_family == AF_INET) {
@@ -530,6 +778,9 @@ static void sort_and_return_results(struct resolv_lookup *lookup)
 
 	debug(lookup->resolv, "lookup %p received %d results", lookup, n);
 
+	cache_store(lookup, status);
+	complete_followers(lookup);
+
 	g_queue_remove(lookup->resolv->lookup_queue, lookup);
 	destroy_lookup(lookup);
 
@@ -735,6 +986,9 @@ static void parse_response(struct resolv_nameserver *nameserver,
 		if (ns_rr_class(rr) != ns_c_in)
 			continue;
 
+		if (ns_rr_ttl(rr) < lookup->ttl)
+			lookup->ttl = ns_rr_ttl(rr);
+
 		g_assert(offsetof(struct sockaddr_in, sin_addr) ==
 				offsetof(struct sockaddr_in6, sin6_flowinfo));
 
@@ -1024,10 +1278,110 @@ static gint add_query(struct resolv_lookup *lookup, const char *hostname, int ty
 	return 0;
 }
 
+static int send_queries(struct resolv_lookup *lookup)
+{
+	GResolv *resolv = lookup->resolv;
+
+	if (resolv->result_family != AF_INET6) {
+		if (add_query(lookup, lookup->hostname, ns_t_a))
+			return -EIO;
+	}
+
+	if (resolv->result_family != AF_INET) {
+		if (add_query(lookup, lookup->hostname, ns_t_aaaa)) {
+			if (lookup->ipv4_query) {
+				g_queue_remove(resolv->query_queue,
+						lookup->ipv4_query);
+				destroy_query(lookup->ipv4_query);
+				lookup->ipv4_query = NULL;
+			}
+
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+static char *lookup_key(GResolv *resolv, const char *hostname)
+{
+	GString *key;
+	GList *list;
+	char *name;
+
+	name = g_ascii_strdown(hostname, -1);
+	key = g_string_new(NULL);
+
+	g_string_printf(key, "%s/%d/%d", name, resolv->index,
+						resolv->result_family);
+
+	for (list = g_list_first(resolv->nameserver_list);
+					list; list = g_list_next(list)) {
+		struct resolv_nameserver *nameserver = list->data;
+
+		g_string_append_printf(key, "/%s#%u", nameserver->address,
+							nameserver->port);
+	}
+
+	g_free(name);
+
+	return g_string_free(key, FALSE);
+}
+
+static void add_pending_lookup(struct resolv_lookup *lookup)
+{
+	if (!pending_lookups)
+		pending_lookups = g_hash_table_new(g_str_hash, g_str_equal);
+
+	g_hash_table_replace(pending_lookups, lookup->key, lookup);
+}
+
+/*
+ * The lookup the others are waiting for is going away, the first
+ * one still wanted sends the queries again for the rest.
+ */
+static void hand_over_followers(struct resolv_lookup *lookup)
+{
+	struct resolv_lookup *follower;
+	GSList *list;
+
+	while (lookup->followers) {
+		follower = lookup->followers->data;
+		lookup->followers = g_slist_delete_link(lookup->followers,
+							lookup->followers);
+		follower->leader = NULL;
+
+		/* Its resolver is being freed as well */
+		if (follower->resolv->ref_count == 0)
+			continue;
+
+		if (send_queries(follower) < 0) {
+			follower->ipv4_status = G_RESOLV_RESULT_STATUS_ERROR;
+			follower->ipv6_status = G_RESOLV_RESULT_STATUS_ERROR;
+			follower->idle = g_idle_add(complete_lookup, follower);
+			continue;
+		}
+
+		follower->key = lookup_key(follower->resolv,
+							follower->hostname);
+		add_pending_lookup(follower);
+
+		follower->followers = lookup->followers;
+		lookup->followers = NULL;
+
+		for (list = follower->followers; list; list = list->next) {
+			struct resolv_lookup *waiting = list->data;
+
+			waiting->leader = follower;
+		}
+	}
+}
+
 guint g_resolv_lookup_hostname(GResolv *resolv, const char *hostname,
 				GResolvResultFunc func, gpointer user_data)
 {
-	struct resolv_lookup *lookup;
+	struct resolv_lookup *lookup, *leader;
+	char *key;
 
 	if (!resolv)
 		return 0;
@@ -1067,25 +1421,40 @@ guint g_resolv_lookup_hostname(GResolv *resolv, const char *hostname,
 	lookup->result_func = func;
 	lookup->result_data = user_data;
 	lookup->id = resolv->next_lookup_id++;
+	lookup->hostname = g_strdup(hostname);
+	lookup->ttl = RESOLV_CACHE_MAX_TTL;
 
-	if (resolv->result_family != AF_INET6) {
-		if (add_query(lookup, hostname, ns_t_a)) {
-			g_free(lookup);
-			return -EIO;
-		}
-	}
+	key = lookup_key(resolv, hostname);
 
-	if (resolv->result_family != AF_INET) {
-		if (add_query(lookup, hostname, ns_t_aaaa)) {
-			if (resolv->result_family != AF_INET6) {
-				g_queue_remove(resolv->query_queue,
-						lookup->ipv4_query);
-				destroy_query(lookup->ipv4_query);
-			}
+	if (cache_lookup(lookup, key)) {
+		debug(resolv, "lookup %p answered from cache", lookup);
 
+		/* Sorted again for the new source addresses and stored */
+		if (!lookup->sorted)
+			lookup->key = key;
+		else
+			g_free(key);
+
+		lookup->idle = g_idle_add(complete_lookup, lookup);
+	} else if (pending_lookups &&
+			(leader = g_hash_table_lookup(pending_lookups, key))) {
+		debug(resolv, "lookup %p waits for lookup %p", lookup, leader);
+
+		g_free(key);
+
+		lookup->leader = leader;
+		leader->followers = g_slist_append(leader->followers, lookup);
+	} else {
+		if (send_queries(lookup) < 0) {
+			g_free(key);
+			g_free(lookup->results);
+			g_free(lookup->hostname);
 			g_free(lookup);
 			return -EIO;
 		}
+
+		lookup->key = key;
+		add_pending_lookup(lookup);
 	}
 
 	g_queue_push_tail(resolv->lookup_queue, lookup);
@@ -47,11 +47,15 @@
 
 #define SESSION_FLAG_USE_TLS	(1 << 0)
 
+#define POOL_IDLE_TIMEOUT	15
+#define POOL_MAX_IDLE		4
+
 enum chunk_state {
 	CHUNK_SIZE,
 	CHUNK_R_BODY,
 	CHUNK_N_BODY,
 	CHUNK_DATA,
+	CHUNK_TRAILER,
 };
 
 struct _GWebResult {
@@ -107,6 +111,22 @@ struct web_session {
 	gpointer user_data;
 
 	bool cancelled;
+
+	char *pool_key;
+	bool reused;
+	bool keep_alive;
+	bool has_length;
+	gsize body_left;
+	bool body_complete;
+};
+
+struct web_connection {
+	GWeb *web;
+	char *key;
+	char *address;
+	GIOChannel *channel;
+	guint watch;
+	guint timeout;
 };
 
 struct _GWeb {
@@ -127,6 +147,10 @@ struct _GWeb {
 	char *http_version;
 	bool close_connection;
 
+	GSList *idle_connections;
+	GHashTable *tls_sessions;
+	GWebPoolStats pool_stats;
+
 	GWebDebugFunc debug_func;
 	gpointer debug_data;
 };
@@ -215,6 +239,8 @@ static void free_session(struct web_session *session)
 	if (session->addr)
 		freeaddrinfo(session->addr);
 
+	g_free(session->pool_key);
+
 	g_free(session);
 }
 
@@ -231,6 +257,29 @@ static void flush_sessions(GWeb *web)
 	g_hash_table_destroy(web->session_hash);
 }
 
+static void free_connection(struct web_connection *conn)
+{
+	if (conn->watch > 0)
+		g_source_remove(conn->watch);
+
+	if (conn->timeout > 0)
+		g_source_remove(conn->timeout);
+
+	if (conn->channel)
+		g_io_channel_unref(conn->channel);
+
+	g_free(conn->key);
+	g_free(conn->address);
+	g_free(conn);
+}
+
+static void flush_connections(GWeb *web)
+{
+	g_slist_free_full(web->idle_connections,
+				(GDestroyNotify) free_connection);
+	web->idle_connections = NULL;
+}
+
 GWeb *g_web_new(int index)
 {
 	GWeb *web;
@@ -250,9 +299,13 @@ GWeb *g_web_new(int index)
 
 	web->index = index;
 	web->session_hash = g_hash_table_new(g_direct_hash, g_direct_equal);
+	web->tls_sessions = g_hash_table_new_full(g_str_hash, g_str_equal,
+				g_free, (GDestroyNotify) g_byte_array_unref);
 
 	web->resolv = g_resolv_new(index);
 	if (!web->resolv) {
+		g_hash_table_destroy(web->session_hash);
+		g_hash_table_destroy(web->tls_sessions);
 		g_free(web);
 		return NULL;
 	}
@@ -283,6 +336,8 @@ void g_web_unref(GWeb *web)
 		return;
 
 	flush_sessions(web);
+	flush_connections(web);
+	g_hash_table_destroy(web->tls_sessions);
 
 	g_resolv_unref(web->resolv);
 
@@ -462,6 +517,17 @@ bool g_web_get_close_connection(GWeb *web)
 	return web->close_connection;
 }
 
+bool g_web_get_pool_stats(GWeb *web, GWebPoolStats *stats)
+{
+	if (!web || !stats)
+		return false;
+
+	*stats = web->pool_stats;
+	stats->idle = g_slist_length(web->idle_connections);
+
+	return true;
+}
+
 static inline void call_result_func(struct web_session *session, guint16 status)
 {
 
@@ -740,7 +806,8 @@ static int decode_chunked(struct web_session *session,
 			if (session->chunk_size == 0) {
 				debug(session->web, "Download Done in chunk");
 				g_string_truncate(session->current_header, 0);
-				return 0;
+				session->chunck_state = CHUNK_TRAILER;
+				break;
 			}
 
 			if (session->chunk_left <= len) {
@@ -769,6 +836,36 @@ static int decode_chunked(struct web_session *session,
 			len -= len;
 			ptr += len;
 			break;
+		case CHUNK_TRAILER:
+			pos = memchr(ptr, '\n', len);
+			if (!pos) {
+				g_string_append_len(session->current_header,
+						(gchar *) ptr, len);
+				return 0;
+			}
+
+			count = pos - ptr;
+			g_string_append_len(session->current_header,
+						(gchar *) ptr, count);
+
+			len -= count + 1;
+			ptr = pos + 1;
+
+			str = session->current_header->str;
+
+			/* The trailer ends with an empty line */
+			if (str[0] == '\0' || g_str_equal(str, "\r")) {
+				g_string_truncate(session->current_header, 0);
+				session->body_complete = true;
+
+				if (len > 0)
+					session->keep_alive = false;
+
+				return 0;
+			}
+
+			g_string_truncate(session->current_header, 0);
+			break;
 		}
 	}
 
@@ -783,6 +880,19 @@ static int handle_body(struct web_session *session,
 	debug(session->web, "[body] length %zu", len);
 
 	if (!session->result.use_chunk) {
+		if (session->has_length) {
+			if (len >= session->body_left) {
+				/* Anything after the body is not ours */
+				if (len > session->body_left)
+					session->keep_alive = false;
+
+				len = session->body_left;
+				session->body_complete = true;
+			}
+
+			session->body_left -= len;
+		}
+
 		if (len > 0) {
 			session->result.buffer = buf;
 			session->result.length = len;
@@ -878,6 +988,202 @@ static void add_header_field(struct web_session *session)
 	}
 }
 
+static void check_response_body(struct web_session *session)
+{
+	const char *value;
+
+	if (session->result.status == 204 || session->result.status == 304) {
+		session->has_length = true;
+		session->body_left = 0;
+	} else if (!session->result.use_chunk &&
+			g_web_result_get_header(&session->result,
+						"Content-Length", &value)) {
+		char *end;
+		guint64 length = g_ascii_strtoull(value, &end, 10);
+
+		if (end != value && *end == '\0') {
+			session->has_length = true;
+			session->body_left = length;
+		}
+	}
+
+	/* Without a length the body ends when the server closes */
+	if (!session->has_length && !session->result.use_chunk)
+		session->keep_alive = false;
+
+	if (g_web_result_get_header(&session->result, "Connection", &value) &&
+				g_ascii_strcasecmp(value, "close") == 0)
+		session->keep_alive = false;
+}
+
+static void drop_idle_connection(struct web_connection *conn)
+{
+	GWeb *web = conn->web;
+
+	web->idle_connections = g_slist_remove(web->idle_connections, conn);
+	free_connection(conn);
+}
+
+static gboolean idle_connection_event(GIOChannel *channel,
+					GIOCondition cond, gpointer user_data)
+{
+	struct web_connection *conn = user_data;
+
+	/* Nothing is expected while idle, the server is closing it */
+	debug(conn->web, "idle connection to %s closed", conn->key);
+
+	conn->watch = 0;
+	drop_idle_connection(conn);
+
+	return FALSE;
+}
+
+static gboolean idle_connection_timeout(gpointer user_data)
+{
+	struct web_connection *conn = user_data;
+
+	debug(conn->web, "idle connection to %s expired", conn->key);
+
+	conn->timeout = 0;
+	drop_idle_connection(conn);
+
+	return FALSE;
+}
+
+static void release_connection(struct web_session *session)
+{
+	GWeb *web = session->web;
+	struct web_connection *conn;
+	GSList *last;
+
+	conn = g_try_new0(struct web_connection, 1);
+	if (!conn)
+		return;
+
+	conn->web = web;
+	conn->key = g_strdup(session->pool_key);
+	conn->address = g_strdup(session->address);
+	conn->channel = session->transport_channel;
+	session->transport_channel = NULL;
+
+	conn->watch = g_io_add_watch(conn->channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						idle_connection_event, conn);
+	conn->timeout = g_timeout_add_seconds(POOL_IDLE_TIMEOUT,
+					idle_connection_timeout, conn);
+
+	debug(web, "keeping connection to %s", conn->key);
+
+	web->idle_connections = g_slist_prepend(web->idle_connections, conn);
+
+	if (g_slist_length(web->idle_connections) > POOL_MAX_IDLE) {
+		last = g_slist_last(web->idle_connections);
+		drop_idle_connection(last->data);
+	}
+}
+
+static GIOChannel *take_connection(GWeb *web, const char *key,
+							char **address)
+{
+	struct web_connection *conn = NULL;
+	GIOChannel *channel;
+	GSList *list;
+
+	for (list = web->idle_connections; list; list = list->next) {
+		conn = list->data;
+
+		if (g_str_equal(conn->key, key))
+			break;
+	}
+
+	if (!list)
+		return NULL;
+
+	web->idle_connections = g_slist_delete_link(web->idle_connections,
+									list);
+
+	channel = conn->channel;
+	conn->channel = NULL;
+	*address = conn->address;
+	conn->address = NULL;
+
+	free_connection(conn);
+
+	return channel;
+}
+
+static void save_tls_session(struct web_session *session)
+{
+	GWeb *web = session->web;
+	GByteArray *data;
+
+	if (g_io_channel_gnutls_session_resumed(session->transport_channel))
+		web->pool_stats.tls_resumed++;
+
+	data = g_io_channel_gnutls_get_session(session->transport_channel);
+	if (data)
+		g_hash_table_replace(web->tls_sessions,
+					g_strdup(session->pool_key), data);
+}
+
+static void finish_response(struct web_session *session)
+{
+	debug(session->web, "response done keep-alive %d",
+						session->keep_alive);
+
+	if (session->flags & SESSION_FLAG_USE_TLS && !session->reused)
+		save_tls_session(session);
+
+	if (session->keep_alive && session->send_watch == 0)
+		release_connection(session);
+
+	if (session->transport_channel) {
+		if (session->send_watch > 0) {
+			g_source_remove(session->send_watch);
+			session->send_watch = 0;
+		}
+
+		g_io_channel_unref(session->transport_channel);
+		session->transport_channel = NULL;
+	}
+
+	session->result.buffer = NULL;
+	session->result.length = 0;
+	call_result_func(session, 0);
+}
+
+static int resolve_session(struct web_session *session);
+
+/*
+ * The server may close an idle connection just when it is reused.
+ * Send the request again over a new one if nothing came back yet.
+ */
+static bool retry_session(struct web_session *session)
+{
+	if (!session->reused || session->content_type ||
+				session->result.status != 0 ||
+				session->current_header->len > 0)
+		return false;
+
+	debug(session->web, "reused connection closed, reconnecting");
+
+	session->reused = false;
+
+	if (session->send_watch > 0) {
+		g_source_remove(session->send_watch);
+		session->send_watch = 0;
+	}
+
+	g_io_channel_unref(session->transport_channel);
+	session->transport_channel = NULL;
+
+	session->request_started = false;
+	session->body_done = false;
+	g_string_truncate(session->send_buffer, 0);
+
+	return resolve_session(session) == 0;
+}
+
 static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 							gpointer user_data)
 {
@@ -891,6 +1197,10 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 	if (cond & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
 		session->transport_watch = 0;
+
+		if (retry_session(session))
+			return FALSE;
+
 		session->result.buffer = NULL;
 		session->result.length = 0;
 		call_result_func(session, 400);
@@ -905,6 +1215,10 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 	if (status != G_IO_STATUS_NORMAL && status != G_IO_STATUS_AGAIN) {
 		session->transport_watch = 0;
+
+		if (retry_session(session))
+			return FALSE;
+
 		session->result.buffer = NULL;
 		session->result.length = 0;
 		call_result_func(session, 0);
@@ -919,6 +1233,13 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 			session->transport_watch = 0;
 			return FALSE;
 		}
+
+		if (session->body_complete) {
+			session->transport_watch = 0;
+			finish_response(session);
+			return FALSE;
+		}
+
 		return TRUE;
 	}
 
@@ -968,10 +1289,18 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 				}
 			}
 
+			check_response_body(session);
+
 			if (handle_body(session, ptr, bytes_read) < 0) {
 				session->transport_watch = 0;
 				return FALSE;
 			}
+
+			if (session->body_complete) {
+				session->transport_watch = 0;
+				finish_response(session);
+				return FALSE;
+			}
 			break;
 		}
 
@@ -982,6 +1311,9 @@ static gboolean received_data(GIOChannel *channel, GIOCondition cond,
 
 			if (sscanf(str, "HTTP/%*s %u %*s", &code) == 1)
 				session->result.status = code;
+
+			if (g_str_has_prefix(str, "HTTP/1.0"))
+				session->keep_alive = false;
 		}
 
 		debug(session->web, "[header] %s", str);
@@ -1049,8 +1381,20 @@ static inline int bind_socket(int sk, int index, int family)
 	return err;
 }
 
+static void add_transport_watches(struct web_session *session)
+{
+	session->transport_watch = g_io_add_watch(session->transport_channel,
+				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						received_data, session);
+
+	session->send_watch = g_io_add_watch(session->transport_channel,
+				G_IO_OUT | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+						send_data, session);
+}
+
 static int connect_session_transport(struct web_session *session)
 {
+	GByteArray *tls_session;
 	GIOFlags flags;
 	int sk;
 
@@ -1071,6 +1415,13 @@ static int connect_session_transport(struct web_session *session)
 	if (session->flags & SESSION_FLAG_USE_TLS) {
 		debug(session->web, "using TLS encryption");
 		session->transport_channel = g_io_channel_gnutls_new(sk);
+
+		tls_session = g_hash_table_lookup(session->web->tls_sessions,
+							session->pool_key);
+		if (session->transport_channel && tls_session)
+			g_io_channel_gnutls_set_session(
+					session->transport_channel,
+					tls_session);
 	} else {
 		debug(session->web, "no encryption");
 		session->transport_channel = g_io_channel_unix_new(sk);
@@ -1101,13 +1452,9 @@ static int connect_session_transport(struct web_session *session)
 		}
 	}
 
-	session->transport_watch = g_io_add_watch(session->transport_channel,
-				G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
-						received_data, session);
+	add_transport_watches(session);
 
-	session->send_watch = g_io_add_watch(session->transport_channel,
-				G_IO_OUT | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
-						send_data, session);
+	session->web->pool_stats.connections++;
 
 	return 0;
 }
@@ -1304,13 +1651,36 @@ static bool is_ip_address(const char *host)
 	return result == 0;
 }
 
+static int resolve_session(struct web_session *session)
+{
+	GWeb *web = session->web;
+	const gchar *host;
+
+	host = session->address ? session->address : session->host;
+	if (is_ip_address(host)) {
+		if (session->address != host) {
+			g_free(session->address);
+			session->address = g_strdup(host);
+		}
+		session->address_action = g_timeout_add(0, already_resolved,
+							session);
+	} else {
+		session->resolv_action = g_resolv_lookup_hostname(web->resolv,
+					host, resolv_result, session);
+		if (session->resolv_action == 0)
+			return -EIO;
+	}
+
+	return 0;
+}
+
 static guint do_request(GWeb *web, const char *url,
 				const char *type, GWebInputFunc input,
 				int fd, gsize length, GWebResultFunc func,
 				GWebRouteFunc route, gpointer user_data)
 {
 	struct web_session *session;
-	const gchar *host;
+	char *address;
 
 	if (!web || !url)
 		return 0;
@@ -1368,21 +1738,29 @@ static guint do_request(GWeb *web, const char *url,
 	session->header_done = false;
 	session->body_done = false;
 
-	host = session->address ? session->address : session->host;
-	if (is_ip_address(host)) {
-		if (session->address != host) {
-			g_free(session->address);
-			session->address = g_strdup(host);
-		}
-		session->address_action = g_timeout_add(0, already_resolved,
-							session);
-	} else {
-		session->resolv_action = g_resolv_lookup_hostname(web->resolv,
-					host, resolv_result, session);
-		if (session->resolv_action == 0) {
-			free_session(session);
-			return 0;
-		}
+	session->keep_alive = !web->close_connection &&
+				(!web->http_version ||
+				g_str_equal(web->http_version, "1.1"));
+
+	session->pool_key = g_strdup_printf("%s://%s:%u",
+			session->flags & SESSION_FLAG_USE_TLS ? "https" : "http",
+			session->address ? session->address : session->host,
+			session->port);
+
+	session->transport_channel = take_connection(web, session->pool_key,
+								&address);
+	if (session->transport_channel) {
+		debug(web, "reusing connection to %s", session->pool_key);
+
+		g_free(session->address);
+		session->address = address;
+		session->reused = true;
+		web->pool_stats.reused++;
+
+		add_transport_watches(session);
+	} else if (resolve_session(session) < 0) {
+		free_session(session);
+		return 0;
 	}
 
 	g_hash_table_insert(web->session_hash, GUINT_TO_POINTER(web->next_query_id), session);
@@ -49,6 +49,13 @@ typedef bool (*GWebInputFunc)(const guint8 **data, gsize *length,
 
 typedef void (*GWebDebugFunc)(const char *str, gpointer user_data);
 
+typedef struct {
+	unsigned int connections;	/* connections opened */
+	unsigned int reused;		/* requests sent over idle ones */
+	unsigned int tls_resumed;	/* TLS sessions resumed */
+	unsigned int idle;		/* connections kept idle now */
+} GWebPoolStats;
+
 GWeb *g_web_new(int index);
 
 GWeb *g_web_ref(GWeb *web);
@@ -79,6 +86,8 @@ bool g_web_set_http_version(GWeb *web, const char *version);
 void g_web_set_close_connection(GWeb *web, bool enabled);
 bool g_web_get_close_connection(GWeb *web);
 
+bool g_web_get_pool_stats(GWeb *web, GWebPoolStats *stats);
+
 guint g_web_request_get(GWeb *web, const char *url,
 				GWebResultFunc func, GWebRouteFunc route,
 				gpointer user_data);
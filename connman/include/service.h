@@ -130,6 +130,8 @@ bool connman_service_get_autoconnect(struct connman_service *service);
 
 struct connman_service *connman_service_lookup_from_network(struct connman_network *network);
 void connman_service_update_strength_from_network(struct connman_network *network);
+void connman_service_freeze_sort(void);
+void connman_service_thaw_sort(void);
 
 void connman_service_create_ip4config(struct connman_service *service,
 								int index);
@@ -22,14 +22,22 @@
 #ifndef __CONNMAN_STORAGE_H
 #define __CONNMAN_STORAGE_H
 
+#include <stdbool.h>
+
 #include <glib.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+#define CONNMAN_STORAGE_FAVORITE	(1 << 0)
+#define CONNMAN_STORAGE_AUTOCONNECT	(1 << 1)
+#define CONNMAN_STORAGE_HIDDEN		(1 << 2)
+
 gchar **connman_storage_get_services();
 GKeyFile *connman_storage_load_service(const char *service_id);
+bool connman_storage_get_service_hints(const char *service_id,
+				unsigned int *flags, GTimeVal *modified);
 
 const char *connman_storage_dir(void);
 const char *connman_storage_vpn_dir(void);
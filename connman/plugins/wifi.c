@@ -1088,9 +1088,17 @@ static int get_hidden_connections(GSupplicantScanParams *scan_data)
 
 	services = connman_storage_get_services();
 	for (i = 0; services && services[i]; i++) {
+		unsigned int flags;
+
 		if (strncmp(services[i], "wifi_", 5) != 0)
 			continue;
 
+		if (connman_storage_get_service_hints(services[i], &flags,
+								NULL) &&
+				(!(flags & CONNMAN_STORAGE_HIDDEN) ||
+				!(flags & CONNMAN_STORAGE_FAVORITE)))
+			continue;
+
 		keyfile = connman_storage_load_service(services[i]);
 		if (!keyfile)
 			continue;
@@ -1665,9 +1673,17 @@ static int get_latest_connections(int max_ssids,
 
 	services = connman_storage_get_services();
 	for (i = 0; services && services[i]; i++) {
+		unsigned int flags;
+
 		if (strncmp(services[i], "wifi_", 5) != 0)
 			continue;
 
+		if (connman_storage_get_service_hints(services[i], &flags,
+								NULL) &&
+				(!(flags & CONNMAN_STORAGE_FAVORITE) ||
+				!(flags & CONNMAN_STORAGE_AUTOCONNECT)))
+			continue;
+
 		keyfile = connman_storage_load_service(services[i]);
 		if (!keyfile)
 			continue;
@@ -2858,6 +2874,108 @@ static void network_changed(GSupplicantNetwork *network, const char *property)
 	connman_network_set_frequency(connman_network, frequency);
 }
 
+static bool refresh_network(struct connman_network *network,
+				GSupplicantNetwork *supplicant_network)
+{
+	bool wps;
+	int err;
+
+	wps = g_supplicant_network_get_wps(supplicant_network);
+	connman_network_set_bool(network, "WiFi.WPS", wps);
+
+	if (wps && g_supplicant_network_is_wps_active(supplicant_network) &&
+			g_supplicant_network_is_wps_pbc(supplicant_network) &&
+			g_supplicant_network_is_wps_advertizing(
+							supplicant_network))
+		connman_network_set_bool(network, "WiFi.UseWPS", true);
+
+	connman_network_set_bssid(network,
+			g_supplicant_network_get_bssid(supplicant_network));
+	connman_network_set_maxrate(network,
+			g_supplicant_network_get_maxrate(supplicant_network));
+	connman_network_set_frequency(network,
+			g_supplicant_network_get_frequency(supplicant_network));
+	connman_network_set_available(network, true);
+
+	err = connman_network_set_strength(network,
+				calculate_strength(supplicant_network));
+	if (err < 0)
+		return false;
+
+	connman_network_update(network);
+
+	return true;
+}
+
+/*
+ * Called with all the networks of the interface once a scan is done.
+ * New networks are added, known ones only get their strength and BSS
+ * details refreshed and the ones which went away are removed. The
+ * service list is sorted once at the end.
+ */
+static void scan_results(GSupplicantInterface *interface, GList *networks)
+{
+	struct wifi_data *wifi = g_supplicant_interface_get_data(interface);
+	struct connman_network *network;
+	GHashTable *found;
+	GSList *list, *next;
+	GList *iter;
+	int added = 0, changed = 0, removed = 0;
+
+	if (!wifi || !wifi->device)
+		return;
+
+	connman_service_freeze_sort();
+
+	found = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (iter = networks; iter; iter = iter->next) {
+		GSupplicantNetwork *supplicant_network = iter->data;
+		const char *identifier;
+
+		identifier = g_supplicant_network_get_identifier(
+							supplicant_network);
+		network = connman_device_get_network(wifi->device, identifier);
+
+		/* A pending hidden connect is matched by network_added() */
+		if (!network || wifi->hidden) {
+			if (!network)
+				added++;
+
+			network_added(supplicant_network);
+
+			network = connman_device_get_network(wifi->device,
+								identifier);
+		} else if (refresh_network(network, supplicant_network)) {
+			changed++;
+		}
+
+		if (network)
+			g_hash_table_add(found, network);
+	}
+
+	for (list = wifi->networks; list; list = next) {
+		next = list->next;
+		network = list->data;
+
+		if (g_hash_table_contains(found, network))
+			continue;
+
+		wifi->networks = g_slist_delete_link(wifi->networks, list);
+
+		connman_device_remove_network(wifi->device, network);
+		connman_network_unref(network);
+		removed++;
+	}
+
+	g_hash_table_destroy(found);
+
+	connman_service_thaw_sort();
+
+	DBG("networks %d added %d changed %d removed %d",
+			g_list_length(networks), added, changed, removed);
+}
+
 static void apply_peer_services(GSupplicantPeer *peer,
 				struct connman_peer *connman_peer)
 {
@@ -3061,6 +3179,7 @@ static const GSupplicantCallbacks callbacks = {
 	.network_added		= network_added,
 	.network_removed	= network_removed,
 	.network_changed	= network_changed,
+	.scan_results		= scan_results,
 	.peer_found		= peer_found,
 	.peer_lost		= peer_lost,
 	.peer_changed		= peer_changed,
@@ -409,6 +409,7 @@ static struct gateway_data *add_gateway(struct connman_service *service,
 static void set_default_gateway(struct gateway_data *data,
 				enum connman_ipconfig_type type)
 {
+	struct __connman_inet_rtnl_batch *batch;
 	int index;
 	int status4 = 0, status6 = 0;
 	bool do_ipv4 = false, do_ipv6 = false;
@@ -471,15 +472,33 @@ static void set_default_gateway(struct gateway_data *data,
 		goto done;
 	}
 
+	/*
+	 * Both default routes go to the kernel in one batch, the status
+	 * is the position of the request until the batch is committed.
+	 */
+	batch = __connman_inet_rtnl_batch_new();
+
 	if (do_ipv6 && data->ipv6_gateway)
-		status6 = __connman_inet_add_default_to_table(RT_TABLE_MAIN,
-					index, data->ipv6_gateway->gateway);
+		status6 = __connman_inet_batch_add_default_to_table(batch,
+					RT_TABLE_MAIN, index,
+					data->ipv6_gateway->gateway);
 
 	if (do_ipv4 && data->ipv4_gateway)
-		status4 = __connman_inet_add_default_to_table(RT_TABLE_MAIN,
-					index, data->ipv4_gateway->gateway);
+		status4 = __connman_inet_batch_add_default_to_table(batch,
+					RT_TABLE_MAIN, index,
+					data->ipv4_gateway->gateway);
+
+	__connman_inet_rtnl_batch_commit(batch);
+
+	if (do_ipv6 && data->ipv6_gateway && status6 >= 0)
+		status6 = __connman_inet_rtnl_batch_result(batch, status6);
+	if (do_ipv4 && data->ipv4_gateway && status4 >= 0)
+		status4 = __connman_inet_rtnl_batch_result(batch, status4);
+
+	__connman_inet_rtnl_batch_free(batch);
 
-	if (status4 < 0 || status6 < 0)
+	if ((status4 < 0 && status4 != -EEXIST) ||
+			(status6 < 0 && status6 != -EEXIST))
 		return;
 
 done:
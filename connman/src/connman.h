@@ -33,6 +33,10 @@ dbus_bool_t __connman_dbus_append_objpath_array(DBusMessage *msg,
 			connman_dbus_append_cb_t function, void *user_data);
 int __connman_dbus_init(DBusConnection *conn);
 void __connman_dbus_cleanup(void);
+void __connman_dbus_batch_interface(const char *interface);
+void __connman_dbus_get_batch_stats(unsigned int *changes,
+						unsigned int *signals);
+void __connman_dbus_flush_properties(const char *path);
 
 DBusMessage *__connman_error_failed(DBusMessage *msg, int errnum);
 DBusMessage *__connman_error_invalid_arguments(DBusMessage *msg);
@@ -132,6 +136,7 @@ int __connman_log_init(const char *program, const char *debug,
 		gboolean detach, gboolean backtrace,
 		const char *program_name, const char *program_version);
 void __connman_log_cleanup(gboolean backtrace);
+int __connman_log_trace_init(const char *path);
 void __connman_log_enable(struct connman_debug_desc *start,
 					struct connman_debug_desc *stop);
 
@@ -246,6 +251,37 @@ int __connman_inet_add_fwmark_rule(uint32_t table_id, int family, uint32_t fwmar
 int __connman_inet_del_fwmark_rule(uint32_t table_id, int family, uint32_t fwmark);
 int __connman_inet_add_default_to_table(uint32_t table_id, int ifindex, const char *gateway);
 int __connman_inet_del_default_from_table(uint32_t table_id, int ifindex, const char *gateway);
+
+struct __connman_inet_rtnl_batch;
+struct __connman_inet_rtnl_batch *__connman_inet_rtnl_batch_new(void);
+void __connman_inet_rtnl_batch_free(struct __connman_inet_rtnl_batch *batch);
+int __connman_inet_rtnl_batch_add(struct __connman_inet_rtnl_batch *batch,
+						const struct nlmsghdr *n);
+int __connman_inet_rtnl_batch_commit(struct __connman_inet_rtnl_batch *batch);
+int __connman_inet_rtnl_batch_result(struct __connman_inet_rtnl_batch *batch,
+								int op);
+int __connman_inet_batch_add_host_route(struct __connman_inet_rtnl_batch *batch,
+				int index, const char *host,
+				const char *gateway);
+int __connman_inet_batch_del_host_route(struct __connman_inet_rtnl_batch *batch,
+				int index, const char *host);
+int __connman_inet_batch_add_fwmark_rule(struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int family, uint32_t fwmark);
+int __connman_inet_batch_del_fwmark_rule(struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int family, uint32_t fwmark);
+int __connman_inet_batch_add_default_to_table(
+				struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int ifindex,
+				const char *gateway);
+int __connman_inet_batch_del_default_from_table(
+				struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int ifindex,
+				const char *gateway);
+
+void __connman_inet_ifname_cache_set(int index, const char *name);
+void __connman_inet_ifname_cache_remove(int index);
+void __connman_inet_ifname_cache_flush(void);
+void __connman_inet_cleanup(void);
 int __connman_inet_get_address_netmask(int ifindex,
 		struct sockaddr_in *address, struct sockaddr_in *netmask);
 
@@ -268,6 +304,11 @@ int __connman_storage_dir_mode(void);
 int __connman_storage_file_mode(void);
 int __connman_storage_init(const char *root, int dir_mode, int file_mode);
 void __connman_storage_cleanup(void);
+void __connman_storage_set_write_delay(unsigned int delay_ms);
+void __connman_storage_set_service_index(bool enable);
+void __connman_storage_sync(void);
+void __connman_storage_get_stats(unsigned int *requested,
+						unsigned int *performed);
 GKeyFile *__connman_storage_open_global(void);
 GKeyFile *__connman_storage_load_global(void);
 int __connman_storage_save_global(GKeyFile *keyfile);
@@ -941,6 +982,8 @@ void __connman_stats_rebase(struct connman_stats *stats,
 				const struct connman_stats_data *data);
 void __connman_stats_get(struct connman_stats *stats,
 				struct connman_stats_data *data);
+int __connman_stats_get_since(struct connman_stats *stats, time_t since,
+				struct connman_stats_data *data);
 
 int __connman_iptables_dump(const char *table_name);
 int __connman_iptables_new_chain(const char *table_name,
@@ -979,6 +1022,37 @@ void __connman_dnsproxy_remove_listener(int index);
 int __connman_dnsproxy_append(int index, const char *domain, const char *server);
 int __connman_dnsproxy_remove(int index, const char *domain, const char *server);
 
+struct connman_dnsproxy_stats {
+	unsigned int prefetch_queries;
+	unsigned int prefetch_hits;
+	unsigned int stale_answers;
+	unsigned int udp_wakeups;
+	unsigned int udp_queries;
+	unsigned int udp_max_batch;
+};
+
+void __connman_dnsproxy_get_stats(struct connman_dnsproxy_stats *stats);
+
+struct connman_dnsproxy_server_stats {
+	const char *server;
+	int index;
+	unsigned int srtt;
+	unsigned int rttvar;
+	unsigned int loss;
+	unsigned int queries;
+	unsigned int replies;
+	unsigned int timeouts;
+	unsigned int failures;
+};
+
+typedef void (*connman_dnsproxy_server_stats_cb_t)(
+			struct connman_dnsproxy_server_stats *stats,
+			void *user_data);
+
+void __connman_dnsproxy_foreach_server_stats(
+			connman_dnsproxy_server_stats_cb_t callback,
+			void *user_data);
+
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
 int __connman_6to4_check(struct connman_ipconfig *ipconfig);
@@ -229,6 +229,289 @@ void connman_dbus_property_append_array(DBusMessageIter *iter,
 
 static DBusConnection *connection = NULL;
 
+/*
+ * PropertyChanged signals of the interfaces passed to
+ * __connman_dbus_batch_interface() are not sent right away but kept per
+ * object for BATCH_DELAY ms. A later change of the same property
+ * replaces the earlier one. All changes of the object are then
+ * broadcast in a single PropertiesChanged signal instead.
+ *
+ * Pending changes are sent before any method reply goes out on the
+ * connection, so that no caller sees a reply before the property
+ * change that it caused.
+ */
+#define BATCH_DELAY	20
+
+struct batch_property {
+	char *key;
+	DBusMessage *signal;
+};
+
+struct batch_object {
+	char *path;
+	const char *interface;
+	GPtrArray *properties;
+};
+
+static GSList *batch_interfaces = NULL;
+static GHashTable *batch_objects = NULL;
+static GQueue batch_queue = G_QUEUE_INIT;
+static guint batch_timeout = 0;
+static unsigned int batch_changes = 0;
+static unsigned int batch_signals = 0;
+
+static void batch_property_free(gpointer data)
+{
+	struct batch_property *property = data;
+
+	dbus_message_unref(property->signal);
+	g_free(property->key);
+	g_free(property);
+}
+
+static void batch_object_free(gpointer data)
+{
+	struct batch_object *object = data;
+
+	g_ptr_array_free(object->properties, TRUE);
+	g_free(object->path);
+	g_free(object);
+}
+
+static void copy_iter(DBusMessageIter *from, DBusMessageIter *to)
+{
+	do {
+		DBusMessageIter sub_from, sub_to;
+		char *signature = NULL;
+		int type;
+
+		type = dbus_message_iter_get_arg_type(from);
+		if (type == DBUS_TYPE_INVALID)
+			break;
+
+		if (dbus_type_is_basic(type)) {
+			DBusBasicValue value;
+
+			dbus_message_iter_get_basic(from, &value);
+			dbus_message_iter_append_basic(to, type, &value);
+			continue;
+		}
+
+		dbus_message_iter_recurse(from, &sub_from);
+
+		if (type == DBUS_TYPE_VARIANT)
+			signature = dbus_message_iter_get_signature(&sub_from);
+		else if (type == DBUS_TYPE_ARRAY)
+			signature = dbus_message_iter_get_signature(from);
+
+		/* The signature of an array includes the leading 'a' */
+		dbus_message_iter_open_container(to, type,
+				type == DBUS_TYPE_ARRAY ? signature + 1 :
+				signature, &sub_to);
+		copy_iter(&sub_from, &sub_to);
+		dbus_message_iter_close_container(to, &sub_to);
+
+		dbus_free(signature);
+	} while (dbus_message_iter_next(from));
+}
+
+static void batch_send(struct batch_object *object)
+{
+	struct batch_property *property;
+	DBusMessage *signal;
+	DBusMessageIter iter, dict;
+	unsigned int i;
+
+	signal = dbus_message_new_signal(object->path, object->interface,
+							"PropertiesChanged");
+	if (!signal)
+		return;
+
+	dbus_message_iter_init_append(signal, &iter);
+	connman_dbus_dict_open(&iter, &dict);
+
+	for (i = 0; i < object->properties->len; i++) {
+		DBusMessageIter from, entry;
+
+		property = g_ptr_array_index(object->properties, i);
+
+		/* PropertyChanged carries the name and value of a dict entry */
+		dbus_message_iter_init(property->signal, &from);
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY,
+								NULL, &entry);
+		copy_iter(&from, &entry);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	connman_dbus_dict_close(&iter, &dict);
+
+	/*
+	 * Use dbus_connection_send() here, g_dbus_send_message() would
+	 * flush the batches again while this one is half sent.
+	 */
+	dbus_connection_send(connection, signal, NULL);
+	dbus_message_unref(signal);
+	batch_signals++;
+}
+
+static void batch_flush(void)
+{
+	struct batch_object *object;
+
+	if (batch_timeout) {
+		g_source_remove(batch_timeout);
+		batch_timeout = 0;
+	}
+
+	while ((object = g_queue_pop_head(&batch_queue))) {
+		g_hash_table_remove(batch_objects, object);
+		batch_send(object);
+		batch_object_free(object);
+	}
+}
+
+static void batch_flush_connection(DBusConnection *conn,
+						DBusMessage *message)
+{
+	if (conn != connection)
+		return;
+
+	/* Signals can wait for the timer, replies must not overtake them */
+	switch (dbus_message_get_type(message)) {
+	case DBUS_MESSAGE_TYPE_METHOD_RETURN:
+	case DBUS_MESSAGE_TYPE_ERROR:
+		batch_flush();
+		break;
+	}
+}
+
+static gboolean batch_timeout_cb(gpointer user_data)
+{
+	batch_timeout = 0;
+	batch_flush();
+
+	return FALSE;
+}
+
+static guint batch_object_hash(gconstpointer key)
+{
+	const struct batch_object *object = key;
+
+	return g_str_hash(object->path) ^ g_str_hash(object->interface);
+}
+
+static gboolean batch_object_equal(gconstpointer a, gconstpointer b)
+{
+	const struct batch_object *object_a = a;
+	const struct batch_object *object_b = b;
+
+	return g_str_equal(object_a->path, object_b->path) &&
+		g_str_equal(object_a->interface, object_b->interface);
+}
+
+static bool batch_property_changed(const char *path, const char *interface,
+					const char *key, DBusMessage *signal)
+{
+	struct batch_object *object, lookup;
+	struct batch_property *property;
+	GSList *list;
+	unsigned int i;
+
+	list = g_slist_find_custom(batch_interfaces, interface,
+					(GCompareFunc) g_strcmp0);
+	if (!list)
+		return false;
+
+	lookup.path = (char *) path;
+	lookup.interface = list->data;
+
+	object = g_hash_table_lookup(batch_objects, &lookup);
+	if (!object) {
+		object = g_new0(struct batch_object, 1);
+		object->path = g_strdup(path);
+		object->interface = list->data;
+		object->properties = g_ptr_array_new_with_free_func(
+							batch_property_free);
+		g_hash_table_add(batch_objects, object);
+		g_queue_push_tail(&batch_queue, object);
+	}
+
+	batch_changes++;
+
+	for (i = 0; i < object->properties->len; i++) {
+		property = g_ptr_array_index(object->properties, i);
+
+		if (g_str_equal(property->key, key)) {
+			dbus_message_unref(property->signal);
+			property->signal = signal;
+			return true;
+		}
+	}
+
+	property = g_new0(struct batch_property, 1);
+	property->key = g_strdup(key);
+	property->signal = signal;
+	g_ptr_array_add(object->properties, property);
+
+	if (!batch_timeout)
+		batch_timeout = g_timeout_add(BATCH_DELAY, batch_timeout_cb,
+									NULL);
+
+	return true;
+}
+
+static void send_property_changed(const char *path, const char *interface,
+					const char *key, DBusMessage *signal)
+{
+	if (batch_interfaces &&
+			batch_property_changed(path, interface, key, signal))
+		return;
+
+	g_dbus_send_message(connection, signal);
+}
+
+void __connman_dbus_batch_interface(const char *interface)
+{
+	DBG("%s", interface);
+
+	if (!batch_objects) {
+		batch_objects = g_hash_table_new(batch_object_hash,
+							batch_object_equal);
+		g_dbus_set_flush_function(batch_flush_connection);
+	}
+
+	if (!g_slist_find_custom(batch_interfaces, interface,
+					(GCompareFunc) g_strcmp0))
+		batch_interfaces = g_slist_prepend(batch_interfaces,
+							g_strdup(interface));
+}
+
+void __connman_dbus_get_batch_stats(unsigned int *changes,
+						unsigned int *signals)
+{
+	*changes = batch_changes;
+	*signals = batch_signals;
+}
+
+void __connman_dbus_flush_properties(const char *path)
+{
+	GList *list, *next;
+
+	for (list = batch_queue.head; list; list = next) {
+		struct batch_object *object = list->data;
+
+		next = list->next;
+
+		if (g_strcmp0(object->path, path))
+			continue;
+
+		g_queue_delete_link(&batch_queue, list);
+		g_hash_table_remove(batch_objects, object);
+		batch_send(object);
+		batch_object_free(object);
+	}
+}
+
 dbus_bool_t connman_dbus_property_changed_basic(const char *path,
 				const char *interface, const char *key,
 							int type, void *val)
@@ -246,7 +529,7 @@ dbus_bool_t connman_dbus_property_changed_basic(const char *path,
 	dbus_message_iter_init_append(signal, &iter);
 	connman_dbus_property_append_basic(&iter, key, type, val);
 
-	g_dbus_send_message(connection, signal);
+	send_property_changed(path, interface, key, signal);
 
 	return TRUE;
 }
@@ -268,7 +551,7 @@ dbus_bool_t connman_dbus_property_changed_dict(const char *path,
 	dbus_message_iter_init_append(signal, &iter);
 	connman_dbus_property_append_dict(&iter, key, function, user_data);
 
-	g_dbus_send_message(connection, signal);
+	send_property_changed(path, interface, key, signal);
 
 	return TRUE;
 }
@@ -291,7 +574,7 @@ dbus_bool_t connman_dbus_property_changed_array(const char *path,
 	connman_dbus_property_append_array(&iter, key, type,
 						function, user_data);
 
-	g_dbus_send_message(connection, signal);
+	send_property_changed(path, interface, key, signal);
 
 	return TRUE;
 }
@@ -706,5 +989,19 @@ void __connman_dbus_cleanup(void)
 {
 	DBG("");
 
+	batch_flush();
+
+	if (batch_objects) {
+		DBG("%u property changes sent in %u signals", batch_changes,
+							batch_signals);
+		g_hash_table_destroy(batch_objects);
+		batch_objects = NULL;
+	}
+
+	g_slist_free_full(batch_interfaces, g_free);
+	batch_interfaces = NULL;
+
+	g_dbus_set_flush_function(NULL);
+
 	connection = NULL;
 }
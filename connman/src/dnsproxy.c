@@ -32,10 +32,11 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <resolv.h>
-#include <gweb/gresolv.h>
 
 #include <glib.h>
 
@@ -78,8 +79,8 @@ struct domain_hdr {
 #endif
 
 struct partial_reply {
-	uint16_t len;
-	uint16_t received;
+	unsigned int len;
+	unsigned int received;
 	unsigned char buf[];
 };
 
@@ -96,6 +97,26 @@ struct server_data {
 	bool enabled;
 	bool connected;
 	struct partial_reply *incoming_reply;
+	/* Queries not yet written to the TCP connection, see tcp_server_write() */
+	GByteArray *outgoing;
+	guint out_watch;
+	/* Upstream statistics of UDP servers, see server_update_rtt() */
+	unsigned int srtt;
+	unsigned int rttvar;
+	unsigned int loss;
+	unsigned int queries;
+	unsigned int replies;
+	unsigned int timeouts;
+	unsigned int failures;
+};
+
+/* A server a UDP request is or will be sent to */
+struct upstream_attempt {
+	struct server_data *server;
+	gint64 sent;
+	guint packets;
+	bool answered;
+	bool lost;
 };
 
 struct request_data {
@@ -121,6 +142,11 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	bool append_domain;
+	bool prefetch;		/* internal query, see cache_prefetch_entry() */
+	bool tcp_resent;	/* see tcp_server_closed() */
+	GList link;		/* link in request_queue while pending */
+	GSList *upstreams;	/* struct upstream_attempt, best first */
+	guint failover;
 };
 
 struct listener_data {
@@ -158,16 +184,32 @@ struct cache_data {
 	int timeout;
 	uint16_t type;
 	uint16_t answers;
+	bool prefetched;
 	unsigned int data_len;
 	unsigned char *data; /* contains DNS header + body */
 };
 
+/*
+ * Cached RRsets are identified by the question they answer. The name
+ * is kept in DNS wire format (label lengths instead of dots).
+ */
+struct cache_key {
+	char *name;
+	uint16_t type;
+	uint16_t class;
+};
+
 struct cache_entry {
-	char *key;
+	struct cache_key key;
 	bool want_refresh;
 	int hits;
-	struct cache_data *ipv4;
-	struct cache_data *ipv6;
+	time_t expire;		/* cache_until of the cached data */
+	gsize size;		/* memory accounted for this entry */
+	guint heap_index;	/* position in cache_heap */
+	GList lru_link;		/* link in cache_lru, most recent first */
+	GList prefetch_link;	/* link in cache_prefetch if popular */
+	time_t prefetch_sent;
+	struct cache_data *data;
 };
 
 struct domain_question {
@@ -187,6 +229,28 @@ struct domain_rr {
  */
 #define TCP_MAX_BUF_LEN 4096
 
+/*
+ * Seconds an upstream TCP connection is kept open without queries.
+ */
+#define TCP_IDLE_TIMEOUT 10
+
+/*
+ * Max length of a DNS UDP packet we receive.
+ */
+#define UDP_MAX_BUF_LEN 4096
+#define UDP_MAX_QUERY_LEN 768
+
+/*
+ * Under load the UDP sockets are drained in batches: up to
+ * udp_batch_size datagrams are read with one recvmmsg() call and the
+ * datagrams sent while handling them are queued and sent with one
+ * sendmmsg() call per socket at the end of the wakeup. The batch size
+ * can be changed with DnsProxyUdpBatch in main.conf, 1 disables
+ * batching.
+ */
+#define DEFAULT_UDP_BATCH 16
+#define UDP_BATCH_MAX 64
+
 /*
  * We limit how long the cached DNS entry stays in the cache.
  * By default the TTL (time-to-live) of the DNS response is used
@@ -203,18 +267,132 @@ struct domain_rr {
  * not occupy too much memory. Each cached entry occupies on average
  * about 100 bytes memory (depending on DNS name length).
  * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * The value is the default max amount of cached DNS responses (count),
+ * it can be changed with DnsProxyCacheSize in main.conf.
+ */
+#define DEFAULT_CACHE_SIZE 256
+
+/*
+ * Popular entries are re-resolved in the background shortly before
+ * they expire. An entry becomes popular after PREFETCH_MIN_HITS cache
+ * hits and is prefetched PREFETCH_LEAD seconds before the end of its
+ * cache lifetime. The hit count is aged after each prefetch so that
+ * the entry has to stay in use to be prefetched again.
+ */
+#define PREFETCH_MIN_HITS 3
+#define PREFETCH_LEAD 10
+#define PREFETCH_TIMEOUT 5
+
+/*
+ * Expired answers are kept for CACHE_STALE_TIME seconds and served
+ * with STALE_ANSWER_TTL when no upstream server answers (RFC 8767).
+ * This can be disabled with DnsProxyServeStale in main.conf.
  */
-#define MAX_CACHE_SIZE 256
+#define CACHE_STALE_TIME (60 * 60 * 24)
+#define STALE_ANSWER_TTL 30
+
+/*
+ * The round trip time of each UDP server is smoothed like TCP does it
+ * (RFC 6298) and its loss rate is a moving average, in per mille, of
+ * the queries it did not answer in time. Servers are ranked by their
+ * expected latency srtt + rto * loss / (1 - loss). A query is sent to
+ * the DnsProxyParallelQueries best servers first and to the next one
+ * whenever the rto of those passes or all of them fail. A negative
+ * answer only ends the query once the servers of the other interfaces
+ * and domains were asked too. Value 0, the default, sends the query to
+ * all servers at once. Times are in microseconds.
+ */
+#define DEFAULT_PARALLEL_QUERIES 0
+#define SERVER_INITIAL_RTT 100000
+#define SERVER_INITIAL_RTO 1000000
+#define SERVER_MIN_RTO 200000
+#define SERVER_MAX_RTO 2000000
+#define SERVER_MAX_LOSS 900
+
+/*
+ * The cache is partitioned per network. When the default service
+ * changes, the answers cached for the old service are packed into a
+ * snapshot and the snapshot of the new service, if there is one, is
+ * loaded back with the original expiry times. Snapshots of the last
+ * MAX_CACHE_PARTITIONS services are kept in memory. With
+ * DnsProxyPersistentCache in main.conf they are also stored in the
+ * service storage directory so that they survive a restart.
+ */
+#define MAX_CACHE_PARTITIONS 8
+#define CACHE_SNAPSHOT_FILE "dnscache"
+#define CACHE_SNAPSHOT_MAGIC 0xDC5A0001
+
+struct cache_snapshot_hdr {
+	uint32_t magic;
+	uint32_t count;
+} __attribute__ ((packed));
+
+/* followed by the NUL terminated key name and the cached data */
+struct cache_snapshot_record {
+	int64_t inserted;
+	int64_t valid_until;
+	int64_t cache_until;
+	int32_t timeout;
+	uint16_t type;
+	uint16_t class;
+	uint16_t answers;
+	uint16_t name_len;
+	uint32_t data_len;
+} __attribute__ ((packed));
 
 static int cache_size;
+static gsize cache_bytes;
+static guint cache_max_size = DEFAULT_CACHE_SIZE;
+static gsize cache_max_bytes;
 static GHashTable *cache;
+/*
+ * The hash table is used for lookups. In addition every entry is
+ * linked to an LRU queue and to a binary min-heap ordered by expiry
+ * time, so that finding the entry to evict does not need a walk
+ * over the whole cache.
+ */
+static GQueue cache_lru = G_QUEUE_INIT;
+static GPtrArray *cache_heap;
+static GQueue cache_prefetch = G_QUEUE_INIT;
+static guint prefetch_timer;
+static time_t prefetch_due;
+static time_t cache_stale_time = CACHE_STALE_TIME;
+static char *cache_partition;
+static GHashTable *cache_partitions;
+static GQueue cache_partition_lru = G_QUEUE_INIT;
+static bool cache_persistent;
+static struct connman_dnsproxy_stats dnsproxy_stats;
 static int cache_refcount;
 static GSList *server_list = NULL;
-static GSList *request_list = NULL;
+static GHashTable *server_table = NULL;
+static GQueue request_queue = G_QUEUE_INIT;
+static GHashTable *request_table = NULL;
 static GHashTable *listener_table = NULL;
-static time_t next_refresh;
 static GHashTable *partial_tcp_req_table;
+
+struct udp_datagram {
+	int sk;
+	union {
+		struct sockaddr_in6 __sin6; /* Only for the length */
+		struct sockaddr sa;
+	};
+	socklen_t sa_len;
+	unsigned char *buf;
+	int len;
+};
+
+/* A queued query which could not be sent, see udp_send_flush() */
+struct udp_send_error {
+	int sk;
+	guint16 id;
+};
+
+static guint parallel_queries = DEFAULT_PARALLEL_QUERIES;
+static guint udp_batch_size = DEFAULT_UDP_BATCH;
+static unsigned char *udp_batch_buf;
+static struct udp_datagram udp_send_queue[UDP_BATCH_MAX];
+static int udp_send_queued;
+static bool udp_send_batching;
 static guint cache_timer = 0;
 
 static guint16 get_id(void)
@@ -262,93 +440,312 @@ static time_t round_down_ttl(time_t end_time, int ttl)
 	return end_time;
 }
 
+/*
+ * Pending requests are kept in request_queue in arrival order and are
+ * indexed by both of their upstream transaction IDs in request_table,
+ * so matching a reply does not need a walk over all of them.
+ */
 static struct request_data *find_request(guint16 id)
 {
-	GSList *list;
+	if (!request_table)
+		return NULL;
 
-	for (list = request_list; list; list = list->next) {
-		struct request_data *req = list->data;
+	return g_hash_table_lookup(request_table, GUINT_TO_POINTER(id));
+}
 
-		if (req->dstid == id || req->altid == id)
-			return req;
-	}
+/*
+ * Pick a transaction ID that is not used by any pending request.
+ */
+static guint16 get_request_id(void)
+{
+	guint16 id;
 
-	return NULL;
+	do {
+		id = get_id();
+	} while (request_table &&
+			g_hash_table_size(request_table) < G_MAXUINT16 &&
+			find_request(id));
+
+	return id;
+}
+
+static void request_add(struct request_data *req)
+{
+	if (!request_table)
+		request_table = g_hash_table_new(g_direct_hash,
+							g_direct_equal);
+
+	req->link.data = req;
+	g_queue_push_tail_link(&request_queue, &req->link);
+
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->dstid),
+									req);
+	g_hash_table_replace(request_table, GUINT_TO_POINTER(req->altid),
+									req);
+}
+
+static void request_remove(struct request_data *req)
+{
+	if (!req->link.data)
+		return;
+
+	g_queue_unlink(&request_queue, &req->link);
+	req->link.data = NULL;
+
+	g_hash_table_remove(request_table, GUINT_TO_POINTER(req->dstid));
+	g_hash_table_remove(request_table, GUINT_TO_POINTER(req->altid));
+}
+
+/*
+ * Servers are looked up by (index, address, protocol). All negative
+ * indexes (the fallback servers) are considered equal.
+ */
+static guint server_hash(gconstpointer key)
+{
+	const struct server_data *data = key;
+	int index = data->index < 0 ? -1 : data->index;
+
+	return g_str_hash(data->server) ^ (index << 8) ^ data->protocol;
+}
+
+static gboolean server_equal(gconstpointer a, gconstpointer b)
+{
+	const struct server_data *data_a = a, *data_b = b;
+
+	if (data_a->protocol != data_b->protocol)
+		return FALSE;
+
+	if (data_a->index != data_b->index &&
+			(data_a->index >= 0 || data_b->index >= 0))
+		return FALSE;
+
+	return g_str_equal(data_a->server, data_b->server);
 }
 
 static struct server_data *find_server(int index,
 					const char *server,
 						int protocol)
 {
-	GSList *list;
+	struct server_data key = {
+		.index = index,
+		.server = (char *) server,
+		.protocol = protocol,
+	};
 
 	DBG("index %d server %s proto %d", index, server, protocol);
 
+	if (!server_table || !server)
+		return NULL;
+
+	return g_hash_table_lookup(server_table, &key);
+}
+
+static void server_list_append(struct server_data *data)
+{
+	server_list = g_slist_append(server_list, data);
+
+	if (!data->server)
+		return;
+
+	if (!server_table)
+		server_table = g_hash_table_new(server_hash, server_equal);
+
+	/*
+	 * Should there be several servers with the same address, the
+	 * first one is found like in the list.
+	 */
+	if (!g_hash_table_lookup(server_table, data))
+		g_hash_table_insert(server_table, data, data);
+}
+
+static void server_list_remove(struct server_data *data)
+{
+	GSList *list;
+
+	server_list = g_slist_remove(server_list, data);
+
+	if (!server_table || !data->server ||
+			g_hash_table_lookup(server_table, data) != data)
+		return;
+
+	g_hash_table_remove(server_table, data);
+
 	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
+		struct server_data *other = list->data;
+
+		if (other->server && server_equal(other, data)) {
+			g_hash_table_insert(server_table, other, other);
+			break;
+		}
+	}
+}
 
-		if (index < 0 && data->index < 0 &&
-				g_str_equal(data->server, server) &&
-				data->protocol == protocol)
-			return data;
+static unsigned int server_rto(struct server_data *server)
+{
+	unsigned int rto;
 
-		if (index < 0 ||
-				data->index < 0 || !data->server)
-			continue;
+	if (!server->srtt)
+		return SERVER_INITIAL_RTO;
+
+	rto = server->srtt + 4 * server->rttvar;
+
+	return CLAMP(rto, SERVER_MIN_RTO, SERVER_MAX_RTO);
+}
+
+static guint64 server_cost(struct server_data *server)
+{
+	unsigned int loss = MIN(server->loss, SERVER_MAX_LOSS);
+	guint64 rtt = server->srtt ? server->srtt : SERVER_INITIAL_RTT;
+
+	return rtt + (guint64) server_rto(server) * loss / (1000 - loss);
+}
+
+static gint server_rank_compare(gconstpointer a, gconstpointer b)
+{
+	guint64 cost_a = server_cost((struct server_data *) a);
+	guint64 cost_b = server_cost((struct server_data *) b);
+
+	if (cost_a < cost_b)
+		return -1;
+
+	return cost_a > cost_b;
+}
+
+static void server_update_rtt(struct server_data *server, gint64 rtt)
+{
+	unsigned int delta;
+
+	rtt = CLAMP(rtt, 1, SERVER_MAX_RTO * 4);
 
-		if (data->index == index &&
-				g_str_equal(data->server, server) &&
-				data->protocol == protocol)
-			return data;
+	if (!server->srtt) {
+		server->srtt = rtt;
+		server->rttvar = rtt / 2;
+	} else {
+		delta = ABS((gint64) server->srtt - rtt);
+		server->rttvar = server->rttvar - server->rttvar / 4 +
+								delta / 4;
+		server->srtt = server->srtt - server->srtt / 8 + rtt / 8;
 	}
 
-	return NULL;
+	if (!server->srtt)
+		server->srtt = 1;
+
+	server->loss -= server->loss / 8;
+}
+
+/*
+ * Karn's rule: the reply to a query which was sent more than once, or
+ * given up on and sent to the next server, cannot be matched to a send
+ * time, so it gives no rtt sample. Returns -1 in that case.
+ */
+static gint64 upstream_reply_rtt(struct upstream_attempt *attempt,
+								gint64 now)
+{
+	if (attempt->packets != 1 || attempt->lost)
+		return -1;
+
+	return now - attempt->sent;
 }
 
-/* we can keep using the same resolve's */
-static GResolv *ipv4_resolve;
-static GResolv *ipv6_resolve;
+static void server_update_loss(struct server_data *server)
+{
+	server->loss += (1000 - server->loss) / 8;
+	server->timeouts++;
+}
 
-static void dummy_resolve_func(GResolvResultStatus status,
-					char **results, gpointer user_data)
+static struct upstream_attempt *request_find_upstream(
+					struct request_data *req,
+					struct server_data *server)
 {
+	GSList *list;
+
+	for (list = req->upstreams; list; list = list->next) {
+		struct upstream_attempt *attempt = list->data;
+
+		if (attempt->server == server)
+			return attempt;
+	}
+
+	return NULL;
 }
 
 /*
- * Refresh a DNS entry, but also age the hit count a bit */
-static void refresh_dns_entry(struct cache_entry *entry, char *name)
+ * Count the servers a request was sent to and which did not answer
+ * within their rto as lost.
+ */
+static void request_upstreams_lost(struct request_data *req)
 {
-	int age = 1;
+	GSList *list;
+
+	for (list = req->upstreams; list; list = list->next) {
+		struct upstream_attempt *attempt = list->data;
+
+		if (!attempt->sent || attempt->answered || attempt->lost)
+			continue;
+
+		attempt->lost = true;
+		server_update_loss(attempt->server);
 
-	if (!ipv4_resolve) {
-		ipv4_resolve = g_resolv_new(0);
-		g_resolv_set_address_family(ipv4_resolve, AF_INET);
-		g_resolv_add_nameserver(ipv4_resolve, "127.0.0.1", 53, 0);
+		/* Do not wait for the answers of the lost server */
+		req->numserv -= MIN(req->numserv, attempt->packets);
 	}
+}
+
+static bool server_same_scope(struct server_data *a,
+					struct server_data *b)
+{
+	GList *la, *lb;
+
+	if (a->index != b->index)
+		return false;
 
-	if (!ipv6_resolve) {
-		ipv6_resolve = g_resolv_new(0);
-		g_resolv_set_address_family(ipv6_resolve, AF_INET6);
-		g_resolv_add_nameserver(ipv6_resolve, "::1", 53, 0);
+	for (la = a->domains, lb = b->domains; la && lb;
+					la = la->next, lb = lb->next) {
+		if (g_strcmp0(la->data, lb->data))
+			return false;
 	}
 
-	if (!entry->ipv4) {
-		DBG("Refreshing A record for %s", name);
-		g_resolv_lookup_hostname(ipv4_resolve, name,
-					dummy_resolve_func, NULL);
-		age = 4;
+	return !la && !lb;
+}
+
+/*
+ * A server which did not know the name was asked. The servers of the
+ * same interface and domains are given up on, they would not know it
+ * either. Returns true if servers of another scope are left to ask.
+ */
+static bool request_other_scope(struct request_data *req,
+					struct server_data *server)
+{
+	GSList *list;
+	bool found = false;
+
+	if (!server)
+		return false;
+
+	for (list = req->upstreams; list; list = list->next) {
+		struct upstream_attempt *attempt = list->data;
+
+		if (attempt->sent || attempt->lost)
+			continue;
+
+		if (server_same_scope(attempt->server, server))
+			attempt->lost = true;
+		else
+			found = true;
 	}
 
-	if (!entry->ipv6) {
-		DBG("Refreshing AAAA record for %s", name);
-		g_resolv_lookup_hostname(ipv6_resolve, name,
-					dummy_resolve_func, NULL);
-		age = 4;
+	return found;
+}
+
+static void request_upstreams_free(struct request_data *req)
+{
+	if (req->failover > 0) {
+		g_source_remove(req->failover);
+		req->failover = 0;
 	}
 
-	entry->hits -= age;
-	if (entry->hits < 0)
-		entry->hits = 0;
+	g_slist_free_full(req->upstreams, g_free);
+	req->upstreams = NULL;
 }
 
 static int dns_name_length(unsigned char *buf)
@@ -407,77 +804,297 @@ static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
 	}
 }
 
-static void send_cached_response(int sk, unsigned char *buf, int len,
-				const struct sockaddr *to, socklen_t tolen,
-				int protocol, int id, uint16_t answers, int ttl)
-{
-	struct domain_hdr *hdr;
-	unsigned char *ptr = buf;
-	int err, offset, dns_len, adj_len = len - 2;
+static void udp_query_failed(int sk, guint16 id);
 
-	/*
-	 * The cached packet contains always the TCP offset (two bytes)
-	 * so skip them for UDP.
-	 */
-	switch (protocol) {
-	case IPPROTO_UDP:
-		ptr += 2;
-		len -= 2;
-		dns_len = len;
-		offset = 0;
-		break;
-	case IPPROTO_TCP:
-		offset = 2;
-		dns_len = ptr[0] * 256 + ptr[1];
-		break;
-	default:
-		return;
-	}
+/*
+ * Report a queued datagram which could not be sent. A query to an
+ * upstream server is remembered in failed so that the request can be
+ * failed over once the queue is free again.
+ */
+static void udp_send_failed(struct udp_datagram *dgram, int err,
+				struct udp_send_error *failed, int *n_failed)
+{
+	DBG("Cannot send to sk %d: %s", dgram->sk, strerror(err));
 
-	if (len < 12)
+	if (dgram->len < 2)
 		return;
 
-	hdr = (void *) (ptr + offset);
+	failed[*n_failed].sk = dgram->sk;
+	failed[*n_failed].id = dgram->buf[0] | dgram->buf[1] << 8;
+	(*n_failed)++;
+}
 
-	hdr->id = id;
-	hdr->qr = 1;
-	hdr->rcode = ns_r_noerror;
-	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
-	hdr->arcount = 0;
+/*
+ * Send all datagrams queued while handling a batch. The datagrams of
+ * each socket are sent in their original order. The requests whose
+ * queries could not be sent are failed over like when sendto() fails.
+ */
+static void udp_send_flush(void)
+{
+	struct udp_send_error failed[UDP_BATCH_MAX];
+#ifdef HAVE_SENDMMSG
+	struct udp_datagram *dgrams[UDP_BATCH_MAX];
+	struct mmsghdr msgs[UDP_BATCH_MAX];
+	struct iovec iov[UDP_BATCH_MAX];
+	int n = 0;
+#endif
+	int i, j, err, n_failed = 0;
 
-	/* if this is a negative reply, we are authorative */
-	if (answers == 0)
-		hdr->aa = 1;
-	else
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+	for (i = 0; i < udp_send_queued; i++) {
+		int sk = udp_send_queue[i].sk;
 
-	DBG("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
-		sk, hdr->id, answers, ptr, len, dns_len);
+		if (!udp_send_queue[i].buf)
+			continue;
 
-	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
-	if (err < 0) {
-		connman_error("Cannot send cached DNS response: %s",
-				strerror(errno));
-		return;
-	}
+#ifdef HAVE_SENDMMSG
+		n = 0;
+#endif
+		for (j = i; j < udp_send_queued; j++) {
+			struct udp_datagram *dgram = &udp_send_queue[j];
 
-	if (err != len || (dns_len != (len - 2) && protocol == IPPROTO_TCP) ||
-				(dns_len != len && protocol == IPPROTO_UDP))
-		DBG("Packet length mismatch, sent %d wanted %d dns %d",
-			err, len, dns_len);
-}
+			if (!dgram->buf || dgram->sk != sk)
+				continue;
 
-static void send_response(int sk, unsigned char *buf, int len,
-				const struct sockaddr *to, socklen_t tolen,
-				int protocol)
-{
-	struct domain_hdr *hdr;
-	int err, offset = protocol_offset(protocol);
+#ifdef HAVE_SENDMMSG
+			iov[n].iov_base = dgram->buf;
+			iov[n].iov_len = dgram->len;
 
-	DBG("sk %d", sk);
+			memset(&msgs[n], 0, sizeof(msgs[n]));
+			msgs[n].msg_hdr.msg_iov = &iov[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+			if (dgram->sa_len) {
+				msgs[n].msg_hdr.msg_name = &dgram->sa;
+				msgs[n].msg_hdr.msg_namelen = dgram->sa_len;
+			}
+			dgrams[n++] = dgram;
+#else
+			err = sendto(sk, dgram->buf, dgram->len, MSG_NOSIGNAL,
+					dgram->sa_len ? &dgram->sa : NULL,
+					dgram->sa_len);
+			if (err < 0)
+				udp_send_failed(dgram, errno, failed,
+								&n_failed);
+#endif
+		}
 
-	if (offset < 0)
+#ifdef HAVE_SENDMMSG
+		for (j = 0; j < n; ) {
+			err = sendmmsg(sk, msgs + j, n - j, MSG_NOSIGNAL);
+			if (err <= 0) {
+				/*
+				 * sendmmsg() stops at the first datagram
+				 * that cannot be sent, skip it and send
+				 * the rest.
+				 */
+				udp_send_failed(dgrams[j],
+						err < 0 ? errno : EIO,
+						failed, &n_failed);
+				err = 1;
+			}
+
+			j += err;
+		}
+#endif
+
+		for (j = i; j < udp_send_queued; j++) {
+			if (udp_send_queue[j].sk != sk)
+				continue;
+
+			g_free(udp_send_queue[j].buf);
+			udp_send_queue[j].buf = NULL;
+		}
+	}
+
+	udp_send_queued = 0;
+
+	/* The queries sent while failing over are queued again */
+	for (i = 0; i < n_failed; i++)
+		udp_query_failed(failed[i].sk, failed[i].id);
+}
+
+/*
+ * Like sendto() but while a batch of received datagrams is handled,
+ * the datagram is only queued and sent by udp_send_flush(), which
+ * handles the send errors of queued datagrams itself.
+ */
+static int udp_sendto(int sk, const void *buf, size_t len,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	struct udp_datagram *dgram;
+
+	if (!udp_send_batching || tolen > sizeof(dgram->__sin6))
+		return sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+
+	if (udp_send_queued == UDP_BATCH_MAX)
+		udp_send_flush();
+
+	dgram = &udp_send_queue[udp_send_queued++];
+	dgram->sk = sk;
+	dgram->buf = g_memdup(buf, len);
+	dgram->len = len;
+	dgram->sa_len = to ? tolen : 0;
+	if (dgram->sa_len)
+		memcpy(&dgram->sa, to, tolen);
+
+	return len;
+}
+
+typedef void (*udp_datagram_cb_t)(int sk, unsigned char *buf, int len,
+				struct sockaddr *sa, socklen_t sa_len,
+				gpointer user_data);
+
+/*
+ * Read the datagrams waiting in the socket, up to udp_batch_size of
+ * them, and hand them to func. Returns the number of datagrams read.
+ */
+static int udp_recv_batch(int sk, udp_datagram_cb_t func,
+							gpointer user_data)
+{
+#ifdef HAVE_RECVMMSG
+	struct mmsghdr msgs[UDP_BATCH_MAX];
+	struct iovec iov[UDP_BATCH_MAX];
+	struct sockaddr_in6 addrs[UDP_BATCH_MAX];
+	int i;
+#endif
+	struct sockaddr_in6 addr;
+	socklen_t addr_len = sizeof(addr);
+	unsigned char buf[UDP_MAX_BUF_LEN];
+	int count;
+
+#ifdef HAVE_RECVMMSG
+	if (udp_batch_size > 1 && udp_batch_buf) {
+		memset(msgs, 0, sizeof(msgs));
+
+		for (i = 0; i < (int) udp_batch_size; i++) {
+			iov[i].iov_base = udp_batch_buf + i * UDP_MAX_BUF_LEN;
+			iov[i].iov_len = UDP_MAX_BUF_LEN;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+		}
+
+		count = recvmmsg(sk, msgs, udp_batch_size, MSG_DONTWAIT, NULL);
+		if (count < 0) {
+			if (errno == ENOSYS) {
+				connman_warn("recvmmsg not supported, "
+						"disabling DNS batching");
+				udp_batch_size = 1;
+			}
+			return 0;
+		}
+
+		udp_send_batching = true;
+
+		for (i = 0; i < count; i++) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				DBG("Dropping truncated datagram on sk %d",
+									sk);
+				continue;
+			}
+
+			func(sk, iov[i].iov_base, msgs[i].msg_len,
+				(struct sockaddr *) &addrs[i],
+				msgs[i].msg_hdr.msg_namelen, user_data);
+		}
+
+		udp_send_batching = false;
+		udp_send_flush();
+
+		return count;
+	}
+#endif
+
+	memset(&addr, 0, sizeof(addr));
+	count = recvfrom(sk, buf, sizeof(buf), MSG_TRUNC,
+					(struct sockaddr *) &addr, &addr_len);
+	if (count < 0)
+		return 0;
+
+	if (count > (int) sizeof(buf)) {
+		DBG("Dropping truncated datagram on sk %d", sk);
+		return 1;
+	}
+
+	func(sk, buf, count, (struct sockaddr *) &addr, addr_len, user_data);
+
+	return 1;
+}
+
+static void send_cached_response(int sk, unsigned char *buf, int len,
+				const struct sockaddr *to, socklen_t tolen,
+				int protocol, int id, uint16_t answers, int ttl)
+{
+	struct domain_hdr *hdr;
+	unsigned char *ptr = buf;
+	int err, offset, dns_len, adj_len = len - 2;
+
+	/*
+	 * The cached packet contains always the TCP offset (two bytes)
+	 * so skip them for UDP.
+	 */
+	switch (protocol) {
+	case IPPROTO_UDP:
+		ptr += 2;
+		len -= 2;
+		dns_len = len;
+		offset = 0;
+		break;
+	case IPPROTO_TCP:
+		offset = 2;
+		dns_len = ptr[0] * 256 + ptr[1];
+		break;
+	default:
+		return;
+	}
+
+	if (len < 12)
+		return;
+
+	hdr = (void *) (ptr + offset);
+
+	hdr->id = id;
+	hdr->qr = 1;
+	hdr->rcode = ns_r_noerror;
+	hdr->ancount = htons(answers);
+	hdr->nscount = 0;
+	hdr->arcount = 0;
+
+	/* if this is a negative reply, we are authorative */
+	if (answers == 0)
+		hdr->aa = 1;
+	else
+		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+
+	DBG("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
+		sk, hdr->id, answers, ptr, len, dns_len);
+
+	if (protocol == IPPROTO_UDP)
+		err = udp_sendto(sk, ptr, len, to, tolen);
+	else
+		err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
+	if (err < 0) {
+		connman_error("Cannot send cached DNS response: %s",
+				strerror(errno));
+		return;
+	}
+
+	if (err != len || (dns_len != (len - 2) && protocol == IPPROTO_TCP) ||
+				(dns_len != len && protocol == IPPROTO_UDP))
+		DBG("Packet length mismatch, sent %d wanted %d dns %d",
+			err, len, dns_len);
+}
+
+static void send_response(int sk, unsigned char *buf, int len,
+				const struct sockaddr *to, socklen_t tolen,
+				int protocol)
+{
+	struct domain_hdr *hdr;
+	int err, offset = protocol_offset(protocol);
+
+	DBG("sk %d", sk);
+
+	if (offset < 0)
 		return;
 
 	if (len < 12)
@@ -494,7 +1111,10 @@ static void send_response(int sk, unsigned char *buf, int len,
 	hdr->nscount = 0;
 	hdr->arcount = 0;
 
-	err = sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
+	if (protocol == IPPROTO_UDP)
+		err = udp_sendto(sk, buf, len, to, tolen);
+	else
+		err = sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
 	if (err < 0) {
 		connman_error("Failed to send DNS response to %d: %s",
 				sk, strerror(errno));
@@ -522,12 +1142,16 @@ static void destroy_request_data(struct request_data *req)
 	if (req->timeout > 0)
 		g_source_remove(req->timeout);
 
+	request_upstreams_free(req);
+
 	g_free(req->resp);
 	g_free(req->request);
 	g_free(req->name);
 	g_free(req);
 }
 
+static bool cache_send_stale(struct request_data *req, gpointer request);
+
 static gboolean request_timeout(gpointer user_data)
 {
 	struct request_data *req = user_data;
@@ -539,7 +1163,12 @@ static gboolean request_timeout(gpointer user_data)
 
 	DBG("id 0x%04x", req->srcid);
 
-	request_list = g_slist_remove(request_list, req);
+	request_remove(req);
+	request_upstreams_lost(req);
+
+	/* Nobody is waiting for the answer of a prefetch */
+	if (req->prefetch)
+		goto out;
 
 	if (req->protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
@@ -560,6 +1189,8 @@ static gboolean request_timeout(gpointer user_data)
 			sendto(sk, req->resp, req->resplen, MSG_NOSIGNAL,
 				sa, req->sa_len);
 
+	} else if (req->request && cache_send_stale(req, req->request)) {
+		DBG("no reply from servers, sent a stale answer");
 	} else if (req->request) {
 		/*
 		 * There was not reply from server at all.
@@ -646,210 +1277,647 @@ static int append_query(unsigned char *buf, unsigned int size,
 	return ptr - buf;
 }
 
-static bool cache_check_is_valid(struct cache_data *data,
-				time_t current_time)
+static time_t cache_heap_expire(guint i)
 {
-	if (!data)
-		return false;
-
-	if (data->cache_until < current_time)
-		return false;
+	struct cache_entry *entry = g_ptr_array_index(cache_heap, i);
 
-	return true;
+	return entry->expire;
 }
 
-/*
- * remove stale cached entries so that they can be refreshed
- */
-static void cache_enforce_validity(struct cache_entry *entry)
+static void cache_heap_swap(guint a, guint b)
 {
-	time_t current_time = time(NULL);
-
-	if (!cache_check_is_valid(entry->ipv4, current_time)
-							&& entry->ipv4) {
-		DBG("cache timeout \"%s\" type A", entry->key);
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-
-	}
+	struct cache_entry *entry_a = g_ptr_array_index(cache_heap, a);
+	struct cache_entry *entry_b = g_ptr_array_index(cache_heap, b);
 
-	if (!cache_check_is_valid(entry->ipv6, current_time)
-							&& entry->ipv6) {
-		DBG("cache timeout \"%s\" type AAAA", entry->key);
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
-	}
+	cache_heap->pdata[a] = entry_b;
+	cache_heap->pdata[b] = entry_a;
+	entry_b->heap_index = a;
+	entry_a->heap_index = b;
 }
 
-static uint16_t cache_check_validity(char *question, uint16_t type,
-				struct cache_entry *entry)
+static guint cache_heap_sift_up(guint i)
 {
-	time_t current_time = time(NULL);
-	bool want_refresh = false;
+	while (i > 0) {
+		guint parent = (i - 1) / 2;
 
-	/*
-	 * if we have a popular entry, we want a refresh instead of
-	 * total destruction of the entry.
-	 */
-	if (entry->hits > 2)
-		want_refresh = true;
+		if (cache_heap_expire(parent) <= cache_heap_expire(i))
+			break;
 
-	cache_enforce_validity(entry);
+		cache_heap_swap(i, parent);
+		i = parent;
+	}
 
-	switch (type) {
-	case 1:		/* IPv4 */
-		if (!cache_check_is_valid(entry->ipv4, current_time)) {
-			DBG("cache %s \"%s\" type A", entry->ipv4 ?
-					"timeout" : "entry missing", question);
+	return i;
+}
 
-			if (want_refresh)
-				entry->want_refresh = true;
+static void cache_heap_sift_down(guint i)
+{
+	while (true) {
+		guint left = 2 * i + 1, right = left + 1, min = i;
 
-			/*
-			 * We do not remove cache entry if there is still
-			 * valid IPv6 entry found in the cache.
-			 */
-			if (!cache_check_is_valid(entry->ipv6, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
+		if (left < cache_heap->len &&
+				cache_heap_expire(left) < cache_heap_expire(min))
+			min = left;
 
-	case 28:	/* IPv6 */
-		if (!cache_check_is_valid(entry->ipv6, current_time)) {
-			DBG("cache %s \"%s\" type AAAA", entry->ipv6 ?
-					"timeout" : "entry missing", question);
+		if (right < cache_heap->len &&
+				cache_heap_expire(right) < cache_heap_expire(min))
+			min = right;
 
-			if (want_refresh)
-				entry->want_refresh = true;
+		if (min == i)
+			break;
 
-			if (!cache_check_is_valid(entry->ipv4, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
+		cache_heap_swap(i, min);
+		i = min;
 	}
+}
 
-	return type;
+static void cache_heap_insert(struct cache_entry *entry)
+{
+	entry->heap_index = cache_heap->len;
+	g_ptr_array_add(cache_heap, entry);
+	cache_heap_sift_up(entry->heap_index);
 }
 
-static void cache_element_destroy(gpointer value)
+static void cache_heap_remove(struct cache_entry *entry)
 {
-	struct cache_entry *entry = value;
+	guint i = entry->heap_index;
 
-	if (!entry)
+	if (i >= cache_heap->len ||
+			g_ptr_array_index(cache_heap, i) != entry)
 		return;
 
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-	}
+	/* The last element is moved to the hole, then re-positioned */
+	g_ptr_array_remove_index_fast(cache_heap, i);
+	if (i < cache_heap->len) {
+		struct cache_entry *moved = g_ptr_array_index(cache_heap, i);
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
+		moved->heap_index = i;
+		cache_heap_sift_down(cache_heap_sift_up(i));
 	}
+}
 
-	g_free(entry->key);
-	g_free(entry);
+static gsize cache_data_size(struct cache_data *data)
+{
+	if (!data)
+		return 0;
 
-	if (--cache_size < 0)
-		cache_size = 0;
+	return sizeof(*data) + data->data_len;
 }
 
-static gboolean try_remove_cache(gpointer user_data)
+static int server_create_socket(struct server_data *data);
+
+/*
+ * Send the question of a cached entry to the enabled upstream servers.
+ * The reply updates the cache like any other reply but it is not
+ * forwarded to anybody.
+ */
+static void request_rank_upstreams(struct request_data *req);
+static int upstream_send(struct request_data *req, gpointer request,
+					gpointer name, unsigned int count);
+
+static int cache_prefetch_entry(struct cache_entry *entry)
 {
-	cache_timer = 0;
+	struct request_data *req;
+	struct domain_question *q;
+	struct domain_hdr *hdr;
+	unsigned char *buf;
+	int len;
 
-	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
-		DBG("No cache users, removing it.");
+	len = strlen(entry->key.name) + 1;
+
+	req = g_try_new0(struct request_data, 1);
+	if (!req)
+		return -ENOMEM;
 
-		g_hash_table_destroy(cache);
-		cache = NULL;
+	req->request_len = 12 + len + sizeof(*q);
+	req->request = buf = g_try_malloc0(req->request_len);
+	if (!buf) {
+		g_free(req);
+		return -ENOMEM;
 	}
 
-	return FALSE;
-}
+	req->protocol = IPPROTO_UDP;
+	req->dstid = get_request_id();
+	req->altid = get_request_id();
+	req->prefetch = true;
 
-static void create_cache(void)
-{
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
-		cache = g_hash_table_new_full(g_str_hash,
-					g_str_equal,
-					NULL,
-					cache_element_destroy);
-}
+	buf[0] = req->dstid & 0xff;
+	buf[1] = req->dstid >> 8;
 
-static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
-{
-	char *question;
-	struct cache_entry *entry;
-	struct domain_question *q;
-	uint16_t type;
-	int offset, proto_offset;
+	hdr = (void *) buf;
+	hdr->rd = 1;
+	hdr->qdcount = htons(1);
 
-	if (!request)
-		return NULL;
+	memcpy(buf + 12, entry->key.name, len);
+	q = (void *) (buf + 12 + len);
+	q->type = htons(entry->key.type);
+	q->class = htons(entry->key.class);
 
-	proto_offset = protocol_offset(proto);
-	if (proto_offset < 0)
-		return NULL;
+	/* Sent like a client query, to the best ranked servers first */
+	request_rank_upstreams(req);
+	upstream_send(req, req->request, NULL, parallel_queries ?
+				parallel_queries : G_MAXUINT);
 
-	question = request + proto_offset + 12;
+	if (!req->numserv) {
+		destroy_request_data(req);
+		return -EHOSTUNREACH;
+	}
 
-	offset = strlen(question) + 1;
-	q = (void *) (question + offset);
-	type = ntohs(q->type);
+	DBG("prefetch \"%s\" type %d hits %d id 0x%04x", entry->key.name,
+			entry->key.type, entry->hits, req->dstid);
 
-	/* We only cache either A (1) or AAAA (28) requests */
-	if (type != 1 && type != 28)
-		return NULL;
+	req->timeout = g_timeout_add_seconds(PREFETCH_TIMEOUT,
+						request_timeout, req);
+	request_add(req);
 
-	if (!cache) {
-		create_cache();
-		return NULL;
-	}
+	entry->prefetch_sent = time(NULL);
+	entry->hits /= 2;
+	dnsproxy_stats.prefetch_queries++;
 
-	entry = g_hash_table_lookup(cache, question);
-	if (!entry)
-		return NULL;
+	return 0;
+}
 
-	type = cache_check_validity(question, type, entry);
-	if (type == 0)
-		return NULL;
+static void cache_prefetch_remove(struct cache_entry *entry)
+{
+	if (!entry->prefetch_link.data)
+		return;
 
-	*qtype = type;
-	return entry;
+	g_queue_unlink(&cache_prefetch, &entry->prefetch_link);
+	entry->prefetch_link.data = NULL;
 }
 
 /*
- * Get a label/name from DNS resource record. The function decompresses the
- * label if necessary. The function does not convert the name to presentation
- * form. This means that the result string will contain label lengths instead
- * of dots between labels. We intentionally do not want to convert to dotted
- * format so that we can cache the wire format string directly.
+ * Prefetch the popular entries that are due and rearm the timer for
+ * the next one. Entries whose data has expired are dropped from the
+ * queue, a client query goes upstream for them anyway.
  */
-static int get_name(int counter,
-		unsigned char *pkt, unsigned char *start, unsigned char *max,
-		unsigned char *output, int output_max, int *output_len,
-		unsigned char **end, char *name, size_t max_name, int *name_len)
+static gboolean cache_prefetch_timeout(gpointer user_data)
 {
-	unsigned char *p;
+	time_t current_time = time(NULL), next = 0;
+	GList *link, *next_link;
 
-	/* Limit recursion to 10 (this means up to 10 labels in domain name) */
-	if (counter > 10)
-		return -EINVAL;
+	prefetch_timer = 0;
 
-	p = start;
-	while (*p) {
-		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
-			uint16_t offset = (*p & 0x3F) * 256 + *(p + 1);
+	for (link = cache_prefetch.head; link; link = next_link) {
+		struct cache_entry *entry = link->data;
+		time_t due;
 
-			if (offset >= max - pkt)
+		next_link = link->next;
+
+		if (!entry->data || entry->expire < current_time) {
+			cache_prefetch_remove(entry);
+			continue;
+		}
+
+		due = entry->expire - PREFETCH_LEAD;
+		if (due > current_time) {
+			if (!next || due < next)
+				next = due;
+			continue;
+		}
+
+		cache_prefetch_remove(entry);
+		cache_prefetch_entry(entry);
+	}
+
+	if (next) {
+		prefetch_due = next;
+		prefetch_timer = g_timeout_add_seconds(next - current_time,
+						cache_prefetch_timeout, NULL);
+	}
+
+	return FALSE;
+}
+
+static void cache_prefetch_schedule(time_t due)
+{
+	time_t current_time = time(NULL);
+
+	if (prefetch_timer) {
+		if (prefetch_due <= due)
+			return;
+
+		g_source_remove(prefetch_timer);
+	}
+
+	prefetch_due = due;
+	prefetch_timer = g_timeout_add_seconds(due > current_time ?
+						due - current_time : 0,
+						cache_prefetch_timeout, NULL);
+}
+
+static void cache_prefetch_add(struct cache_entry *entry)
+{
+	if (entry->prefetch_link.data || !entry->data)
+		return;
+
+	entry->prefetch_link.data = entry;
+	g_queue_push_tail_link(&cache_prefetch, &entry->prefetch_link);
+
+	cache_prefetch_schedule(entry->expire - PREFETCH_LEAD);
+}
+
+/*
+ * Must be called whenever the cached data of the entry changes so
+ * that the expiry heap and the memory accounting stay up to date.
+ */
+static void cache_entry_update(struct cache_entry *entry)
+{
+	time_t expire = 0;
+
+	if (entry->data)
+		expire = entry->data->cache_until;
+
+	cache_bytes -= entry->size;
+	entry->size = sizeof(*entry) + strlen(entry->key.name) + 1 +
+			cache_data_size(entry->data);
+	cache_bytes += entry->size;
+
+	if (entry->expire != expire) {
+		entry->expire = expire;
+		cache_heap_sift_down(cache_heap_sift_up(entry->heap_index));
+
+		if (entry->prefetch_link.data && expire)
+			cache_prefetch_schedule(expire - PREFETCH_LEAD);
+	}
+}
+
+static void cache_entry_touch(struct cache_entry *entry)
+{
+	g_queue_unlink(&cache_lru, &entry->lru_link);
+	g_queue_push_head_link(&cache_lru, &entry->lru_link);
+}
+
+static void cache_free_data(struct cache_data *data)
+{
+	if (!data)
+		return;
+
+	g_free(data->data);
+	g_free(data);
+}
+
+static bool cache_check_is_valid(struct cache_data *data,
+				time_t current_time)
+{
+	if (!data)
+		return false;
+
+	if (data->cache_until < current_time)
+		return false;
+
+	return true;
+}
+
+/*
+ * remove stale cached entries so that they can be refreshed, expired
+ * data is kept for cache_stale_time seconds for serving stale answers
+ */
+static void cache_enforce_validity(struct cache_entry *entry)
+{
+	time_t current_time = time(NULL) - cache_stale_time;
+
+	if (!cache_check_is_valid(entry->data, current_time)
+							&& entry->data) {
+		DBG("cache timeout \"%s\" type %d", entry->key.name,
+							entry->key.type);
+		cache_free_data(entry->data);
+		entry->data = NULL;
+	}
+
+	cache_entry_update(entry);
+}
+
+static bool cache_check_validity(struct cache_entry *entry)
+{
+	if (entry->data) {
+		cache_enforce_validity(entry);
+		if (cache_check_is_valid(entry->data, time(NULL)))
+			return true;
+	}
+
+	/*
+	 * The query goes upstream, the stale data is only used if
+	 * there is no reply.
+	 */
+	if (entry->data) {
+		DBG("cache entry stale \"%s\" type %d", entry->key.name,
+							entry->key.type);
+		return false;
+	}
+
+	DBG("cache entry missing \"%s\" type %d", entry->key.name,
+							entry->key.type);
+
+	/*
+	 * if we have a popular entry, we want a refresh instead of
+	 * total destruction of the entry.
+	 */
+	if (entry->hits > 2) {
+		entry->want_refresh = true;
+		return false;
+	}
+
+	g_hash_table_remove(cache, &entry->key);
+
+	return false;
+}
+
+static void cache_element_destroy(gpointer value)
+{
+	struct cache_entry *entry = value;
+
+	if (!entry)
+		return;
+
+	g_queue_unlink(&cache_lru, &entry->lru_link);
+	cache_prefetch_remove(entry);
+	cache_heap_remove(entry);
+	cache_bytes -= entry->size;
+
+	cache_free_data(entry->data);
+
+	g_free(entry->key.name);
+	g_free(entry);
+
+	if (--cache_size < 0)
+		cache_size = 0;
+}
+
+static void destroy_cache(void)
+{
+	if (!cache)
+		return;
+
+	g_hash_table_destroy(cache);
+	cache = NULL;
+
+	if (prefetch_timer) {
+		g_source_remove(prefetch_timer);
+		prefetch_timer = 0;
+	}
+
+	g_ptr_array_free(cache_heap, TRUE);
+	cache_heap = NULL;
+	cache_bytes = 0;
+}
+
+static gboolean try_remove_cache(gpointer user_data)
+{
+	cache_timer = 0;
+
+	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
+		DBG("No cache users, removing it.");
+
+		destroy_cache();
+	}
+
+	return FALSE;
+}
+
+static guint cache_key_hash(gconstpointer ptr)
+{
+	const struct cache_key *key = ptr;
+
+	return g_str_hash(key->name) ^ (key->type << 16 | key->class);
+}
+
+static gboolean cache_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct cache_key *key_a = a, *key_b = b;
+
+	return key_a->type == key_b->type && key_a->class == key_b->class &&
+					g_str_equal(key_a->name, key_b->name);
+}
+
+static struct cache_entry *cache_lookup(char *name, uint16_t type,
+							uint16_t class)
+{
+	struct cache_key key = {
+		.name = name,
+		.type = type,
+		.class = class,
+	};
+
+	if (!cache)
+		return NULL;
+
+	return g_hash_table_lookup(cache, &key);
+}
+
+/*
+ * Meta and zone transfer query types are never answered from the cache.
+ */
+static bool cache_type_supported(uint16_t type)
+{
+	switch (type) {
+	case ns_t_opt:
+	case ns_t_tkey:
+	case ns_t_tsig:
+	case ns_t_ixfr:
+	case ns_t_axfr:
+	case ns_t_mailb:
+	case ns_t_maila:
+	case ns_t_any:
+		return false;
+	}
+
+	return true;
+}
+
+static void create_cache(void)
+{
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
+		cache = g_hash_table_new_full(cache_key_hash,
+					cache_key_equal,
+					NULL,
+					cache_element_destroy);
+		cache_heap = g_ptr_array_new();
+	}
+}
+
+static bool cache_over_budget(void)
+{
+	if (cache_size > (int) cache_max_size)
+		return true;
+
+	if (cache_max_bytes && cache_bytes > cache_max_bytes)
+		return true;
+
+	return false;
+}
+
+/*
+ * Make the cache fit into its size and memory budget. Expired
+ * entries are removed first, then the least recently used ones.
+ * The entry given in keep (the one just added or updated) is
+ * never evicted.
+ */
+static void cache_evict(struct cache_entry *keep)
+{
+	time_t current_time = time(NULL);
+	int count = 0;
+
+	while (cache_over_budget()) {
+		struct cache_entry *entry = NULL;
+		GList *link;
+
+		if (cache_heap->len > 0) {
+			entry = g_ptr_array_index(cache_heap, 0);
+			if (entry == keep || entry->expire >= current_time)
+				entry = NULL;
+		}
+
+		if (!entry) {
+			link = g_queue_peek_tail_link(&cache_lru);
+			if (!link || link->data == keep)
+				break;
+
+			entry = link->data;
+		}
+
+		DBG("evicting \"%s\" type %d hits %d", entry->key.name,
+						entry->key.type, entry->hits);
+
+		g_hash_table_remove(cache, &entry->key);
+		count++;
+	}
+
+	if (count)
+		DBG("evicted %d entries, size %d bytes %" G_GSIZE_FORMAT,
+			count, cache_size, cache_bytes);
+}
+
+static struct cache_entry *cache_lookup_request(gpointer request, int proto)
+{
+	char *question;
+	struct domain_question *q;
+	uint16_t type;
+	int offset, proto_offset;
+
+	if (!request || !cache)
+		return NULL;
+
+	proto_offset = protocol_offset(proto);
+	if (proto_offset < 0)
+		return NULL;
+
+	question = request + proto_offset + 12;
+
+	offset = strlen(question) + 1;
+	q = (void *) (question + offset);
+	type = ntohs(q->type);
+
+	if (!cache_type_supported(type))
+		return NULL;
+
+	return cache_lookup(question, type, ntohs(q->class));
+}
+
+static struct cache_entry *cache_check(gpointer request, int proto)
+{
+	struct cache_entry *entry;
+
+	if (!cache) {
+		create_cache();
+		return NULL;
+	}
+
+	entry = cache_lookup_request(request, proto);
+	if (!entry)
+		return NULL;
+
+	if (!cache_check_validity(entry))
+		return NULL;
+
+	cache_entry_touch(entry);
+
+	return entry;
+}
+
+/*
+ * Account a client query answered from the cached data of the entry.
+ */
+static void cache_entry_hit(struct cache_entry *entry)
+{
+	entry->hits++;
+
+	if (entry->data->prefetched)
+		dnsproxy_stats.prefetch_hits++;
+
+	if (entry->hits >= PREFETCH_MIN_HITS)
+		cache_prefetch_add(entry);
+}
+
+/*
+ * Answer the request with expired data from the cache when the upstream
+ * servers cannot be reached, as allowed by RFC 8767.
+ */
+static bool cache_send_stale(struct request_data *req, gpointer request)
+{
+	struct cache_entry *entry;
+	struct cache_data *data;
+	struct sockaddr *sa = NULL;
+	socklen_t sa_len = 0;
+	int sk;
+
+	entry = cache_lookup_request(request, req->protocol);
+	if (!entry || !entry->data)
+		return false;
+
+	cache_enforce_validity(entry);
+
+	data = entry->data;
+	if (!data)
+		return false;
+
+	if (req->protocol == IPPROTO_UDP) {
+		sk = get_req_udp_socket(req);
+		sa = &req->sa;
+		sa_len = req->sa_len;
+	} else
+		sk = req->client_sk;
+
+	if (sk < 0)
+		return false;
+
+	DBG("stale answer \"%s\" type %d expired %ld seconds ago",
+			entry->key.name, entry->key.type,
+			(long) (time(NULL) - data->cache_until));
+
+	send_cached_response(sk, data->data, data->data_len, sa, sa_len,
+			req->protocol, req->srcid, data->answers,
+			STALE_ANSWER_TTL);
+
+	dnsproxy_stats.stale_answers++;
+
+	return true;
+}
+
+/*
+ * Get a label/name from DNS resource record. The function decompresses the
+ * label if necessary. The function does not convert the name to presentation
+ * form. This means that the result string will contain label lengths instead
+ * of dots between labels. We intentionally do not want to convert to dotted
+ * format so that we can cache the wire format string directly.
+ */
+static int get_name(int counter,
+		unsigned char *pkt, unsigned char *start, unsigned char *max,
+		unsigned char *output, int output_max, int *output_len,
+		unsigned char **end, char *name, size_t max_name, int *name_len)
+{
+	unsigned char *p;
+
+	/* Limit recursion to 10 (this means up to 10 labels in domain name) */
+	if (counter > 10)
+		return -EINVAL;
+
+	p = start;
+	while (*p) {
+		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+			uint16_t offset = (*p & 0x3F) * 256 + *(p + 1);
+
+			if (offset >= max - pkt)
 				return -ENOBUFS;
 
 			if (!*end)
@@ -896,6 +1964,73 @@ static int get_name(int counter,
 	return 0;
 }
 
+/*
+ * Copy the rdata of a resource record. Domain names in the rdata of
+ * the well known types may be compressed and would then point into
+ * the original packet, so they are expanded while copying.
+ */
+static int copy_rdata(unsigned char *buf, unsigned char *max,
+			uint16_t type, unsigned char *rdata, int rdlen,
+			unsigned char *output, int output_max)
+{
+	unsigned char *ptr = rdata, *end = rdata + rdlen;
+	char name[NS_MAXDNAME];
+	int fixed = 0, names = 0, len, ret;
+
+	if (end > max)
+		return -ENOBUFS;
+
+	switch (type) {
+	case ns_t_ns:
+	case ns_t_cname:
+	case ns_t_ptr:
+		names = 1;
+		break;
+	case ns_t_mx:
+		fixed = 2;	/* preference */
+		names = 1;
+		break;
+	case ns_t_srv:
+		fixed = 6;	/* priority, weight and port */
+		names = 1;
+		break;
+	case ns_t_soa:
+		names = 2;	/* primary name server and mailbox */
+		break;
+	}
+
+	if (fixed > rdlen || fixed > output_max)
+		return -EINVAL;
+
+	memcpy(output, ptr, fixed);
+	ptr += fixed;
+	len = fixed;
+
+	while (names-- > 0) {
+		ret = dn_expand(buf, max, ptr, name, sizeof(name));
+		if (ret < 0 || ptr + ret > end)
+			return -EINVAL;
+
+		ptr += ret;
+
+		ret = dn_comp(name, output + len, output_max - len,
+								NULL, NULL);
+		if (ret < 0)
+			return -ENOBUFS;
+
+		len += ret;
+	}
+
+	/* The rest, like the SOA serial and timers, is copied as is */
+	if (len + (end - ptr) > output_max)
+		return -ENOBUFS;
+
+	memcpy(output + len, ptr, end - ptr);
+	len += end - ptr;
+
+	return len;
+}
+
 static int parse_rr(unsigned char *buf, unsigned char *start,
 			unsigned char *max,
 			unsigned char *response, unsigned int *response_size,
@@ -904,7 +2039,7 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 			char *name, size_t max_name)
 {
 	struct domain_rr *rr;
-	int err, offset;
+	int err, offset, len;
 	int name_len = 0, output_len = 0, max_rsp = *response_size;
 
 	err = get_name(0, buf, start, max, response, max_rsp,
@@ -922,6 +2057,9 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 	if (!rr)
 		return -EINVAL;
 
+	if (*end + sizeof(struct domain_rr) > max)
+		return -ENOBUFS;
+
 	*type = ntohs(rr->type);
 	*class = ntohs(rr->class);
 	*ttl = ntohl(rr->ttl);
@@ -930,19 +2068,27 @@ static int parse_rr(unsigned char *buf, unsigned char *start,
 	if (*ttl < 0)
 		return -EINVAL;
 
+	if ((unsigned int) (offset + sizeof(struct domain_rr)) >
+							*response_size)
+		return -ENOBUFS;
+
 	memcpy(response + offset, *end, sizeof(struct domain_rr));
 
 	offset += sizeof(struct domain_rr);
 	*end += sizeof(struct domain_rr);
 
-	if ((unsigned int) (offset + *rdlen) > *response_size)
-		return -ENOBUFS;
+	len = copy_rdata(buf, max, *type, *end, *rdlen, response + offset,
+						*response_size - offset);
+	if (len < 0)
+		return len;
 
-	memcpy(response + offset, *end, *rdlen);
+	/* The rdata length changes if names in it were expanded */
+	rr = (void *) (response + offset - sizeof(struct domain_rr));
+	rr->rdlen = htons(len);
 
 	*end += *rdlen;
 
-	*response_size = offset + *rdlen;
+	*response_size = offset + len;
 
 	return 0;
 }
@@ -997,44 +2143,48 @@ static int parse_response(unsigned char *buf, int buflen,
 
 	q = (void *) ptr;
 	qtype = ntohs(q->type);
+	qclass = ntohs(q->class);
 
-	/* We cache only A and AAAA records */
-	if (qtype != 1 && qtype != 28)
-		return -ENOMSG;
+	/* The caller needs to know the question even if nothing is cached */
+	*type = qtype;
+	*class = qclass;
 
-	qclass = ntohs(q->class);
+	if (!cache_type_supported(qtype))
+		return -ENOMSG;
 
 	ptr += 2 + 2; /* ptr points now to answers */
 
 	err = -ENOMSG;
 	*response_len = 0;
 	*answers = 0;
+	*ttl = 0;
 
 	memset(name, 0, sizeof(name));
 
 	/*
 	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
-	 * A or AAAA question. We traverse the answers and parse the
-	 * resource records. Only A and AAAA records are cached, all
-	 * the other records in answers are skipped.
+	 * the question. We traverse the answers and parse the
+	 * resource records. Only the records of the question type are
+	 * cached, all the other records in answers are skipped.
 	 */
 	for (i = 0; i < ancount; i++) {
 		/*
-		 * Get one address at a time to this buffer.
-		 * The max size of the answer is
-		 *   2 (pointer) + 2 (type) + 2 (class) +
-		 *   4 (ttl) + 2 (rdlen) + addr (16 or 4) = 28
-		 * for A or AAAA record.
-		 * For CNAME the size can be bigger.
+		 * Each record is parsed directly to the end of the
+		 * response buffer and kept there only if it answers
+		 * the question.
 		 */
-		unsigned char rsp[NS_MAXCDNAME];
-		unsigned int rsp_len = sizeof(rsp) - 1;
-		int ret, rdlen;
+		unsigned char *rsp = response + *response_len;
+		unsigned int rsp_len = maxlen - *response_len;
+		uint16_t rtype, rclass;
+		int ret, rdlen, rttl;
 
-		memset(rsp, 0, sizeof(rsp));
+		if (rsp_len < 2 + sizeof(struct domain_rr)) {
+			err = -ENOBUFS;
+			goto out;
+		}
 
 		ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name,
+			&rtype, &rclass, &rttl, &rdlen, &next, name,
 			sizeof(name) - 1);
 		if (ret != 0) {
 			err = ret;
@@ -1053,7 +2203,7 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * Go to next answer if the class is not the one we are
 		 * looking for.
 		 */
-		if (*class != qclass) {
+		if (rclass != qclass) {
 			ptr = next;
 			next = NULL;
 			continue;
@@ -1066,7 +2216,7 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * question.
 		 *
 		 * If any CNAME is found in DNS packet, then we cache the alias
-		 * IP address instead of the question (as the server
+		 * records instead of the question (as the server
 		 * said that question has only an alias).
 		 * This means in practice that if e.g., ipv6.google.com is
 		 * queried, DNS server returns CNAME of that name which is
@@ -1079,29 +2229,33 @@ static int parse_response(unsigned char *buf, int buflen,
 		 * says ipv6.google.com has address xxx which is in fact the
 		 * address of ipv6.l.google.com. For caching purposes this
 		 * should not cause any issues.
+		 *
+		 * If the question itself is of type CNAME, the record is
+		 * the answer and is cached as such.
 		 */
-		if (*type == 5 && strncmp(question, name, qlen) == 0) {
+		if (rtype == ns_t_cname && qtype != ns_t_cname &&
+				(check_alias(aliases, name) ||
+				strncmp(question, name, qlen) == 0)) {
 			/*
 			 * So now the alias answered the question. This is
 			 * not very useful from caching point of view as
-			 * the following A or AAAA records will not match the
-			 * question. We need to find the real A/AAAA record
-			 * of the alias and cache that.
+			 * the following records will not match the
+			 * question. We need to find the real records
+			 * of the alias and cache those.
 			 */
+			unsigned char alias[NS_MAXCDNAME];
 			unsigned char *end = NULL;
 			int name_len = 0, output_len = 0;
 
-			memset(rsp, 0, sizeof(rsp));
-			rsp_len = sizeof(rsp) - 1;
-
 			/*
 			 * Alias is in rdata part of the message,
 			 * and next-rdlen points to it. So we need to get
 			 * the real name of the alias.
 			 */
 			ret = get_name(0, buf, next - rdlen, buf + buflen,
-					rsp, rsp_len, &output_len, &end,
-					name, sizeof(name) - 1, &name_len);
+					alias, sizeof(alias) - 1, &output_len,
+					&end, name, sizeof(name) - 1,
+					&name_len);
 			if (ret != 0) {
 				/* just ignore the error at this point */
 				ptr = next;
@@ -1113,7 +2267,7 @@ static int parse_response(unsigned char *buf, int buflen,
 			 * We should now have the alias of the entry we might
 			 * want to cache. Just remember it for a while.
 			 * We check the alias list when we have parsed the
-			 * A or AAAA record.
+			 * records of the question type.
 			 */
 			aliases = g_slist_prepend(aliases, g_strdup(name));
 
@@ -1122,28 +2276,27 @@ static int parse_response(unsigned char *buf, int buflen,
 			continue;
 		}
 
-		if (*type == qtype) {
+		if (rtype == qtype) {
 			/*
-			 * We found correct type (A or AAAA)
+			 * We found correct type
 			 */
 			if (check_alias(aliases, name) ||
 				(!aliases && strncmp(question, name,
 							qlen) == 0)) {
 				/*
 				 * We found an alias or the name of the rr
-				 * matches the question. If so, we append
-				 * the compressed label to the cache.
+				 * matches the question. If so, we keep
+				 * the compressed label in the response.
 				 * The end result is a response buffer that
 				 * will contain one or more cached and
-				 * compressed resource records.
+				 * compressed resource records. The RRset
+				 * is cached with the smallest TTL of
+				 * its records.
 				 */
-				if (*response_len + rsp_len > maxlen) {
-					err = -ENOBUFS;
-					goto out;
-				}
-				memcpy(response + *response_len, rsp, rsp_len);
 				*response_len += rsp_len;
 				(*answers)++;
+				if (*answers == 1 || rttl < *ttl)
+					*ttl = rttl;
 				err = 0;
 			}
 		}
@@ -1155,102 +2308,9 @@ static int parse_response(unsigned char *buf, int buflen,
 out:
 	for (list = aliases; list; list = list->next)
 		g_free(list->data);
-	g_slist_free(aliases);
-
-	return err;
-}
-
-struct cache_timeout {
-	time_t current_time;
-	int max_timeout;
-	int try_harder;
-};
-
-static gboolean cache_check_entry(gpointer key, gpointer value,
-					gpointer user_data)
-{
-	struct cache_timeout *data = user_data;
-	struct cache_entry *entry = value;
-	int max_timeout;
-
-	/* Scale the number of hits by half as part of cache aging */
-
-	entry->hits /= 2;
-
-	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
-	 */
-
-	if (entry->ipv4 && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
-
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
-	}
-
-	if (entry->ipv6 && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
-
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
-	}
-
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
-
-	return FALSE;
-}
-
-static void cache_cleanup(void)
-{
-	static int max_timeout;
-	struct cache_timeout data;
-	int count = 0;
-
-	data.current_time = time(NULL);
-	data.max_timeout = 0;
-	data.try_harder = 0;
-
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-	}
-	DBG("removed %d in the first pass", count);
-
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = 1;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+	g_slist_free(aliases);
+
+	return err;
 }
 
 static gboolean cache_invalidate_entry(gpointer key, gpointer value,
@@ -1262,21 +2322,14 @@ static gboolean cache_invalidate_entry(gpointer key, gpointer value,
 	cache_enforce_validity(entry);
 
 	/* if anything is not expired, mark the entry for refresh */
-	if (entry->hits > 0 && (entry->ipv4 || entry->ipv6))
+	if (entry->hits > 0 && entry->data)
 		entry->want_refresh = true;
 
 	/* delete the cached data */
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-	}
+	cache_free_data(entry->data);
+	entry->data = NULL;
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
-	}
+	cache_entry_update(entry);
 
 	/* keep the entry if we want it refreshed, delete it otherwise */
 	if (entry->want_refresh)
@@ -1306,28 +2359,15 @@ static void cache_refresh_entry(struct cache_entry *entry)
 
 	cache_enforce_validity(entry);
 
-	if (entry->hits > 2 && !entry->ipv4)
-		entry->want_refresh = true;
-	if (entry->hits > 2 && !entry->ipv6)
+	if (entry->hits > 2 && !entry->data)
 		entry->want_refresh = true;
 
 	if (entry->want_refresh) {
-		char *c;
-		char dns_name[NS_MAXDNAME + 1];
 		entry->want_refresh = false;
 
-		/* turn a DNS name into a hostname with dots */
-		strncpy(dns_name, entry->key, NS_MAXDNAME);
-		c = dns_name;
-		while (c && *c) {
-			int jump;
-			jump = *c;
-			*c = '.';
-			c += jump + 1;
-		}
-		DBG("Refreshing %s\n", dns_name);
-		/* then refresh the hostname */
-		refresh_dns_entry(entry, &dns_name[1]);
+		DBG("Refreshing \"%s\" type %d", entry->key.name,
+							entry->key.type);
+		cache_prefetch_entry(entry);
 	}
 }
 
@@ -1347,25 +2387,465 @@ static void cache_refresh(void)
 	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
 }
 
-static int reply_query_type(unsigned char *msg, int len)
+static struct cache_entry *cache_entry_new(char *question, uint16_t type,
+							uint16_t class)
 {
-	unsigned char *c;
-	int l;
-	int type;
+	struct cache_entry *entry;
 
-	/* skip the header */
-	c = msg + sizeof(struct domain_hdr);
-	len -= sizeof(struct domain_hdr);
+	entry = g_try_new0(struct cache_entry, 1);
+	if (!entry)
+		return NULL;
 
-	if (len < 0)
-		return 0;
+	entry->key.name = g_strdup(question);
+	entry->key.type = type;
+	entry->key.class = class;
+	entry->want_refresh = false;
+	entry->hits = 0;
+	entry->lru_link.data = entry;
 
-	/* now the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c);
-	c += l;
-	type = c[0] << 8 | c[1];
+	g_hash_table_replace(cache, &entry->key, entry);
+	g_queue_push_head_link(&cache_lru, &entry->lru_link);
+	cache_heap_insert(entry);
+	cache_size++;
+
+	cache_entry_update(entry);
+
+	return entry;
+}
+
+/*
+ * Replace the cached data of the entry. The entry becomes the most
+ * recently used one and other entries are evicted if the cache grew
+ * over its budget.
+ */
+static void cache_entry_set_data(struct cache_entry *entry,
+					struct cache_data *data)
+{
+	/* the answer to a prefetch, or to a query racing with it */
+	data->prefetched = entry->prefetch_sent &&
+			time(NULL) - entry->prefetch_sent <= PREFETCH_TIMEOUT;
+	entry->prefetch_sent = 0;
+
+	cache_free_data(entry->data);
+	entry->data = data;
+
+	cache_entry_update(entry);
+	cache_entry_touch(entry);
+	cache_evict(entry);
+}
+
+/*
+ * Pack the cached answers that are still usable into a snapshot. The
+ * least recently used entries come first so that restoring them in
+ * order recreates the LRU order.
+ */
+static GByteArray *cache_snapshot_create(void)
+{
+	struct cache_snapshot_hdr hdr = {
+		.magic = CACHE_SNAPSHOT_MAGIC,
+		.count = 0,
+	};
+	time_t current_time = time(NULL);
+	GByteArray *snapshot;
+	GList *link;
+
+	snapshot = g_byte_array_new();
+	g_byte_array_append(snapshot, (guint8 *) &hdr, sizeof(hdr));
+
+	for (link = g_queue_peek_tail_link(&cache_lru); link;
+						link = link->prev) {
+		struct cache_entry *entry = link->data;
+		struct cache_data *data = entry->data;
+		struct cache_snapshot_record rec;
+
+		if (!data || data->cache_until + cache_stale_time <
+							current_time)
+			continue;
+
+		rec.inserted = data->inserted;
+		rec.valid_until = data->valid_until;
+		rec.cache_until = data->cache_until;
+		rec.timeout = data->timeout;
+		rec.type = entry->key.type;
+		rec.class = entry->key.class;
+		rec.answers = data->answers;
+		rec.name_len = strlen(entry->key.name) + 1;
+		rec.data_len = data->data_len;
+
+		g_byte_array_append(snapshot, (guint8 *) &rec, sizeof(rec));
+		g_byte_array_append(snapshot, (guint8 *) entry->key.name,
+							rec.name_len);
+		g_byte_array_append(snapshot, data->data, data->data_len);
+		hdr.count++;
+	}
+
+	memcpy(snapshot->data, &hdr, sizeof(hdr));
+
+	return snapshot;
+}
+
+static bool cache_skip_name(const unsigned char *buf, gsize len,
+								gsize *pos)
+{
+	const unsigned char *end;
+
+	if (*pos >= len)
+		return false;
+
+	/* The same rule as dns_name_length() */
+	if ((buf[*pos] & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+		if (len - *pos < 2)
+			return false;
+
+		*pos += 2;
+		return true;
+	}
+
+	end = memchr(buf + *pos, '\0', len - *pos);
+	if (!end)
+		return false;
+
+	*pos = end - buf + 1;
+
+	return true;
+}
+
+/*
+ * Check that a cached packet can be walked the way
+ * send_cached_response() and update_cached_ttl() do it.
+ */
+static bool cache_data_valid(const unsigned char *buf, gsize len,
+							uint16_t answers)
+{
+	gsize pos, rdlen;
+
+	if (len < 2 + 12 || (gsize) (buf[0] << 8 | buf[1]) != len - 2)
+		return false;
+
+	pos = 2 + 12;
+
+	/* the question, a name and 2 16 bit words */
+	if (!cache_skip_name(buf, len, &pos) || len - pos < 4)
+		return false;
+
+	pos += 4;
+
+	if (answers == 0)
+		return true;
+
+	while (pos < len) {
+		/* name, type, class, ttl, rdlen and the rdata */
+		if (!cache_skip_name(buf, len, &pos) || len - pos < 10)
+			return false;
+
+		rdlen = buf[pos + 8] << 8 | buf[pos + 9];
+		pos += 10;
+
+		if (len - pos < rdlen)
+			return false;
+
+		pos += rdlen;
+	}
+
+	return true;
+}
+
+/*
+ * Load the answers of a snapshot into the cache. Answers that are
+ * older than the stale window or that do not parse are skipped, as
+ * are the ones for which the cache has newer data already. Only as
+ * many of the most recently used answers are loaded as fit into the
+ * cache budget. Returns the number of answers restored or a negative
+ * error if the snapshot is corrupt.
+ */
+static int cache_snapshot_restore(const unsigned char *buf, gsize len)
+{
+	struct cache_snapshot_hdr hdr;
+	struct cache_snapshot_record rec;
+	time_t current_time = time(NULL);
+	gsize pos = sizeof(hdr), bytes, size;
+	GArray *records;
+	unsigned int i, first;
+	int count, restored = 0;
+
+	if (len < sizeof(hdr))
+		return -EINVAL;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (hdr.magic != CACHE_SNAPSHOT_MAGIC)
+		return -EINVAL;
+
+	records = g_array_new(FALSE, FALSE, sizeof(gsize));
+
+	for (i = 0; i < hdr.count; i++) {
+		const char *name;
+
+		if (len - pos < sizeof(rec)) {
+			restored = -EINVAL;
+			goto out;
+		}
+
+		memcpy(&rec, buf + pos, sizeof(rec));
+
+		if (rec.name_len == 0 || rec.data_len < 2 + 12 ||
+				rec.data_len > TCP_MAX_BUF_LEN ||
+				len - pos - sizeof(rec) <
+				(gsize) rec.name_len + rec.data_len) {
+			restored = -EINVAL;
+			goto out;
+		}
+
+		name = (const char *) buf + pos + sizeof(rec);
+		if (name[rec.name_len - 1] != '\0' ||
+				strlen(name) + 1 != rec.name_len) {
+			restored = -EINVAL;
+			goto out;
+		}
+
+		if (rec.cache_until + cache_stale_time >= current_time &&
+				cache_type_supported(rec.type) &&
+				cache_data_valid((const unsigned char *) name +
+						rec.name_len, rec.data_len,
+						rec.answers))
+			g_array_append_val(records, pos);
+
+		pos += sizeof(rec) + rec.name_len + rec.data_len;
+	}
+
+	if (!cache)
+		create_cache();
+
+	/*
+	 * The most recently used answers are at the end. Find the ones
+	 * that fit and load them in order to keep the LRU order.
+	 */
+	bytes = cache_bytes;
+	count = cache_size;
+
+	for (first = records->len; first > 0; first--) {
+		memcpy(&rec, buf + g_array_index(records, gsize, first - 1),
+								sizeof(rec));
+
+		size = sizeof(struct cache_entry) + rec.name_len +
+				sizeof(struct cache_data) + rec.data_len;
+
+		if (count + 1 > (int) cache_max_size || (cache_max_bytes &&
+					bytes + size > cache_max_bytes))
+			break;
+
+		bytes += size;
+		count++;
+	}
+
+	if (first > 0)
+		DBG("cache full, skipping %u answers", first);
+
+	for (i = first; i < records->len; i++) {
+		struct cache_entry *entry;
+		struct cache_data *data;
+		const char *name;
+
+		pos = g_array_index(records, gsize, i);
+		memcpy(&rec, buf + pos, sizeof(rec));
+		name = (const char *) buf + pos + sizeof(rec);
+
+		entry = cache_lookup((char *) name, rec.type, rec.class);
+		if (entry && entry->data &&
+				entry->data->cache_until >= rec.cache_until)
+			continue;
+
+		data = g_try_new0(struct cache_data, 1);
+		if (!data) {
+			restored = -ENOMEM;
+			goto out;
+		}
+
+		data->inserted = rec.inserted;
+		data->valid_until = rec.valid_until;
+		data->cache_until = rec.cache_until;
+		data->timeout = rec.timeout;
+		data->type = rec.type;
+		data->answers = rec.answers;
+		data->data_len = rec.data_len;
+		data->data = g_memdup(name + rec.name_len, rec.data_len);
+
+		if (!entry) {
+			entry = cache_entry_new((char *) name, rec.type,
+								rec.class);
+			if (!entry) {
+				cache_free_data(data);
+				restored = -ENOMEM;
+				goto out;
+			}
+		}
+
+		cache_entry_set_data(entry, data);
+		entry->want_refresh = false;
+		restored++;
+	}
+
+out:
+	g_array_free(records, TRUE);
+
+	return restored;
+}
+
+static char *cache_snapshot_path(const char *ident)
+{
+	return g_strdup_printf("%s/%s/%s", STORAGEDIR, ident,
+						CACHE_SNAPSHOT_FILE);
+}
+
+static void cache_snapshot_write(const char *ident, GByteArray *snapshot)
+{
+	GError *error = NULL;
+	char *dir, *pathname;
+
+	/* only services that are saved have a storage directory */
+	dir = g_strdup_printf("%s/%s", STORAGEDIR, ident);
+	if (!g_file_test(dir, G_FILE_TEST_IS_DIR)) {
+		g_free(dir);
+		return;
+	}
+
+	g_free(dir);
+
+	pathname = cache_snapshot_path(ident);
+
+	if (!g_file_set_contents(pathname, (const gchar *) snapshot->data,
+					snapshot->len, &error)) {
+		connman_error("Failed to save DNS cache to %s: %s",
+						pathname, error->message);
+		g_error_free(error);
+	} else
+		DBG("saved %u bytes to %s", snapshot->len, pathname);
+
+	g_free(pathname);
+}
+
+static int cache_snapshot_read(const char *ident)
+{
+	char *pathname;
+	struct stat st;
+	void *addr;
+	int fd, err;
+
+	pathname = cache_snapshot_path(ident);
+
+	fd = open(pathname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		err = -EINVAL;
+		close(fd);
+		goto out;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED) {
+		err = -errno;
+		goto out;
+	}
+
+	err = cache_snapshot_restore(addr, st.st_size);
+	munmap(addr, st.st_size);
+
+	if (err < 0) {
+		connman_warn("Ignoring corrupt DNS cache %s", pathname);
+		unlink(pathname);
+	}
+
+out:
+	g_free(pathname);
+
+	return err;
+}
+
+static void cache_snapshot_free(gpointer data)
+{
+	g_byte_array_free(data, TRUE);
+}
+
+static void cache_partition_store(const char *ident, GByteArray *snapshot)
+{
+	GList *link;
+	char *oldest;
+
+	link = g_queue_find_custom(&cache_partition_lru, ident,
+						(GCompareFunc) g_strcmp0);
+	if (link) {
+		g_free(link->data);
+		g_queue_delete_link(&cache_partition_lru, link);
+	}
+
+	g_hash_table_replace(cache_partitions, g_strdup(ident), snapshot);
+	g_queue_push_head(&cache_partition_lru, g_strdup(ident));
+
+	while (cache_partition_lru.length > MAX_CACHE_PARTITIONS) {
+		oldest = g_queue_pop_tail(&cache_partition_lru);
+		g_hash_table_remove(cache_partitions, oldest);
+		g_free(oldest);
+	}
+}
+
+static void cache_partitions_destroy(void)
+{
+	char *ident;
+
+	while ((ident = g_queue_pop_head(&cache_partition_lru)))
+		g_free(ident);
+
+	if (cache_partitions) {
+		g_hash_table_destroy(cache_partitions);
+		cache_partitions = NULL;
+	}
+
+	g_free(cache_partition);
+	cache_partition = NULL;
+}
+
+/*
+ * Save the cache of the current network and make the cache belong to
+ * the network of the given service identifier, restoring its earlier
+ * answers. Must be called before the cache is invalidated.
+ */
+static void cache_partition_switch(const char *ident)
+{
+	GByteArray *snapshot;
+	int restored;
+
+	if (cache_partition && cache) {
+		snapshot = cache_snapshot_create();
+
+		if (cache_persistent)
+			cache_snapshot_write(cache_partition, snapshot);
+
+		cache_partition_store(cache_partition, snapshot);
+	}
+
+	g_free(cache_partition);
+	cache_partition = g_strdup(ident);
 
-	return type;
+	cache_invalidate();
+
+	if (!ident)
+		return;
+
+	snapshot = g_hash_table_lookup(cache_partitions, ident);
+	if (snapshot)
+		restored = cache_snapshot_restore(snapshot->data,
+							snapshot->len);
+	else if (cache_persistent)
+		restored = cache_snapshot_read(ident);
+	else
+		restored = 0;
+
+	DBG("partition %s restored %d", ident, restored);
 }
 
 static int cache_update(struct server_data *srv, unsigned char *msg,
@@ -1379,26 +2859,14 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	struct cache_entry *entry;
 	struct cache_data *data;
 	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
+	unsigned char response[TCP_MAX_BUF_LEN];
 	unsigned char *ptr;
 	unsigned int rsplen;
 	bool new_entry = true;
 	time_t current_time;
 
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
-
 	current_time = time(NULL);
 
-	/* don't do a cache refresh more than twice a minute */
-	if (next_refresh < current_time) {
-		cache_refresh();
-		next_refresh = current_time + 30;
-	}
-
 	if (offset < 0)
 		return 0;
 
@@ -1424,20 +2892,22 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	 * for a record that's already in our ipv4 cache.. we want
 	 * to cache the negative response.
 	 */
-	if ((err == -ENOMSG || err == -ENOBUFS) &&
-			reply_query_type(msg + offset,
-					msg_len - offset) == 28) {
-		entry = g_hash_table_lookup(cache, question);
-		if (entry && entry->ipv4 && !entry->ipv6) {
+	if ((err == -ENOMSG || err == -ENOBUFS) && type == ns_t_aaaa) {
+		struct cache_entry *ipv4 = cache_lookup(question, ns_t_a,
+									class);
+
+		entry = cache_lookup(question, ns_t_aaaa, class);
+
+		if (ipv4 && ipv4->data && (!entry || !entry->data)) {
 			int cache_offset = 0;
 
 			data = g_try_new(struct cache_data, 1);
 			if (!data)
 				return -ENOMEM;
-			data->inserted = entry->ipv4->inserted;
+			data->inserted = ipv4->data->inserted;
 			data->type = type;
 			data->answers = ntohs(hdr->ancount);
-			data->timeout = entry->ipv4->timeout;
+			data->timeout = ipv4->data->timeout;
 			if (srv->protocol == IPPROTO_UDP)
 				cache_offset = 2;
 			data->data_len = msg_len + cache_offset;
@@ -1446,10 +2916,20 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 			ptr[1] = (data->data_len - 2) - ptr[0] * 256;
 			if (srv->protocol == IPPROTO_UDP)
 				ptr += 2;
-			data->valid_until = entry->ipv4->valid_until;
-			data->cache_until = entry->ipv4->cache_until;
+			data->valid_until = ipv4->data->valid_until;
+			data->cache_until = ipv4->data->cache_until;
 			memcpy(ptr, msg, msg_len);
-			entry->ipv6 = data;
+
+			if (!entry) {
+				entry = cache_entry_new(question, type, class);
+				if (!entry) {
+					cache_free_data(data);
+					return -ENOMEM;
+				}
+			}
+
+			cache_entry_set_data(entry, data);
+
 			/*
 			 * we will get a "hit" when we serve the response
 			 * out of the cache
@@ -1466,60 +2946,9 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	qlen = strlen(question);
 
-	/*
-	 * If the cache contains already data, check if the
-	 * type of the cached data is the same and do not add
-	 * to cache if data is already there.
-	 * This is needed so that we can cache both A and AAAA
-	 * records for the same name.
-	 */
-	entry = g_hash_table_lookup(cache, question);
-	if (!entry) {
-		entry = g_try_new(struct cache_entry, 1);
-		if (!entry)
-			return -ENOMEM;
-
-		data = g_try_new(struct cache_data, 1);
-		if (!data) {
-			g_free(entry);
-			return -ENOMEM;
-		}
-
-		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
-		entry->want_refresh = false;
-		entry->hits = 0;
-
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
-	} else {
-		if (type == 1 && entry->ipv4)
-			return 0;
-
-		if (type == 28 && entry->ipv6)
-			return 0;
-
-		data = g_try_new(struct cache_data, 1);
-		if (!data)
-			return -ENOMEM;
-
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
-
-		/*
-		 * compensate for the hit we'll get for serving
-		 * the response out of the cache
-		 */
-		entry->hits--;
-		if (entry->hits < 0)
-			entry->hits = 0;
-
-		new_entry = false;
-	}
+	data = g_try_new(struct cache_data, 1);
+	if (!data)
+		return -ENOMEM;
 
 	if (ttl < MIN_CACHE_TTL)
 		ttl = MIN_CACHE_TTL;
@@ -1534,7 +2963,7 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	 * of cached packet.
 	 */
 	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
-	data->data = ptr = g_malloc(data->data_len);
+	data->data = ptr = g_try_malloc(data->data_len);
 	data->valid_until = current_time + ttl;
 
 	/*
@@ -1547,9 +2976,7 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	data->cache_until = round_down_ttl(current_time + ttl, ttl);
 
 	if (!data->data) {
-		g_free(entry->key);
 		g_free(data);
-		g_free(entry);
 		return -ENOMEM;
 	}
 
@@ -1577,16 +3004,37 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	memcpy(ptr + offset + 12 + qlen + 1 + sizeof(struct domain_question),
 		response, rsplen);
 
-	if (new_entry) {
-		g_hash_table_replace(cache, entry->key, entry);
-		cache_size++;
+	/*
+	 * Each RRset has its own entry, so e.g. the A and AAAA records
+	 * of a name are cached and expire independently. If the entry
+	 * exists already, its data is replaced with the fresh answer.
+	 */
+	entry = cache_lookup(question, type, class);
+	if (!entry) {
+		entry = cache_entry_new(question, type, class);
+		if (!entry) {
+			cache_free_data(data);
+			return -ENOMEM;
+		}
+	} else {
+		/*
+		 * compensate for the hit we'll get for serving
+		 * the response out of the cache
+		 */
+		entry->hits--;
+		if (entry->hits < 0)
+			entry->hits = 0;
+
+		new_entry = false;
 	}
 
+	cache_entry_set_data(entry, data);
+
 	DBG("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
 								"dns len %u",
 		cache_size, new_entry ? "new " : "old ",
 		question, type, ttl,
-		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
+		entry->size,
 		data->data_len,
 		srv->protocol == IPPROTO_TCP ?
 			(unsigned int)(data->data[0] * 256 + data->data[1]) :
@@ -1595,28 +3043,107 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 	return 0;
 }
 
+static void tcp_server_closed(struct server_data *server);
+
+static gboolean tcp_server_writable(GIOChannel *channel,
+				GIOCondition condition, gpointer user_data)
+{
+	struct server_data *server = user_data;
+	int sk = g_io_channel_unix_get_fd(channel);
+	ssize_t len;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		goto hangup;
+
+	while (server->outgoing->len > 0) {
+		len = send(sk, server->outgoing->data, server->outgoing->len,
+								MSG_NOSIGNAL);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return TRUE;
+
+			connman_error("DNS proxy error %s", strerror(errno));
+			goto hangup;
+		}
+
+		g_byte_array_remove_range(server->outgoing, 0, len);
+	}
+
+	DBG("server %s queue sent", server->server);
+
+	server->out_watch = 0;
+
+	return FALSE;
+
+hangup:
+	/* The watch is removed when returning */
+	server->out_watch = 0;
+	tcp_server_closed(server);
+
+	return FALSE;
+}
+
+/*
+ * Write a length prefixed query to the TCP connection of the server.
+ * Several queries share the connection, so what the socket does not
+ * take at once is queued and written in order when it is writable
+ * again. Returns len, or -1 with errno set when the connection failed.
+ */
+static ssize_t tcp_server_write(struct server_data *server,
+					const void *buf, size_t len)
+{
+	int sk = g_io_channel_unix_get_fd(server->channel);
+	ssize_t sent = 0;
+
+	if (!server->outgoing || server->outgoing->len == 0) {
+		sent = send(sk, buf, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+
+			sent = 0;
+		}
+
+		if ((size_t) sent == len)
+			return len;
+	}
+
+	if (!server->outgoing)
+		server->outgoing = g_byte_array_new();
+
+	g_byte_array_append(server->outgoing,
+			(const guint8 *) buf + sent, len - sent);
+
+	DBG("server %s queued %zd bytes", server->server, len - sent);
+
+	if (!server->out_watch)
+		server->out_watch = g_io_add_watch(server->channel,
+				G_IO_OUT | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+				tcp_server_writable, server);
+
+	return len;
+}
+
 static int ns_resolv(struct server_data *server, struct request_data *req,
 				gpointer request, gpointer name)
 {
 	GList *list;
-	int sk, err, type = 0;
+	int sk, err;
 	char *dot, *lookup = (char *) name;
 	struct cache_entry *entry;
 
-	entry = cache_check(request, &type, req->protocol);
+	/* A prefetch is sent because the cached entry is about to expire */
+	entry = req->prefetch ? NULL : cache_check(request, req->protocol);
 	if (entry) {
 		int ttl_left = 0;
 		struct cache_data *data;
 
-		DBG("cache hit %s type %s", lookup, type == 1 ? "A" : "AAAA");
-		if (type == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		DBG("cache hit %s type %d", lookup, entry->key.type);
+		data = entry->data;
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+			cache_entry_hit(entry);
 		}
 
 		if (data && req->protocol == IPPROTO_TCP) {
@@ -1642,8 +3169,11 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 
 	sk = g_io_channel_unix_get_fd(server->channel);
 
-	err = sendto(sk, request, req->request_len, MSG_NOSIGNAL,
-			server->server_addr, server->server_addr_len);
+	if (server->protocol == IPPROTO_UDP)
+		err = udp_sendto(sk, request, req->request_len,
+				server->server_addr, server->server_addr_len);
+	else
+		err = tcp_server_write(server, request, req->request_len);
 	if (err < 0) {
 		DBG("Cannot send message to server %s sock %d "
 			"protocol %d (%s/%d)",
@@ -1654,6 +3184,10 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 
 	req->numserv++;
 
+	/* The question of a prefetch is already the full name */
+	if (req->prefetch)
+		return 0;
+
 	/* If we have more than one dot, we don't add domains */
 	dot = strchr(lookup, '.');
 	if (dot && dot != lookup + strlen(lookup) - 1)
@@ -1708,7 +3242,12 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		DBG("req %p dstid 0x%04x altid 0x%04x", req, req->dstid,
 				req->altid);
 
-		err = send(sk, alt, req->request_len + domlen, MSG_NOSIGNAL);
+		if (server->protocol == IPPROTO_UDP)
+			err = udp_sendto(sk, alt, req->request_len + domlen,
+								NULL, 0);
+		else
+			err = tcp_server_write(server, alt,
+						req->request_len + domlen);
 		if (err < 0)
 			return -EIO;
 
@@ -1925,6 +3464,8 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 {
 	struct domain_hdr *hdr;
 	struct request_data *req;
+	struct upstream_attempt *attempt;
+	gint64 rtt = -1;
 	int dns_id, sk, err, offset = protocol_offset(protocol);
 
 	if (offset < 0)
@@ -1942,6 +3483,19 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	DBG("req %p dstid 0x%04x altid 0x%04x rcode %d",
 			req, req->dstid, req->altid, hdr->rcode);
 
+	attempt = request_find_upstream(req, data);
+	if (attempt && attempt->sent && !attempt->answered) {
+		attempt->answered = true;
+		data->replies++;
+
+		rtt = upstream_reply_rtt(attempt, g_get_monotonic_time());
+
+		if (hdr->rcode == ns_r_servfail ||
+				hdr->rcode == ns_r_notimpl ||
+				hdr->rcode == ns_r_refused)
+			data->failures++;
+	}
+
 	reply[offset] = req->srcid & 0xff;
 	reply[offset + 1] = req->srcid >> 8;
 
@@ -2125,6 +3679,31 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	}
 
 out:
+	/*
+	 * The servers asked so far failed, try the next one right away.
+	 * A name the servers asked so far do not know may still be known
+	 * by the servers of another interface or domain (split DNS).
+	 */
+	if (req->protocol == IPPROTO_UDP && req->upstreams &&
+			req->numresp >= req->numserv &&
+			(hdr->rcode == ns_r_servfail ||
+			hdr->rcode == ns_r_notimpl ||
+			hdr->rcode == ns_r_refused ||
+			((hdr->rcode == ns_r_nxdomain ||
+				(hdr->rcode == ns_r_noerror &&
+					hdr->ancount == 0)) &&
+				request_other_scope(req, data)))) {
+		err = upstream_send(req, req->request, req->name, 1);
+		if (err > 0)
+			return -EINVAL;
+
+		if (err == -EALREADY) {
+			request_remove(req);
+			destroy_request_data(req);
+			return 0;
+		}
+	}
+
 	if (req->numresp < req->numserv) {
 		if (hdr->rcode > ns_r_noerror) {
 			return -EINVAL;
@@ -2133,7 +3712,20 @@ out:
 		}
 	}
 
-	request_list = g_slist_remove(request_list, req);
+	request_remove(req);
+
+	/*
+	 * Only the reply which completes the request is a sample, late
+	 * replies of servers nobody waited for would skew the ranking.
+	 */
+	if (rtt >= 0)
+		server_update_rtt(data, rtt);
+
+	if (req->prefetch) {
+		DBG("prefetch id 0x%04x done", req->dstid);
+		destroy_request_data(req);
+		return 0;
+	}
 
 	if (protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
@@ -2141,7 +3733,7 @@ out:
 			errno = -EIO;
 			err = -EIO;
 		} else
-			err = sendto(sk, req->resp, req->resplen, 0,
+			err = udp_sendto(sk, req->resp, req->resplen,
 				&req->sa, req->sa_len);
 	} else {
 		sk = req->client_sk;
@@ -2180,18 +3772,50 @@ static void server_destroy_socket(struct server_data *data)
 		data->channel = NULL;
 	}
 
+	if (data->out_watch > 0) {
+		g_source_remove(data->out_watch);
+		data->out_watch = 0;
+	}
+
+	if (data->outgoing) {
+		g_byte_array_free(data->outgoing, TRUE);
+		data->outgoing = NULL;
+	}
+
 	g_free(data->incoming_reply);
 	data->incoming_reply = NULL;
 }
 
+/* Pending requests must not point to a server which goes away */
+static void server_forget_requests(struct server_data *server)
+{
+	GList *list;
+
+	for (list = request_queue.head; list; list = list->next) {
+		struct request_data *req = list->data;
+		struct upstream_attempt *attempt;
+
+		attempt = request_find_upstream(req, server);
+		if (!attempt)
+			continue;
+
+		if (attempt->sent && !attempt->answered && !attempt->lost)
+			req->numserv -= MIN(req->numserv, attempt->packets);
+
+		req->upstreams = g_slist_remove(req->upstreams, attempt);
+		g_free(attempt);
+	}
+}
+
 static void destroy_server(struct server_data *server)
 {
 	DBG("index %d server %s sock %d", server->index, server->server,
 			server->channel ?
 			g_io_channel_unix_get_fd(server->channel): -1);
 
-	server_list = g_slist_remove(server_list, server);
+	server_list_remove(server);
 	server_destroy_socket(server);
+	server_forget_requests(server);
 
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		DBG("Removing DNS server %s", server->server);
@@ -2215,12 +3839,23 @@ static void destroy_server(struct server_data *server)
 	g_free(server);
 }
 
+static void udp_server_reply(int sk, unsigned char *buf, int len,
+				struct sockaddr *sa, socklen_t sa_len,
+				gpointer user_data)
+{
+	struct server_data *data = user_data;
+
+	if (len < 12)
+		return;
+
+	forward_dns_reply(buf, len, IPPROTO_UDP, data);
+}
+
 static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 							gpointer user_data)
 {
-	unsigned char buf[4096];
-	int sk, err, len;
 	struct server_data *data = user_data;
+	int sk;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
 		connman_error("Error with UDP server %s", data->server);
@@ -2230,152 +3865,248 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 
 	sk = g_io_channel_unix_get_fd(channel);
 
-	len = recv(sk, buf, sizeof(buf), 0);
-	if (len < 12)
-		return TRUE;
-
-	err = forward_dns_reply(buf, len, IPPROTO_UDP, data);
-	if (err < 0)
-		return TRUE;
+	udp_recv_batch(sk, udp_server_reply, data);
 
 	return TRUE;
 }
 
-static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
-							gpointer user_data)
+static struct server_data *create_server(int index,
+					const char *domain, const char *server,
+					int protocol);
+
+/*
+ * Send a TCP request over a connected upstream connection. Several
+ * requests can be outstanding on one connection, the replies are
+ * matched to them by their id like the UDP ones.
+ */
+static int tcp_server_send(struct server_data *server,
+					struct request_data *req)
+{
+	struct upstream_attempt *attempt;
+	guint numserv = req->numserv;
+	int err;
+
+	if (request_find_upstream(req, server))
+		return -EALREADY;
+
+	err = ns_resolv(server, req, req->request, req->name);
+	if (err != 0)
+		return err;
+
+	attempt = g_new0(struct upstream_attempt, 1);
+	attempt->server = server;
+	attempt->sent = g_get_monotonic_time();
+	attempt->packets = req->numserv - numserv;
+	req->upstreams = g_slist_append(req->upstreams, attempt);
+
+	server->queries++;
+
+	return 0;
+}
+
+static bool tcp_server_outstanding(struct server_data *server)
+{
+	GList *list;
+
+	for (list = request_queue.head; list; list = list->next) {
+		struct upstream_attempt *attempt;
+
+		attempt = request_find_upstream(list->data, server);
+		if (attempt && attempt->sent && !attempt->answered &&
+							!attempt->lost)
+			return true;
+	}
+
+	return false;
+}
+
+static gboolean tcp_idle_timeout(gpointer user_data)
 {
-	int sk;
 	struct server_data *server = user_data;
 
-	sk = g_io_channel_unix_get_fd(channel);
-	if (sk == 0)
-		return FALSE;
+	DBG("server %s connected %d", server->server, server->connected);
 
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		GSList *list;
-hangup:
-		DBG("TCP server channel closed, sk %d", sk);
+	if (server->connected && tcp_server_outstanding(server))
+		return TRUE;
 
-		/*
-		 * Discard any partial response which is buffered; better
-		 * to get a proper response from a working server.
-		 */
-		g_free(server->incoming_reply);
-		server->incoming_reply = NULL;
+	server->timeout = 0;
+	destroy_server(server);
 
-		list = request_list;
-		while (list) {
-			struct request_data *req = list->data;
-			struct domain_hdr *hdr;
-			list = list->next;
+	return FALSE;
+}
 
-			if (req->protocol == IPPROTO_UDP)
-				continue;
+static void tcp_server_set_idle(struct server_data *server)
+{
+	if (server->timeout > 0)
+		g_source_remove(server->timeout);
 
-			if (!req->request)
-				continue;
+	server->timeout = g_timeout_add_seconds(TCP_IDLE_TIMEOUT,
+						tcp_idle_timeout, server);
+}
 
-			/*
-			 * If we're not waiting for any further response
-			 * from another name server, then we send an error
-			 * response to the client.
-			 */
-			if (req->numserv && --(req->numserv))
-				continue;
+/*
+ * The server may close an idle connection just when a query is sent
+ * over it. Such queries are sent once more over a new connection, the
+ * others waiting only for this server get an error reply.
+ */
+static void tcp_server_closed(struct server_data *server)
+{
+	bool reused = server->replies > 0, reconnect = false;
+	GList *list;
 
-			hdr = (void *) (req->request + 2);
-			hdr->id = req->srcid;
-			send_response(req->client_sk, req->request,
-				req->request_len, NULL, 0, IPPROTO_TCP);
+	list = request_queue.head;
+	while (list) {
+		struct request_data *req = list->data;
+		struct upstream_attempt *attempt;
+		struct domain_hdr *hdr;
 
-			request_list = g_slist_remove(request_list, req);
+		list = list->next;
+
+		if (req->protocol == IPPROTO_UDP || !req->request)
+			continue;
+
+		attempt = request_find_upstream(req, server);
+		if (!attempt && server->connected)
+			continue;
+
+		if (attempt) {
+			if (!attempt->answered && !attempt->lost)
+				req->numserv -= MIN(req->numserv,
+							attempt->packets);
+
+			req->upstreams = g_slist_remove(req->upstreams,
+								attempt);
+			g_free(attempt);
 		}
 
-		destroy_server(server);
+		if (req->numserv)
+			continue;
 
-		return FALSE;
+		if (reused && attempt && !req->tcp_resent) {
+			req->tcp_resent = true;
+			reconnect = true;
+			continue;
+		}
+
+		hdr = (void *) (req->request + 2);
+		hdr->id = req->srcid;
+		send_response(req->client_sk, req->request,
+			req->request_len, NULL, 0, IPPROTO_TCP);
+
+		request_remove(req);
+		destroy_request_data(req);
 	}
 
-	if ((condition & G_IO_OUT) && !server->connected) {
-		GSList *list;
-		GList *domains;
-		bool no_request_sent = true;
-		struct server_data *udp_server;
+	if (reconnect) {
+		int index = server->index;
+		char *address = g_strdup(server->server);
 
-		udp_server = find_server(server->index, server->server,
-								IPPROTO_UDP);
-		if (udp_server) {
-			for (domains = udp_server->domains; domains;
-						domains = domains->next) {
-				char *dom = domains->data;
+		destroy_server(server);
+		create_server(index, NULL, address, IPPROTO_TCP);
+		g_free(address);
+		return;
+	}
 
-				DBG("Adding domain %s to %s",
-						dom, server->server);
+	destroy_server(server);
+}
 
-				server->domains = g_list_append(server->domains,
-								g_strdup(dom));
-			}
-		}
+static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data);
+
+static void tcp_server_connected(struct server_data *server)
+{
+	struct server_data *udp_server;
+	GList *list, *domains;
+
+	udp_server = find_server(server->index, server->server,
+							IPPROTO_UDP);
+	if (udp_server) {
+		for (domains = udp_server->domains; domains;
+					domains = domains->next) {
+			char *dom = domains->data;
 
-		server->connected = true;
-		server_list = g_slist_append(server_list, server);
+			DBG("Adding domain %s to %s", dom, server->server);
 
-		if (server->timeout > 0) {
-			g_source_remove(server->timeout);
-			server->timeout = 0;
+			server->domains = g_list_append(server->domains,
+							g_strdup(dom));
 		}
+	}
 
-		for (list = request_list; list; ) {
-			struct request_data *req = list->data;
-			int status;
+	server->connected = true;
 
-			if (req->protocol == IPPROTO_UDP) {
-				list = list->next;
-				continue;
-			}
+	/* Queries the socket does not take are sent by tcp_server_writable() */
+	server->watch = g_io_add_watch(server->channel,
+			G_IO_IN | G_IO_HUP | G_IO_NVAL | G_IO_ERR,
+			tcp_server_event, server);
 
-			DBG("Sending req %s over TCP", (char *)req->name);
+	tcp_server_set_idle(server);
 
-			status = ns_resolv(server, req,
-						req->request, req->name);
-			if (status > 0) {
-				/*
-				 * A cached result was sent,
-				 * so the request can be released
-				 */
-				list = list->next;
-				request_list = g_slist_remove(request_list, req);
-				destroy_request_data(req);
-				continue;
-			}
+	for (list = request_queue.head; list; ) {
+		struct request_data *req = list->data;
+		int status;
 
-			if (status < 0) {
-				list = list->next;
-				continue;
-			}
+		list = list->next;
 
-			no_request_sent = false;
+		if (req->protocol == IPPROTO_UDP || !req->request)
+			continue;
 
-			if (req->timeout > 0)
-				g_source_remove(req->timeout);
+		DBG("Sending req %s over TCP", (char *)req->name);
 
-			req->timeout = g_timeout_add_seconds(30,
-						request_timeout, req);
-			list = list->next;
+		status = tcp_server_send(server, req);
+		if (status > 0) {
+			/*
+			 * A cached result was sent,
+			 * so the request can be released
+			 */
+			request_remove(req);
+			destroy_request_data(req);
+			continue;
 		}
 
-		if (no_request_sent) {
-			destroy_server(server);
-			return FALSE;
-		}
+		if (status < 0)
+			continue;
+
+		if (req->timeout > 0)
+			g_source_remove(req->timeout);
+
+		req->timeout = g_timeout_add_seconds(30,
+					request_timeout, req);
+	}
+}
+
+static gboolean tcp_server_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	int sk;
+	struct server_data *server = user_data;
+	struct partial_reply *reply;
+	int bytes_recv;
 
-	} else if (condition & G_IO_IN) {
-		struct partial_reply *reply = server->incoming_reply;
-		int bytes_recv;
+	sk = g_io_channel_unix_get_fd(channel);
+	if (sk == 0)
+		return FALSE;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP))
+		goto hangup;
+
+	if (!server->connected) {
+		if (!(condition & G_IO_OUT))
+			return TRUE;
+
+		tcp_server_connected(server);
+		return FALSE;
+	}
+
+	if (!(condition & G_IO_IN))
+		return TRUE;
+
+	/* Read all the replies which have arrived */
+	while (true) {
+		reply = server->incoming_reply;
 
 		if (!reply) {
 			unsigned char reply_len_buf[2];
-			uint16_t reply_len;
+			unsigned int reply_len;
 
 			bytes_recv = recv(sk, reply_len_buf, 2, MSG_PEEK);
 			if (!bytes_recv) {
@@ -2410,42 +4141,41 @@ hangup:
 					reply->len - reply->received, 0);
 			if (!bytes_recv) {
 				connman_error("DNS proxy TCP disconnect");
-				break;
+				goto hangup;
 			} else if (bytes_recv < 0) {
 				if (errno == EAGAIN || errno == EWOULDBLOCK)
 					return TRUE;
 
 				connman_error("DNS proxy error %s",
 						strerror(errno));
-				break;
+				goto hangup;
 			}
 			reply->received += bytes_recv;
 		}
 
-		forward_dns_reply(reply->buf, reply->received, IPPROTO_TCP,
-					server);
-
-		g_free(reply);
 		server->incoming_reply = NULL;
 
-		destroy_server(server);
-
-		return FALSE;
-	}
-
-	return TRUE;
-}
+		forward_dns_reply(reply->buf, reply->received, IPPROTO_TCP,
+					server);
 
-static gboolean tcp_idle_timeout(gpointer user_data)
-{
-	struct server_data *server = user_data;
+		g_free(reply);
 
-	DBG("");
+		tcp_server_set_idle(server);
+	}
 
-	if (!server)
-		return FALSE;
+hangup:
+	DBG("TCP server channel closed, sk %d", sk);
 
-	destroy_server(server);
+	/*
+	 * Discard any partial response which is buffered; better
+	 * to get a proper response from a working server.
+	 */
+	g_free(server->incoming_reply);
+	server->incoming_reply = NULL;
+
+	/* The watch is removed when returning */
+	server->watch = 0;
+	tcp_server_closed(server);
 
 	return FALSE;
 }
@@ -2637,18 +4367,151 @@ static struct server_data *create_server(int index,
 
 			enable_fallback(false);
 		}
-
-		server_list = g_slist_append(server_list, data);
 	}
 
+	/* TCP servers are pooled for all clients while connecting too */
+	server_list_append(data);
+
 	return data;
 }
 
-static bool resolv(struct request_data *req,
-				gpointer request, gpointer name)
+static gboolean request_failover(gpointer user_data);
+
+/*
+ * Send the request to the next count servers it was not sent to yet.
+ * Returns the number of servers the request was sent to, or -EALREADY
+ * if a cached answer was sent to the client instead.
+ */
+static int upstream_send(struct request_data *req, gpointer request,
+					gpointer name, unsigned int count)
+{
+	unsigned int rto = 0;
+	GSList *list;
+	int sent = 0;
+
+	for (list = req->upstreams; list && count; list = list->next) {
+		struct upstream_attempt *attempt = list->data;
+		struct server_data *server = attempt->server;
+		guint numserv = req->numserv;
+		int err;
+
+		if (attempt->sent || attempt->lost)
+			continue;
+
+		if (!server->channel && server_create_socket(server) < 0) {
+			DBG("socket creation failed while resolving");
+			attempt->lost = true;
+			continue;
+		}
+
+		err = ns_resolv(server, req, request, name);
+		if (err > 0)
+			return -EALREADY;
+
+		if (err < 0) {
+			attempt->lost = true;
+			continue;
+		}
+
+		DBG("server %s srtt %u loss %u", server->server,
+						server->srtt, server->loss);
+
+		attempt->sent = g_get_monotonic_time();
+		attempt->packets = req->numserv - numserv;
+		server->queries++;
+		rto = MAX(rto, server_rto(server));
+		count--;
+		sent++;
+	}
+
+	if (req->failover > 0) {
+		g_source_remove(req->failover);
+		req->failover = 0;
+	}
+
+	/* Some servers are left to fail over to */
+	if (sent && list)
+		req->failover = g_timeout_add(rto / 1000, request_failover,
+									req);
+
+	return sent;
+}
+
+static gboolean request_failover(gpointer user_data)
+{
+	struct request_data *req = user_data;
+
+	req->failover = 0;
+
+	DBG("id 0x%04x", req->srcid);
+
+	request_upstreams_lost(req);
+
+	if (upstream_send(req, req->request, req->name, 1) == -EALREADY) {
+		request_remove(req);
+		destroy_request_data(req);
+	}
+
+	return FALSE;
+}
+
+/*
+ * A query queued by udp_sendto() could not be sent. Like when
+ * ns_resolv() fails, the server is given up on and the request is
+ * failed over to the next server if no other one has it anymore.
+ */
+static void udp_query_failed(int sk, guint16 id)
 {
+	struct upstream_attempt *attempt = NULL;
+	struct request_data *req;
 	GSList *list;
 
+	req = find_request(id);
+	if (!req)
+		return;
+
+	for (list = req->upstreams; list; list = list->next) {
+		struct upstream_attempt *a = list->data;
+
+		if (a->server->channel &&
+			g_io_channel_unix_get_fd(a->server->channel) == sk) {
+			attempt = a;
+			break;
+		}
+	}
+
+	if (!attempt || !attempt->sent || attempt->answered)
+		return;
+
+	DBG("req %p server %s", req, attempt->server->server);
+
+	req->numserv -= MIN(req->numserv, 1);
+	if (attempt->packets)
+		attempt->packets--;
+
+	if (!attempt->lost) {
+		attempt->lost = true;
+		if (attempt->server->queries)
+			attempt->server->queries--;
+	}
+
+	if (req->numserv)
+		return;
+
+	if (req->failover > 0)
+		g_source_remove(req->failover);
+
+	request_failover(req);
+}
+
+/*
+ * Queue the enabled UDP servers in the request, best ranked first.
+ * upstream_send() then sends the query to them in that order.
+ */
+static void request_rank_upstreams(struct request_data *req)
+{
+	GSList *list, *ranked = NULL;
+
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
 
@@ -2662,15 +4525,39 @@ static bool resolv(struct request_data *req,
 		if (!data->enabled)
 			continue;
 
-		if (!data->channel && data->protocol == IPPROTO_UDP) {
-			if (server_create_socket(data) < 0) {
-				DBG("socket creation failed while resolving");
-				continue;
-			}
-		}
+		ranked = g_slist_prepend(ranked, data);
+	}
 
-		if (ns_resolv(data, req, request, name) > 0)
-			return true;
+	/* The sort is stable, equal servers stay in the configured order */
+	ranked = g_slist_sort(g_slist_reverse(ranked), server_rank_compare);
+
+	for (list = ranked; list; list = list->next) {
+		struct upstream_attempt *attempt;
+
+		attempt = g_new0(struct upstream_attempt, 1);
+		attempt->server = list->data;
+		req->upstreams = g_slist_prepend(req->upstreams, attempt);
+	}
+
+	req->upstreams = g_slist_reverse(req->upstreams);
+	g_slist_free(ranked);
+}
+
+static bool resolv(struct request_data *req,
+				gpointer request, gpointer name)
+{
+	request_rank_upstreams(req);
+
+	if (upstream_send(req, request, name, parallel_queries ?
+				parallel_queries : G_MAXUINT) == -EALREADY) {
+		request_upstreams_free(req);
+		return true;
+	}
+
+	/* The query could not be sent anywhere */
+	if (!req->numserv && cache_send_stale(req, request)) {
+		request_upstreams_free(req);
+		return true;
 	}
 
 	return false;
@@ -2730,21 +4617,52 @@ static void remove_domain(int index, const char *domain)
 
 static void flush_requests(struct server_data *server)
 {
-	GSList *list;
+	GList *list;
 
-	list = request_list;
+	list = request_queue.head;
 	while (list) {
 		struct request_data *req = list->data;
 
 		list = list->next;
 
+		/* prefetch queries are not resent, they just time out */
+		if (req->prefetch)
+			continue;
+
+		/* UDP requests go to the new server when they fail over */
+		if (req->protocol == IPPROTO_UDP && req->upstreams &&
+				server->protocol == IPPROTO_UDP) {
+			struct upstream_attempt *attempt;
+
+			attempt = g_new0(struct upstream_attempt, 1);
+			attempt->server = server;
+			req->upstreams = g_slist_append(req->upstreams,
+								attempt);
+
+			if (req->failover)
+				continue;
+
+			if (upstream_send(req, req->request, req->name,
+							1) == -EALREADY) {
+				request_remove(req);
+				destroy_request_data(req);
+				continue;
+			}
+
+			if (req->timeout > 0)
+				g_source_remove(req->timeout);
+
+			req->timeout = g_timeout_add_seconds(5,
+						request_timeout, req);
+			continue;
+		}
+
 		if (ns_resolv(server, req, req->request, req->name)) {
 			/*
 			 * A cached result was sent,
 			 * so the request can be released
 			 */
-			request_list =
-				g_slist_remove(request_list, req);
+			request_remove(req);
 			destroy_request_data(req);
 			continue;
 		}
@@ -2871,8 +4789,12 @@ static void dnsproxy_default_changed(struct connman_service *service)
 
 	DBG("service %p", service);
 
-	/* DNS has changed, invalidate the cache */
-	cache_invalidate();
+	/*
+	 * DNS has changed, invalidate the cache and bring back what was
+	 * cached earlier on the new network
+	 */
+	cache_partition_switch(service ?
+				__connman_service_get_ident(service) : NULL);
 
 	if (!service) {
 		/* When no services are active, then disable DNS proxying */
@@ -3026,8 +4948,7 @@ static bool read_tcp_data(struct tcp_partial_client_data *client,
 	int client_sk, err;
 	unsigned int msg_len;
 	GSList *list;
-	bool waiting_for_connect = false;
-	int qtype = 0;
+	bool waiting_for_server = false;
 	struct cache_entry *entry;
 
 	client_sk = g_io_channel_unix_get_fd(client->channel);
@@ -3073,12 +4994,12 @@ read_another:
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
 		send_response(client_sk, client->buf, msg_len + 2,
 			NULL, 0, IPPROTO_TCP);
-		return true;
+		goto out;
 	}
 
 	req = g_try_new0(struct request_data, 1);
 	if (!req)
-		return true;
+		goto out;
 
 	memcpy(&req->sa, client_addr, client_addr_len);
 	req->sa_len = client_addr_len;
@@ -3087,8 +5008,8 @@ read_another:
 	req->family = client->family;
 
 	req->srcid = client->buf[2] | (client->buf[3] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
+	req->dstid = get_request_id();
+	req->altid = get_request_id();
 	req->request_len = msg_len + 2;
 
 	client->buf[2] = req->dstid & 0xff;
@@ -3102,20 +5023,17 @@ read_another:
 	 * Check if the answer is found in the cache before
 	 * creating sockets to the server.
 	 */
-	entry = cache_check(client->buf, &qtype, IPPROTO_TCP);
+	entry = cache_check(client->buf, IPPROTO_TCP);
 	if (entry) {
 		int ttl_left = 0;
 		struct cache_data *data;
 
-		DBG("cache hit %s type %s", query, qtype == 1 ? "A" : "AAAA");
-		if (qtype == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		DBG("cache hit %s type %d", query, entry->key.type);
+		data = entry->data;
 
 		if (data) {
 			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+			cache_entry_hit(entry);
 
 			send_cached_response(client_sk, data->data,
 					data->data_len, NULL, 0, IPPROTO_TCP,
@@ -3127,33 +5045,6 @@ read_another:
 			DBG("data missing, ignoring cache for this query");
 	}
 
-	for (list = server_list; list; list = list->next) {
-		struct server_data *data = list->data;
-
-		if (data->protocol != IPPROTO_UDP || !data->enabled)
-			continue;
-
-		if (!create_server(data->index, NULL, data->server,
-					IPPROTO_TCP))
-			continue;
-
-		waiting_for_connect = true;
-	}
-
-	if (!waiting_for_connect) {
-		/* No server is waiting for connect */
-		send_response(client_sk, client->buf,
-			req->request_len, NULL, 0, IPPROTO_TCP);
-		g_free(req);
-		return true;
-	}
-
-	/*
-	 * The server is not connected yet.
-	 * Copy the relevant buffers.
-	 * The request will actually be sent once we're
-	 * properly connected over TCP to the nameserver.
-	 */
 	req->request = g_try_malloc0(req->request_len);
 	if (!req->request) {
 		send_response(client_sk, client->buf,
@@ -3173,9 +5064,59 @@ read_another:
 	}
 	memcpy(req->name, query, sizeof(query));
 
+	/*
+	 * Connected servers get the request right away. Otherwise it
+	 * is sent once we're properly connected over TCP to the
+	 * nameserver.
+	 */
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+		struct server_data *tcp_server;
+
+		if (data->protocol != IPPROTO_UDP || !data->enabled)
+			continue;
+
+		tcp_server = find_server(data->index, data->server,
+							IPPROTO_TCP);
+		if (tcp_server && tcp_server->connected) {
+			err = tcp_server_send(tcp_server, req);
+			if (err > 0) {
+				/* A cached result was sent */
+				destroy_request_data(req);
+				goto out;
+			}
+
+			if (err == 0) {
+				waiting_for_server = true;
+				continue;
+			}
+
+			/* The server has closed the connection */
+			tcp_server_closed(tcp_server);
+			tcp_server = find_server(data->index, data->server,
+							IPPROTO_TCP);
+		}
+
+		if (!tcp_server)
+			tcp_server = create_server(data->index, NULL,
+						data->server, IPPROTO_TCP);
+
+		if (tcp_server)
+			waiting_for_server = true;
+	}
+
+	if (!waiting_for_server) {
+		/* No server is going to answer */
+		if (!cache_send_stale(req, client->buf))
+			send_response(client_sk, client->buf,
+				req->request_len, NULL, 0, IPPROTO_TCP);
+		destroy_request_data(req);
+		goto out;
+	}
+
 	req->timeout = g_timeout_add_seconds(30, request_timeout, req);
 
-	request_list = g_slist_append(request_list, req);
+	request_add(req);
 
 out:
 	if (client->buf_end > (msg_len + 2)) {
@@ -3186,15 +5127,15 @@ out:
 			TCP_MAX_BUF_LEN - client->buf_end,
 			client->buf_end - (msg_len + 2));
 		memmove(client->buf, client->buf + msg_len + 2,
-			TCP_MAX_BUF_LEN - client->buf_end);
+			client->buf_end - (msg_len + 2));
 		client->buf_end = client->buf_end - (msg_len + 2);
 
 		/*
 		 * If we have a full message waiting, just read it
-		 * immediately.
+		 * immediately. Pipelining clients send several.
 		 */
 		msg_len = get_msg_len(client->buf);
-		if ((msg_len + 2) == client->buf_end) {
+		if ((msg_len + 2) <= client->buf_end) {
 			DBG("client %d reading another %d bytes", client_sk,
 								msg_len + 2);
 			goto read_another;
@@ -3210,7 +5151,8 @@ out:
 		 * remove the timeout handler here otherwise we might get
 		 * timeout while waiting the results from server.
 		 */
-		g_source_remove(client->timeout);
+		if (client->timeout > 0)
+			g_source_remove(client->timeout);
 		client->timeout = 0;
 	}
 
@@ -3422,9 +5364,10 @@ static bool tcp_listener_event(GIOChannel *channel, GIOCondition condition,
 
 	/*
 	 * The packet length bytes do not contain the total message length,
-	 * that is the reason to -2 below.
+	 * that is the reason to -2 below. More than one message can be
+	 * there already if the client pipelines its queries.
 	 */
-	if (msg_len != (unsigned int)(len - 2)) {
+	if (msg_len > (unsigned int)(len - 2)) {
 		DBG("client %d sent %d bytes but expecting %u pending %d",
 			client_sk, len, msg_len + 2, msg_len + 2 - len);
 
@@ -3453,64 +5396,48 @@ static gboolean tcp6_listener_event(GIOChannel *channel, GIOCondition condition,
 				&ifdata->tcp6_listener_watch);
 }
 
-static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
-				struct listener_data *ifdata, int family,
-				guint *listener_watch)
+static void udp_listener_query(int sk, unsigned char *buf, int len,
+				struct sockaddr *sa, socklen_t sa_len,
+				gpointer user_data)
 {
-	unsigned char buf[768];
+	struct listener_data *ifdata = user_data;
 	char query[512];
 	struct request_data *req;
-	struct sockaddr_in6 client_addr6;
-	socklen_t client_addr6_len = sizeof(client_addr6);
-	struct sockaddr_in client_addr4;
-	socklen_t client_addr4_len = sizeof(client_addr4);
-	void *client_addr;
-	socklen_t *client_addr_len;
-	int sk, err, len;
-
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		*listener_watch = 0;
-		return false;
-	}
+	int err;
 
-	sk = g_io_channel_unix_get_fd(channel);
+	if (len < 2)
+		return;
 
-	if (family == AF_INET) {
-		client_addr = &client_addr4;
-		client_addr_len = &client_addr4_len;
-	} else {
-		client_addr = &client_addr6;
-		client_addr_len = &client_addr6_len;
+	/*
+	 * Queries are rewritten in place and may get a search domain
+	 * appended, so keep the old receive buffer limit.
+	 */
+	if (len > UDP_MAX_QUERY_LEN) {
+		DBG("Dropping oversized query (%d bytes)", len);
+		return;
 	}
 
-	memset(client_addr, 0, *client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, client_addr, client_addr_len);
-	if (len < 2)
-		return true;
-
 	DBG("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
 	err = parse_request(buf, len, query, sizeof(query));
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
-		send_response(sk, buf, len, client_addr,
-				*client_addr_len, IPPROTO_UDP);
-		return true;
+		send_response(sk, buf, len, sa, sa_len, IPPROTO_UDP);
+		return;
 	}
 
 	req = g_try_new0(struct request_data, 1);
 	if (!req)
-		return true;
+		return;
 
-	memcpy(&req->sa, client_addr, *client_addr_len);
-	req->sa_len = *client_addr_len;
+	memcpy(&req->sa, sa, sa_len);
+	req->sa_len = sa_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
-	req->family = family;
+	req->family = sa->sa_family;
 
 	req->srcid = buf[0] | (buf[1] << 8);
-	req->dstid = get_id();
-	req->altid = get_id();
+	req->dstid = get_request_id();
+	req->altid = get_request_id();
 	req->request_len = len;
 
 	buf[0] = req->dstid & 0xff;
@@ -3523,14 +5450,37 @@ static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	if (resolv(req, buf, query)) {
 		/* a cached result was sent, so the request can be released */
 	        g_free(req);
-		return true;
+		return;
 	}
 
 	req->name = g_strdup(query);
 	req->request = g_malloc(len);
 	memcpy(req->request, buf, len);
 	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
-	request_list = g_slist_append(request_list, req);
+	request_add(req);
+}
+
+static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
+				struct listener_data *ifdata, int family,
+				guint *listener_watch)
+{
+	int sk, count;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		*listener_watch = 0;
+		return false;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	count = udp_recv_batch(sk, udp_listener_query, ifdata);
+	if (count > 0) {
+		dnsproxy_stats.udp_wakeups++;
+		dnsproxy_stats.udp_queries += count;
+		if ((unsigned int) count > dnsproxy_stats.udp_max_batch)
+			dnsproxy_stats.udp_max_batch = count;
+	}
 
 	return true;
 }
@@ -3790,7 +5740,7 @@ static int create_listener(struct listener_data *ifdata)
 static void destroy_listener(struct listener_data *ifdata)
 {
 	int index;
-	GSList *list;
+	GList *list;
 
 	index = connman_inet_ifindex("lo");
 	if (ifdata->index == index) {
@@ -3798,18 +5748,15 @@ static void destroy_listener(struct listener_data *ifdata)
 		__connman_resolvfile_remove(index, NULL, "::1");
 	}
 
-	for (list = request_list; list; list = list->next) {
+	while ((list = request_queue.head)) {
 		struct request_data *req = list->data;
 
 		DBG("Dropping request (id 0x%04x -> 0x%04x)",
 						req->srcid, req->dstid);
+		request_remove(req);
 		destroy_request_data(req);
-		list->data = NULL;
 	}
 
-	g_slist_free(request_list);
-	request_list = NULL;
-
 	destroy_tcp_listener(ifdata);
 	destroy_udp_listener(ifdata);
 }
@@ -3892,6 +5839,42 @@ static void free_partial_reqs(gpointer value)
 	g_free(data);
 }
 
+void __connman_dnsproxy_get_stats(struct connman_dnsproxy_stats *stats)
+{
+	*stats = dnsproxy_stats;
+
+	DBG("prefetch queries %u hits %u stale answers %u",
+		stats->prefetch_queries, stats->prefetch_hits,
+		stats->stale_answers);
+}
+
+void __connman_dnsproxy_foreach_server_stats(
+			connman_dnsproxy_server_stats_cb_t callback,
+			void *user_data)
+{
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *server = list->data;
+		struct connman_dnsproxy_server_stats stats;
+
+		if (server->protocol != IPPROTO_UDP)
+			continue;
+
+		stats.server = server->server;
+		stats.index = server->index;
+		stats.srtt = server->srtt;
+		stats.rttvar = server->rttvar;
+		stats.loss = server->loss;
+		stats.queries = server->queries;
+		stats.replies = server->replies;
+		stats.timeouts = server->timeouts;
+		stats.failures = server->failures;
+
+		callback(&stats, user_data);
+	}
+}
+
 int __connman_dnsproxy_init(void)
 {
 	int err, index;
@@ -3906,6 +5889,36 @@ int __connman_dnsproxy_init(void)
 							NULL,
 							free_partial_reqs);
 
+	cache_max_size = connman_setting_get_uint("DnsProxyCacheSize");
+	if (!cache_max_size)
+		cache_max_size = DEFAULT_CACHE_SIZE;
+
+	cache_max_bytes = (gsize) connman_setting_get_uint(
+					"DnsProxyCacheMemory") * 1024;
+
+	if (!connman_setting_get_bool("DnsProxyServeStale"))
+		cache_stale_time = 0;
+
+	cache_persistent = connman_setting_get_bool("DnsProxyPersistentCache");
+	cache_partitions = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, cache_snapshot_free);
+
+	udp_batch_size = connman_setting_get_uint("DnsProxyUdpBatch");
+	if (!udp_batch_size)
+		udp_batch_size = DEFAULT_UDP_BATCH;
+	else if (udp_batch_size > UDP_BATCH_MAX)
+		udp_batch_size = UDP_BATCH_MAX;
+
+	if (udp_batch_size > 1)
+		udp_batch_buf = g_try_malloc(udp_batch_size * UDP_MAX_BUF_LEN);
+
+	parallel_queries = connman_setting_get_uint("DnsProxyParallelQueries");
+
+	DBG("cache size %u memory %" G_GSIZE_FORMAT " stale %ld batch %u "
+			"parallel %u", cache_max_size, cache_max_bytes,
+			(long) cache_stale_time, udp_batch_size,
+			parallel_queries);
+
 	index = connman_inet_ifindex("lo");
 	err = __connman_dnsproxy_add_listener(index);
 	if (err < 0)
@@ -3921,6 +5934,7 @@ destroy:
 	__connman_dnsproxy_remove_listener(index);
 	g_hash_table_destroy(listener_table);
 	g_hash_table_destroy(partial_tcp_req_table);
+	cache_partitions_destroy();
 
 	return err;
 }
@@ -3934,11 +5948,17 @@ void __connman_dnsproxy_cleanup(void)
 		cache_timer = 0;
 	}
 
-	if (cache) {
-		g_hash_table_destroy(cache);
-		cache = NULL;
+	if (cache_persistent && cache_partition && cache) {
+		GByteArray *snapshot = cache_snapshot_create();
+
+		cache_snapshot_write(cache_partition, snapshot);
+		cache_snapshot_free(snapshot);
 	}
 
+	destroy_cache();
+
+	cache_partitions_destroy();
+
 	connman_notifier_unregister(&dnsproxy_notifier);
 
 	g_hash_table_foreach(listener_table, remove_listener, NULL);
@@ -3946,4 +5966,17 @@ void __connman_dnsproxy_cleanup(void)
 	g_hash_table_destroy(listener_table);
 
 	g_hash_table_destroy(partial_tcp_req_table);
+
+	if (request_table) {
+		g_hash_table_destroy(request_table);
+		request_table = NULL;
+	}
+
+	if (server_table) {
+		g_hash_table_destroy(server_table);
+		server_table = NULL;
+	}
+
+	g_free(udp_batch_buf);
+	udp_batch_buf = NULL;
 }
@@ -284,10 +284,6 @@ static int firewall_enable_rule(struct fw_rule *rule)
 	if (err < 0)
 		return err;
 
-	err = __connman_iptables_commit(rule->table);
-	if (err < 0)
-		return err;
-
 	rule->enabled = true;
 
 	return 0;
@@ -307,18 +303,60 @@ static int firewall_disable_rule(struct fw_rule *rule)
 		return err;
 	}
 
-	err = __connman_iptables_commit(rule->table);
-	if (err < 0) {
-		connman_error("Cannot remove previously installed "
-			"iptables rules: %s", strerror(-err));
-		return err;
-	}
-
 	rule->enabled = false;
 
 	return 0;
 }
 
+/*
+ * Rules are only added to or removed from the cached tables by
+ * firewall_enable_rule() and firewall_disable_rule(). Every table
+ * touched by a batch of rules is committed once afterwards. If the
+ * kernel refuses a table, iptables drops its cached copy and the
+ * kernel still has the old rules, so only the state of the rules of
+ * that batch is put back the way it was.
+ */
+static int firewall_commit_rules(GSList *rules, bool enabled)
+{
+	GSList *tables = NULL, *list, *iter;
+	struct fw_rule *rule;
+	const char *table;
+	int err = 0, e;
+
+	for (list = rules; list; list = list->next) {
+		rule = list->data;
+
+		if (!g_slist_find_custom(tables, rule->table,
+						(GCompareFunc) g_strcmp0))
+			tables = g_slist_prepend(tables, rule->table);
+	}
+
+	for (list = tables; list; list = list->next) {
+		table = list->data;
+
+		e = __connman_iptables_commit(table);
+		if (e == 0)
+			continue;
+
+		connman_error("Cannot commit iptables table %s: %s", table,
+				strerror(-e));
+		err = e;
+
+		for (iter = rules; iter; iter = iter->next) {
+			rule = iter->data;
+
+			if (g_strcmp0(rule->table, table))
+				continue;
+
+			rule->enabled = !enabled;
+		}
+	}
+
+	g_slist_free(tables);
+
+	return err;
+}
+
 int __connman_firewall_add_rule(struct firewall_context *ctx,
 				const char *table,
 				const char *chain,
@@ -372,8 +410,9 @@ int __connman_firewall_remove_rule(struct firewall_context *ctx, int id)
 int __connman_firewall_enable_rule(struct firewall_context *ctx, int id)
 {
 	struct fw_rule *rule;
+	GSList *enabled = NULL;
 	GList *list;
-	int err = -ENOENT;
+	int err = -ENOENT, e;
 
 	for (list = g_list_first(ctx->rules); list; list = g_list_next(list)) {
 		rule = list->data;
@@ -383,17 +422,27 @@ int __connman_firewall_enable_rule(struct firewall_context *ctx, int id)
 			if (err < 0)
 				break;
 
+			enabled = g_slist_prepend(enabled, rule);
+
 			if (id != FW_ALL_RULES)
 				break;
 		}
 	}
 
+	/* Rules enabled before a failure still get installed */
+	e = firewall_commit_rules(enabled, true);
+	if (e < 0 && err == 0)
+		err = e;
+
+	g_slist_free(enabled);
+
 	return err;
 }
 
 int __connman_firewall_disable_rule(struct firewall_context *ctx, int id)
 {
 	struct fw_rule *rule;
+	GSList *disabled = NULL;
 	GList *list;
 	int e;
 	int err = -ENOENT;
@@ -411,11 +460,20 @@ int __connman_firewall_disable_rule(struct firewall_context *ctx, int id)
 			else if (e < 0)
 				err = e;
 
+			if (e == 0)
+				disabled = g_slist_prepend(disabled, rule);
+
 			if (id != FW_ALL_RULES)
 				break;
 		}
 	}
 
+	e = firewall_commit_rules(disabled, false);
+	if (e < 0)
+		err = e;
+
+	g_slist_free(disabled);
+
 	return err;
 }
 
@@ -75,6 +75,374 @@ int __connman_inet_rtnl_addattr_l(struct nlmsghdr *n, size_t max_length,
 	return 0;
 }
 
+/* Requests whose ACK does not arrive in time fail with -ETIMEDOUT */
+#define INET_RTNL_TIMEOUT_SEC	1
+#define INET_RTNL_PENDING	1
+
+struct __connman_inet_rtnl_batch {
+	GByteArray *buf;
+	GArray *results;
+};
+
+static int inet_rtnl_fd = -1;
+static __u32 inet_rtnl_seq;
+static int inet_ioctl_sk = -1;
+static GHashTable *ifname_table = NULL;
+static GHashTable *ifindex_table = NULL;
+
+/*
+ * The netlink socket used to change addresses, routes and rules stays
+ * open for the lifetime of the daemon.
+ */
+static int inet_rtnl_socket(void)
+{
+	struct sockaddr_nl addr;
+	struct timeval timeout = { INET_RTNL_TIMEOUT_SEC, 0 };
+	int fd, one = 1;
+
+	if (inet_rtnl_fd >= 0)
+		return inet_rtnl_fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		int err = -errno;
+
+		close(fd);
+		return err;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+#ifdef NETLINK_CAP_ACK
+	/* Errors do not need to carry the whole request back */
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+#endif
+
+	inet_rtnl_fd = fd;
+	inet_rtnl_seq = time(NULL);
+
+	DBG("fd %d", fd);
+
+	return fd;
+}
+
+static int inet_ioctl_socket(void)
+{
+	if (inet_ioctl_sk < 0)
+		inet_ioctl_sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+	return inet_ioctl_sk;
+}
+
+/* The object is already in the state the request asked for */
+static bool inet_rtnl_error_benign(uint16_t type, int err)
+{
+	switch (type) {
+	case RTM_NEWADDR:
+	case RTM_NEWROUTE:
+	case RTM_NEWRULE:
+		return err == -EEXIST;
+	case RTM_DELADDR:
+		return err == -EADDRNOTAVAIL;
+	case RTM_DELROUTE:
+		return err == -ESRCH;
+	case RTM_DELRULE:
+		return err == -ENOENT;
+	}
+
+	return false;
+}
+
+struct __connman_inet_rtnl_batch *__connman_inet_rtnl_batch_new(void)
+{
+	struct __connman_inet_rtnl_batch *batch;
+
+	batch = g_new0(struct __connman_inet_rtnl_batch, 1);
+	batch->buf = g_byte_array_new();
+	batch->results = g_array_new(FALSE, FALSE, sizeof(int));
+
+	return batch;
+}
+
+void __connman_inet_rtnl_batch_free(struct __connman_inet_rtnl_batch *batch)
+{
+	if (!batch)
+		return;
+
+	g_byte_array_free(batch->buf, TRUE);
+	g_array_free(batch->results, TRUE);
+	g_free(batch);
+}
+
+/* Queues a copy of the request and returns its position in the batch */
+int __connman_inet_rtnl_batch_add(struct __connman_inet_rtnl_batch *batch,
+						const struct nlmsghdr *n)
+{
+	static const uint8_t padding[NLMSG_ALIGNTO];
+	struct nlmsghdr *hdr;
+	int pending = INET_RTNL_PENDING;
+	guint offset;
+
+	if (!batch || !n || n->nlmsg_len < sizeof(*n))
+		return -EINVAL;
+
+	offset = batch->buf->len;
+
+	g_byte_array_append(batch->buf, (const guint8 *) n, n->nlmsg_len);
+	g_byte_array_append(batch->buf, padding,
+				NLMSG_ALIGN(n->nlmsg_len) - n->nlmsg_len);
+
+	hdr = (struct nlmsghdr *) (batch->buf->data + offset);
+	hdr->nlmsg_flags |= NLM_F_REQUEST | NLM_F_ACK;
+
+	g_array_append_val(batch->results, pending);
+
+	return batch->results->len - 1;
+}
+
+static void inet_rtnl_batch_ack(struct __connman_inet_rtnl_batch *batch,
+				__u32 first_seq, void *buf, size_t len,
+				unsigned int *pending)
+{
+	struct nlmsghdr *hdr;
+	struct nlmsgerr *err;
+	__u32 op;
+
+	for (hdr = buf; NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+		if (hdr->nlmsg_type != NLMSG_ERROR)
+			continue;
+
+		/* Left over from an earlier batch that timed out */
+		op = hdr->nlmsg_seq - first_seq;
+		if (op >= batch->results->len)
+			continue;
+
+		if (g_array_index(batch->results, int, op) !=
+							INET_RTNL_PENDING)
+			continue;
+
+		err = NLMSG_DATA(hdr);
+		g_array_index(batch->results, int, op) = err->error;
+		(*pending)--;
+	}
+}
+
+/*
+ * Sends every queued request with a single sendto() and waits for the
+ * ACK of each one. Returns the first error that is not only telling
+ * the object already is in the requested state.
+ */
+int __connman_inet_rtnl_batch_commit(struct __connman_inet_rtnl_batch *batch)
+{
+	struct sockaddr_nl nladdr;
+	unsigned char buf[4096];
+	struct nlmsghdr *hdr;
+	unsigned int pending;
+	__u32 first_seq;
+	size_t offset;
+	ssize_t len;
+	guint i;
+	int fd, err = 0;
+
+	if (!batch)
+		return -EINVAL;
+
+	pending = batch->results->len;
+	if (pending == 0)
+		return 0;
+
+	fd = inet_rtnl_socket();
+	if (fd < 0)
+		return fd;
+
+	first_seq = inet_rtnl_seq + 1;
+
+	for (offset = 0; offset < batch->buf->len;
+				offset += NLMSG_ALIGN(hdr->nlmsg_len)) {
+		hdr = (struct nlmsghdr *) (batch->buf->data + offset);
+		hdr->nlmsg_seq = ++inet_rtnl_seq;
+	}
+
+	memset(&nladdr, 0, sizeof(nladdr));
+	nladdr.nl_family = AF_NETLINK;
+
+	DBG("requests %u len %u", pending, batch->buf->len);
+
+	if (sendto(fd, batch->buf->data, batch->buf->len, 0,
+			(struct sockaddr *) &nladdr, sizeof(nladdr)) < 0) {
+		err = -errno;
+		connman_error("Can not talk to rtnetlink err %d %s",
+							err, strerror(-err));
+		goto done;
+	}
+
+	while (pending > 0) {
+		len = recv(fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			err = errno == EAGAIN ? -ETIMEDOUT : -errno;
+			break;
+		}
+
+		inet_rtnl_batch_ack(batch, first_seq, buf, len, &pending);
+	}
+
+done:
+	offset = 0;
+
+	for (i = 0; i < batch->results->len; i++) {
+		int *result = &g_array_index(batch->results, int, i);
+
+		hdr = (struct nlmsghdr *) (batch->buf->data + offset);
+		offset += NLMSG_ALIGN(hdr->nlmsg_len);
+
+		if (*result == INET_RTNL_PENDING)
+			*result = err < 0 ? err : -EIO;
+
+		if (*result == 0 ||
+				inet_rtnl_error_benign(hdr->nlmsg_type,
+								*result))
+			continue;
+
+		DBG("request %u type %d: %s", i, hdr->nlmsg_type,
+						strerror(-*result));
+
+		if (err == 0)
+			err = *result;
+	}
+
+	return err;
+}
+
+int __connman_inet_rtnl_batch_result(struct __connman_inet_rtnl_batch *batch,
+								int op)
+{
+	if (!batch || op < 0 || (guint) op >= batch->results->len)
+		return -EINVAL;
+
+	return g_array_index(batch->results, int, op);
+}
+
+/*
+ * Queues the request when a batch is given and returns its position in
+ * the batch, otherwise sends it right away and waits for the kernel to
+ * answer.
+ */
+static int inet_rtnl_submit(struct __connman_inet_rtnl_batch *batch,
+						const struct nlmsghdr *n)
+{
+	struct __connman_inet_rtnl_batch *single;
+	int err;
+
+	if (batch)
+		return __connman_inet_rtnl_batch_add(batch, n);
+
+	single = __connman_inet_rtnl_batch_new();
+
+	err = __connman_inet_rtnl_batch_add(single, n);
+	if (err >= 0)
+		err = __connman_inet_rtnl_batch_commit(single);
+
+	__connman_inet_rtnl_batch_free(single);
+
+	return err;
+}
+
+/*
+ * Interface names are kept up to date from the RTM_NEWLINK and
+ * RTM_DELLINK events, so looking them up needs no ioctl.
+ */
+void __connman_inet_ifname_cache_set(int index, const char *name)
+{
+	const char *old;
+
+	if (index < 0 || !name)
+		return;
+
+	if (!ifname_table) {
+		ifname_table = g_hash_table_new_full(g_direct_hash,
+						g_direct_equal, NULL, g_free);
+		ifindex_table = g_hash_table_new_full(g_str_hash,
+						g_str_equal, g_free, NULL);
+	}
+
+	old = g_hash_table_lookup(ifname_table, GINT_TO_POINTER(index));
+	if (old) {
+		if (g_str_equal(old, name))
+			return;
+
+		g_hash_table_remove(ifindex_table, old);
+	}
+
+	g_hash_table_replace(ifname_table, GINT_TO_POINTER(index),
+							g_strdup(name));
+	g_hash_table_replace(ifindex_table, g_strdup(name),
+							GINT_TO_POINTER(index));
+}
+
+void __connman_inet_ifname_cache_remove(int index)
+{
+	const char *name;
+
+	if (!ifname_table)
+		return;
+
+	name = g_hash_table_lookup(ifname_table, GINT_TO_POINTER(index));
+	if (!name)
+		return;
+
+	if (GPOINTER_TO_INT(g_hash_table_lookup(ifindex_table, name)) ==
+									index)
+		g_hash_table_remove(ifindex_table, name);
+
+	g_hash_table_remove(ifname_table, GINT_TO_POINTER(index));
+}
+
+void __connman_inet_ifname_cache_flush(void)
+{
+	if (!ifname_table)
+		return;
+
+	g_hash_table_remove_all(ifindex_table);
+	g_hash_table_remove_all(ifname_table);
+}
+
+static const char *cached_ifname(int index)
+{
+	if (!ifname_table)
+		return NULL;
+
+	return g_hash_table_lookup(ifname_table, GINT_TO_POINTER(index));
+}
+
+void __connman_inet_cleanup(void)
+{
+	if (inet_rtnl_fd >= 0) {
+		close(inet_rtnl_fd);
+		inet_rtnl_fd = -1;
+	}
+
+	if (inet_ioctl_sk >= 0) {
+		close(inet_ioctl_sk);
+		inet_ioctl_sk = -1;
+	}
+
+	if (ifname_table) {
+		g_hash_table_destroy(ifindex_table);
+		g_hash_table_destroy(ifname_table);
+		ifindex_table = NULL;
+		ifname_table = NULL;
+	}
+}
+
 int __connman_inet_modify_address(int cmd, int flags,
 				int index, int family,
 				const char *address,
@@ -88,11 +456,10 @@ int __connman_inet_modify_address(int cmd, int flags,
 			RTA_LENGTH(sizeof(struct in6_addr))];
 
 	struct nlmsghdr *header;
-	struct sockaddr_nl nl_addr;
 	struct ifaddrmsg *ifaddrmsg;
 	struct in6_addr ipv6_addr;
 	struct in_addr ipv4_addr, ipv4_dest, ipv4_bcast;
-	int sk, err;
+	int err;
 
 	DBG("cmd %#x flags %#x index %d family %d address %s peer %s "
 		"prefixlen %hhu broadcast %s", cmd, flags, index, family,
@@ -171,50 +538,52 @@ int __connman_inet_modify_address(int cmd, int flags,
 			return err;
 	}
 
-	sk = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
-	if (sk < 0)
-		return -errno;
-
-	memset(&nl_addr, 0, sizeof(nl_addr));
-	nl_addr.nl_family = AF_NETLINK;
-
-	if ((err = sendto(sk, request, header->nlmsg_len, 0,
-			(struct sockaddr *) &nl_addr, sizeof(nl_addr))) < 0)
-		goto done;
-
-	err = 0;
-
-done:
-	close(sk);
-
-	return err;
+	return inet_rtnl_submit(NULL, header);
 }
 
 int connman_inet_ifindex(const char *name)
 {
 	struct ifreq ifr;
-	int sk, err;
+	gpointer index;
+	int sk;
 
 	if (!name)
 		return -1;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (ifindex_table && g_hash_table_lookup_extended(ifindex_table,
+							name, NULL, &index))
+		return GPOINTER_TO_INT(index);
+
+	sk = inet_ioctl_socket();
 	if (sk < 0)
 		return -1;
 
 	memset(&ifr, 0, sizeof(ifr));
 	strncpy(ifr.ifr_name, name, sizeof(ifr.ifr_name) - 1);
 
-	err = ioctl(sk, SIOCGIFINDEX, &ifr);
-
-	close(sk);
-
-	if (err < 0)
+	if (ioctl(sk, SIOCGIFINDEX, &ifr) < 0)
 		return -1;
 
 	return ifr.ifr_ifindex;
 }
 
+/* Fills in the interface name of ifr->ifr_ifindex */
+static int inet_ifreq_name(int sk, struct ifreq *ifr)
+{
+	const char *name;
+
+	name = cached_ifname(ifr->ifr_ifindex);
+	if (name) {
+		strncpy(ifr->ifr_name, name, sizeof(ifr->ifr_name) - 1);
+		return 0;
+	}
+
+	if (ioctl(sk, SIOCGIFNAME, ifr) < 0)
+		return -errno;
+
+	return 0;
+}
+
 char *connman_inet_ifname(int index)
 {
 	struct ifreq ifr;
@@ -223,19 +592,14 @@ char *connman_inet_ifname(int index)
 	if (index < 0)
 		return NULL;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_ioctl_socket();
 	if (sk < 0)
 		return NULL;
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_ifindex = index;
 
-	err = ioctl(sk, SIOCGIFNAME, &ifr);
-	if (err < 0)
-		err = -errno;
-
-	close(sk);
-
+	err = inet_ifreq_name(sk, &ifr);
 	if (err < 0) {
 		DBG("%d: %s", index, strerror(-err));
 		return NULL;
@@ -249,41 +613,29 @@ int connman_inet_ifup(int index)
 	struct ifreq ifr;
 	int sk, err;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_ioctl_socket();
 	if (sk < 0)
 		return -errno;
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_ifindex = index;
 
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	err = inet_ifreq_name(sk, &ifr);
+	if (err < 0)
+		return err;
 
-	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0)
+		return -errno;
 
-	if (ifr.ifr_flags & IFF_UP) {
-		err = -EALREADY;
-		goto done;
-	}
+	if (ifr.ifr_flags & IFF_UP)
+		return -EALREADY;
 
 	ifr.ifr_flags |= (IFF_UP|IFF_DYNAMIC);
 
-	if (ioctl(sk, SIOCSIFFLAGS, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
-
-	err = 0;
-
-done:
-	close(sk);
+	if (ioctl(sk, SIOCSIFFLAGS, &ifr) < 0)
+		return -errno;
 
-	return err;
+	return 0;
 }
 
 int connman_inet_ifdown(int index)
@@ -292,22 +644,19 @@ int connman_inet_ifdown(int index)
 	struct sockaddr_in *addr;
 	int sk, err;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	sk = inet_ioctl_socket();
 	if (sk < 0)
 		return -errno;
 
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_ifindex = index;
 
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	err = inet_ifreq_name(sk, &ifr);
+	if (err < 0)
+		return err;
 
-	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0) {
-		err = -errno;
-		goto done;
-	}
+	if (ioctl(sk, SIOCGIFFLAGS, &ifr) < 0)
+		return -errno;
 
 	memset(&addr_ifr, 0, sizeof(addr_ifr));
 	memcpy(&addr_ifr.ifr_name, &ifr.ifr_name, sizeof(ifr.ifr_name) - 1);
@@ -316,22 +665,15 @@ int connman_inet_ifdown(int index)
 	if (ioctl(sk, SIOCSIFADDR, &addr_ifr) < 0)
 		connman_warn("Could not clear IPv4 address index %d", index);
 
-	if (!(ifr.ifr_flags & IFF_UP)) {
-		err = -EALREADY;
-		goto done;
-	}
+	if (!(ifr.ifr_flags & IFF_UP))
+		return -EALREADY;
 
 	ifr.ifr_flags = (ifr.ifr_flags & ~IFF_UP) | IFF_DYNAMIC;
 
 	if (ioctl(sk, SIOCSIFFLAGS, &ifr) < 0)
-		err = -errno;
-	else
-		err = 0;
-
-done:
-	close(sk);
+		return -errno;
 
-	return err;
+	return 0;
 }
 
 struct in6_ifreq {
@@ -451,72 +793,67 @@ int connman_inet_del_host_route(int index, const char *host)
 	return connman_inet_del_network_route(index, host);
 }
 
-int connman_inet_add_network_route(int index, const char *host,
-					const char *gateway,
-					const char *netmask)
+static int inet_route_modify(struct __connman_inet_rtnl_batch *batch,
+				int cmd, int index, const char *host,
+				const char *gateway, const char *netmask)
 {
-	struct ifreq ifr;
-	struct rtentry rt;
-	struct sockaddr_in addr;
-	int sk, err = 0;
+	struct __connman_inet_rtnl_handle rth;
+	struct in_addr addr;
 
-	DBG("index %d host %s gateway %s netmask %s", index,
-		host, gateway, netmask);
+	if (!host || inet_pton(AF_INET, host, &addr) != 1)
+		return -EINVAL;
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-	if (sk < 0) {
-		err = -errno;
-		goto out;
-	}
+	memset(&rth, 0, sizeof(rth));
 
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
+	rth.req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	rth.req.n.nlmsg_flags = NLM_F_REQUEST;
+	rth.req.n.nlmsg_type = cmd;
+	rth.req.u.r.rt.rtm_family = AF_INET;
+	rth.req.u.r.rt.rtm_table = RT_TABLE_MAIN;
+	rth.req.u.r.rt.rtm_dst_len = 32;
 
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
-		goto out;
+	if (netmask)
+		rth.req.u.r.rt.rtm_dst_len =
+			connman_ipaddress_calc_netmask_len(netmask);
+
+	if (cmd == RTM_NEWROUTE) {
+		rth.req.n.nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+		rth.req.u.r.rt.rtm_protocol = RTPROT_BOOT;
+		rth.req.u.r.rt.rtm_type = RTN_UNICAST;
+		rth.req.u.r.rt.rtm_scope = gateway ? RT_SCOPE_UNIVERSE :
+							RT_SCOPE_LINK;
+	} else {
+		rth.req.u.r.rt.rtm_scope = RT_SCOPE_NOWHERE;
 	}
 
-	DBG("ifname %s", ifr.ifr_name);
+	__connman_inet_rtnl_addattr_l(&rth.req.n, sizeof(rth.req), RTA_DST,
+							&addr, sizeof(addr));
 
-	memset(&rt, 0, sizeof(rt));
-	rt.rt_flags = RTF_UP;
-	if (gateway)
-		rt.rt_flags |= RTF_GATEWAY;
-	if (!netmask)
-		rt.rt_flags |= RTF_HOST;
+	if (gateway) {
+		if (inet_pton(AF_INET, gateway, &addr) != 1)
+			return -EINVAL;
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(host);
-	memcpy(&rt.rt_dst, &addr, sizeof(rt.rt_dst));
-
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	if (gateway)
-		addr.sin_addr.s_addr = inet_addr(gateway);
-	else
-		addr.sin_addr.s_addr = INADDR_ANY;
-	memcpy(&rt.rt_gateway, &addr, sizeof(rt.rt_gateway));
+		__connman_inet_rtnl_addattr_l(&rth.req.n, sizeof(rth.req),
+					RTA_GATEWAY, &addr, sizeof(addr));
+	}
 
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = INADDR_ANY;
-	if (netmask)
-		addr.sin_addr.s_addr = inet_addr(netmask);
-	else
-		addr.sin_addr.s_addr = INADDR_ANY;
-	memcpy(&rt.rt_genmask, &addr, sizeof(rt.rt_genmask));
+	__connman_inet_rtnl_addattr32(&rth.req.n, sizeof(rth.req),
+							RTA_OIF, index);
 
-	rt.rt_dev = ifr.ifr_name;
+	return inet_rtnl_submit(batch, &rth.req.n);
+}
 
-	if (ioctl(sk, SIOCADDRT, &rt) < 0 && errno != EEXIST)
-		err = -errno;
+int connman_inet_add_network_route(int index, const char *host,
+					const char *gateway,
+					const char *netmask)
+{
+	int err;
 
-	close(sk);
+	DBG("index %d host %s gateway %s netmask %s", index,
+		host, gateway, netmask);
 
-out:
+	err = inet_route_modify(NULL, RTM_NEWROUTE, index, host, gateway,
+								netmask);
 	if (err < 0)
 		connman_error("Adding host route failed (%s)",
 							strerror(-err));
@@ -526,46 +863,11 @@ out:
 
 int connman_inet_del_network_route(int index, const char *host)
 {
-	struct ifreq ifr;
-	struct rtentry rt;
-	struct sockaddr_in addr;
-	int sk, err = 0;
+	int err;
 
 	DBG("index %d host %s", index, host);
 
-	sk = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
-	if (sk < 0) {
-		err = -errno;
-		goto out;
-	}
-
-	memset(&ifr, 0, sizeof(ifr));
-	ifr.ifr_ifindex = index;
-
-	if (ioctl(sk, SIOCGIFNAME, &ifr) < 0) {
-		err = -errno;
-		close(sk);
-		goto out;
-	}
-
-	DBG("ifname %s", ifr.ifr_name);
-
-	memset(&rt, 0, sizeof(rt));
-	rt.rt_flags = RTF_UP | RTF_HOST;
-
-	memset(&addr, 0, sizeof(addr));
-	addr.sin_family = AF_INET;
-	addr.sin_addr.s_addr = inet_addr(host);
-	memcpy(&rt.rt_dst, &addr, sizeof(rt.rt_dst));
-
-	rt.rt_dev = ifr.ifr_name;
-
-	if (ioctl(sk, SIOCDELRT, &rt) < 0 && errno != ESRCH)
-		err = -errno;
-
-	close(sk);
-
-out:
+	err = inet_route_modify(NULL, RTM_DELROUTE, index, host, NULL, NULL);
 	if (err < 0)
 		connman_error("Deleting host route failed (%s)",
 							strerror(-err));
@@ -573,6 +875,27 @@ out:
 	return err;
 }
 
+int __connman_inet_batch_add_host_route(struct __connman_inet_rtnl_batch *batch,
+				int index, const char *host,
+				const char *gateway)
+{
+	if (!batch)
+		return -EINVAL;
+
+	return inet_route_modify(batch, RTM_NEWROUTE, index, host, gateway,
+									NULL);
+}
+
+int __connman_inet_batch_del_host_route(struct __connman_inet_rtnl_batch *batch,
+				int index, const char *host)
+{
+	if (!batch)
+		return -EINVAL;
+
+	return inet_route_modify(batch, RTM_DELROUTE, index, host, NULL,
+									NULL);
+}
+
 int connman_inet_del_ipv6_network_route(int index, const char *host,
 						unsigned char prefix_len)
 {
@@ -2736,11 +3059,11 @@ out:
 	return err;
 }
 
-static int iprule_modify(int cmd, int family, uint32_t table_id,
+static int iprule_modify(struct __connman_inet_rtnl_batch *batch,
+			int cmd, int family, uint32_t table_id,
 			uint32_t fwmark)
 {
 	struct __connman_inet_rtnl_handle rth;
-	int ret;
 
 	memset(&rth, 0, sizeof(rth));
 
@@ -2773,31 +3096,41 @@ static int iprule_modify(int cmd, int family, uint32_t table_id,
 	if (rth.req.u.r.rt.rtm_family == AF_UNSPEC)
 		rth.req.u.r.rt.rtm_family = AF_INET;
 
-	ret = __connman_inet_rtnl_open(&rth);
-	if (ret < 0)
-		goto done;
-
-	ret = __connman_inet_rtnl_send(&rth, &rth.req.n);
-
-done:
-	__connman_inet_rtnl_close(&rth);
-
-	return ret;
+	return inet_rtnl_submit(batch, &rth.req.n);
 }
 
 int __connman_inet_add_fwmark_rule(uint32_t table_id, int family, uint32_t fwmark)
 {
 	/* ip rule add fwmark 9876 table 1234 */
 
-	return iprule_modify(RTM_NEWRULE, family, table_id, fwmark);
+	return iprule_modify(NULL, RTM_NEWRULE, family, table_id, fwmark);
 }
 
 int __connman_inet_del_fwmark_rule(uint32_t table_id, int family, uint32_t fwmark)
 {
-	return iprule_modify(RTM_DELRULE, family, table_id, fwmark);
+	return iprule_modify(NULL, RTM_DELRULE, family, table_id, fwmark);
+}
+
+int __connman_inet_batch_add_fwmark_rule(struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int family, uint32_t fwmark)
+{
+	if (!batch)
+		return -EINVAL;
+
+	return iprule_modify(batch, RTM_NEWRULE, family, table_id, fwmark);
+}
+
+int __connman_inet_batch_del_fwmark_rule(struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int family, uint32_t fwmark)
+{
+	if (!batch)
+		return -EINVAL;
+
+	return iprule_modify(batch, RTM_DELRULE, family, table_id, fwmark);
 }
 
-static int iproute_default_modify(int cmd, uint32_t table_id, int ifindex,
+static int iproute_default_modify(struct __connman_inet_rtnl_batch *batch,
+			int cmd, uint32_t table_id, int ifindex,
 			const char *gateway)
 {
 	struct __connman_inet_rtnl_handle rth;
@@ -2845,16 +3178,7 @@ static int iproute_default_modify(int cmd, uint32_t table_id, int ifindex,
 	__connman_inet_rtnl_addattr32(&rth.req.n, sizeof(rth.req),
 							RTA_OIF, ifindex);
 
-	ret = __connman_inet_rtnl_open(&rth);
-	if (ret < 0)
-		goto done;
-
-	ret = __connman_inet_rtnl_send(&rth, &rth.req.n);
-
-done:
-	__connman_inet_rtnl_close(&rth);
-
-	return ret;
+	return inet_rtnl_submit(batch, &rth.req.n);
 }
 
 int __connman_inet_add_default_to_table(uint32_t table_id, int ifindex,
@@ -2862,7 +3186,8 @@ int __connman_inet_add_default_to_table(uint32_t table_id, int ifindex,
 {
 	/* ip route add default via 1.2.3.4 dev wlan0 table 1234 */
 
-	return iproute_default_modify(RTM_NEWROUTE, table_id, ifindex, gateway);
+	return iproute_default_modify(NULL, RTM_NEWROUTE, table_id, ifindex,
+								gateway);
 }
 
 int __connman_inet_del_default_from_table(uint32_t table_id, int ifindex,
@@ -2870,7 +3195,32 @@ int __connman_inet_del_default_from_table(uint32_t table_id, int ifindex,
 {
 	/* ip route del default via 1.2.3.4 dev wlan0 table 1234 */
 
-	return iproute_default_modify(RTM_DELROUTE, table_id, ifindex, gateway);
+	return iproute_default_modify(NULL, RTM_DELROUTE, table_id, ifindex,
+								gateway);
+}
+
+int __connman_inet_batch_add_default_to_table(
+				struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int ifindex,
+				const char *gateway)
+{
+	if (!batch)
+		return -EINVAL;
+
+	return iproute_default_modify(batch, RTM_NEWROUTE, table_id, ifindex,
+								gateway);
+}
+
+int __connman_inet_batch_del_default_from_table(
+				struct __connman_inet_rtnl_batch *batch,
+				uint32_t table_id, int ifindex,
+				const char *gateway)
+{
+	if (!batch)
+		return -EINVAL;
+
+	return iproute_default_modify(batch, RTM_DELROUTE, table_id, ifindex,
+								gateway);
 }
 
 int __connman_inet_get_interface_ll_address(int index, int family,
@@ -57,14 +57,183 @@ struct connman_ippool {
 	void *user_data;
 };
 
-GSList *allocated_blocks;
+/*
+ * Every /24 block of the private IP ranges has one bit in the block
+ * bitmap. The bits are in the order the blocks are handed out:
+ *
+ * 16-bit block 192.168.0.0 – 192.168.255.255	bits     0 –   255
+ * 20-bit block  172.16.0.0 –  172.31.255.255	bits   256 –  4351
+ * 24-bit block    10.0.0.0 –  10.255.255.255	bits  4352 – 69887
+ *
+ * A set bit means the first address of the block is used by a pool,
+ * by an address on the system or that the block is never handed out.
+ */
+#define BLOCK_BITS_16		256
+#define BLOCK_BITS_20		4096
+#define BLOCK_BITS_24		65536
+#define BLOCK_BITS		(BLOCK_BITS_16 + BLOCK_BITS_20 + BLOCK_BITS_24)
+#define LONG_BITS		(sizeof(unsigned long) * 8)
+#define BLOCK_WORDS		((BLOCK_BITS + LONG_BITS - 1) / LONG_BITS)
+
+struct block_range {
+	uint32_t first;		/* first address of the range */
+	unsigned int bits;	/* number of /24 blocks */
+	unsigned int offset;	/* bit of the first block */
+};
+
+static struct block_range block_ranges[3];
+
+static unsigned long block_bitmap[BLOCK_WORDS];
 
-static uint32_t last_block;
-static uint32_t block_16_bits;
-static uint32_t block_20_bits;
-static uint32_t block_24_bits;
+/* address_info by index and start address */
+static GHashTable *info_table;
+/* address_info of the pools by block */
+static GHashTable *pool_table;
+/* reference count by bit of blocks used more than once */
+static GHashTable *shared_blocks;
+
+static unsigned int last_bit;
 static uint32_t subnet_mask_24;
 
+static guint info_hash(gconstpointer key)
+{
+	const struct address_info *info = key;
+
+	return info->start ^ ((guint) info->index << 24);
+}
+
+static gboolean info_equal(gconstpointer a, gconstpointer b)
+{
+	const struct address_info *info_a = a, *info_b = b;
+
+	return info_a->index == info_b->index && info_a->start == info_b->start;
+}
+
+static int block_to_bit(uint32_t block)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(block_ranges); i++) {
+		const struct block_range *range = &block_ranges[i];
+		uint32_t n = (block - range->first) >> 8;
+
+		if (block >= range->first && n < range->bits)
+			return range->offset + n;
+	}
+
+	return -1;
+}
+
+static uint32_t bit_to_block(unsigned int bit)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(block_ranges); i++) {
+		const struct block_range *range = &block_ranges[i];
+
+		if (bit < range->offset + range->bits)
+			return range->first + ((bit - range->offset) << 8);
+	}
+
+	return 0;
+}
+
+/*
+ * Blocks ending in .255.0 and the whole 10.255.0.0/16 are never
+ * handed out.
+ */
+static bool is_reserved_bit(unsigned int bit)
+{
+	uint32_t block = bit_to_block(bit);
+
+	if ((block & 0x0000ff00) == 0x0000ff00)
+		return true;
+
+	return (block & 0xffff0000) == (block_ranges[2].first | 0x00ff0000);
+}
+
+/*
+ * Only blocks used more than once, e.g. by overlapping addresses, have
+ * a reference count in shared_blocks.
+ */
+static void set_bit(unsigned int bit, bool used)
+{
+	unsigned long *word = &block_bitmap[bit / LONG_BITS];
+	unsigned long mask = 1UL << (bit % LONG_BITS);
+	unsigned int count;
+
+	if (used && !(*word & mask)) {
+		*word |= mask;
+		return;
+	}
+
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(shared_blocks,
+						GUINT_TO_POINTER(bit)));
+
+	if (used)
+		count = count ? count + 1 : 2;
+	else if (count == 0) {
+		*word &= ~mask;
+		return;
+	} else
+		count--;
+
+	if (count > 1)
+		g_hash_table_replace(shared_blocks, GUINT_TO_POINTER(bit),
+						GUINT_TO_POINTER(count));
+	else
+		g_hash_table_remove(shared_blocks, GUINT_TO_POINTER(bit));
+}
+
+/* Marks the blocks whose first address is within start and end */
+static void set_blocks(uint32_t start, uint32_t end, bool used)
+{
+	unsigned int i;
+
+	for (i = 0; i < G_N_ELEMENTS(block_ranges); i++) {
+		const struct block_range *range = &block_ranges[i];
+		uint64_t first, last, limit;
+
+		first = ((uint64_t) start + 0xff) & ~0xffULL;
+		last = end & ~0xffU;
+		limit = range->first + ((uint64_t) (range->bits - 1) << 8);
+
+		if (first < range->first)
+			first = range->first;
+		if (last > limit)
+			last = limit;
+
+		for (; first <= last; first += 0x100)
+			set_bit(range->offset + ((first - range->first) >> 8),
+									used);
+	}
+}
+
+static void add_info(struct address_info *info)
+{
+	g_hash_table_replace(info_table, info, info);
+
+	if (info->pool)
+		g_hash_table_replace(pool_table,
+				GUINT_TO_POINTER(info->start), info);
+
+	set_blocks(info->start, info->end, true);
+}
+
+static void remove_info(struct address_info *info)
+{
+	if (g_hash_table_lookup(info_table, info) != info)
+		return;
+
+	g_hash_table_steal(info_table, info);
+
+	if (info->pool)
+		g_hash_table_remove(pool_table,
+				GUINT_TO_POINTER(info->start));
+
+	set_blocks(info->start, info->end, false);
+}
+
 struct connman_ippool *
 __connman_ippool_ref_debug(struct connman_ippool *pool,
 				const char *file, int line, const char *caller)
@@ -90,7 +259,7 @@ void __connman_ippool_unref_debug(struct connman_ippool *pool,
 		return;
 
 	if (pool->info) {
-		allocated_blocks = g_slist_remove(allocated_blocks, pool->info);
+		remove_info(pool->info);
 		g_free(pool->info);
 	}
 
@@ -112,74 +281,10 @@ static char *get_ip(uint32_t ip)
 	return g_strdup(inet_ntoa(addr));
 }
 
-static uint32_t next_block(uint32_t block)
-{
-	uint32_t next;
-
-	/*
-	 * Return the next IP block within the private IP range
-	 *
-	 * 16-bit block 192.168.0.0 – 192.168.255.255
-	 * 20-bit block  172.16.0.0 –  172.31.255.255
-	 * 24-bit block    10.0.0.0 –  10.255.255.255
-	 */
-
-	next = (block & 0x0000ff00) >> 8;
-	next += 1;
-
-	if (next == 255) {
-		if ((block & 0xffff0000) == block_16_bits) {
-			/*
-			 * Reached the end of the 16 bit block, switch
-			 * to the 20-bit block.
-			 */
-			return block_20_bits;
-		}
-
-		if ((block & 0xffff0000) >= block_20_bits) {
-			next = (block & 0x00ff0000) >> 16;
-			if (next >= 16 && next < 32)
-				next += 1;
-
-			if (next == 32) {
-				/*
-				 * Reached the end of the 20 bit
-				 * block, switch to the 24-bit block.
-				 */
-				return block_24_bits;
-			}
-
-			return (block & 0xff000000) |
-				((next << 16) & 0x00ff0000);
-		}
-
-		if ((block & 0xff000000) == block_24_bits) {
-			next = (block & 0x00ff0000) >> 16;
-			if (next < 255)
-				next += 1;
-
-			if (next == 255) {
-				/*
-				 * Reached the end of the 24 bit
-				 * block, switch to the 16-bit block.
-				 */
-				return block_16_bits;
-			}
-
-			return (block & 0xff000000) |
-				((next << 16) & 0x00ff0000);
-		}
-	}
-
-	return (block & 0xffff0000) | ((next << 8) & 0x0000ff00);
-}
-
 static uint32_t get_free_block(unsigned int size)
 {
-	struct address_info *info;
-	uint32_t block;
-	GSList *list;
-	bool collision;
+	unsigned long word;
+	unsigned int bit, i;
 
 	/*
 	 * Instead starting always from the 16 bit block, we start
@@ -188,46 +293,34 @@ static uint32_t get_free_block(unsigned int size)
 	 * the first half of the private IP pool is in use and a new
 	 * we need to find a new block.
 	 *
-	 * To only thing we have to make sure is that we terminated if
-	 * there is no block left.
+	 * Whole words of used blocks are skipped, so at most
+	 * BLOCK_WORDS words are looked at before giving up.
 	 */
-	if (last_block)
-		block = last_block;
-	else
-		block = block_16_bits;
+	bit = last_bit;
 
-	do {
-		collision = false;
-		for (list = allocated_blocks; list; list = list->next) {
-			info = list->data;
+	for (i = 0; i <= BLOCK_WORDS; i++) {
+		word = ~block_bitmap[bit / LONG_BITS];
+		word &= ~0UL << (bit % LONG_BITS);
 
-			if (info->start <= block && block <= info->end) {
-				collision = true;
-				break;
-			}
+		if (word) {
+			bit = bit - bit % LONG_BITS + __builtin_ctzl(word);
+			if (bit < BLOCK_BITS)
+				return bit_to_block(bit);
 		}
 
-		if (!collision)
-			return block;
-
-		block = next_block(block);
-	} while (block != last_block);
+		bit = (bit / LONG_BITS + 1) * LONG_BITS;
+		if (bit >= BLOCK_BITS)
+			bit = 0;
+	}
 
 	return 0;
 }
 
 static struct address_info *lookup_info(int index, uint32_t start)
 {
-	GSList *list;
-
-	for (list = allocated_blocks; list; list = list->next) {
-		struct address_info *info = list->data;
-
-		if (info->index == index && info->start == start)
-			return info;
-	}
+	struct address_info key = { .index = index, .start = start };
 
-	return NULL;
+	return g_hash_table_lookup(info_table, &key);
 }
 
 static bool is_private_address(uint32_t address)
@@ -250,7 +343,6 @@ void __connman_ippool_newaddr(int index, const char *address,
 	struct address_info *info, *it;
 	struct in_addr inp;
 	uint32_t start, end, mask;
-	GSList *list;
 
 	if (inet_aton(address, &inp) == 0)
 		return;
@@ -279,7 +371,7 @@ void __connman_ippool_newaddr(int index, const char *address,
 	info->start = start;
 	info->end = end;
 
-	allocated_blocks = g_slist_prepend(allocated_blocks, info);
+	add_info(info);
 
 update:
 	info->use_count = info->use_count + 1;
@@ -292,20 +384,16 @@ update:
 		return;
 	}
 
-	for (list = allocated_blocks; list; list = list->next) {
-		it = list->data;
-
-		if (it == info)
-			continue;
-
-		if (!(info->start >= it->start && info->start <= it->end))
-			continue;
-
-		if (it->pool && it->pool->collision_cb)
-			it->pool->collision_cb(it->pool, it->pool->user_data);
+	it = g_hash_table_lookup(pool_table,
+				GUINT_TO_POINTER(info->start & ~0xffU));
+	if (!it || it == info)
+		return;
 
+	if (!(info->start >= it->start && info->start <= it->end))
 		return;
-	}
+
+	if (it->pool->collision_cb)
+		it->pool->collision_cb(it->pool, it->pool->user_data);
 }
 
 void __connman_ippool_deladdr(int index, const char *address,
@@ -339,7 +427,7 @@ void __connman_ippool_deladdr(int index, const char *address,
 	if (info->use_count > 0)
 		return;
 
-	allocated_blocks = g_slist_remove(allocated_blocks, info);
+	remove_info(info);
 	g_free(info);
 }
 
@@ -380,7 +468,7 @@ struct connman_ippool *__connman_ippool_create(int index,
 		return NULL;
 	}
 
-	last_block = block;
+	last_bit = block_to_bit(block);
 
 	info->index = index;
 	info->start = block;
@@ -402,7 +490,7 @@ struct connman_ippool *__connman_ippool_create(int index,
 	pool->start_ip = get_ip(block + start);
 	pool->end_ip = get_ip(block + start + range);
 
-	allocated_blocks = g_slist_prepend(allocated_blocks, info);
+	add_info(info);
 
 	return pool;
 }
@@ -434,18 +522,39 @@ const char *__connman_ippool_get_subnet_mask(struct connman_ippool *pool)
 
 int __connman_ippool_init(void)
 {
+	uint32_t block;
+	unsigned int bit;
+	int last;
+
 	DBG("");
 
-	block_16_bits = ntohl(inet_addr("192.168.0.0"));
-	block_20_bits = ntohl(inet_addr("172.16.0.0"));
-	block_24_bits = ntohl(inet_addr("10.0.0.0"));
+	block_ranges[0].first = ntohl(inet_addr("192.168.0.0"));
+	block_ranges[0].bits = BLOCK_BITS_16;
+	block_ranges[0].offset = 0;
+	block_ranges[1].first = ntohl(inet_addr("172.16.0.0"));
+	block_ranges[1].bits = BLOCK_BITS_20;
+	block_ranges[1].offset = BLOCK_BITS_16;
+	block_ranges[2].first = ntohl(inet_addr("10.0.0.0"));
+	block_ranges[2].bits = BLOCK_BITS_24;
+	block_ranges[2].offset = BLOCK_BITS_16 + BLOCK_BITS_20;
 	subnet_mask_24 = ntohl(inet_addr("255.255.255.0"));
 
-	last_block = ntohl(inet_addr(connman_option_get_string(
+	info_table = g_hash_table_new_full(info_hash, info_equal,
+							g_free, NULL);
+	pool_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	shared_blocks = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	memset(block_bitmap, 0, sizeof(block_bitmap));
+	for (bit = 0; bit < BLOCK_BITS; bit++) {
+		if (is_reserved_bit(bit))
+			set_bit(bit, true);
+	}
+
+	block = ntohl(inet_addr(connman_option_get_string(
 						CONF_TETHERING_SUBNET_BLOCK)));
 
-	if (!is_private_address(last_block))
-		last_block = 0;
+	last = block_to_bit(block & subnet_mask_24);
+	last_bit = last < 0 ? 0 : last;
 
 	return 0;
 }
@@ -454,7 +563,14 @@ void __connman_ippool_cleanup(void)
 {
 	DBG("");
 
-	g_slist_free_full(allocated_blocks, g_free);
-	last_block = 0;
-	allocated_blocks = NULL;
+	g_hash_table_destroy(shared_blocks);
+	shared_blocks = NULL;
+
+	g_hash_table_destroy(pool_table);
+	pool_table = NULL;
+
+	g_hash_table_destroy(info_table);
+	info_table = NULL;
+
+	last_bit = 0;
 }
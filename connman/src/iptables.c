@@ -160,12 +160,23 @@ struct connman_iptables_entry {
 	struct ipt_entry *entry;
 };
 
+/*
+ * A table stays cached after it has been committed, so only the
+ * modifications made since the last commit need to be applied to it.
+ * The modifications are recorded in order to be able to replay them
+ * on a fresh copy if the kernel table got changed by someone else.
+ */
+struct connman_iptables_change {
+	char cmd;
+	char *chain;
+	char *arg;
+};
+
 struct connman_iptables {
 	char *name;
 	int ipt_sock;
 
 	struct ipt_getinfo *info;
-	struct ipt_get_entries *blob_entries;
 
 	unsigned int num_entries;
 	unsigned int old_entries;
@@ -175,6 +186,10 @@ struct connman_iptables {
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 
 	GList *entries;
+	GList *changes;
+
+	/* The kernel table as last seen, see table_kernel_changed() */
+	GByteArray *kernel_state;
 };
 
 static GHashTable *table_hash = NULL;
@@ -247,6 +262,34 @@ static int iterate_entries(struct ipt_entry *entries,
 	return 0;
 }
 
+static int iterate_table(struct connman_iptables *table,
+				iterate_entries_cb_t cb, void *user_data)
+{
+	struct connman_iptables_entry *e;
+	struct xt_entry_target *target;
+	unsigned int hook = NF_INET_NUMHOOKS;
+	GList *list;
+	int err;
+
+	for (list = table->entries; list; list = list->next) {
+		e = list->data;
+
+		target = ipt_get_target(e->entry);
+
+		if (e->builtin >= 0)
+			hook = e->builtin;
+		else if (!g_strcmp0(target->u.user.name, IPT_ERROR_TARGET))
+			hook = NF_INET_NUMHOOKS;
+
+		err = cb(e->entry, e->builtin, hook, table->size, e->offset,
+				user_data);
+		if (err < 0)
+			return err;
+	}
+
+	return 0;
+}
+
 static int print_entry(struct ipt_entry *entry, int builtin, unsigned int hook,
 					size_t size, unsigned int offset,
 					void *user_data)
@@ -1335,28 +1378,23 @@ static void dump_table(struct connman_iptables *table)
 {
 	DBG("%s valid_hooks=0x%08x, num_entries=%u, size=%u",
 			table->info->name,
-			table->info->valid_hooks, table->info->num_entries,
-				table->info->size);
+			table->info->valid_hooks, table->num_entries,
+				table->size);
 
 	DBG("entry hook: pre/in/fwd/out/post %d/%d/%d/%d/%d",
-		table->info->hook_entry[NF_IP_PRE_ROUTING],
-		table->info->hook_entry[NF_IP_LOCAL_IN],
-		table->info->hook_entry[NF_IP_FORWARD],
-		table->info->hook_entry[NF_IP_LOCAL_OUT],
-		table->info->hook_entry[NF_IP_POST_ROUTING]);
+		table->hook_entry[NF_IP_PRE_ROUTING],
+		table->hook_entry[NF_IP_LOCAL_IN],
+		table->hook_entry[NF_IP_FORWARD],
+		table->hook_entry[NF_IP_LOCAL_OUT],
+		table->hook_entry[NF_IP_POST_ROUTING]);
 	DBG("underflow:  pre/in/fwd/out/post %d/%d/%d/%d/%d",
-		table->info->underflow[NF_IP_PRE_ROUTING],
-		table->info->underflow[NF_IP_LOCAL_IN],
-		table->info->underflow[NF_IP_FORWARD],
-		table->info->underflow[NF_IP_LOCAL_OUT],
-		table->info->underflow[NF_IP_POST_ROUTING]);
+		table->underflow[NF_IP_PRE_ROUTING],
+		table->underflow[NF_IP_LOCAL_IN],
+		table->underflow[NF_IP_FORWARD],
+		table->underflow[NF_IP_LOCAL_OUT],
+		table->underflow[NF_IP_POST_ROUTING]);
 
-	iterate_entries(table->blob_entries->entrytable,
-			table->info->valid_hooks,
-			table->info->hook_entry,
-			table->info->underflow,
-			table->blob_entries->size,
-			print_entry, dump_entry);
+	iterate_table(table, print_entry, dump_entry);
 }
 
 static void dump_ipt_replace(struct ipt_replace *repl)
@@ -1383,7 +1421,8 @@ static void dump_ipt_replace(struct ipt_replace *repl)
 			repl->size, print_entry, dump_entry);
 }
 
-static int iptables_get_entries(struct connman_iptables *table)
+static int iptables_get_entries(struct connman_iptables *table,
+				struct ipt_get_entries *blob_entries)
 {
 	socklen_t entry_size;
 	int err;
@@ -1391,7 +1430,7 @@ static int iptables_get_entries(struct connman_iptables *table)
 	entry_size = sizeof(struct ipt_get_entries) + table->info->size;
 
 	err = getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_ENTRIES,
-				table->blob_entries, &entry_size);
+				blob_entries, &entry_size);
 	if (err < 0)
 		return -errno;
 
@@ -1440,6 +1479,15 @@ static int add_entry(struct ipt_entry *entry, int builtin, unsigned int hook,
 			table->num_entries);
 }
 
+static void free_change(gpointer data)
+{
+	struct connman_iptables_change *change = data;
+
+	g_free(change->chain);
+	g_free(change->arg);
+	g_free(change);
+}
+
 static void table_cleanup(struct connman_iptables *table)
 {
 	GList *list;
@@ -1459,15 +1507,113 @@ static void table_cleanup(struct connman_iptables *table)
 	}
 
 	g_list_free(table->entries);
+	g_list_free_full(table->changes, free_change);
+
+	if (table->kernel_state)
+		g_byte_array_free(table->kernel_state, TRUE);
+
 	g_free(table->name);
 	g_free(table->info);
-	g_free(table->blob_entries);
 	g_free(table);
 }
 
+/*
+ * The hooks and entries of a table without the packet counters,
+ * which change all the time.
+ */
+static GByteArray *kernel_state_new(struct ipt_getinfo *info,
+					struct ipt_get_entries *blob_entries)
+{
+	GByteArray *state;
+	struct ipt_entry *entry;
+	unsigned int offset;
+
+	state = g_byte_array_sized_new(sizeof(info->hook_entry) +
+				sizeof(info->underflow) + blob_entries->size);
+
+	g_byte_array_append(state, (guint8 *) info->hook_entry,
+						sizeof(info->hook_entry));
+	g_byte_array_append(state, (guint8 *) info->underflow,
+						sizeof(info->underflow));
+	g_byte_array_append(state, (guint8 *) blob_entries->entrytable,
+						blob_entries->size);
+
+	for (offset = 0; offset + sizeof(*entry) <= blob_entries->size;
+					offset += entry->next_offset) {
+		entry = (struct ipt_entry *) (state->data +
+					sizeof(info->hook_entry) +
+					sizeof(info->underflow) + offset);
+
+		memset(&entry->counters, 0, sizeof(entry->counters));
+
+		if (entry->next_offset == 0)
+			break;
+	}
+
+	return state;
+}
+
+static GByteArray *kernel_state_read(struct connman_iptables *table)
+{
+	struct ipt_get_entries *blob_entries;
+	struct ipt_getinfo info;
+	GByteArray *state = NULL;
+	socklen_t s;
+
+	memset(&info, 0, sizeof(info));
+	g_stpcpy(info.name, table->name);
+
+	s = sizeof(info);
+	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_INFO,
+							&info, &s) < 0)
+		return NULL;
+
+	blob_entries = g_try_malloc0(sizeof(struct ipt_get_entries) +
+								info.size);
+	if (!blob_entries)
+		return NULL;
+
+	g_stpcpy(blob_entries->name, table->name);
+	blob_entries->size = info.size;
+
+	s = sizeof(struct ipt_get_entries) + info.size;
+	if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_ENTRIES,
+						blob_entries, &s) == 0)
+		state = kernel_state_new(&info, blob_entries);
+
+	g_free(blob_entries);
+
+	return state;
+}
+
+/*
+ * The cached table is only good as long as nobody else touched the
+ * kernel table. Changes like iptables -P or -R keep the number of
+ * entries, so the kernel would not notice them on replace.
+ */
+static bool table_kernel_changed(struct connman_iptables *table)
+{
+	GByteArray *state;
+	bool changed;
+
+	state = kernel_state_read(table);
+	if (!state || !table->kernel_state)
+		changed = true;
+	else
+		changed = state->len != table->kernel_state->len ||
+			memcmp(state->data, table->kernel_state->data,
+							state->len) != 0;
+
+	if (state)
+		g_byte_array_free(state, TRUE);
+
+	return changed;
+}
+
 static struct connman_iptables *iptables_init(const char *table_name)
 {
 	struct connman_iptables *table = NULL;
+	struct ipt_get_entries *blob_entries = NULL;
 	char *module = NULL;
 	socklen_t s;
 
@@ -1506,15 +1652,15 @@ static struct connman_iptables *iptables_init(const char *table_name)
 		goto err;
 	}
 
-	table->blob_entries = g_try_malloc0(sizeof(struct ipt_get_entries) +
+	blob_entries = g_try_malloc0(sizeof(struct ipt_get_entries) +
 						table->info->size);
-	if (!table->blob_entries)
+	if (!blob_entries)
 		goto err;
 
-	g_stpcpy(table->blob_entries->name, table_name);
-	table->blob_entries->size = table->info->size;
+	g_stpcpy(blob_entries->name, table_name);
+	blob_entries->size = table->info->size;
 
-	if (iptables_get_entries(table) < 0)
+	if (iptables_get_entries(table, blob_entries) < 0)
 		goto err;
 
 	table->num_entries = 0;
@@ -1526,17 +1672,22 @@ static struct connman_iptables *iptables_init(const char *table_name)
 	memcpy(table->hook_entry, table->info->hook_entry,
 				sizeof(table->info->hook_entry));
 
-	iterate_entries(table->blob_entries->entrytable,
+	iterate_entries(blob_entries->entrytable,
 			table->info->valid_hooks, table->info->hook_entry,
-			table->info->underflow, table->blob_entries->size,
+			table->info->underflow, blob_entries->size,
 			add_entry, table);
 
+	/* From here on the cached entries are the only copy we use */
+	table->kernel_state = kernel_state_new(table->info, blob_entries);
+	g_free(blob_entries);
+
 	if (debug_enabled)
 		dump_table(table);
 
 	return table;
 
 err:
+	g_free(blob_entries);
 	table_cleanup(table);
 
 	return NULL;
@@ -2146,68 +2297,9 @@ int __connman_iptables_dump(const char *table_name)
 	return 0;
 }
 
-int __connman_iptables_new_chain(const char *table_name,
-					const char *chain)
-{
-	struct connman_iptables *table;
-
-	DBG("-t %s -N %s", table_name, chain);
-
-	table = get_table(table_name);
-	if (!table)
-		return -EINVAL;
-
-	return iptables_add_chain(table, chain);
-}
-
-int __connman_iptables_delete_chain(const char *table_name,
-					const char *chain)
+static int apply_rule(struct connman_iptables *table, char cmd,
+				const char *chain, const char *rule_spec)
 {
-	struct connman_iptables *table;
-
-	DBG("-t %s -X %s", table_name, chain);
-
-	table = get_table(table_name);
-	if (!table)
-		return -EINVAL;
-
-	return iptables_delete_chain(table, chain);
-}
-
-int __connman_iptables_flush_chain(const char *table_name,
-					const char *chain)
-{
-	struct connman_iptables *table;
-
-	DBG("-t %s -F %s", table_name, chain);
-
-	table = get_table(table_name);
-	if (!table)
-		return -EINVAL;
-
-	return iptables_flush_chain(table, chain);
-}
-
-int __connman_iptables_change_policy(const char *table_name,
-					const char *chain,
-					const char *policy)
-{
-	struct connman_iptables *table;
-
-	DBG("-t %s -F %s", table_name, chain);
-
-	table = get_table(table_name);
-	if (!table)
-		return -EINVAL;
-
-	return iptables_change_policy(table, chain, policy);
-}
-
-int __connman_iptables_append(const char *table_name,
-				const char *chain,
-				const char *rule_spec)
-{
-	struct connman_iptables *table;
 	struct parse_context *ctx;
 	const char *target_name;
 	int err;
@@ -2216,18 +2308,10 @@ int __connman_iptables_append(const char *table_name,
 	if (!ctx)
 		return -ENOMEM;
 
-	DBG("-t %s -A %s %s", table_name, chain, rule_spec);
-
 	err = prepare_getopt_args(rule_spec, ctx);
 	if (err < 0)
 		goto out;
 
-	table = get_table(table_name);
-	if (!table) {
-		err = -EINVAL;
-		goto out;
-	}
-
 	err = parse_rule_spec(table, ctx);
 	if (err < 0)
 		goto out;
@@ -2237,8 +2321,24 @@ int __connman_iptables_append(const char *table_name,
 	else
 		target_name = ctx->xt_t->name;
 
-	err = iptables_append_rule(table, ctx->ip, chain,
+	switch (cmd) {
+	case 'A':
+		err = iptables_append_rule(table, ctx->ip, chain,
+				target_name, ctx->xt_t, ctx->xt_rm);
+		break;
+	case 'I':
+		err = iptables_insert_rule(table, ctx->ip, chain,
 				target_name, ctx->xt_t, ctx->xt_rm);
+		break;
+	case 'D':
+		err = iptables_delete_rule(table, ctx->ip, chain,
+				target_name, ctx->xt_t, ctx->xt_m,
+				ctx->xt_rm);
+		break;
+	default:
+		err = -EINVAL;
+		break;
+	}
 out:
 	cleanup_parse_context(ctx);
 	reset_xtables();
@@ -2246,91 +2346,156 @@ out:
 	return err;
 }
 
-int __connman_iptables_insert(const char *table_name,
-				const char *chain,
-				const char *rule_spec)
+static int apply_change(struct connman_iptables *table, char cmd,
+				const char *chain, const char *arg)
+{
+	switch (cmd) {
+	case 'N':
+		return iptables_add_chain(table, chain);
+	case 'X':
+		return iptables_delete_chain(table, chain);
+	case 'F':
+		return iptables_flush_chain(table, chain);
+	case 'P':
+		return iptables_change_policy(table, chain, arg);
+	case 'A':
+	case 'I':
+	case 'D':
+		return apply_rule(table, cmd, chain, arg);
+	}
+
+	return -EINVAL;
+}
+
+static int table_change(const char *table_name, char cmd,
+				const char *chain, const char *arg)
 {
 	struct connman_iptables *table;
-	struct parse_context *ctx;
-	const char *target_name;
+	struct connman_iptables_change *change;
 	int err;
 
-	ctx = g_try_new0(struct parse_context, 1);
-	if (!ctx)
-		return -ENOMEM;
-
-	DBG("-t %s -I %s %s", table_name, chain, rule_spec);
+	table = get_table(table_name);
+	if (!table)
+		return -EINVAL;
 
-	err = prepare_getopt_args(rule_spec, ctx);
+	err = apply_change(table, cmd, chain, arg);
 	if (err < 0)
-		goto out;
+		return err;
+
+	change = g_new0(struct connman_iptables_change, 1);
+	change->cmd = cmd;
+	change->chain = g_strdup(chain);
+	change->arg = g_strdup(arg);
+
+	/* Kept newest first, see table_resync() */
+	table->changes = g_list_prepend(table->changes, change);
+
+	return 0;
+}
+
+/*
+ * The kernel refuses to replace a table with EAGAIN if it has been
+ * modified since we read it. Read it again and replay the pending
+ * changes on top of the fresh copy.
+ */
+static struct connman_iptables *table_resync(struct connman_iptables *table)
+{
+	struct connman_iptables_change *change;
+	GList *changes, *list;
+	char *table_name;
+	int err;
+
+	table_name = g_strdup(table->name);
+	changes = g_list_reverse(table->changes);
+	table->changes = NULL;
+
+	g_hash_table_remove(table_hash, table_name);
 
 	table = get_table(table_name);
 	if (!table) {
-		err = -EINVAL;
+		g_list_free_full(changes, free_change);
 		goto out;
 	}
 
-	err = parse_rule_spec(table, ctx);
-	if (err < 0)
-		goto out;
+	for (list = changes; list; list = list->next) {
+		change = list->data;
 
-	if (!ctx->xt_t)
-		target_name = NULL;
-	else
-		target_name = ctx->xt_t->name;
+		err = apply_change(table, change->cmd, change->chain,
+					change->arg);
+		if (err < 0)
+			connman_warn("Cannot reapply -t %s -%c %s %s: %s",
+					table_name, change->cmd,
+					change->chain,
+					change->arg ? change->arg : "",
+					strerror(-err));
+	}
+
+	table->changes = g_list_reverse(changes);
 
-	err = iptables_insert_rule(table, ctx->ip, chain,
-				target_name, ctx->xt_t, ctx->xt_rm);
 out:
-	cleanup_parse_context(ctx);
-	reset_xtables();
+	g_free(table_name);
 
-	return err;
+	return table;
 }
 
-int __connman_iptables_delete(const char *table_name,
-				const char *chain,
-				const char *rule_spec)
+int __connman_iptables_new_chain(const char *table_name,
+					const char *chain)
 {
-	struct connman_iptables *table;
-	struct parse_context *ctx;
-	const char *target_name;
-	int err;
+	DBG("-t %s -N %s", table_name, chain);
 
-	ctx = g_try_new0(struct parse_context, 1);
-	if (!ctx)
-		return -ENOMEM;
+	return table_change(table_name, 'N', chain, NULL);
+}
 
-	DBG("-t %s -D %s %s", table_name, chain, rule_spec);
+int __connman_iptables_delete_chain(const char *table_name,
+					const char *chain)
+{
+	DBG("-t %s -X %s", table_name, chain);
 
-	err = prepare_getopt_args(rule_spec, ctx);
-	if (err < 0)
-		goto out;
+	return table_change(table_name, 'X', chain, NULL);
+}
 
-	table = get_table(table_name);
-	if (!table) {
-		err = -EINVAL;
-		goto out;
-	}
+int __connman_iptables_flush_chain(const char *table_name,
+					const char *chain)
+{
+	DBG("-t %s -F %s", table_name, chain);
 
-	err = parse_rule_spec(table, ctx);
-	if (err < 0)
-		goto out;
+	return table_change(table_name, 'F', chain, NULL);
+}
 
-	if (!ctx->xt_t)
-		target_name = NULL;
-	else
-		target_name = ctx->xt_t->name;
+int __connman_iptables_change_policy(const char *table_name,
+					const char *chain,
+					const char *policy)
+{
+	DBG("-t %s -P %s %s", table_name, chain, policy);
 
-	err = iptables_delete_rule(table, ctx->ip, chain,
-				target_name, ctx->xt_t, ctx->xt_m,
-				ctx->xt_rm);
-out:
-	cleanup_parse_context(ctx);
-	reset_xtables();
+	return table_change(table_name, 'P', chain, policy);
+}
 
-	return err;
+int __connman_iptables_append(const char *table_name,
+				const char *chain,
+				const char *rule_spec)
+{
+	DBG("-t %s -A %s %s", table_name, chain, rule_spec);
+
+	return table_change(table_name, 'A', chain, rule_spec);
+}
+
+int __connman_iptables_insert(const char *table_name,
+				const char *chain,
+				const char *rule_spec)
+{
+	DBG("-t %s -I %s %s", table_name, chain, rule_spec);
+
+	return table_change(table_name, 'I', chain, rule_spec);
+}
+
+int __connman_iptables_delete(const char *table_name,
+				const char *chain,
+				const char *rule_spec)
+{
+	DBG("-t %s -D %s %s", table_name, chain, rule_spec);
+
+	return table_change(table_name, 'D', chain, rule_spec);
 }
 
 int __connman_iptables_commit(const char *table_name)
@@ -2349,41 +2514,99 @@ int __connman_iptables_commit(const char *table_name)
 	if (!table)
 		return -EINVAL;
 
+	/* Nothing to tell the kernel since the last commit */
+	if (!table->changes)
+		return 0;
+
+	if (table_kernel_changed(table)) {
+		DBG("%s changed behind our back, reloading", table_name);
+
+		table = table_resync(table);
+		if (!table)
+			return -EINVAL;
+	}
+
 	repl = iptables_blob(table);
-	if (!repl)
+	if (!repl) {
+		g_hash_table_remove(table_hash, table_name);
 		return -ENOMEM;
+	}
 
 	if (debug_enabled)
 		dump_ipt_replace(repl);
 
 	err = iptables_replace(table, repl);
+	if (err == -EAGAIN) {
+		DBG("%s changed behind our back, reloading", table_name);
 
-	if (err < 0)
+		g_free(repl->counters);
+		g_free(repl);
+
+		table = table_resync(table);
+		if (!table)
+			return -EINVAL;
+
+		repl = iptables_blob(table);
+		if (!repl) {
+			g_hash_table_remove(table_hash, table_name);
+			return -ENOMEM;
+		}
+
+		err = iptables_replace(table, repl);
+	}
+
+	if (err < 0) {
+		/*
+		 * The cache holds changes the kernel does not have, read
+		 * the table again on next use.
+		 */
+		g_hash_table_remove(table_hash, table_name);
 		goto out_free;
+	}
 
 	counters = g_try_malloc0(sizeof(*counters) +
 			sizeof(struct xt_counters) * table->num_entries);
-	if (!counters) {
+	if (counters) {
+		g_stpcpy(counters->name, table->info->name);
+		counters->num_counters = table->num_entries;
+		for (list = table->entries, cnt = 0; list;
+				list = list->next, cnt++) {
+			e = list->data;
+			if (e->counter_idx >= 0)
+				counters->counters[cnt] =
+					repl->counters[e->counter_idx];
+		}
+		err = iptables_add_counters(table, counters);
+		g_free(counters);
+	} else {
 		err = -ENOMEM;
-		goto out_hash_remove;
 	}
-	g_stpcpy(counters->name, table->info->name);
-	counters->num_counters = table->num_entries;
+
+	/*
+	 * The new rules are in place even if restoring the counters
+	 * failed, so there is no reason to report an error.
+	 */
+	if (err < 0)
+		connman_warn("Cannot restore %s counters: %s", table_name,
+				strerror(-err));
+
+	/* The kernel table matches the cached one now */
 	for (list = table->entries, cnt = 0; list; list = list->next, cnt++) {
 		e = list->data;
-		if (e->counter_idx >= 0)
-			counters->counters[cnt] = repl->counters[e->counter_idx];
+		e->counter_idx = cnt;
 	}
-	err = iptables_add_counters(table, counters);
-	g_free(counters);
 
-	if (err < 0)
-		goto out_hash_remove;
+	table->old_entries = table->num_entries;
+
+	g_list_free_full(table->changes, free_change);
+	table->changes = NULL;
+
+	if (table->kernel_state)
+		g_byte_array_free(table->kernel_state, TRUE);
+	table->kernel_state = kernel_state_read(table);
 
 	err = 0;
 
-out_hash_remove:
-	g_hash_table_remove(table_hash, table_name);
 out_free:
 	g_free(repl->counters);
 	g_free(repl);
@@ -2431,12 +2654,7 @@ int __connman_iptables_iterate_chains(const char *table_name,
 		return -EINVAL;
 	}
 
-	iterate_entries(table->blob_entries->entrytable,
-			table->info->valid_hooks,
-			table->info->hook_entry,
-			table->info->underflow,
-			table->blob_entries->size,
-			iterate_chains_cb, cbd);
+	iterate_table(table, iterate_chains_cb, cbd);
 
 	g_free(cbd);
 
@@ -31,6 +31,7 @@
 #include <sys/stat.h>
 
 #include "connman.h"
+#include "src/shared/stats-history.h"
 
 /*
  * Simplified version of stats.c
@@ -55,6 +56,13 @@
 #define STATS_SHORT_WRITE_PERIOD_SEC    (2)
 #define STATS_LONG_WRITE_PERIOD_SEC     (30)
 
+/*
+ * Besides the totals, the traffic history is kept in a fixed size file
+ * next to each stats file which is mapped into memory, see
+ * src/shared/stats-history.h.
+ */
+#define STATS_HISTORY_SUFFIX    ".history"
+
 /* Unused files that may have been created by earlier versions of connman */
 static const char* stats_obsolete[] = { "data", "history" };
 
@@ -67,6 +75,7 @@ struct stats_file_contents {
 struct connman_stats {
 	char *path;
 	char *name;
+	struct stats_history *history;
 	gboolean modified;
 	uint64_t bytes_change;
 	guint short_write_timeout_id;
@@ -139,6 +148,77 @@ static gboolean stats_file_write(const char *path,
 	return ok;
 }
 
+static struct stats_history *stats_history_open(const char *path,
+							gboolean create)
+{
+	struct stats_history *history;
+	char *name = g_strconcat(path, STATS_HISTORY_SUFFIX, NULL);
+	struct stat st;
+	void *addr;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0),
+							STATS_FILE_MODE);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			connman_error("%s: %s", name, strerror(errno));
+		g_free(name);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+			(st.st_size != sizeof(*history) &&
+			ftruncate(fd, sizeof(*history)) < 0)) {
+		connman_error("%s: %s", name, strerror(errno));
+		close(fd);
+		g_free(name);
+		return NULL;
+	}
+
+	addr = mmap(NULL, sizeof(*history), PROT_READ | PROT_WRITE,
+							MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (addr == MAP_FAILED) {
+		connman_error("%s: %s", name, strerror(errno));
+		g_free(name);
+		return NULL;
+	}
+
+	history = addr;
+
+	if (st.st_size != sizeof(*history) ||
+			history->version != STATS_HISTORY_VERSION) {
+		DBG("%s: new history", name);
+		stats_history_init(history, time(NULL));
+	}
+
+	g_free(name);
+	return history;
+}
+
+static void stats_history_close(struct stats_history *history)
+{
+	if (history)
+		munmap(history, sizeof(*history));
+}
+
+/* A history must not outlive its stats file */
+static void stats_history_remove(const char *path)
+{
+	char *name = g_strconcat(path, STATS_HISTORY_SUFFIX, NULL);
+
+	if (unlink(name) < 0) {
+		if (errno != ENOENT)
+			connman_error("error deleting %s: %s", name,
+							strerror(errno));
+	} else {
+		DBG("deleted %s", name);
+	}
+
+	g_free(name);
+}
+
 static struct connman_stats *stats_new(const char *id, const char *dir,
 							const char *file)
 {
@@ -188,7 +268,9 @@ struct connman_stats *__connman_stats_new(const char *ident, gboolean roaming)
 
 	if (!err) {
 		stats = stats_new(ident, dir, stats_file(roaming));
-		stats_file_read(stats->path, &stats->contents);
+		if (!stats_file_read(stats->path, &stats->contents))
+			stats_history_remove(stats->path);
+		stats->history = stats_history_open(stats->path, TRUE);
 		stats_delete_obsolete_files(dir);
 	} else {
 		connman_error("failed to create %s: %s", dir, strerror(errno));
@@ -211,6 +293,9 @@ struct connman_stats *__connman_stats_new_existing(const char *identifier,
 	if (stats_file_read(path, &contents)) {
 		stats = stats_new(identifier, dir, file);
 		stats->contents = contents;
+		stats->history = stats_history_open(path, FALSE);
+	} else {
+		stats_history_remove(path);
 	}
 
 	g_free(dir);
@@ -232,6 +317,7 @@ void __connman_stats_free(struct connman_stats *stats)
                 if (stats->long_write_timeout_id)
                     g_source_remove(stats->long_write_timeout_id);
 
+		stats_history_close(stats->history);
 		g_free(stats->path);
 		g_free(stats->name);
 		g_free(stats);
@@ -311,6 +397,7 @@ void __connman_stats_update(struct connman_stats *stats,
 {
 	struct connman_stats_data *last, *total;
 	struct connman_stats_data fixed;
+	struct stats_history_data delta;
 
 	if (!stats)
 		return;
@@ -370,15 +457,27 @@ void __connman_stats_update(struct connman_stats *stats,
 	DBG("%s [TX] %llu packets %llu bytes", stats->name,
 					data->tx_packets, data->tx_bytes);
 
+	delta.rx_packets = data->rx_packets - last->rx_packets;
+	delta.tx_packets = data->tx_packets - last->tx_packets;
+	delta.rx_bytes   = data->rx_bytes   - last->rx_bytes;
+	delta.tx_bytes   = data->tx_bytes   - last->tx_bytes;
+	delta.rx_errors  = data->rx_errors  - last->rx_errors;
+	delta.tx_errors  = data->tx_errors  - last->tx_errors;
+	delta.rx_dropped = data->rx_dropped - last->rx_dropped;
+	delta.tx_dropped = data->tx_dropped - last->tx_dropped;
+
 	/* Update the total counters */
-	total->rx_packets += (data->rx_packets - last->rx_packets);
-	total->tx_packets += (data->tx_packets - last->tx_packets);
-	total->rx_bytes   += (data->rx_bytes   - last->rx_bytes  );
-	total->tx_bytes   += (data->tx_bytes   - last->tx_bytes  );
-	total->rx_errors  += (data->rx_errors  - last->rx_errors );
-	total->tx_errors  += (data->tx_errors  - last->tx_errors );
-	total->rx_dropped += (data->rx_dropped - last->rx_dropped);
-	total->tx_dropped += (data->tx_dropped - last->tx_dropped);
+	total->rx_packets += delta.rx_packets;
+	total->tx_packets += delta.tx_packets;
+	total->rx_bytes   += delta.rx_bytes;
+	total->tx_bytes   += delta.tx_bytes;
+	total->rx_errors  += delta.rx_errors;
+	total->tx_errors  += delta.tx_errors;
+	total->rx_dropped += delta.rx_dropped;
+	total->tx_dropped += delta.tx_dropped;
+
+	if (stats->history)
+		stats_history_add(stats->history, time(NULL), &delta);
 
 	/* Accumulate the changes */
 	stats->modified = true;
@@ -443,6 +542,36 @@ void __connman_stats_get(struct connman_stats *stats,
 	}
 }
 
+/*
+ * Traffic since the given time, rounded down to the hour for the last
+ * STATS_HISTORY_HOURS hours and to the day (UTC) before that. Resets
+ * of the totals do not affect the history.
+ */
+int __connman_stats_get_since(struct connman_stats *stats, time_t since,
+				struct connman_stats_data *data)
+{
+	struct stats_history_data value;
+	int err;
+
+	if (!stats || !stats->history)
+		return -ENOENT;
+
+	err = stats_history_get_since(stats->history, since, &value);
+	if (err < 0)
+		return err;
+
+	data->rx_packets = value.rx_packets;
+	data->tx_packets = value.tx_packets;
+	data->rx_bytes   = value.rx_bytes;
+	data->tx_bytes   = value.tx_bytes;
+	data->rx_errors  = value.rx_errors;
+	data->tx_errors  = value.tx_errors;
+	data->rx_dropped = value.rx_dropped;
+	data->tx_dropped = value.tx_dropped;
+
+	return 0;
+}
+
 int __connman_stats_init(void)
 {
 	return 0;
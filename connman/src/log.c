@@ -29,10 +29,16 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <syslog.h>
 #include <execinfo.h>
 #include <dlfcn.h>
+#include <sys/mman.h>
 
 #include "connman.h"
 
@@ -42,6 +48,382 @@ static GString *connman_debug_str;
 static const char *program_exec;
 static const char *program_path;
 
+/*
+ * Binary debug trace. When enabled, debug messages are not formatted
+ * but stored into a ring of fixed size records in a shared file
+ * mapping: a reference to the format string, the raw arguments and a
+ * timestamp. Format strings are copied once into the string area of
+ * the same file, so tools/trace-decode can print the messages later
+ * without the binary. Records are claimed with an atomic increment and
+ * marked complete by writing their sequence number last, so no lock is
+ * taken. The layout must be kept in sync with tools/trace-decode.c.
+ */
+#define TRACE_MAGIC		0x43525443	/* "CTRC" */
+#define TRACE_VERSION		1
+#define TRACE_RECORDS		16384
+#define TRACE_RECORD_SIZE	128
+#define TRACE_STRINGS_SIZE	(256 * 1024)
+#define TRACE_FORMATS		8192
+#define TRACE_TRUNCATED		0x0001
+#define TRACE_STRING_NULL	0xffff
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t records;
+	uint32_t strings_size;
+	uint32_t strings_used;
+	uint64_t head;
+	int64_t realtime_offset;
+	uint32_t pid;
+	uint8_t padding[20];
+};
+
+struct trace_record {
+	uint64_t seq;
+	uint64_t timestamp;
+	uint32_t format;
+	uint16_t length;
+	uint16_t flags;
+	uint8_t payload[TRACE_RECORD_SIZE - 24];
+};
+
+struct trace_format {
+	const char *format;
+	uint32_t offset;
+};
+
+static struct trace_header *trace_header;
+static char *trace_strings;
+static struct trace_record *trace_records;
+static size_t trace_size;
+static char *trace_path;
+static struct trace_format trace_formats[TRACE_FORMATS];
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t trace_add_string(const char *file, const char *format)
+{
+	size_t file_len = strlen(file) + 1;
+	size_t format_len = strlen(format) + 1;
+	uint32_t offset;
+
+	offset = __atomic_fetch_add(&trace_header->strings_used,
+					file_len + format_len, __ATOMIC_RELAXED);
+	if (offset + file_len + format_len > trace_header->strings_size)
+		return 0;
+
+	memcpy(trace_strings + offset, file, file_len);
+	memcpy(trace_strings + offset + file_len, format, format_len);
+
+	return offset;
+}
+
+/*
+ * Format strings are looked up by address in an open addressing table.
+ * An empty slot is claimed with a compare and swap; a thread that finds
+ * a slot claimed but not yet filled in stores the record without its
+ * format rather than waiting.
+ */
+static uint32_t trace_lookup_format(const char *file, const char *format)
+{
+	unsigned int hash, i;
+
+	hash = ((uintptr_t) format >> 3) * 2654435761u;
+
+	for (i = 0; i < TRACE_FORMATS; i++) {
+		struct trace_format *entry;
+		const char *expected = NULL;
+		uint32_t offset;
+
+		entry = &trace_formats[(hash + i) & (TRACE_FORMATS - 1)];
+
+		if (__atomic_compare_exchange_n(&entry->format, &expected,
+					format, false, __ATOMIC_ACQ_REL,
+					__ATOMIC_ACQUIRE)) {
+			offset = trace_add_string(file, format);
+			__atomic_store_n(&entry->offset, offset,
+							__ATOMIC_RELEASE);
+			return offset;
+		}
+
+		if (expected == format)
+			return __atomic_load_n(&entry->offset,
+							__ATOMIC_ACQUIRE);
+	}
+
+	return 0;
+}
+
+static bool trace_put(struct trace_record *record, const void *data,
+								size_t len)
+{
+	if (record->length + len > sizeof(record->payload)) {
+		record->flags |= TRACE_TRUNCATED;
+		return false;
+	}
+
+	memcpy(record->payload + record->length, data, len);
+	record->length += len;
+
+	return true;
+}
+
+static bool trace_put_int(struct trace_record *record, int64_t value)
+{
+	return trace_put(record, &value, sizeof(value));
+}
+
+static bool trace_put_string(struct trace_record *record, const char *str)
+{
+	size_t avail;
+	uint16_t len;
+
+	if (!str) {
+		len = TRACE_STRING_NULL;
+		return trace_put(record, &len, sizeof(len));
+	}
+
+	if (record->length + sizeof(len) >= sizeof(record->payload)) {
+		record->flags |= TRACE_TRUNCATED;
+		return false;
+	}
+
+	avail = sizeof(record->payload) - record->length - sizeof(len);
+	len = strnlen(str, avail);
+	if (len == avail && str[len])
+		record->flags |= TRACE_TRUNCATED;
+
+	trace_put(record, &len, sizeof(len));
+	trace_put(record, str, len);
+
+	return !(record->flags & TRACE_TRUNCATED);
+}
+
+/*
+ * Walks the conversions of a printf format and stores their arguments:
+ * integers, pointers and doubles as 8 bytes, strings with a 16 bit
+ * length. %m is stored as the value of errno.
+ */
+static void trace_put_args(struct trace_record *record, const char *format,
+								va_list ap)
+{
+	const char *p = format;
+	int saved_errno = errno;
+
+	while ((p = strchr(p, '%'))) {
+		int longs = 0;
+		char size = 0;
+		bool ok = true;
+
+		p++;
+		if (*p == '%') {
+			p++;
+			continue;
+		}
+
+		while (*p && strchr("-+ #0'I", *p))
+			p++;
+
+		if (*p == '*') {
+			ok = trace_put_int(record, va_arg(ap, int));
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			p++;
+
+		if (*p == '.') {
+			p++;
+			if (*p == '*') {
+				ok = ok && trace_put_int(record,
+							va_arg(ap, int));
+				p++;
+			}
+			while (*p >= '0' && *p <= '9')
+				p++;
+		}
+
+		if (!ok)
+			return;
+
+		for (; *p && strchr("hlLqjzt", *p); p++) {
+			if (*p == 'l')
+				longs++;
+			else
+				size = *p;
+		}
+
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+		case 'c':
+			if (longs >= 2 || size == 'q' || size == 'L')
+				ok = trace_put_int(record,
+						va_arg(ap, long long));
+			else if (longs == 1)
+				ok = trace_put_int(record, va_arg(ap, long));
+			else if (size == 'j')
+				ok = trace_put_int(record,
+						va_arg(ap, intmax_t));
+			else if (size == 'z')
+				ok = trace_put_int(record, va_arg(ap, size_t));
+			else if (size == 't')
+				ok = trace_put_int(record,
+						va_arg(ap, ptrdiff_t));
+			else
+				ok = trace_put_int(record, va_arg(ap, int));
+			break;
+		case 'p':
+			ok = trace_put_int(record,
+					(uintptr_t) va_arg(ap, void *));
+			break;
+		case 's':
+			ok = trace_put_string(record,
+					va_arg(ap, const char *));
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A': {
+			double value;
+
+			if (size == 'L')
+				value = va_arg(ap, long double);
+			else
+				value = va_arg(ap, double);
+
+			ok = trace_put(record, &value, sizeof(value));
+			break;
+		}
+		case 'm':
+			ok = trace_put_int(record, saved_errno);
+			break;
+		case 'n':
+			va_arg(ap, void *);
+			break;
+		default:
+			record->flags |= TRACE_TRUNCATED;
+			return;
+		}
+
+		if (!ok || !*p)
+			return;
+
+		p++;
+	}
+}
+
+static void trace_log(const struct connman_debug_desc *desc,
+				const char *format, va_list ap)
+{
+	struct trace_record *record;
+	uint64_t seq;
+
+	seq = __atomic_fetch_add(&trace_header->head, 1, __ATOMIC_RELAXED);
+	record = &trace_records[seq & (trace_header->records - 1)];
+
+	/* Readers skip the record until the sequence number is back */
+	__atomic_store_n(&record->seq, 0, __ATOMIC_RELEASE);
+
+	record->timestamp = trace_now();
+	record->format = trace_lookup_format(desc->file ? desc->file : "",
+								format);
+	record->length = 0;
+	record->flags = 0;
+	trace_put_args(record, format, ap);
+
+	__atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+int __connman_log_trace_init(const char *path)
+{
+	struct timespec real;
+	size_t strings_offset, records_offset;
+	void *map;
+	int fd, err;
+
+	strings_offset = sizeof(struct trace_header);
+	records_offset = strings_offset + TRACE_STRINGS_SIZE;
+	trace_size = records_offset + TRACE_RECORDS * TRACE_RECORD_SIZE;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		err = -errno;
+		connman_error("Failed to open trace file %s: %s", path,
+							strerror(errno));
+		return err;
+	}
+
+	if (ftruncate(fd, trace_size) < 0) {
+		err = -errno;
+		connman_error("Failed to size trace file %s: %s", path,
+							strerror(errno));
+		close(fd);
+		return err;
+	}
+
+	map = mmap(NULL, trace_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+								fd, 0);
+	err = -errno;
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		connman_error("Failed to map trace file %s: %s", path,
+							strerror(-err));
+		return err;
+	}
+
+	trace_header = map;
+	trace_strings = (char *) map + strings_offset;
+	trace_records = (struct trace_record *)
+					((char *) map + records_offset);
+
+	clock_gettime(CLOCK_REALTIME, &real);
+
+	trace_header->version = TRACE_VERSION;
+	trace_header->record_size = TRACE_RECORD_SIZE;
+	trace_header->records = TRACE_RECORDS;
+	trace_header->strings_size = TRACE_STRINGS_SIZE;
+	/* Offset 0 means that the format is not known */
+	trace_header->strings_used = 1;
+	trace_header->realtime_offset = (int64_t) real.tv_sec * 1000000000 +
+						real.tv_nsec - trace_now();
+	trace_header->pid = getpid();
+	__atomic_store_n(&trace_header->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+
+	trace_path = g_strdup(path);
+
+	connman_info("Writing debug trace to %s", trace_path);
+
+	return 0;
+}
+
+static void trace_sync(void)
+{
+	if (trace_header)
+		msync(trace_header, trace_size, MS_SYNC);
+}
+
+static void trace_cleanup(void)
+{
+	if (!trace_header)
+		return;
+
+	trace_sync();
+	munmap(trace_header, trace_size);
+	trace_header = NULL;
+	trace_strings = NULL;
+	trace_records = NULL;
+
+	g_free(trace_path);
+	trace_path = NULL;
+}
+
 /**
  * connman_info:
  * @format: format string
@@ -148,7 +530,9 @@ void connman_log(const struct connman_debug_desc *desc,
 
 	va_start(ap, format);
 
-	if (connman_debug_str) {
+	if (trace_header) {
+		trace_log(desc, format, ap);
+	} else if (connman_debug_str) {
 		g_string_vprintf(connman_debug_str, format, ap);
 		syslog(LOG_DEBUG, "%s:%s", desc->file, connman_debug_str->str);
 	} else {
@@ -272,6 +656,11 @@ static void signal_handler(int signo)
 
 	print_backtrace(2);
 
+	if (trace_header) {
+		trace_sync();
+		connman_error("Debug trace saved in %s", trace_path);
+	}
+
 	exit(EXIT_FAILURE);
 }
 
@@ -400,6 +789,8 @@ void __connman_log_cleanup(gboolean backtrace)
 	if (backtrace)
 		signal_setup(SIG_DFL);
 
+	trace_cleanup();
+
 	g_strfreev(enabled);
 	g_string_free(connman_debug_str, TRUE);
 	connman_debug_str = NULL;
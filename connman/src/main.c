@@ -90,6 +90,16 @@ static struct {
 	mode_t storage_file_permissions;
 	mode_t umask;
 	bool enable_6to4;
+	unsigned int dnsproxy_cache_size;
+	unsigned int dnsproxy_cache_memory;
+	bool dnsproxy_serve_stale;
+	unsigned int dnsproxy_udp_batch;
+	bool dnsproxy_persistent_cache;
+	unsigned int dnsproxy_parallel_queries;
+	bool services_changed_delta;
+	unsigned int storage_write_delay;
+	bool storage_service_index;
+	bool property_changed_batch;
 } connman_settings  = {
 	.bg_scan = true,
 	.pref_timeservers = NULL,
@@ -107,6 +117,16 @@ static struct {
 	.storage_file_permissions = DEFAULT_STORAGE_FILE_PERMISSIONS,
 	.umask = DEFAULT_UMASK,
 	.enable_6to4 = false,
+	.dnsproxy_cache_size = 0,
+	.dnsproxy_cache_memory = 0,
+	.dnsproxy_serve_stale = true,
+	.dnsproxy_udp_batch = 0,
+	.dnsproxy_persistent_cache = false,
+	.dnsproxy_parallel_queries = 0,
+	.services_changed_delta = false,
+	.storage_write_delay = 1000,
+	.storage_service_index = false,
+	.property_changed_batch = false,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -129,6 +149,16 @@ static struct {
 #define CONF_STORAGE_FILE_PERMISSIONS   "StorageFilePermissions"
 #define CONF_UMASK                      "Umask"
 #define CONF_ENABLE_6TO4                "Enable6to4"
+#define CONF_DNSPROXY_CACHE_SIZE        "DnsProxyCacheSize"
+#define CONF_DNSPROXY_CACHE_MEMORY      "DnsProxyCacheMemory"
+#define CONF_DNSPROXY_SERVE_STALE       "DnsProxyServeStale"
+#define CONF_DNSPROXY_UDP_BATCH         "DnsProxyUdpBatch"
+#define CONF_DNSPROXY_PERSISTENT_CACHE  "DnsProxyPersistentCache"
+#define CONF_DNSPROXY_PARALLEL_QUERIES  "DnsProxyParallelQueries"
+#define CONF_SERVICES_CHANGED_DELTA     "ServicesChangedDelta"
+#define CONF_STORAGE_WRITE_DELAY        "StorageWriteDelay"
+#define CONF_STORAGE_SERVICE_INDEX      "StorageServiceIndex"
+#define CONF_PROPERTY_CHANGED_BATCH     "PropertyChangedBatch"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -154,6 +184,16 @@ static const char *supported_options[] = {
 	CONF_DONT_BRING_DOWN_AT_STARTUP,
 	CONF_DISABLE_PLUGINS,
 	CONF_ENABLE_6TO4,
+	CONF_DNSPROXY_CACHE_SIZE,
+	CONF_DNSPROXY_CACHE_MEMORY,
+	CONF_DNSPROXY_SERVE_STALE,
+	CONF_DNSPROXY_UDP_BATCH,
+	CONF_DNSPROXY_PERSISTENT_CACHE,
+	CONF_DNSPROXY_PARALLEL_QUERIES,
+	CONF_SERVICES_CHANGED_DELTA,
+	CONF_STORAGE_WRITE_DELAY,
+	CONF_STORAGE_SERVICE_INDEX,
+	CONF_PROPERTY_CHANGED_BATCH,
 	NULL
 };
 
@@ -311,6 +351,7 @@ static void parse_config(GKeyFile *config)
 	struct in_addr ip;
 	gsize len;
 	int timeout;
+	int integer;
 
 	if (!config) {
 		connman_settings.auto_connect =
@@ -478,6 +519,76 @@ static void parse_config(GKeyFile *config)
 		connman_settings.enable_6to4 = boolean;
 
 	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, group,
+					CONF_DNSPROXY_CACHE_SIZE, &error);
+	if (!error && integer >= 0)
+		connman_settings.dnsproxy_cache_size = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, group,
+					CONF_DNSPROXY_CACHE_MEMORY, &error);
+	if (!error && integer >= 0)
+		connman_settings.dnsproxy_cache_memory = integer;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, group,
+					CONF_DNSPROXY_SERVE_STALE, &error);
+	if (!error)
+		connman_settings.dnsproxy_serve_stale = boolean;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, group,
+					CONF_DNSPROXY_UDP_BATCH, &error);
+	if (!error && integer >= 0)
+		connman_settings.dnsproxy_udp_batch = integer;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, group,
+					CONF_DNSPROXY_PERSISTENT_CACHE, &error);
+	if (!error)
+		connman_settings.dnsproxy_persistent_cache = boolean;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, group,
+					CONF_DNSPROXY_PARALLEL_QUERIES, &error);
+	if (!error && integer >= 0)
+		connman_settings.dnsproxy_parallel_queries = integer;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, group,
+					CONF_SERVICES_CHANGED_DELTA, &error);
+	if (!error)
+		connman_settings.services_changed_delta = boolean;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, group,
+					CONF_STORAGE_WRITE_DELAY, &error);
+	if (!error && integer >= 0)
+		connman_settings.storage_write_delay = integer;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, group,
+					CONF_STORAGE_SERVICE_INDEX, &error);
+	if (!error)
+		connman_settings.storage_service_index = boolean;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, group,
+					CONF_PROPERTY_CHANGED_BATCH, &error);
+	if (!error)
+		connman_settings.property_changed_batch = boolean;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -579,6 +690,7 @@ static gchar *option_plugin = NULL;
 static gchar *option_nodevice = NULL;
 static gchar *option_noplugin = NULL;
 static gchar *option_wifi = NULL;
+static gchar *option_trace = NULL;
 static gboolean option_detach = TRUE;
 static gboolean option_dnsproxy = TRUE;
 static gboolean option_backtrace = TRUE;
@@ -649,6 +761,9 @@ static GOptionEntry options[] = {
 	{ "nodnsproxy", 'r', G_OPTION_FLAG_REVERSE,
 				G_OPTION_ARG_NONE, &option_dnsproxy,
 				"Don't enable DNS Proxy" },
+	{ "trace", 't', 0, G_OPTION_ARG_FILENAME, &option_trace,
+				"Store debug messages in a binary trace file "
+				"instead of syslog", "FILE" },
 	{ "nobacktrace", 0, G_OPTION_FLAG_REVERSE,
 				G_OPTION_ARG_NONE, &option_backtrace,
 				"Don't print out backtrace information" },
@@ -705,6 +820,18 @@ bool connman_setting_get_bool(const char *key)
 	if (g_str_equal(key, CONF_ENABLE_6TO4))
 		return connman_settings.enable_6to4;
 
+	if (g_str_equal(key, CONF_DNSPROXY_SERVE_STALE))
+		return connman_settings.dnsproxy_serve_stale;
+
+	if (g_str_equal(key, CONF_DNSPROXY_PERSISTENT_CACHE))
+		return connman_settings.dnsproxy_persistent_cache;
+
+	if (g_str_equal(key, CONF_SERVICES_CHANGED_DELTA))
+		return connman_settings.services_changed_delta;
+
+	if (g_str_equal(key, CONF_PROPERTY_CHANGED_BATCH))
+		return connman_settings.property_changed_batch;
+
 	return false;
 }
 
@@ -739,6 +866,23 @@ unsigned int *connman_setting_get_uint_list(const char *key)
 	return NULL;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, CONF_DNSPROXY_CACHE_SIZE))
+		return connman_settings.dnsproxy_cache_size;
+
+	if (g_str_equal(key, CONF_DNSPROXY_CACHE_MEMORY))
+		return connman_settings.dnsproxy_cache_memory;
+
+	if (g_str_equal(key, CONF_DNSPROXY_UDP_BATCH))
+		return connman_settings.dnsproxy_udp_batch;
+
+	if (g_str_equal(key, CONF_DNSPROXY_PARALLEL_QUERIES))
+		return connman_settings.dnsproxy_parallel_queries;
+
+	return 0;
+}
+
 unsigned int connman_timeout_input_request(void)
 {
 	return connman_settings.timeout_inputreq;
@@ -756,6 +900,7 @@ int main(int argc, char *argv[])
 	DBusConnection *conn;
 	DBusError err;
 	guint signal;
+	int trace_err = 0;
 
 	context = g_option_context_new(NULL);
 	g_option_context_add_main_entries(context, options, NULL);
@@ -806,9 +951,19 @@ int main(int argc, char *argv[])
 
 	g_dbus_set_disconnect_function(conn, disconnect_callback, NULL, NULL);
 
+	/* Tracing is cheap enough to keep all debug messages */
+	if (option_trace) {
+		trace_err = __connman_log_trace_init(option_trace);
+		if (trace_err == 0 && !option_debug)
+			option_debug = g_strdup("*");
+	}
+
 	__connman_log_init(argv[0], option_debug, option_detach,
 			option_backtrace, "Connection Manager", VERSION);
 
+	if (trace_err < 0)
+		connman_error("Debug trace disabled: %s", strerror(-trace_err));
+
 	__connman_dbus_init(conn);
 
 	if (!option_config)
@@ -823,6 +978,10 @@ int main(int argc, char *argv[])
 	__connman_storage_init(connman_settings.storage_root,
 				connman_settings.storage_dir_permissions,
 				connman_settings.storage_file_permissions);
+	__connman_storage_set_write_delay(
+				connman_settings.storage_write_delay);
+	__connman_storage_set_service_index(
+				connman_settings.storage_service_index);
 
 	if (g_mkdir_with_parents(STORAGEDIR,
 			connman_settings.storage_dir_permissions) < 0) {
@@ -906,6 +1065,7 @@ int main(int argc, char *argv[])
 	__connman_proxy_cleanup();
 	__connman_task_cleanup();
 	__connman_rtnl_cleanup();
+	__connman_inet_cleanup();
 	__connman_resolver_cleanup();
 
 	__connman_clock_cleanup();
@@ -957,6 +1117,7 @@ int main(int argc, char *argv[])
 
 	g_free(option_debug);
 	g_free(option_wifi);
+	g_free(option_trace);
 
 	return 0;
 }
@@ -251,6 +251,180 @@ static DBusMessage *get_peers(DBusConnection *conn,
 	return reply;
 }
 
+static DBusMessage *get_dnsproxy_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	struct connman_dnsproxy_stats stats;
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	__connman_dnsproxy_get_stats(&stats);
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "PrefetchQueries",
+				DBUS_TYPE_UINT32, &stats.prefetch_queries);
+	connman_dbus_dict_append_basic(&dict, "PrefetchHits",
+				DBUS_TYPE_UINT32, &stats.prefetch_hits);
+	connman_dbus_dict_append_basic(&dict, "StaleAnswers",
+				DBUS_TYPE_UINT32, &stats.stale_answers);
+	connman_dbus_dict_append_basic(&dict, "UdpWakeups",
+				DBUS_TYPE_UINT32, &stats.udp_wakeups);
+	connman_dbus_dict_append_basic(&dict, "UdpQueries",
+				DBUS_TYPE_UINT32, &stats.udp_queries);
+	connman_dbus_dict_append_basic(&dict, "UdpMaxBatch",
+				DBUS_TYPE_UINT32, &stats.udp_max_batch);
+
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
+static void append_dns_server_stats(
+			struct connman_dnsproxy_server_stats *stats,
+			void *user_data)
+{
+	DBusMessageIter *array = user_data;
+	DBusMessageIter entry, dict;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL,
+								&entry);
+
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING,
+							&stats->server);
+
+	connman_dbus_dict_open(&entry, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "Index",
+				DBUS_TYPE_INT32, &stats->index);
+	connman_dbus_dict_append_basic(&dict, "Rtt",
+				DBUS_TYPE_UINT32, &stats->srtt);
+	connman_dbus_dict_append_basic(&dict, "RttVariance",
+				DBUS_TYPE_UINT32, &stats->rttvar);
+	connman_dbus_dict_append_basic(&dict, "Loss",
+				DBUS_TYPE_UINT32, &stats->loss);
+	connman_dbus_dict_append_basic(&dict, "Queries",
+				DBUS_TYPE_UINT32, &stats->queries);
+	connman_dbus_dict_append_basic(&dict, "Replies",
+				DBUS_TYPE_UINT32, &stats->replies);
+	connman_dbus_dict_append_basic(&dict, "Timeouts",
+				DBUS_TYPE_UINT32, &stats->timeouts);
+	connman_dbus_dict_append_basic(&dict, "Failures",
+				DBUS_TYPE_UINT32, &stats->failures);
+
+	connman_dbus_dict_close(&entry, &dict);
+
+	dbus_message_iter_close_container(array, &entry);
+}
+
+static DBusMessage *get_dns_server_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+			DBUS_STRUCT_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING
+			DBUS_STRUCT_END_CHAR_AS_STRING, &array);
+
+	__connman_dnsproxy_foreach_server_stats(append_dns_server_stats,
+								&array);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	return reply;
+}
+
+static DBusMessage *sync_storage(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	DBG("conn %p", conn);
+
+	__connman_storage_sync();
+
+	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
+}
+
+static DBusMessage *get_storage_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	unsigned int requested, performed;
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	__connman_storage_get_stats(&requested, &performed);
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "SavesRequested",
+				DBUS_TYPE_UINT32, &requested);
+	connman_dbus_dict_append_basic(&dict, "SavesPerformed",
+				DBUS_TYPE_UINT32, &performed);
+
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
+static DBusMessage *get_property_changed_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	unsigned int changes, signals;
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+
+	DBG("conn %p", conn);
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	__connman_dbus_get_batch_stats(&changes, &signals);
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+
+	connman_dbus_dict_append_basic(&dict, "PropertyChanges",
+				DBUS_TYPE_UINT32, &changes);
+	connman_dbus_dict_append_basic(&dict, "SignalsSent",
+				DBUS_TYPE_UINT32, &signals);
+
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
 static DBusMessage *connect_provider(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -799,6 +973,19 @@ static const GDBusMethodTable manager_methods[] = {
 	{ GDBUS_METHOD("GetPeers",
 			NULL, GDBUS_ARGS({ "peers", "a(oa{sv})" }),
 			get_peers) },
+	{ GDBUS_METHOD("GetDnsProxyStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_dnsproxy_statistics) },
+	{ GDBUS_METHOD("GetDnsServerStatistics",
+			NULL, GDBUS_ARGS({ "servers", "a(sa{sv})" }),
+			get_dns_server_statistics) },
+	{ GDBUS_METHOD("SyncStorage", NULL, NULL, sync_storage) },
+	{ GDBUS_METHOD("GetStorageStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_storage_statistics) },
+	{ GDBUS_METHOD("GetPropertyChangedStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_property_changed_statistics) },
 	{ GDBUS_DEPRECATED_ASYNC_METHOD("ConnectProvider",
 			      GDBUS_ARGS({ "provider", "a{sv}" }),
 			      GDBUS_ARGS({ "path", "o" }),
@@ -863,6 +1050,10 @@ static const GDBusSignalTable manager_signals[] = {
 	{ GDBUS_SIGNAL("ServicesChanged",
 			GDBUS_ARGS({ "changed", "a(oa{sv})" },
 					{ "removed", "ao" })) },
+	{ GDBUS_SIGNAL("ServicesDelta",
+			GDBUS_ARGS({ "moved", "a(oua{sv})" },
+					{ "removed", "ao" },
+					{ "count", "u" })) },
 	{ GDBUS_SIGNAL("PeersChanged",
 			GDBUS_ARGS({ "changed", "a(oa{sv})" },
 					{ "removed", "ao" })) },
@@ -500,8 +500,7 @@ static gboolean peer_send_changed(gpointer data)
 	__connman_dbus_append_objpath_array(signal,
 						peer_append_removed, NULL);
 
-	dbus_connection_send(connection, signal, NULL);
-	dbus_message_unref(signal);
+	g_dbus_send_message(connection, signal);
 
 	g_hash_table_remove_all(peers_notify->remove);
 	g_hash_table_remove_all(peers_notify->add);
@@ -422,6 +422,8 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 	if (!extract_link(msg, bytes, &address, &ifname, &mtu, &operstate, &stats))
 		return;
 
+	__connman_inet_ifname_cache_set(index, ifname);
+
 	snprintf(ident, 13, "%02x%02x%02x%02x%02x%02x",
 						address.ether_addr_octet[0],
 						address.ether_addr_octet[1],
@@ -541,6 +543,8 @@ static void process_dellink(unsigned short type, int index, unsigned flags,
 	}
 
 	g_hash_table_remove(interface_list, GINT_TO_POINTER(index));
+
+	__connman_inet_ifname_cache_remove(index);
 }
 
 static void extract_ipv4_addr(struct ifaddrmsg *msg, int bytes,
@@ -1305,6 +1309,19 @@ static const char *type2string(uint16_t type)
 static GIOChannel *channel = NULL;
 static guint channel_watch = 0;
 
+/* Big enough for a NLMSG_GOODSIZE dump part, grown when needed */
+#define RTNL_BUF_SIZE		32768
+/* Datagrams read before returning to the main loop */
+#define RTNL_MAX_BATCH		64
+#define RTNL_RCVBUF_SIZE	(1024 * 1024)
+
+static void *rtnl_buf = NULL;
+static size_t rtnl_buf_size = 0;
+static unsigned int rtnl_dropped = 0;
+static guint resync_id = 0;
+
+static void schedule_resync(void);
+
 struct rtnl_request {
 	struct nlmsghdr hdr;
 	struct rtgenmsg msg;
@@ -1395,7 +1412,10 @@ static void rtnl_message(void *buf, size_t len)
 
 		switch (hdr->nlmsg_type) {
 		case NLMSG_NOOP:
+			return;
 		case NLMSG_OVERRUN:
+			rtnl_dropped++;
+			schedule_resync();
 			return;
 		case NLMSG_DONE:
 			process_response(hdr->nlmsg_seq);
@@ -1433,40 +1453,79 @@ static void rtnl_message(void *buf, size_t len)
 	}
 }
 
-static gboolean netlink_event(GIOChannel *chan, GIOCondition cond, gpointer data)
+static int rtnl_receive(int fd)
 {
-	unsigned char buf[4096];
 	struct sockaddr_nl nladdr;
 	socklen_t addr_len = sizeof(nladdr);
 	ssize_t status;
-	int fd;
-
-	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
-		return FALSE;
-
-	memset(buf, 0, sizeof(buf));
-	memset(&nladdr, 0, sizeof(nladdr));
 
-	fd = g_io_channel_unix_get_fd(chan);
-
-	status = recvfrom(fd, buf, sizeof(buf), 0,
-                       (struct sockaddr *) &nladdr, &addr_len);
-	if (status < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			return TRUE;
+	/*
+	 * Peek first so that the buffer can be grown to fit the whole
+	 * datagram, netlink drops the part that does not fit otherwise.
+	 */
+	while (true) {
+		status = recvfrom(fd, rtnl_buf, rtnl_buf_size,
+					MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT,
+					(struct sockaddr *) &nladdr, &addr_len);
+		if (status < 0)
+			return -errno;
+
+		if ((size_t) status <= rtnl_buf_size)
+			break;
 
-		return FALSE;
+		rtnl_buf_size = status;
+		rtnl_buf = g_realloc(rtnl_buf, rtnl_buf_size);
 	}
 
+	/* The data is already in the buffer, only dequeue the datagram */
+	if (recv(fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN)
+		return -errno;
+
 	if (status == 0)
-		return FALSE;
+		return 0;
 
 	if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
 		DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
-		return TRUE;
+		return 1;
 	}
 
-	rtnl_message(buf, status);
+	rtnl_message(rtnl_buf, status);
+
+	return 1;
+}
+
+static gboolean netlink_event(GIOChannel *chan, GIOCondition cond, gpointer data)
+{
+	int fd, err, count;
+
+	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
+		return FALSE;
+
+	fd = g_io_channel_unix_get_fd(chan);
+
+	/*
+	 * Drain what is queued, but give the main loop a chance to run
+	 * once in a while when the kernel keeps sending.
+	 */
+	for (count = 0; count < RTNL_MAX_BATCH; count++) {
+		err = rtnl_receive(fd);
+		if (err > 0)
+			continue;
+
+		switch (err) {
+		case -EINTR:
+			continue;
+		case -EAGAIN:
+			return TRUE;
+		case -ENOBUFS:
+			/* The socket overflowed and events were lost */
+			rtnl_dropped++;
+			schedule_resync();
+			continue;
+		default:
+			return FALSE;
+		}
+	}
 
 	return TRUE;
 }
@@ -1531,6 +1590,53 @@ static int send_getroute(void)
 	return queue_request(req);
 }
 
+static bool request_pending(uint16_t type)
+{
+	GSList *list;
+
+	/* The head of the list has been sent already */
+	if (!request_list)
+		return false;
+
+	for (list = request_list->next; list; list = list->next) {
+		struct rtnl_request *req = list->data;
+
+		if (req->hdr.nlmsg_type == type)
+			return true;
+	}
+
+	return false;
+}
+
+static gboolean resync_cb(gpointer user_data)
+{
+	resync_id = 0;
+
+	connman_warn("rtnl events lost, resyncing (%u overruns so far)",
+							rtnl_dropped);
+
+	/* A lost RTM_DELLINK would leave a stale name behind */
+	__connman_inet_ifname_cache_flush();
+
+	/* Dump everything again to catch up with what was lost */
+	if (!request_pending(RTM_GETLINK))
+		send_getlink();
+	if (!request_pending(RTM_GETADDR))
+		send_getaddr();
+	if (!request_pending(RTM_GETROUTE))
+		send_getroute();
+
+	return FALSE;
+}
+
+static void schedule_resync(void)
+{
+	if (resync_id > 0)
+		return;
+
+	resync_id = g_idle_add(resync_cb, NULL);
+}
+
 static gboolean update_timeout_cb(gpointer user_data)
 {
 	__connman_rtnl_request_update();
@@ -1606,7 +1712,7 @@ int __connman_rtnl_request_update(void)
 int __connman_rtnl_init(void)
 {
 	struct sockaddr_nl addr;
-	int sk;
+	int sk, rcvbuf = RTNL_RCVBUF_SIZE;
 
 	DBG("");
 
@@ -1628,6 +1734,14 @@ int __connman_rtnl_init(void)
 		return -1;
 	}
 
+	/* Make room for bursts of events when many links change at once */
+	if (setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf,
+						sizeof(rcvbuf)) < 0)
+		connman_warn("SO_RCVBUF: %s", strerror(errno));
+
+	rtnl_buf_size = RTNL_BUF_SIZE;
+	rtnl_buf = g_malloc(rtnl_buf_size);
+
 	channel = g_io_channel_unix_new(sk);
 	g_io_channel_set_close_on_unref(channel, TRUE);
 
@@ -1691,6 +1805,15 @@ void __connman_rtnl_cleanup(void)
 		channel_watch = 0;
 	}
 
+	if (resync_id) {
+		g_source_remove(resync_id);
+		resync_id = 0;
+	}
+
+	g_free(rtnl_buf);
+	rtnl_buf = NULL;
+	rtnl_buf_size = 0;
+
 	g_io_channel_shutdown(channel, TRUE, NULL);
 	g_io_channel_unref(channel);
 
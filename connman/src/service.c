@@ -39,6 +39,7 @@
 #include <connman/provision.h>
 
 #include "connman.h"
+#include "src/shared/services-delta.h"
 
 #define CONNECT_TIMEOUT		120
 
@@ -170,6 +171,8 @@ static struct connman_service *current_default = NULL;
 static bool services_dirty = false;
 static bool autoconnect_paused = false;
 static guint load_wifi_services_id = 0;
+static unsigned int sort_frozen = 0;
+static bool sort_pending = false;
 
 struct connman_service_boolean_property {
 	const char *name;
@@ -270,6 +273,8 @@ struct connman_service {
 	GBytes *ssid;
 	struct connman_access_service_policy *policy;
 	char *access;
+	int notify_index; /* position in the last services signal */
+	bool notify_moved; /* listed in the next ServicesDelta */
 };
 
 static const char *service_get_access(struct connman_service *service);
@@ -286,11 +291,6 @@ static struct connman_ipconfig *create_ip4config(struct connman_service *service
 static struct connman_ipconfig *create_ip6config(struct connman_service *service,
 		int index);
 
-struct find_data {
-	const char *path;
-	struct connman_service *service;
-};
-
 void __connman_service_foreach(void (*fn) (struct connman_service *service,
 					void *user_data), void *user_data)
 {
@@ -414,27 +414,22 @@ static void service_remove(struct connman_service *service)
 	g_hash_table_remove(service_hash, service->identifier);
 }
 
-static void compare_path(gpointer value, gpointer user_data)
-{
-	struct connman_service *service = value;
-	struct find_data *data = user_data;
-
-	if (data->service)
-		return;
-
-	if (g_strcmp0(service->path, data->path) == 0)
-		data->service = service;
-}
-
 static struct connman_service *find_service(const char *path)
 {
-	struct find_data data = { .path = path, .service = NULL };
+	struct connman_service *service;
+	const char *prefix = CONNMAN_PATH "/service/";
 
 	DBG("path %s", path);
 
-	g_list_foreach(service_list, compare_path, &data);
+	/* The object path is made of the identifier */
+	if (!g_str_has_prefix(path, prefix))
+		return NULL;
+
+	service = g_hash_table_lookup(service_hash, path + strlen(prefix));
+	if (!service || g_strcmp0(service->path, path))
+		return NULL;
 
-	return data.service;
+	return service;
 }
 
 static const char *reason2string(enum connman_service_connect_reason reason)
@@ -1532,51 +1527,81 @@ void __connman_service_nameserver_clear(struct connman_service *service)
 	nameserver_add_all(service, CONNMAN_IPCONFIG_TYPE_ALL);
 }
 
-static void add_nameserver_route(int family, int index, char *nameserver,
-				const char *gw)
-{
-	switch (family) {
-	case AF_INET:
-		if (connman_inet_compare_subnet(index, nameserver))
-			break;
-
-		if (connman_inet_add_host_route(index, nameserver, gw) < 0)
-			/* For P-t-P link the above route add will fail */
-			connman_inet_add_host_route(index, nameserver, NULL);
-		break;
-
-	case AF_INET6:
-		if (connman_inet_add_ipv6_host_route(index, nameserver,
-								gw) < 0)
-			connman_inet_add_ipv6_host_route(index, nameserver,
-							NULL);
-		break;
-	}
-}
-
+/*
+ * The IPv4 routes of all nameservers are sent to the kernel in one
+ * batch. The routes via the gateway that fail, as they do on a P-t-P
+ * link, are retried in a second batch without the gateway.
+ */
 static void nameserver_add_routes(int index, char **nameservers,
 					const char *gw)
 {
+	struct __connman_inet_rtnl_batch *batch, *retry = NULL;
 	int i, ns_family, gw_family;
+	int *ops;
 
 	gw_family = connman_inet_check_ipaddress(gw);
 	if (gw_family < 0)
 		return;
 
+	batch = __connman_inet_rtnl_batch_new();
+	ops = g_new0(int, g_strv_length(nameservers));
+
 	for (i = 0; nameservers[i]; i++) {
+		ops[i] = -1;
+
 		ns_family = connman_inet_check_ipaddress(nameservers[i]);
 		if (ns_family < 0 || ns_family != gw_family)
 			continue;
 
-		add_nameserver_route(ns_family, index, nameservers[i], gw);
+		switch (ns_family) {
+		case AF_INET:
+			if (connman_inet_compare_subnet(index, nameservers[i]))
+				break;
+
+			ops[i] = __connman_inet_batch_add_host_route(batch,
+						index, nameservers[i], gw);
+			break;
+
+		case AF_INET6:
+			if (connman_inet_add_ipv6_host_route(index,
+						nameservers[i], gw) < 0)
+				connman_inet_add_ipv6_host_route(index,
+						nameservers[i], NULL);
+			break;
+		}
 	}
+
+	__connman_inet_rtnl_batch_commit(batch);
+
+	for (i = 0; nameservers[i]; i++) {
+		if (ops[i] < 0 ||
+			__connman_inet_rtnl_batch_result(batch, ops[i]) >= 0)
+			continue;
+
+		if (!retry)
+			retry = __connman_inet_rtnl_batch_new();
+
+		__connman_inet_batch_add_host_route(retry, index,
+						nameservers[i], NULL);
+	}
+
+	if (retry) {
+		__connman_inet_rtnl_batch_commit(retry);
+		__connman_inet_rtnl_batch_free(retry);
+	}
+
+	__connman_inet_rtnl_batch_free(batch);
+	g_free(ops);
 }
 
 static void nameserver_del_routes(int index, char **nameservers,
 				enum connman_ipconfig_type type)
 {
+	struct __connman_inet_rtnl_batch *batch;
 	int i, family;
 
+	batch = __connman_inet_rtnl_batch_new();
+
 	for (i = 0; nameservers[i]; i++) {
 		family = connman_inet_check_ipaddress(nameservers[i]);
 		if (family < 0)
@@ -1585,8 +1610,8 @@ static void nameserver_del_routes(int index, char **nameservers,
 		switch (family) {
 		case AF_INET:
 			if (type != CONNMAN_IPCONFIG_TYPE_IPV6)
-				connman_inet_del_host_route(index,
-							nameservers[i]);
+				__connman_inet_batch_del_host_route(batch,
+						index, nameservers[i]);
 			break;
 		case AF_INET6:
 			if (type != CONNMAN_IPCONFIG_TYPE_IPV4)
@@ -1595,6 +1620,9 @@ static void nameserver_del_routes(int index, char **nameservers,
 			break;
 		}
 	}
+
+	__connman_inet_rtnl_batch_commit(batch);
+	__connman_inet_rtnl_batch_free(batch);
 }
 
 void __connman_service_nameserver_add_routes(struct connman_service *service,
@@ -5325,6 +5353,79 @@ static DBusMessage *reset_counters(DBusConnection *conn,
 	return g_dbus_create_reply(msg, DBUS_TYPE_INVALID);
 }
 
+static void append_history(DBusMessageIter *dict, const char *key,
+			struct connman_stats *stats, time_t since)
+{
+	struct connman_stats_data data;
+	DBusMessageIter entry, value, counters;
+
+	if (__connman_stats_get_since(stats, since, &data) < 0)
+		return;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+			DBUS_TYPE_ARRAY_AS_STRING
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &value);
+
+	connman_dbus_dict_open(&value, &counters);
+	connman_dbus_dict_append_basic(&counters, "RX.Packets",
+				DBUS_TYPE_UINT64, &data.rx_packets);
+	connman_dbus_dict_append_basic(&counters, "TX.Packets",
+				DBUS_TYPE_UINT64, &data.tx_packets);
+	connman_dbus_dict_append_basic(&counters, "RX.Bytes",
+				DBUS_TYPE_UINT64, &data.rx_bytes);
+	connman_dbus_dict_append_basic(&counters, "TX.Bytes",
+				DBUS_TYPE_UINT64, &data.tx_bytes);
+	connman_dbus_dict_append_basic(&counters, "RX.Errors",
+				DBUS_TYPE_UINT64, &data.rx_errors);
+	connman_dbus_dict_append_basic(&counters, "TX.Errors",
+				DBUS_TYPE_UINT64, &data.tx_errors);
+	connman_dbus_dict_append_basic(&counters, "RX.Dropped",
+				DBUS_TYPE_UINT64, &data.rx_dropped);
+	connman_dbus_dict_append_basic(&counters, "TX.Dropped",
+				DBUS_TYPE_UINT64, &data.tx_dropped);
+	connman_dbus_dict_close(&value, &counters);
+
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static DBusMessage *get_history(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	struct connman_service *service = user_data;
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+	dbus_uint32_t seconds;
+	time_t since;
+
+	if (!dbus_message_get_args(msg, NULL, DBUS_TYPE_UINT32, &seconds,
+							DBUS_TYPE_INVALID))
+		return __connman_error_invalid_arguments(msg);
+
+	DBG("service %p seconds %u", service, seconds);
+
+	since = time(NULL) - seconds;
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+	append_history(&dict, "Home", stats_get_home(service, false), since);
+	append_history(&dict, "Roaming", stats_get_roaming(service, false),
+									since);
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
 static DBusMessage *check_access(DBusConnection *conn,
 					DBusMessage *msg, void *user_data)
 {
@@ -5379,6 +5480,8 @@ static struct _services_notify {
 	GHashTable *remove;
 } *services_notify;
 
+static bool services_delta;
+
 static void service_append_added_foreach(gpointer data, gpointer user_data)
 {
 	struct connman_service *service = data;
@@ -5403,7 +5506,98 @@ static void service_append_added_foreach(gpointer data, gpointer user_data)
 
 static void service_append_ordered(DBusMessageIter *iter, void *user_data)
 {
+	GList *list;
+	int index = 0;
+
 	g_list_foreach(service_list, service_append_added_foreach, iter);
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+
+		if (service && service->path)
+			service->notify_index = index++;
+	}
+}
+
+/*
+ * Number of services that are new or out of the order they had when
+ * the services were signaled last time, see services_delta_moved().
+ */
+static unsigned int services_moved(void)
+{
+	struct connman_service *service;
+	unsigned int nr = 0, moved;
+	int *prev_index;
+	bool *is_moved;
+	GList *list;
+
+	for (list = service_list; list; list = list->next) {
+		service = list->data;
+		if (service && service->path)
+			nr++;
+	}
+
+	if (!nr)
+		return 0;
+
+	prev_index = g_new(int, nr);
+	is_moved = g_new(bool, nr);
+
+	nr = 0;
+	for (list = service_list; list; list = list->next) {
+		service = list->data;
+		if (service && service->path)
+			prev_index[nr++] = service->notify_index;
+	}
+
+	moved = services_delta_moved(prev_index, nr, is_moved);
+
+	nr = 0;
+	for (list = service_list; list; list = list->next) {
+		service = list->data;
+		if (service && service->path)
+			service->notify_moved = is_moved[nr++];
+	}
+
+	g_free(is_moved);
+	g_free(prev_index);
+
+	return moved;
+}
+
+static void append_added_properties(DBusMessageIter *dict, void *user_data)
+{
+	append_properties(dict, TRUE, user_data);
+}
+
+static void service_append_moved(DBusMessageIter *iter, void *user_data)
+{
+	GList *list;
+	dbus_uint32_t index = 0;
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+		bool added;
+
+		if (!service || !service->path)
+			continue;
+
+		if (!service->notify_moved) {
+			service->notify_index = index++;
+			continue;
+		}
+
+		added = g_hash_table_remove(services_notify->add,
+							service->path);
+		if (added)
+			DBG("new %s", service->path);
+
+		services_delta_append(iter, service->path, index,
+				added ? append_added_properties : NULL,
+				service);
+
+		service->notify_index = index++;
+	}
 }
 
 static void append_removed(gpointer key, gpointer value, gpointer user_data)
@@ -5420,6 +5614,46 @@ static void service_append_removed(DBusMessageIter *iter, void *user_data)
 	g_hash_table_foreach(services_notify->remove, append_removed, iter);
 }
 
+/*
+ * ServicesDelta carries only the services that were added or moved,
+ * each with its new position. The services that are not listed keep
+ * the position they had before, so the complete list can be rebuilt
+ * from the previous one.
+ */
+static DBusMessage *services_delta_signal(void)
+{
+	DBusMessage *signal;
+	DBusMessageIter iter, array;
+	dbus_uint32_t count = 0;
+	GList *list;
+
+	signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
+			CONNMAN_MANAGER_INTERFACE, "ServicesDelta");
+	if (!signal)
+		return NULL;
+
+	dbus_message_iter_init_append(signal, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+					SERVICES_DELTA_SIGNATURE, &array);
+	service_append_moved(&array, NULL);
+	dbus_message_iter_close_container(&iter, &array);
+
+	__connman_dbus_append_objpath_array(signal,
+					service_append_removed, NULL);
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+
+		if (service && service->path)
+			count++;
+	}
+
+	dbus_message_append_args(signal, DBUS_TYPE_UINT32, &count,
+							DBUS_TYPE_INVALID);
+
+	return signal;
+}
+
 static gboolean service_send_changed(gpointer data)
 {
 	DBusMessage *signal;
@@ -5428,18 +5662,31 @@ static gboolean service_send_changed(gpointer data)
 
 	services_notify->id = 0;
 
-	signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
-			CONNMAN_MANAGER_INTERFACE, "ServicesChanged");
-	if (!signal)
+	/* Sorting often leaves the order as it was */
+	if (services_moved() == 0 &&
+			g_hash_table_size(services_notify->remove) == 0) {
+		DBG("services unchanged");
+		g_hash_table_remove_all(services_notify->add);
 		return FALSE;
+	}
 
-	__connman_dbus_append_objpath_dict_array(signal,
+	if (services_delta) {
+		signal = services_delta_signal();
+		if (!signal)
+			return FALSE;
+	} else {
+		signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
+				CONNMAN_MANAGER_INTERFACE, "ServicesChanged");
+		if (!signal)
+			return FALSE;
+
+		__connman_dbus_append_objpath_dict_array(signal,
 					service_append_ordered, NULL);
-	__connman_dbus_append_objpath_array(signal,
+		__connman_dbus_append_objpath_array(signal,
 					service_append_removed, NULL);
+	}
 
-	dbus_connection_send(connection, signal, NULL);
-	dbus_message_unref(signal);
+	g_dbus_send_message(connection, signal);
 
 	g_hash_table_remove_all(services_notify->remove);
 	g_hash_table_remove_all(services_notify->add);
@@ -5459,6 +5706,8 @@ static void service_schedule_added(struct connman_service *service)
 {
 	DBG("service %p", service);
 
+	service->notify_index = -1;
+
 	g_hash_table_remove(services_notify->remove, service->path);
 	g_hash_table_replace(services_notify->add, service->path, service);
 
@@ -5474,6 +5723,8 @@ static void service_schedule_removed(struct connman_service *service)
 
 	DBG("service %p %s", service, service->path);
 
+	service->notify_index = -1;
+
 	g_hash_table_remove(services_notify->add, service->path);
 	g_hash_table_replace(services_notify->remove, g_strdup(service->path),
 			NULL);
@@ -5517,6 +5768,9 @@ static const GDBusMethodTable service_methods[] = {
 			GDBUS_ARGS({ "service", "o" }), NULL,
 			move_after) },
 	{ GDBUS_METHOD("ResetCounters", NULL, NULL, reset_counters) },
+	{ GDBUS_METHOD("GetHistory",
+			GDBUS_ARGS({ "seconds", "u" }),
+			GDBUS_ARGS({ "counters", "a{sv}" }), get_history) },
 	{ GDBUS_METHOD("CheckAccess",
 			NULL, GDBUS_ARGS({ "access", "uuu" }),
 			check_access) },
@@ -5531,6 +5785,8 @@ static const GDBusSignalTable service_signals[] = {
 			GDBUS_ARGS({ "name", "s" }, { "value", "v" })) },
 	{ GDBUS_SIGNAL("RestrictedPropertyChanged",
 			GDBUS_ARGS({ "name", "s" })) },
+	{ GDBUS_SIGNAL("PropertiesChanged",
+			GDBUS_ARGS({ "properties", "a{sv}" })) },
 	{ },
 };
 
@@ -5567,6 +5823,7 @@ static void service_free(gpointer user_data)
 	if (path) {
 		__connman_connection_update_gateway();
 
+		__connman_dbus_flush_properties(path);
 		g_dbus_unregister_interface(connection, path,
 						CONNMAN_SERVICE_INTERFACE);
 		g_free(path);
@@ -5671,6 +5928,7 @@ static void service_initialize(struct connman_service *service)
 	service->connect_reason = CONNMAN_SERVICE_CONNECT_REASON_NONE;
 
 	service->order = 0;
+	service->notify_index = -1;
 
 	service->online_check_timer_ipv4 = 0;
 	service->online_check_timer_ipv6 = 0;
@@ -5860,14 +6118,86 @@ static gint service_compare(gconstpointer a, gconstpointer b)
 	return g_strcmp0(service_a->name, service_b->name);
 }
 
+/*
+ * Between two sorts usually only a few services change their sort
+ * keys, e.g. the strength of one network. Instead of sorting the whole
+ * list, an insertion pass moves back only the services that are out
+ * of place. If more than REORDER_MAX_MOVES services have to move, as
+ * after a scan, the insertion pass would become quadratic and the rest
+ * is left to g_list_sort().
+ *
+ * service_compare() is not transitive when services are connecting,
+ * so the order may differ from a full sort in that case.
+ */
+#define REORDER_MAX_MOVES 4
+
+static void service_list_reorder(void)
+{
+	struct connman_service *service;
+	GList *list, *next, *pos;
+	unsigned int moves = 0;
+
+	for (list = service_list->next; list; list = next) {
+		next = list->next;
+		service = list->data;
+
+		if (service_compare(list->prev->data, service) <= 0)
+			continue;
+
+		if (++moves > REORDER_MAX_MOVES) {
+			service_list = g_list_sort(service_list,
+							service_compare);
+			return;
+		}
+
+		for (pos = list->prev->prev; pos; pos = pos->prev) {
+			if (service_compare(pos->data, service) <= 0)
+				break;
+		}
+
+		service_list = g_list_delete_link(service_list, list);
+		service_list = g_list_insert_before(service_list,
+				pos ? pos->next : service_list, service);
+	}
+}
+
 static void service_list_sort(void)
 {
+	if (sort_frozen) {
+		sort_pending = true;
+		return;
+	}
+
 	if (service_list && service_list->next) {
-		service_list = g_list_sort(service_list, service_compare);
+		service_list_reorder();
 		service_schedule_changed();
 	}
 }
 
+/*
+ * Plugins reporting many network updates at once freeze the sorting
+ * of the service list while applying them, the list is then sorted
+ * only once when the last freeze is released.
+ */
+void connman_service_freeze_sort(void)
+{
+	sort_frozen++;
+}
+
+void connman_service_thaw_sort(void)
+{
+	if (!sort_frozen)
+		return;
+
+	if (--sort_frozen)
+		return;
+
+	if (sort_pending) {
+		sort_pending = false;
+		service_list_sort();
+	}
+}
+
 int __connman_service_compare(const struct connman_service *a,
 					const struct connman_service *b)
 {
@@ -8059,6 +8389,9 @@ void connman_service_update_strength_from_network(struct connman_network *networ
 		if (service->strength != strength) {
 			service->strength = strength;
 			strength_changed(service);
+
+			if (sort_frozen)
+				sort_pending = true;
 		}
 	}
 }
@@ -8554,6 +8887,10 @@ int __connman_service_init(void)
 	services_notify->remove = g_hash_table_new_full(g_str_hash,
 			g_str_equal, g_free, NULL);
 	services_notify->add = g_hash_table_new(g_str_hash, g_str_equal);
+	services_delta = connman_setting_get_bool("ServicesChangedDelta");
+
+	if (connman_setting_get_bool("PropertyChangedBatch"))
+		__connman_dbus_batch_interface(CONNMAN_SERVICE_INTERFACE);
 
 	remove_unprovisioned_services();
 
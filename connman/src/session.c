@@ -308,29 +308,45 @@ static void cleanup_firewall_session(struct connman_session *session)
 
 static int init_routing_table(struct connman_session *session)
 {
-	int err;
+	struct __connman_inet_rtnl_batch *batch;
+	int ipv4, ipv6;
 
 	if (session->policy_config->id_type == CONNMAN_SESSION_ID_TYPE_UNKNOWN)
 		return 0;
 
 	DBG("");
 
-	err = __connman_inet_add_fwmark_rule(session->mark,
-						AF_INET, session->mark);
-	if (err < 0)
-		return err;
+	batch = __connman_inet_rtnl_batch_new();
 
-	err = __connman_inet_add_fwmark_rule(session->mark,
+	ipv4 = __connman_inet_batch_add_fwmark_rule(batch, session->mark,
+						AF_INET, session->mark);
+	ipv6 = __connman_inet_batch_add_fwmark_rule(batch, session->mark,
 						AF_INET6, session->mark);
-	if (err < 0)
+
+	__connman_inet_rtnl_batch_commit(batch);
+
+	ipv4 = __connman_inet_rtnl_batch_result(batch, ipv4);
+	ipv6 = __connman_inet_rtnl_batch_result(batch, ipv6);
+
+	__connman_inet_rtnl_batch_free(batch);
+
+	if (ipv4 < 0 && ipv4 != -EEXIST)
+		return ipv4;
+
+	/* A kernel without IPv6 does not know about IPv6 rules */
+	if (ipv6 < 0 && ipv6 != -EEXIST && ipv6 != -EAFNOSUPPORT) {
 		__connman_inet_del_fwmark_rule(session->mark,
 						AF_INET, session->mark);
+		return ipv6;
+	}
+
 	session->policy_routing = true;
 
-	return err;
+	return 0;
 }
 
-static void del_default_route(struct connman_session *session)
+static void del_default_route(struct connman_session *session,
+				struct __connman_inet_rtnl_batch *batch)
 {
 	if (!session->gateway)
 		return;
@@ -338,20 +354,21 @@ static void del_default_route(struct connman_session *session)
 	DBG("index %d routing table %d default gateway %s",
 		session->index, session->mark, session->gateway);
 
-	__connman_inet_del_default_from_table(session->mark,
+	__connman_inet_batch_del_default_from_table(batch, session->mark,
 					session->index, session->gateway);
 	g_free(session->gateway);
 	session->gateway = NULL;
 	session->index = -1;
 }
 
-static void add_default_route(struct connman_session *session)
+/* Returns the position of the request in the batch */
+static int add_default_route(struct connman_session *session,
+				struct __connman_inet_rtnl_batch *batch)
 {
 	struct connman_ipconfig *ipconfig;
-	int err;
 
 	if (!session->service)
-		return;
+		return -EINVAL;
 
 	ipconfig = __connman_service_get_ip4config(session->service);
 	session->index = __connman_ipconfig_get_index(ipconfig);
@@ -360,10 +377,8 @@ static void add_default_route(struct connman_session *session)
 	DBG("index %d routing table %d default gateway %s",
 		session->index, session->mark, session->gateway);
 
-	err = __connman_inet_add_default_to_table(session->mark,
+	return __connman_inet_batch_add_default_to_table(batch, session->mark,
 					session->index, session->gateway);
-	if (err < 0)
-		DBG("session %p %s", session, strerror(-err));
 }
 
 static void del_nat_rules(struct connman_session *session)
@@ -425,24 +440,46 @@ static void add_nat_rules(struct connman_session *session)
 
 static void cleanup_routing_table(struct connman_session *session)
 {
+	struct __connman_inet_rtnl_batch *batch;
+
 	DBG("");
 
+	batch = __connman_inet_rtnl_batch_new();
+
 	if (session->policy_routing) {
-		__connman_inet_del_fwmark_rule(session->mark,
+		__connman_inet_batch_del_fwmark_rule(batch, session->mark,
 					AF_INET6, session->mark);
-
-		__connman_inet_del_fwmark_rule(session->mark,
+		__connman_inet_batch_del_fwmark_rule(batch, session->mark,
 					AF_INET, session->mark);
+
 		session->policy_routing = false;
 	}
 
-	del_default_route(session);
+	del_default_route(session, batch);
+
+	__connman_inet_rtnl_batch_commit(batch);
+	__connman_inet_rtnl_batch_free(batch);
 }
 
 static void update_routing_table(struct connman_session *session)
 {
-	del_default_route(session);
-	add_default_route(session);
+	struct __connman_inet_rtnl_batch *batch;
+	int op, err;
+
+	batch = __connman_inet_rtnl_batch_new();
+
+	del_default_route(session, batch);
+	op = add_default_route(session, batch);
+
+	__connman_inet_rtnl_batch_commit(batch);
+
+	if (op >= 0) {
+		err = __connman_inet_rtnl_batch_result(batch, op);
+		if (err < 0 && err != -EEXIST)
+			DBG("session %p %s", session, strerror(-err));
+	}
+
+	__connman_inet_rtnl_batch_free(batch);
 }
 
 static void update_nat_rules(struct connman_session *session)
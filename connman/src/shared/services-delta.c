@@ -0,0 +1,108 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+
+#include "src/shared/services-delta.h"
+
+/*
+ * Marks the services that are new (prev_index < 0) or out of the order
+ * they had in the last signal, and returns how many there are. The
+ * services that are not marked are the longest run, in list order,
+ * whose positions in the last signal are increasing. So removing or
+ * inserting a service only shifts the services behind it, and moving
+ * one service up or down marks just that service.
+ */
+unsigned int services_delta_moved(const int *prev_index, unsigned int count,
+								bool *moved)
+{
+	unsigned int i, len = 0, lo, hi, mid;
+	int *tails, *prev, n;
+
+	if (!count)
+		return 0;
+
+	tails = g_new(int, count);
+	prev = g_new(int, count);
+
+	for (i = 0; i < count; i++) {
+		moved[i] = true;
+		prev[i] = -1;
+
+		if (prev_index[i] < 0)
+			continue;
+
+		/* Longest increasing run of prev_index, patience sorting */
+		lo = 0;
+		hi = len;
+		while (lo < hi) {
+			mid = (lo + hi) / 2;
+			if (prev_index[tails[mid]] < prev_index[i])
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+
+		if (lo > 0)
+			prev[i] = tails[lo - 1];
+
+		tails[lo] = i;
+		if (lo == len)
+			len++;
+	}
+
+	for (n = len ? tails[len - 1] : -1; n >= 0; n = prev[n])
+		moved[n] = false;
+
+	g_free(prev);
+	g_free(tails);
+
+	return count - len;
+}
+
+/*
+ * Appends one added or moved service with its new position to the
+ * ServicesDelta array. function fills in the properties of an added
+ * service, the dictionary of a moved one is left empty.
+ */
+void services_delta_append(DBusMessageIter *array, const char *path,
+				dbus_uint32_t index,
+				services_delta_append_t function,
+				void *user_data)
+{
+	DBusMessageIter entry, dict;
+
+	dbus_message_iter_open_container(array, DBUS_TYPE_STRUCT, NULL,
+								&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH, &path);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &index);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+	if (function)
+		function(&dict, user_data);
+	dbus_message_iter_close_container(&entry, &dict);
+	dbus_message_iter_close_container(array, &entry);
+}
@@ -0,0 +1,44 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdbool.h>
+
+#include <dbus/dbus.h>
+
+/* Signature of the array of added or moved services in ServicesDelta */
+#define SERVICES_DELTA_SIGNATURE				\
+	DBUS_STRUCT_BEGIN_CHAR_AS_STRING			\
+	DBUS_TYPE_OBJECT_PATH_AS_STRING				\
+	DBUS_TYPE_UINT32_AS_STRING				\
+	DBUS_TYPE_ARRAY_AS_STRING				\
+		DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING		\
+			DBUS_TYPE_STRING_AS_STRING		\
+			DBUS_TYPE_VARIANT_AS_STRING		\
+		DBUS_DICT_ENTRY_END_CHAR_AS_STRING		\
+	DBUS_STRUCT_END_CHAR_AS_STRING
+
+typedef void (*services_delta_append_t) (DBusMessageIter *dict,
+							void *user_data);
+
+unsigned int services_delta_moved(const int *prev_index, unsigned int count,
+								bool *moved);
+void services_delta_append(DBusMessageIter *array, const char *path,
+				dbus_uint32_t index,
+				services_delta_append_t function,
+				void *user_data);
@@ -0,0 +1,144 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2014 Jolla Ltd. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+
+#include "src/shared/stats-history.h"
+
+void stats_history_init(struct stats_history *history, time_t created)
+{
+	memset(history, 0, sizeof(*history));
+	history->version = STATS_HISTORY_VERSION;
+	history->created = created;
+}
+
+/*
+ * The slots of the periods since the last update (or since the history
+ * was created) are closed with the value the counters had at that time,
+ * and the slot of the current period gets the current value.
+ */
+static void history_slots_update(struct stats_history_slot *slots,
+			unsigned int nr, int64_t period, int64_t created,
+			int64_t updated, int64_t now,
+			const struct stats_history_data *before,
+			const struct stats_history_data *after)
+{
+	int64_t cur = now / period;
+	int64_t n = updated ? updated / period + 1 : created / period;
+
+	if (n < cur - nr + 1)
+		n = cur - nr + 1;
+
+	for (; n < cur; n++) {
+		slots[n % nr].start = n * period;
+		slots[n % nr].value = *before;
+	}
+
+	slots[cur % nr].start = cur * period;
+	slots[cur % nr].value = *after;
+}
+
+void stats_history_add(struct stats_history *history, time_t now,
+				const struct stats_history_data *delta)
+{
+	struct stats_history_data before = history->value;
+	struct stats_history_data *value = &history->value;
+
+	if (now < history->updated)
+		now = history->updated;
+
+	value->rx_packets += delta->rx_packets;
+	value->tx_packets += delta->tx_packets;
+	value->rx_bytes   += delta->rx_bytes;
+	value->tx_bytes   += delta->tx_bytes;
+	value->rx_errors  += delta->rx_errors;
+	value->tx_errors  += delta->tx_errors;
+	value->rx_dropped += delta->rx_dropped;
+	value->tx_dropped += delta->tx_dropped;
+
+	history_slots_update(history->hours, STATS_HISTORY_HOURS,
+			STATS_HOUR, history->created, history->updated, now,
+			&before, value);
+	history_slots_update(history->days, STATS_HISTORY_DAYS,
+			STATS_DAY, history->created, history->updated, now,
+			&before, value);
+
+	history->updated = now;
+}
+
+/*
+ * Find the value the counters had at the start of the hour or day
+ * containing since, or NULL if the history does not go back that far.
+ */
+static const struct stats_history_data *history_lookup(
+		const struct stats_history_slot *slots, unsigned int nr,
+		int64_t period, const struct stats_history *history,
+		time_t since)
+{
+	static const struct stats_history_data zero;
+	int64_t n = since / period - 1;
+
+	if (n >= history->updated / period)
+		return &history->value;
+
+	if (n < history->created / period)
+		return &zero;
+
+	if (slots[n % nr].start != n * period)
+		return NULL;
+
+	return &slots[n % nr].value;
+}
+
+/*
+ * Traffic since the given time, rounded down to the hour for the last
+ * STATS_HISTORY_HOURS hours and to the day (UTC) before that.
+ */
+int stats_history_get_since(const struct stats_history *history,
+				time_t since, struct stats_history_data *data)
+{
+	const struct stats_history_data *base;
+	const struct stats_history_data *value = &history->value;
+
+	base = history_lookup(history->hours, STATS_HISTORY_HOURS,
+					STATS_HOUR, history, since);
+	if (!base)
+		base = history_lookup(history->days, STATS_HISTORY_DAYS,
+					STATS_DAY, history, since);
+	if (!base)
+		return -ERANGE;
+
+	data->rx_packets = value->rx_packets - base->rx_packets;
+	data->tx_packets = value->tx_packets - base->tx_packets;
+	data->rx_bytes   = value->rx_bytes   - base->rx_bytes;
+	data->tx_bytes   = value->tx_bytes   - base->tx_bytes;
+	data->rx_errors  = value->rx_errors  - base->rx_errors;
+	data->tx_errors  = value->tx_errors  - base->tx_errors;
+	data->rx_dropped = value->rx_dropped - base->rx_dropped;
+	data->tx_dropped = value->tx_dropped - base->tx_dropped;
+
+	return 0;
+}
@@ -0,0 +1,70 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2014 Jolla Ltd. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Traffic history as it is stored in the "<stats file>.history" files.
+ * It holds monotonic counters, not affected by resets, as they were at
+ * the end of each of the last STATS_HISTORY_HOURS hours and
+ * STATS_HISTORY_DAYS days (UTC). Both are ring buffers indexed by the
+ * hour or day number, so recording a sample and getting the traffic
+ * since a given time take constant time no matter how long the history
+ * is.
+ */
+#define STATS_HISTORY_VERSION   (0x01)
+#define STATS_HISTORY_HOURS     (48)
+#define STATS_HISTORY_DAYS      (400)
+#define STATS_HOUR              (60 * 60)
+#define STATS_DAY               (24 * STATS_HOUR)
+
+struct stats_history_data {
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
+};
+
+struct stats_history_slot {
+	int64_t start;
+	struct stats_history_data value;
+};
+
+struct stats_history {
+	uint32_t version;
+	uint32_t reserved;
+	int64_t created;
+	int64_t updated;
+	struct stats_history_data value;
+	struct stats_history_slot hours[STATS_HISTORY_HOURS];
+	struct stats_history_slot days[STATS_HISTORY_DAYS];
+};
+
+void stats_history_init(struct stats_history *history, time_t created);
+void stats_history_add(struct stats_history *history, time_t now,
+				const struct stats_history_data *delta);
+int stats_history_get_since(const struct stats_history *history,
+				time_t since, struct stats_history_data *data);
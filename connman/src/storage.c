@@ -65,6 +65,23 @@ struct keyfile_record {
 
 static GHashTable *keyfile_hash = NULL;
 
+/*
+ * Saves are not written right away but kept here, keyed by path name,
+ * until the write delay expires. Later saves of the same file replace
+ * the pending keyfile so a burst of changes costs one write.
+ */
+struct pending_save {
+	gchar *pathname;
+	GKeyFile *keyfile;
+};
+
+static GHashTable *pending_saves = NULL;
+static GHashTable *saved_checksums = NULL;
+static unsigned int write_delay = 0;
+static guint flush_timeout = 0;
+static unsigned int saves_requested = 0;
+static unsigned int saves_performed = 0;
+
 static void storage_dir_cleanup(void);
 
 static void storage_inotify_subdir_cb(struct inotify_event *event,
@@ -448,6 +465,29 @@ static void keyfile_cleanup(void)
 	keyfile_hash = NULL;
 }
 
+/*
+ * Pending saves keep a copy of their own, so that a keyfile changed by
+ * its owner after saving or after loading it does not change what is
+ * waiting to be written.
+ */
+static GKeyFile *keyfile_copy(GKeyFile *keyfile)
+{
+	GKeyFile *copy;
+	gchar *data;
+	gsize length;
+
+	copy = g_key_file_new();
+
+	data = g_key_file_to_data(keyfile, &length, NULL);
+	if (data)
+		g_key_file_load_from_data(copy, data, length,
+					G_KEY_FILE_KEEP_COMMENTS, NULL);
+
+	g_free(data);
+
+	return copy;
+}
+
 static GKeyFile *storage_load(const char *pathname)
 {
 	struct keyfile_record *record = NULL;
@@ -456,6 +496,16 @@ static GKeyFile *storage_load(const char *pathname)
 
 	DBG("Loading %s", pathname);
 
+	if (pending_saves) {
+		struct pending_save *pending;
+
+		pending = g_hash_table_lookup(pending_saves, pathname);
+		if (pending) {
+			DBG("Found pending save of %s", pathname);
+			return keyfile_copy(pending->keyfile);
+		}
+	}
+
 	record = g_hash_table_lookup(keyfile_hash, pathname);
 	if (record) {
 		DBG("Found record %p for %s from cache.", record, pathname);
@@ -479,17 +529,13 @@ static GKeyFile *storage_load(const char *pathname)
 	return keyfile;
 }
 
-static int storage_save(GKeyFile *keyfile, char *pathname)
+static int write_file(const char *pathname, const gchar *data, gsize length)
 {
-	gchar *data = NULL;
-	gsize length = 0;
 	GError *error = NULL;
 	int ret = 0;
 	const mode_t perm = STORAGE_FILE_MODE;
 	const mode_t old_mask = umask(~perm & 0777);
 
-	data = g_key_file_to_data(keyfile, &length, NULL);
-
 	if (!g_file_set_contents(pathname, data, length, &error)) {
 		DBG("Failed to store information: %s", error->message);
 		g_error_free(error);
@@ -505,16 +551,586 @@ static int storage_save(GKeyFile *keyfile, char *pathname)
 		}
 	}
 
-	g_free(data);
 	umask(old_mask);
 
 	return ret;
 }
 
+static int storage_write(GKeyFile *keyfile, const char *pathname)
+{
+	gchar *data = NULL;
+	gchar *checksum;
+	gsize length = 0;
+	int ret;
+
+	data = g_key_file_to_data(keyfile, &length, NULL);
+	checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1,
+					(const guchar *) data, length);
+
+	if (g_strcmp0(checksum, g_hash_table_lookup(saved_checksums,
+						pathname)) == 0 &&
+			g_file_test(pathname, G_FILE_TEST_IS_REGULAR)) {
+		DBG("%s unchanged, not writing", pathname);
+		g_free(checksum);
+		g_free(data);
+		return 0;
+	}
+
+	ret = write_file(pathname, data, length);
+	if (ret == 0) {
+		saves_performed++;
+		g_hash_table_replace(saved_checksums, g_strdup(pathname),
+								checksum);
+	} else {
+		g_hash_table_remove(saved_checksums, pathname);
+		g_free(checksum);
+	}
+
+	g_free(data);
+
+	return ret;
+}
+
+static void pending_save_free(gpointer data)
+{
+	struct pending_save *pending = data;
+
+	g_key_file_unref(pending->keyfile);
+	g_free(pending->pathname);
+	g_free(pending);
+}
+
+static gboolean flush_timeout_cb(gpointer user_data);
+
+static void storage_schedule_flush(unsigned int delay)
+{
+	if (!flush_timeout)
+		flush_timeout = g_timeout_add(delay, flush_timeout_cb, NULL);
+}
+
+/*
+ * Optional index of the saved services, stored in SERVICE_INDEX. It
+ * lists the identifiers together with the settings most often needed
+ * before a service is instantiated, so that enumerating the services
+ * neither parses every settings file nor watches every directory. Each
+ * record remembers the modification time and size of the settings
+ * file it was made from and records that no longer match are rebuilt
+ * from the settings file when the index is loaded.
+ */
+#define SERVICE_INDEX		"services.index"
+#define SERVICE_INDEX_MAGIC	0x58444953	/* "SIDX" */
+#define SERVICE_INDEX_VERSION	1
+#define SERVICE_INDEX_DELAY	1000
+
+struct service_index_header {
+	guint32 magic;
+	guint32 version;
+	guint32 count;
+	guint32 names_size;
+	guint32 checksum;
+} __attribute__((packed));
+
+struct service_index_record {
+	guint32 name_offset;
+	guint16 name_len;
+	guint16 flags;
+	gint64 modified;	/* "Modified" in microseconds */
+	gint64 mtime;		/* settings file mtime in nanoseconds */
+	gint64 size;
+} __attribute__((packed));
+
+struct service_index_entry {
+	unsigned int flags;
+	gint64 modified;
+	gint64 mtime;		/* 0 until the settings file is written */
+	gint64 size;
+};
+
+static bool service_index_enabled = false;
+static GHashTable *service_index = NULL;
+static bool service_index_dirty = false;
+
+static guint32 service_index_checksum(const guint8 *data, gsize len)
+{
+	guint32 hash = 2166136261u;
+	gsize i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= data[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static bool service_index_stat(const char *service_id, gint64 *mtime,
+							gint64 *size)
+{
+	struct stat st;
+	gchar *pathname;
+	int err;
+
+	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id,
+								SETTINGS);
+	err = stat(pathname, &st);
+	g_free(pathname);
+
+	if (err < 0 || !S_ISREG(st.st_mode))
+		return false;
+
+	*mtime = (gint64) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	*size = st.st_size;
+
+	return true;
+}
+
+static void service_index_parse(const char *service_id, GKeyFile *keyfile,
+				struct service_index_entry *entry)
+{
+	GTimeVal modified = { 0, 0 };
+	gchar *str;
+
+	entry->flags = 0;
+
+	if (g_key_file_get_boolean(keyfile, service_id, "Favorite", NULL))
+		entry->flags |= CONNMAN_STORAGE_FAVORITE;
+
+	if (g_key_file_get_boolean(keyfile, service_id, "AutoConnect", NULL))
+		entry->flags |= CONNMAN_STORAGE_AUTOCONNECT;
+
+	if (g_key_file_get_boolean(keyfile, service_id, "Hidden", NULL))
+		entry->flags |= CONNMAN_STORAGE_HIDDEN;
+
+	str = g_key_file_get_string(keyfile, service_id, "Modified", NULL);
+	if (str)
+		g_time_val_from_iso8601(str, &modified);
+	g_free(str);
+
+	entry->modified = (gint64) modified.tv_sec * G_USEC_PER_SEC +
+							modified.tv_usec;
+}
+
+static void service_index_map(void)
+{
+	const struct service_index_header *header;
+	const struct service_index_record *records;
+	const char *names;
+	GMappedFile *file;
+	gchar *pathname;
+	const guint8 *data;
+	gsize length, records_size;
+	guint32 i;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, SERVICE_INDEX);
+	file = g_mapped_file_new(pathname, FALSE, NULL);
+	g_free(pathname);
+
+	if (!file)
+		return;
+
+	data = (const guint8 *) g_mapped_file_get_contents(file);
+	length = g_mapped_file_get_length(file);
+	header = (const struct service_index_header *) data;
+
+	if (length < sizeof(*header) ||
+			header->magic != SERVICE_INDEX_MAGIC ||
+			header->version != SERVICE_INDEX_VERSION)
+		goto invalid;
+
+	records_size = (gsize) header->count * sizeof(*records);
+	if (length != sizeof(*header) + records_size + header->names_size)
+		goto invalid;
+
+	if (service_index_checksum(data + sizeof(*header),
+				length - sizeof(*header)) != header->checksum)
+		goto invalid;
+
+	records = (const struct service_index_record *)
+						(data + sizeof(*header));
+	names = (const char *) records + records_size;
+
+	for (i = 0; i < header->count; i++) {
+		const struct service_index_record *record = &records[i];
+		struct service_index_entry *entry;
+
+		if ((gsize) record->name_offset + record->name_len >
+							header->names_size)
+			goto invalid;
+
+		entry = g_new0(struct service_index_entry, 1);
+		entry->flags = record->flags;
+		entry->modified = record->modified;
+		entry->mtime = record->mtime;
+		entry->size = record->size;
+
+		g_hash_table_replace(service_index,
+				g_strndup(names + record->name_offset,
+					record->name_len), entry);
+	}
+
+	DBG("%u services in index", header->count);
+
+	g_mapped_file_unref(file);
+	return;
+
+invalid:
+	connman_warn("Ignoring invalid service index");
+	g_hash_table_remove_all(service_index);
+	g_mapped_file_unref(file);
+}
+
+static void service_index_inotify_cb(struct inotify_event *event,
+					const char *ident, gpointer user_data)
+{
+	if (!(event->mask & IN_ISDIR) || !service_index)
+		return;
+
+	/*
+	 * Directories created by someone else than connmand are picked up
+	 * when the index is loaded on the next start.
+	 */
+	if ((event->mask & IN_DELETE) || (event->mask & IN_MOVED_FROM)) {
+		if (g_hash_table_remove(service_index, event->name)) {
+			DBG("%s removed", event->name);
+			service_index_dirty = true;
+			storage_schedule_flush(SERVICE_INDEX_DELAY);
+		}
+	}
+}
+
+static GKeyFile *service_index_read_settings(const char *service_id)
+{
+	struct pending_save *pending;
+	GKeyFile *keyfile;
+	gchar *pathname;
+
+	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id,
+								SETTINGS);
+
+	pending = g_hash_table_lookup(pending_saves, pathname);
+	if (pending) {
+		g_free(pathname);
+		return keyfile_copy(pending->keyfile);
+	}
+
+	/* Not through storage_load() to keep it out of the keyfile cache */
+	keyfile = g_key_file_new();
+	if (!g_key_file_load_from_file(keyfile, pathname, 0, NULL)) {
+		g_key_file_unref(keyfile);
+		keyfile = NULL;
+	}
+
+	g_free(pathname);
+
+	return keyfile;
+}
+
+static bool service_index_load(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	GHashTable *found;
+	struct dirent *d;
+	DIR *dir;
+	unsigned int reparsed = 0;
+
+	if (service_index)
+		return true;
+
+	if (!service_index_enabled)
+		return false;
+
+	dir = opendir(STORAGEDIR);
+	if (!dir)
+		return false;
+
+	service_index = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+	service_index_map();
+
+	found = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	while ((d = readdir(dir))) {
+		struct service_index_entry *entry;
+		gint64 mtime, size;
+		GKeyFile *keyfile;
+
+		if (d->d_type != DT_DIR && d->d_type != DT_UNKNOWN)
+			continue;
+
+		if (d->d_name[0] == '.' || !is_service_dir_name(d->d_name))
+			continue;
+
+		if (!service_index_stat(d->d_name, &mtime, &size))
+			continue;
+
+		entry = g_hash_table_lookup(service_index, d->d_name);
+		if (entry && entry->mtime == mtime && entry->size == size) {
+			g_hash_table_add(found, entry);
+			continue;
+		}
+
+		keyfile = service_index_read_settings(d->d_name);
+		if (!keyfile)
+			continue;
+
+		if (!entry) {
+			entry = g_new0(struct service_index_entry, 1);
+			g_hash_table_replace(service_index,
+						g_strdup(d->d_name), entry);
+		}
+
+		service_index_parse(d->d_name, keyfile, entry);
+		entry->mtime = mtime;
+		entry->size = size;
+		g_hash_table_add(found, entry);
+		g_key_file_unref(keyfile);
+
+		service_index_dirty = true;
+		reparsed++;
+	}
+
+	closedir(dir);
+
+	g_hash_table_iter_init(&iter, service_index);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		if (!g_hash_table_contains(found, value)) {
+			DBG("%s no longer stored", (char *) key);
+			g_hash_table_iter_remove(&iter);
+			service_index_dirty = true;
+		}
+	}
+
+	g_hash_table_destroy(found);
+
+	DBG("%u services, %u read from settings",
+			g_hash_table_size(service_index), reparsed);
+
+	connman_inotify_register(STORAGEDIR, service_index_inotify_cb,
+								NULL, NULL);
+
+	if (service_index_dirty)
+		storage_schedule_flush(SERVICE_INDEX_DELAY);
+
+	return true;
+}
+
+static void service_index_update(const char *service_id, GKeyFile *keyfile)
+{
+	struct service_index_entry *entry, parsed = { 0 };
+
+	if (!service_index_load())
+		return;
+
+	service_index_parse(service_id, keyfile, &parsed);
+
+	entry = g_hash_table_lookup(service_index, service_id);
+	if (!entry) {
+		entry = g_new0(struct service_index_entry, 1);
+		g_hash_table_replace(service_index, g_strdup(service_id),
+									entry);
+	}
+
+	/* The file is stat'ed again once it has actually been written */
+	entry->flags = parsed.flags;
+	entry->modified = parsed.modified;
+	entry->mtime = 0;
+
+	service_index_dirty = true;
+	storage_schedule_flush(SERVICE_INDEX_DELAY);
+}
+
+static void service_index_remove(const char *service_id)
+{
+	if (!service_index)
+		return;
+
+	if (g_hash_table_remove(service_index, service_id)) {
+		service_index_dirty = true;
+		storage_schedule_flush(SERVICE_INDEX_DELAY);
+	}
+}
+
+static void service_index_write(void)
+{
+	struct service_index_header *header;
+	struct service_index_record *records;
+	GHashTableIter iter;
+	gpointer key, value;
+	GString *names;
+	GByteArray *buf;
+	gchar *pathname;
+	guint32 i = 0;
+
+	if (!service_index || !service_index_dirty)
+		return;
+
+	service_index_dirty = false;
+
+	buf = g_byte_array_sized_new(sizeof(*header) +
+			g_hash_table_size(service_index) * sizeof(*records));
+	g_byte_array_set_size(buf, sizeof(*header) +
+			g_hash_table_size(service_index) * sizeof(*records));
+	records = (struct service_index_record *) (buf->data +
+							sizeof(*header));
+	names = g_string_new(NULL);
+
+	g_hash_table_iter_init(&iter, service_index);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct service_index_entry *entry = value;
+
+		if (!entry->mtime && !service_index_stat(key, &entry->mtime,
+							&entry->size)) {
+			g_hash_table_iter_remove(&iter);
+			continue;
+		}
+
+		records[i].name_offset = names->len;
+		records[i].name_len = strlen(key);
+		records[i].flags = entry->flags;
+		records[i].modified = entry->modified;
+		records[i].mtime = entry->mtime;
+		records[i].size = entry->size;
+		g_string_append_len(names, key, records[i].name_len);
+		i++;
+	}
+
+	g_byte_array_set_size(buf, sizeof(*header) + i * sizeof(*records));
+	g_byte_array_append(buf, (const guint8 *) names->str, names->len);
+
+	header = (struct service_index_header *) buf->data;
+	header->magic = SERVICE_INDEX_MAGIC;
+	header->version = SERVICE_INDEX_VERSION;
+	header->count = i;
+	header->names_size = names->len;
+	header->checksum = service_index_checksum(buf->data + sizeof(*header),
+						buf->len - sizeof(*header));
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, SERVICE_INDEX);
+
+	if (write_file(pathname, (const gchar *) buf->data, buf->len) < 0)
+		connman_warn("Failed to write service index");
+	else
+		DBG("%u services", i);
+
+	g_free(pathname);
+	g_string_free(names, TRUE);
+	g_byte_array_free(buf, TRUE);
+}
+
+static void service_index_cleanup(void)
+{
+	if (!service_index)
+		return;
+
+	connman_inotify_unregister(STORAGEDIR, service_index_inotify_cb, NULL);
+	g_hash_table_destroy(service_index);
+	service_index = NULL;
+}
+
+static void storage_flush(void)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	if (flush_timeout) {
+		g_source_remove(flush_timeout);
+		flush_timeout = 0;
+	}
+
+	if (pending_saves && g_hash_table_size(pending_saves) > 0) {
+		DBG("writing %u files", g_hash_table_size(pending_saves));
+
+		g_hash_table_iter_init(&iter, pending_saves);
+		while (g_hash_table_iter_next(&iter, NULL, &value)) {
+			struct pending_save *pending = value;
+
+			if (storage_write(pending->keyfile,
+						pending->pathname) < 0)
+				connman_error("Failed to save %s",
+							pending->pathname);
+
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	/* After the settings files so that their final mtime is indexed */
+	service_index_write();
+}
+
+static gboolean flush_timeout_cb(gpointer user_data)
+{
+	flush_timeout = 0;
+	storage_flush();
+
+	return FALSE;
+}
+
+static void cancel_pending_save(const char *pathname)
+{
+	if (pending_saves && g_hash_table_remove(pending_saves, pathname))
+		DBG("dropped pending save of %s", pathname);
+
+	if (saved_checksums)
+		g_hash_table_remove(saved_checksums, pathname);
+}
+
+static gboolean match_prefix(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	return g_str_has_prefix(key, user_data);
+}
+
+static void cancel_pending_saves_under(const char *dirname)
+{
+	gchar *prefix = g_strconcat(dirname, "/", NULL);
+
+	if (pending_saves)
+		g_hash_table_foreach_remove(pending_saves, match_prefix,
+								prefix);
+
+	if (saved_checksums)
+		g_hash_table_foreach_remove(saved_checksums, match_prefix,
+								prefix);
+
+	g_free(prefix);
+}
+
+static int storage_save(GKeyFile *keyfile, char *pathname)
+{
+	struct pending_save *pending;
+
+	saves_requested++;
+
+	if (!write_delay || !pending_saves)
+		return storage_write(keyfile, pathname);
+
+	pending = g_hash_table_lookup(pending_saves, pathname);
+	if (pending) {
+		g_key_file_unref(pending->keyfile);
+		pending->keyfile = keyfile_copy(keyfile);
+	} else {
+		pending = g_new0(struct pending_save, 1);
+		pending->pathname = g_strdup(pathname);
+		pending->keyfile = keyfile_copy(keyfile);
+		g_hash_table_insert(pending_saves, pending->pathname, pending);
+	}
+
+	/*
+	 * The timer is not restarted by later saves so that a file which
+	 * keeps changing still reaches the disk once per write delay.
+	 */
+	storage_schedule_flush(write_delay);
+
+	return 0;
+}
+
 static void storage_delete(const char *pathname)
 {
 	DBG("file path %s", pathname);
 
+	cancel_pending_save(pathname);
+
 	if (unlink(pathname) < 0)
 		connman_error("Failed to remove %s", pathname);
 }
@@ -629,6 +1245,20 @@ gchar **connman_storage_get_services(void)
 
 	DBG("");
 
+	if (service_index_load()) {
+		GHashTableIter iter;
+		gpointer key;
+
+		result = g_new0(gchar *, g_hash_table_size(service_index) + 1);
+
+		pos = 0;
+		g_hash_table_iter_init(&iter, service_index);
+		while (g_hash_table_iter_next(&iter, &key, NULL))
+			result[pos++] = g_strdup(key);
+
+		return result;
+	}
+
 	if (!storage.initialized) {
 		storage_dir_init();
 		if (!storage.initialized)
@@ -670,6 +1300,29 @@ GKeyFile *connman_storage_load_service(const char *service_id)
 	return keyfile;
 }
 
+bool connman_storage_get_service_hints(const char *service_id,
+				unsigned int *flags, GTimeVal *modified)
+{
+	struct service_index_entry *entry;
+
+	if (!service_index_load())
+		return false;
+
+	entry = g_hash_table_lookup(service_index, service_id);
+	if (!entry)
+		return false;
+
+	if (flags)
+		*flags = entry->flags;
+
+	if (modified) {
+		modified->tv_sec = entry->modified / G_USEC_PER_SEC;
+		modified->tv_usec = entry->modified % G_USEC_PER_SEC;
+	}
+
+	return true;
+}
+
 int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 {
 	int ret = 0;
@@ -697,6 +1350,8 @@ int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 	g_free(dirname);
 
 	ret = storage_save(keyfile, pathname);
+	if (ret == 0)
+		service_index_update(service_id, keyfile);
 
 	g_free(pathname);
 
@@ -712,6 +1367,8 @@ static bool remove_file(const char *service_id, const char *file)
 	if (!pathname)
 		return false;
 
+	cancel_pending_save(pathname);
+
 	if (!g_file_test(pathname, G_FILE_TEST_EXISTS)) {
 		ret = true;
 	} else if (g_file_test(pathname, G_FILE_TEST_IS_REGULAR)) {
@@ -747,7 +1404,13 @@ bool __connman_storage_remove_service(const char *service_id)
 {
 	bool removed = false;
 	gchar *pathname = g_strdup_printf("%s/%s", STORAGEDIR, service_id);
-	DIR *dir = opendir(pathname);
+	DIR *dir;
+
+	/* Nothing may recreate the directory once it is gone */
+	cancel_pending_saves_under(pathname);
+	service_index_remove(service_id);
+
+	dir = opendir(pathname);
 
 	if (dir) {
 		struct dirent *d;
@@ -914,12 +1577,61 @@ int __connman_storage_init(const char *dir, int dir_mode, int file_mode)
 	storage_dir_mode = dir_mode;
 	storage_file_mode = file_mode;
 	keyfile_init();
+
+	pending_saves = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, pending_save_free);
+	saved_checksums = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, g_free);
 	return 0;
 }
 
+void __connman_storage_set_write_delay(unsigned int delay_ms)
+{
+	DBG("%u ms", delay_ms);
+
+	write_delay = delay_ms;
+	if (!write_delay)
+		storage_flush();
+}
+
+void __connman_storage_set_service_index(bool enable)
+{
+	DBG("%s", enable ? "enabled" : "disabled");
+
+	service_index_enabled = enable;
+	if (!enable)
+		service_index_cleanup();
+}
+
+void __connman_storage_sync(void)
+{
+	storage_flush();
+}
+
+void __connman_storage_get_stats(unsigned int *requested,
+						unsigned int *performed)
+{
+	if (requested)
+		*requested = saves_requested;
+
+	if (performed)
+		*performed = saves_performed;
+}
+
 void __connman_storage_cleanup(void)
 {
 	DBG("");
+	storage_flush();
+
+	DBG("saves requested %u performed %u", saves_requested,
+							saves_performed);
+
+	g_hash_table_destroy(pending_saves);
+	pending_saves = NULL;
+	g_hash_table_destroy(saved_checksums);
+	saved_checksums = NULL;
+	service_index_cleanup();
+
 	storage_dir_cleanup();
 	keyfile_cleanup();
 	g_free(storage_dir);
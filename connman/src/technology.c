@@ -571,8 +571,7 @@ static void technology_added_signal(struct connman_technology *technology)
 							&technology->path);
 	append_properties(&iter, technology);
 
-	dbus_connection_send(connection, signal, NULL);
-	dbus_message_unref(signal);
+	g_dbus_send_message(connection, signal);
 }
 
 static void technology_removed_signal(struct connman_technology *technology)
@@ -1126,6 +1125,8 @@ static const GDBusMethodTable technology_methods[] = {
 static const GDBusSignalTable technology_signals[] = {
 	{ GDBUS_SIGNAL("PropertyChanged",
 			GDBUS_ARGS({ "name", "s" }, { "value", "v" })) },
+	{ GDBUS_SIGNAL("PropertiesChanged",
+			GDBUS_ARGS({ "properties", "a{sv}" })) },
 	{ },
 };
 
@@ -1155,6 +1156,7 @@ static void technology_dbus_unregister(struct connman_technology *technology)
 	if (!technology->dbus_registered)
 		return;
 
+	__connman_dbus_flush_properties(technology->path);
 	technology_removed_signal(technology);
 	g_dbus_unregister_interface(connection, technology->path,
 		CONNMAN_TECHNOLOGY_INTERFACE);
@@ -1869,6 +1871,9 @@ int __connman_technology_init(void)
 
 	connection = connman_dbus_get_connection();
 
+	if (connman_setting_get_bool("PropertyChangedBatch"))
+		__connman_dbus_batch_interface(CONNMAN_TECHNOLOGY_INTERFACE);
+
 	rfkill_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_rfkill);
 
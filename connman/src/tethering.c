@@ -139,6 +139,7 @@ static GDHCPServer *dhcp_server_start(const char *bridge,
 {
 	GDHCPServerError error;
 	GDHCPServer *dhcp_server;
+	char *lease_file;
 	int index;
 
 	DBG("");
@@ -161,6 +162,11 @@ static GDHCPServer *dhcp_server_start(const char *bridge,
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_DNS_SERVER, dns);
 	g_dhcp_server_set_ip_range(dhcp_server, start_ip, end_ip);
 
+	/* Let clients keep their address across restarts */
+	lease_file = g_strdup_printf("%s/tethering.leases", STORAGEDIR);
+	g_dhcp_server_set_lease_file(dhcp_server, lease_file);
+	g_free(lease_file);
+
 	g_dhcp_server_start(dhcp_server);
 
 	return dhcp_server;
@@ -23,14 +23,49 @@
 #include <config.h>
 #endif
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
 
 #include <gdhcp/gdhcp.h>
+#include "gdhcp/common.h"
+
+/* Requests on the wire at the same time in load mode */
+#define LOAD_WINDOW	32
+/* Microseconds to wait for an OFFER or ACK before giving up */
+#define LOAD_TIMEOUT	(1000 * 1000)
+#define LOAD_XID_BASE	0x4c000000
 
 static GMainLoop *main_loop;
 
+struct load_client {
+	uint32_t xid;
+	uint8_t mac[ETH_ALEN];
+	gint64 sent;
+	bool offered;
+	bool done;
+};
+
+static struct {
+	int sk;
+	guint watch;
+	guint timer;
+	struct load_client *clients;
+	unsigned int count;
+	unsigned int next;
+	unsigned int in_flight;
+	unsigned int acked;
+	unsigned int lost;
+	GArray *offer_latency;
+	GArray *ack_latency;
+	gint64 started;
+} load;
+
 static void sig_term(int sig)
 {
 	g_main_loop_quit(main_loop);
@@ -71,21 +106,308 @@ static void dhcp_debug(const char *str, void *data)
 	printf("%s: %s\n", (const char *) data, str);
 }
 
+static int load_send(struct load_client *client, char type,
+				uint32_t requested_nip, uint32_t server_nid)
+{
+	struct dhcp_packet packet;
+	struct sockaddr_in dst;
+	int len;
+
+	dhcp_init_header(&packet, type);
+	packet.xid = client->xid;
+	packet.flags = htons(BROADCAST_FLAG);
+	memcpy(packet.chaddr, client->mac, ETH_ALEN);
+
+	if (requested_nip)
+		dhcp_add_option_uint32(&packet, DHCP_REQUESTED_IP,
+							requested_nip);
+	if (server_nid)
+		dhcp_add_option_uint32(&packet, DHCP_SERVER_ID,
+							ntohl(server_nid));
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	dst.sin_port = htons(SERVER_PORT);
+	dst.sin_addr.s_addr = INADDR_BROADCAST;
+
+	len = sizeof(packet) - sizeof(packet.options) +
+				dhcp_end_option(packet.options) + 1;
+
+	client->sent = g_get_monotonic_time();
+
+	return sendto(load.sk, &packet, len, 0,
+				(struct sockaddr *) &dst, sizeof(dst));
+}
+
+static void load_start_clients(void)
+{
+	struct load_client *client;
+
+	while (load.in_flight < LOAD_WINDOW && load.next < load.count) {
+		client = &load.clients[load.next++];
+
+		if (load_send(client, DHCPDISCOVER, 0, 0) < 0) {
+			load.lost++;
+			continue;
+		}
+
+		load.in_flight++;
+	}
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	const gint64 *la = a, *lb = b;
+
+	return *la < *lb ? -1 : *la > *lb;
+}
+
+static void print_latency(const char *name, GArray *latency)
+{
+	gint64 *values = (gint64 *) latency->data, sum = 0;
+	unsigned int i;
+
+	if (latency->len == 0) {
+		printf("%s: no replies\n", name);
+		return;
+	}
+
+	qsort(values, latency->len, sizeof(gint64), compare_latency);
+
+	for (i = 0; i < latency->len; i++)
+		sum += values[i];
+
+	printf("%s: %u replies  avg %" G_GINT64_FORMAT " us  "
+		"p50 %" G_GINT64_FORMAT " us  p99 %" G_GINT64_FORMAT " us  "
+		"max %" G_GINT64_FORMAT " us\n", name, latency->len,
+		sum / latency->len, values[latency->len / 2],
+		values[latency->len * 99 / 100], values[latency->len - 1]);
+}
+
+static void load_finish(void)
+{
+	gint64 elapsed = g_get_monotonic_time() - load.started;
+
+	printf("%u clients, %u acked, %u lost in %" G_GINT64_FORMAT
+		" ms\n", load.count, load.acked, load.lost, elapsed / 1000);
+	print_latency("OFFER", load.offer_latency);
+	print_latency("ACK", load.ack_latency);
+
+	g_main_loop_quit(main_loop);
+}
+
+static void load_client_done(struct load_client *client, bool acked)
+{
+	client->done = true;
+	load.in_flight--;
+
+	if (acked)
+		load.acked++;
+	else
+		load.lost++;
+
+	load_start_clients();
+
+	if (load.in_flight == 0 && load.next == load.count)
+		load_finish();
+}
+
+static gboolean load_event(GIOChannel *channel, GIOCondition condition,
+							gpointer user_data)
+{
+	struct dhcp_packet packet;
+	struct load_client *client;
+	uint8_t *type, *server_id;
+	gint64 latency;
+	uint32_t index;
+	int len;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		load.watch = 0;
+		return FALSE;
+	}
+
+	len = recv(load.sk, &packet, sizeof(packet), 0);
+	if (len < (int) (sizeof(packet) - sizeof(packet.options)))
+		return TRUE;
+
+	if (packet.op != BOOTREPLY)
+		return TRUE;
+
+	index = packet.xid - LOAD_XID_BASE;
+	if (index >= load.count)
+		return TRUE;
+
+	client = &load.clients[index];
+	if (client->done)
+		return TRUE;
+
+	type = dhcp_get_option(&packet, DHCP_MESSAGE_TYPE);
+	if (!type)
+		return TRUE;
+
+	latency = g_get_monotonic_time() - client->sent;
+
+	switch (*type) {
+	case DHCPOFFER:
+		if (client->offered)
+			break;
+
+		server_id = dhcp_get_option(&packet, DHCP_SERVER_ID);
+		if (!server_id)
+			break;
+
+		client->offered = true;
+		g_array_append_val(load.offer_latency, latency);
+
+		if (load_send(client, DHCPREQUEST, ntohl(packet.yiaddr),
+				get_unaligned((uint32_t *) server_id)) < 0)
+			load_client_done(client, false);
+		break;
+	case DHCPACK:
+		g_array_append_val(load.ack_latency, latency);
+		load_client_done(client, true);
+		break;
+	case DHCPNAK:
+		load_client_done(client, false);
+		break;
+	}
+
+	return TRUE;
+}
+
+static gboolean load_timeout(gpointer user_data)
+{
+	gint64 now = g_get_monotonic_time();
+	unsigned int i;
+
+	for (i = 0; i < load.next; i++) {
+		struct load_client *client = &load.clients[i];
+
+		if (!client->done && now - client->sent > LOAD_TIMEOUT)
+			load_client_done(client, false);
+	}
+
+	return TRUE;
+}
+
+/*
+ * Acts as many DHCP clients at once on the other end of a veth pair
+ * (or any link to the server interface), each doing DISCOVER/OFFER and
+ * REQUEST/ACK with its own MAC address.
+ */
+static int load_init(int ifindex, unsigned int count)
+{
+	GIOChannel *channel;
+	struct sockaddr_in addr;
+	char ifname[IF_NAMESIZE];
+	unsigned int i;
+	int on = 1, err;
+
+	if (!if_indextoname(ifindex, ifname))
+		return -errno;
+
+	load.sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (load.sk < 0)
+		return -errno;
+
+	setsockopt(load.sk, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	setsockopt(load.sk, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+	if (setsockopt(load.sk, SOL_SOCKET, SO_BINDTODEVICE, ifname,
+						strlen(ifname) + 1) < 0)
+		goto err;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(CLIENT_PORT);
+	addr.sin_addr.s_addr = INADDR_ANY;
+
+	if (bind(load.sk, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+		goto err;
+
+	load.count = count;
+	load.clients = g_new0(struct load_client, count);
+
+	for (i = 0; i < count; i++) {
+		load.clients[i].xid = LOAD_XID_BASE + i;
+		load.clients[i].mac[0] = 0x02;
+		load.clients[i].mac[2] = i >> 24;
+		load.clients[i].mac[3] = i >> 16;
+		load.clients[i].mac[4] = i >> 8;
+		load.clients[i].mac[5] = i;
+	}
+
+	load.offer_latency = g_array_sized_new(FALSE, FALSE,
+						sizeof(gint64), count);
+	load.ack_latency = g_array_sized_new(FALSE, FALSE,
+						sizeof(gint64), count);
+
+	channel = g_io_channel_unix_new(load.sk);
+	load.watch = g_io_add_watch(channel,
+				G_IO_IN | G_IO_NVAL | G_IO_ERR | G_IO_HUP,
+				load_event, NULL);
+	g_io_channel_unref(channel);
+
+	load.timer = g_timeout_add(100, load_timeout, NULL);
+	load.started = g_get_monotonic_time();
+
+	load_start_clients();
+
+	return 0;
+
+err:
+	err = -errno;
+	close(load.sk);
+	load.sk = -1;
+
+	return err;
+}
+
+static void load_cleanup(void)
+{
+	if (load.watch)
+		g_source_remove(load.watch);
+
+	if (load.timer)
+		g_source_remove(load.timer);
+
+	if (load.sk >= 0)
+		close(load.sk);
+
+	if (load.offer_latency)
+		g_array_free(load.offer_latency, TRUE);
+
+	if (load.ack_latency)
+		g_array_free(load.ack_latency, TRUE);
+
+	g_free(load.clients);
+}
+
 
 int main(int argc, char *argv[])
 {
 	struct sigaction sa;
 	GDHCPServerError error;
 	GDHCPServer *dhcp_server;
-	int index;
+	int index, load_index = -1;
+	unsigned int clients = 0;
 
 	if (argc < 2) {
-		printf("Usage: dhcp-server-test <interface index>\n");
+		printf("Usage: dhcp-server-test <interface index> "
+			"[load <client interface index> <clients>]\n");
 		exit(0);
 	}
 
 	index = atoi(argv[1]);
 
+	if (argc >= 5 && g_str_equal(argv[2], "load")) {
+		load_index = atoi(argv[3]);
+		clients = atoi(argv[4]);
+	}
+
+	load.sk = -1;
+
 	printf("Create DHCP server for interface %d\n", index);
 
 	dhcp_server = g_dhcp_server_new(G_DHCP_IPV4, index, &error);
@@ -94,20 +416,35 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
-	g_dhcp_server_set_debug(dhcp_server, dhcp_debug, "DHCP");
+	if (load_index < 0)
+		g_dhcp_server_set_debug(dhcp_server, dhcp_debug, "DHCP");
 
 	g_dhcp_server_set_lease_time(dhcp_server, 3600);
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_SUBNET, "255.255.0.0");
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_ROUTER, "192.168.0.2");
 	g_dhcp_server_set_option(dhcp_server, G_DHCP_DNS_SERVER, "192.168.0.3");
-	g_dhcp_server_set_ip_range(dhcp_server, "192.168.0.101",
+	if (load_index < 0)
+		g_dhcp_server_set_ip_range(dhcp_server, "192.168.0.101",
 							"192.168.0.102");
+	else
+		g_dhcp_server_set_ip_range(dhcp_server, "192.168.0.1",
+							"192.168.255.254");
 	main_loop = g_main_loop_new(NULL, FALSE);
 
 	printf("Start DHCP Server operation\n");
 
 	g_dhcp_server_start(dhcp_server);
 
+	if (load_index >= 0 && clients > 0) {
+		int err = load_init(load_index, clients);
+
+		if (err < 0) {
+			printf("Cannot start load: %s\n", strerror(-err));
+			g_dhcp_server_unref(dhcp_server);
+			exit(1);
+		}
+	}
+
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = sig_term;
 	sigaction(SIGINT, &sa, NULL);
@@ -115,6 +452,8 @@ int main(int argc, char *argv[])
 
 	g_main_loop_run(main_loop);
 
+	load_cleanup();
+
 	g_dhcp_server_unref(dhcp_server);
 
 	g_main_loop_unref(main_loop);
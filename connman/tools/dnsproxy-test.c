@@ -24,6 +24,7 @@
 #endif
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -412,6 +413,203 @@ static void test_multiple_ipv6_tcp_msg(void)
 		g_assert_cmpint(received, >=, sizeof(msg2));
 }
 
+/*
+ * Send a burst of queries for distinct names so that they are all
+ * pending in the proxy at the same time, and measure how long each
+ * reply takes. Run with "-m perf".
+ */
+#define BURST_QUERIES 10000
+
+static void test_ipv4_udp_burst(void)
+{
+	int sk, i, id, ret, received = 0, rcvbuf = 8 * 1024 * 1024;
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	unsigned char query[sizeof(msg) - 2], buf[512];
+	gint64 *sent, now, start, total = 0, max = 0;
+
+	sk = connect_udp_socket("127.0.0.1", (struct sockaddr *)&sa, &len);
+	g_assert_cmpint(sk, >=, 0);
+
+	setsockopt(sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	fcntl(sk, F_SETFL, O_NONBLOCK);
+
+	sent = g_new0(gint64, BURST_QUERIES);
+	memcpy(query, msg + 2, sizeof(query));
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < BURST_QUERIES || received < BURST_QUERIES; ) {
+		if (i < BURST_QUERIES) {
+			query[0] = i >> 8;
+			query[1] = i & 0xff;
+			/* replace "lolge0" so that the cache is not used */
+			snprintf((char *)query + 13, 7, "b%05d", i);
+			query[19] = 3;
+
+			sent[i] = g_get_monotonic_time();
+			sendto_msg(sk, (struct sockaddr *)&sa, len,
+					query, sizeof(query));
+			i++;
+		}
+
+		ret = recv(sk, buf, sizeof(buf), 0);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				break;
+
+			if (i < BURST_QUERIES)
+				continue;
+
+			/* give up on replies that did not arrive in time */
+			if (g_get_monotonic_time() - start >
+						60 * G_USEC_PER_SEC)
+				break;
+
+			usleep(1000);
+			continue;
+		}
+
+		if (ret < 12)
+			continue;
+
+		id = buf[0] << 8 | buf[1];
+		if (id >= BURST_QUERIES || !sent[id])
+			continue;
+
+		now = g_get_monotonic_time();
+		total += now - sent[id];
+		if (now - sent[id] > max)
+			max = now - sent[id];
+		sent[id] = 0;
+		received++;
+	}
+
+	now = g_get_monotonic_time();
+	close(sk);
+	g_free(sent);
+
+	g_test_message("%d queries, %d replies in %.3f s, "
+			"latency average %.3f ms max %.3f ms",
+			BURST_QUERIES, received,
+			(now - start) / (double) G_USEC_PER_SEC,
+			received ? total / 1000.0 / received : 0,
+			max / 1000.0);
+
+	g_test_minimized_result(received ? total / 1000.0 / received : 0,
+				"average reply latency %.3f ms",
+				received ? total / 1000.0 / received : 0);
+
+	g_assert_cmpint(received, >, 0);
+}
+
+/*
+ * Send a burst of queries for distinct names over one TCP connection
+ * without waiting for the replies. With a single upstream server this
+ * shows how well the proxy reuses its own TCP connections to it. Run
+ * with "-m perf".
+ */
+#define TCP_BURST_QUERIES 2000
+
+static void test_ipv4_tcp_burst(void)
+{
+	int sk, i, id, ret, received = 0;
+	unsigned char query[sizeof(msg)], buf[4096];
+	unsigned int buf_len = 0, reply_len;
+	gint64 *sent, now, start, total = 0, max = 0;
+
+	sk = connect_tcp_socket("127.0.0.1");
+	g_assert_cmpint(sk, >=, 0);
+
+	sent = g_new0(gint64, TCP_BURST_QUERIES);
+	memcpy(query, msg, sizeof(query));
+
+	start = g_get_monotonic_time();
+
+	for (i = 0; i < TCP_BURST_QUERIES || received < TCP_BURST_QUERIES; ) {
+		if (i < TCP_BURST_QUERIES) {
+			query[2] = i >> 8;
+			query[3] = i & 0xff;
+			/* replace "lolge0" so that the cache is not used */
+			snprintf((char *)query + 15, 7, "t%05d", i);
+			query[21] = 3;
+
+			sent[i] = g_get_monotonic_time();
+			ret = send(sk, query, sizeof(query), MSG_NOSIGNAL);
+			if (ret == sizeof(query)) {
+				i++;
+			} else if (ret >= 0 || (errno != EAGAIN &&
+						errno != EWOULDBLOCK)) {
+				/* a partial query cannot be taken back */
+				break;
+			}
+		}
+
+		ret = recv(sk, buf + buf_len, sizeof(buf) - buf_len, 0);
+		if (ret == 0)
+			break;
+
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				break;
+
+			if (i < TCP_BURST_QUERIES)
+				continue;
+
+			/* give up on replies that did not arrive in time */
+			if (g_get_monotonic_time() - start >
+						60 * G_USEC_PER_SEC)
+				break;
+
+			usleep(1000);
+			continue;
+		}
+
+		buf_len += ret;
+
+		while (buf_len >= 2) {
+			reply_len = (buf[0] << 8 | buf[1]) + 2;
+			if (reply_len > sizeof(buf))
+				goto out;
+
+			if (buf_len < reply_len)
+				break;
+
+			id = reply_len >= 4 ? buf[2] << 8 | buf[3] : -1;
+			if (id >= 0 && id < TCP_BURST_QUERIES && sent[id]) {
+				now = g_get_monotonic_time();
+				total += now - sent[id];
+				if (now - sent[id] > max)
+					max = now - sent[id];
+				sent[id] = 0;
+				received++;
+			}
+
+			buf_len -= reply_len;
+			memmove(buf, buf + reply_len, buf_len);
+		}
+	}
+
+out:
+	now = g_get_monotonic_time();
+	close(sk);
+	g_free(sent);
+
+	g_test_message("%d queries, %d replies in %.3f s, "
+			"latency average %.3f ms max %.3f ms",
+			TCP_BURST_QUERIES, received,
+			(now - start) / (double) G_USEC_PER_SEC,
+			received ? total / 1000.0 / received : 0,
+			max / 1000.0);
+
+	g_test_maximized_result(received * (double) G_USEC_PER_SEC /
+				(now - start), "%.1f replies per second",
+				received * (double) G_USEC_PER_SEC /
+				(now - start));
+
+	g_assert_cmpint(received, >, 0);
+}
+
 static void test_failure_tcp_msg(void)
 {
 	int sk, received = 0;
@@ -425,8 +623,252 @@ static void test_failure_tcp_msg(void)
 	g_assert_cmpint(received, ==, 0);
 }
 
+/*
+ * Stand-in upstream resolver for the burst tests. Start it with
+ * "dnsproxy-test --resolver <address>" and give the address to
+ * ConnMan as the only nameserver. Every query is answered with
+ * 127.0.0.1 over both UDP and TCP, and the number of TCP connections
+ * and queries served is printed as it changes.
+ */
+struct resolver_client {
+	GIOChannel *channel;
+	unsigned char buf[4096];
+	unsigned int len;
+	unsigned int queries;
+};
+
+static unsigned int resolver_connections;
+static unsigned int resolver_tcp_queries;
+static unsigned int resolver_udp_queries;
+
+static int resolver_answer(const unsigned char *query, unsigned int len,
+					unsigned char *reply, unsigned int size)
+{
+	static const unsigned char answer[] = {
+		0xc0, 0x0c,		/* name, pointer to the question */
+		0x00, 0x01,		/* type A */
+		0x00, 0x01,		/* class IN */
+		0x00, 0x00, 0x00, 0x3c,	/* ttl 60 */
+		0x00, 0x04,		/* rdlen */
+		127, 0, 0, 1,
+	};
+	unsigned int pos = 12;
+
+	if (len < 12)
+		return -EINVAL;
+
+	/* Skip the question, the rest of the query is dropped */
+	while (pos < len && query[pos]) {
+		if (query[pos] & 0xc0)
+			return -EINVAL;
+		pos += query[pos] + 1;
+	}
+	pos += 5;
+
+	if (pos > len || pos + sizeof(answer) > size)
+		return -EINVAL;
+
+	memcpy(reply, query, pos);
+	reply[2] |= 0x80;			/* response */
+	reply[3] = 0x80;			/* recursion available */
+	reply[4] = 0x00; reply[5] = 0x01;	/* one question */
+	reply[6] = 0x00; reply[7] = 0x01;	/* one answer */
+	memset(reply + 8, 0, 4);
+	memcpy(reply + pos, answer, sizeof(answer));
+
+	return pos + sizeof(answer);
+}
+
+static gboolean resolver_udp_event(GIOChannel *channel,
+				GIOCondition condition, gpointer user_data)
+{
+	unsigned char query[4096], reply[4096 + 16];
+	struct sockaddr_storage sa;
+	socklen_t sa_len = sizeof(sa);
+	int sk, len;
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	len = recvfrom(sk, query, sizeof(query), 0,
+				(struct sockaddr *) &sa, &sa_len);
+	if (len < 0)
+		return TRUE;
+
+	len = resolver_answer(query, len, reply, sizeof(reply));
+	if (len < 0)
+		return TRUE;
+
+	sendto(sk, reply, len, MSG_NOSIGNAL, (struct sockaddr *) &sa,
+								sa_len);
+	resolver_udp_queries++;
+
+	return TRUE;
+}
+
+static gboolean resolver_tcp_client_event(GIOChannel *channel,
+				GIOCondition condition, gpointer user_data)
+{
+	struct resolver_client *client = user_data;
+	unsigned char reply[4096 + 16];
+	unsigned int query_len;
+	int sk, len;
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	len = read(sk, client->buf + client->len,
+				sizeof(client->buf) - client->len);
+	if (len <= 0)
+		goto close;
+
+	client->len += len;
+
+	/* Answer all the complete queries, in order */
+	while (client->len >= 2) {
+		query_len = (client->buf[0] << 8 | client->buf[1]) + 2;
+		if (query_len > sizeof(client->buf))
+			goto close;
+
+		if (client->len < query_len)
+			break;
+
+		len = resolver_answer(client->buf + 2, query_len - 2,
+					reply + 2, sizeof(reply) - 2);
+		if (len > 0) {
+			reply[0] = len >> 8;
+			reply[1] = len & 0xff;
+
+			if (send(sk, reply, len + 2, MSG_NOSIGNAL) < 0)
+				goto close;
+
+			client->queries++;
+			resolver_tcp_queries++;
+		}
+
+		client->len -= query_len;
+		memmove(client->buf, client->buf + query_len, client->len);
+	}
+
+	return TRUE;
+
+close:
+	LOG("connection %d closed after %u queries", sk, client->queries);
+
+	g_io_channel_unref(client->channel);
+	g_free(client);
+
+	return FALSE;
+}
+
+static gboolean resolver_tcp_event(GIOChannel *channel,
+				GIOCondition condition, gpointer user_data)
+{
+	struct resolver_client *client;
+	int sk;
+
+	sk = accept(g_io_channel_unix_get_fd(channel), NULL, NULL);
+	if (sk < 0)
+		return TRUE;
+
+	client = g_new0(struct resolver_client, 1);
+	client->channel = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(client->channel, TRUE);
+	g_io_add_watch(client->channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+				resolver_tcp_client_event, client);
+
+	resolver_connections++;
+
+	return TRUE;
+}
+
+static gboolean resolver_report(gpointer user_data)
+{
+	static unsigned int reported = G_MAXUINT;
+	unsigned int total;
+
+	total = resolver_connections + resolver_tcp_queries +
+						resolver_udp_queries;
+	if (total == reported)
+		return TRUE;
+
+	reported = total;
+
+	printf("tcp connections %u queries %u, udp queries %u\n",
+			resolver_connections, resolver_tcp_queries,
+			resolver_udp_queries);
+	fflush(stdout);
+
+	return TRUE;
+}
+
+static int resolver_listen(const char *address, int type)
+{
+	struct addrinfo hints, *rp;
+	GIOChannel *channel;
+	int sk, on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = type;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_flags = AI_NUMERICSERV | AI_NUMERICHOST;
+
+	if (getaddrinfo(address, "53", &hints, &rp))
+		return -EINVAL;
+
+	sk = socket(rp->ai_family, type, 0);
+	if (sk < 0) {
+		freeaddrinfo(rp);
+		return -errno;
+	}
+
+	setsockopt(sk, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	if (bind(sk, rp->ai_addr, rp->ai_addrlen) < 0 ||
+			(type == SOCK_STREAM && listen(sk, 64) < 0)) {
+		int err = -errno;
+
+		close(sk);
+		freeaddrinfo(rp);
+		return err;
+	}
+
+	freeaddrinfo(rp);
+
+	channel = g_io_channel_unix_new(sk);
+	g_io_channel_set_close_on_unref(channel, TRUE);
+	g_io_add_watch(channel, G_IO_IN, type == SOCK_STREAM ?
+			resolver_tcp_event : resolver_udp_event, NULL);
+
+	return 0;
+}
+
+static int run_resolver(const char *address)
+{
+	GMainLoop *loop;
+	int err;
+
+	err = resolver_listen(address, SOCK_DGRAM);
+	if (!err)
+		err = resolver_listen(address, SOCK_STREAM);
+	if (err < 0) {
+		fprintf(stderr, "Failed to listen on %s port 53: %s\n",
+						address, strerror(-err));
+		return 1;
+	}
+
+	g_timeout_add_seconds(1, resolver_report, NULL);
+
+	loop = g_main_loop_new(NULL, FALSE);
+	g_main_loop_run(loop);
+	g_main_loop_unref(loop);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
+	if (argc == 3 && g_str_equal(argv[1], "--resolver"))
+		return run_resolver(argv[2]);
+
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/dnsproxy/ipv4 udp msg",
@@ -462,5 +904,13 @@ int main(int argc, char *argv[])
 	g_test_add_func("/dnsproxy/multiple ipv6 tcp msg from cache",
 			test_multiple_ipv6_tcp_msg);
 
+	if (g_test_perf())
+		g_test_add_func("/dnsproxy/ipv4 udp burst",
+				test_ipv4_udp_burst);
+
+	if (g_test_perf())
+		g_test_add_func("/dnsproxy/ipv4 tcp burst",
+				test_ipv4_tcp_burst);
+
 	return g_test_run();
 }
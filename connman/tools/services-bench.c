@@ -0,0 +1,340 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Compares the size and the cost of building the ServicesChanged and
+ * ServicesDelta signals for a growing number of services. Every round
+ * changes the strength of some services the way a Wi-Fi scan does,
+ * replaces a few of them, sorts the list again and builds both signals
+ * for the new order. ServicesDelta is built with the code connmand
+ * uses, see src/shared/services-delta.c.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "src/shared/services-delta.h"
+
+#define MANAGER_PATH		"/net/connman"
+#define MANAGER_INTERFACE	"net.connman.Manager"
+
+struct bench_service {
+	char *path;
+	unsigned char strength;
+	int notify_index;
+};
+
+static int option_rounds = 100;
+static int option_changed = 10;
+static int option_replaced = 1;
+static char *option_counts = NULL;
+
+static GOptionEntry options[] = {
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &option_rounds,
+			"Number of scan rounds per service count", "N" },
+	{ "changed", 'c', 0, G_OPTION_ARG_INT, &option_changed,
+			"Percentage of services whose strength changes "
+			"in a round", "PERCENT" },
+	{ "replaced", 'n', 0, G_OPTION_ARG_INT, &option_replaced,
+			"Number of services replaced by new ones "
+			"in a round", "N" },
+	{ "services", 's', 0, G_OPTION_ARG_STRING, &option_counts,
+			"Comma separated list of service counts", "LIST" },
+	{ NULL },
+};
+
+static double cpu_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_strength(const void *a, const void *b)
+{
+	const struct bench_service *service_a = *(void **) a;
+	const struct bench_service *service_b = *(void **) b;
+
+	if (service_a->strength != service_b->strength)
+		return (int) service_b->strength - (int) service_a->strength;
+
+	return strcmp(service_a->path, service_b->path);
+}
+
+static void open_dict(DBusMessageIter *iter, DBusMessageIter *dict)
+{
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+			DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+			DBUS_TYPE_STRING_AS_STRING
+			DBUS_TYPE_VARIANT_AS_STRING
+			DBUS_DICT_ENTRY_END_CHAR_AS_STRING, dict);
+}
+
+/* A new service is announced with its properties */
+static void append_properties(DBusMessageIter *dict, void *user_data)
+{
+	struct bench_service *service = user_data;
+	DBusMessageIter entry, value;
+	const char *key = "Strength";
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY, NULL,
+								&entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT,
+					DBUS_TYPE_BYTE_AS_STRING, &value);
+	dbus_message_iter_append_basic(&value, DBUS_TYPE_BYTE,
+							&service->strength);
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static DBusMessage *build_changed(struct bench_service **list, int count)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter, array, entry, dict;
+	int i;
+
+	msg = dbus_message_new_signal(MANAGER_PATH, MANAGER_INTERFACE,
+						"ServicesChanged");
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "(oa{sv})",
+						&array);
+
+	for (i = 0; i < count; i++) {
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT,
+							NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_OBJECT_PATH,
+							&list[i]->path);
+		open_dict(&entry, &dict);
+		if (list[i]->notify_index < 0)
+			append_properties(&dict, list[i]);
+		dbus_message_iter_close_container(&entry, &dict);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "o", &array);
+	dbus_message_iter_close_container(&iter, &array);
+
+	return msg;
+}
+
+static DBusMessage *build_delta(struct bench_service **list, int count,
+							int *moved)
+{
+	DBusMessage *msg;
+	DBusMessageIter iter, array;
+	dbus_uint32_t index, total = count;
+	int *prev_index;
+	bool *is_moved;
+
+	prev_index = g_new(int, count);
+	is_moved = g_new(bool, count);
+
+	for (index = 0; index < total; index++)
+		prev_index[index] = list[index]->notify_index;
+
+	*moved = services_delta_moved(prev_index, count, is_moved);
+
+	msg = dbus_message_new_signal(MANAGER_PATH, MANAGER_INTERFACE,
+						"ServicesDelta");
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY,
+					SERVICES_DELTA_SIGNATURE, &array);
+
+	for (index = 0; index < total; index++) {
+		if (!is_moved[index])
+			continue;
+
+		services_delta_append(&array, list[index]->path, index,
+				list[index]->notify_index < 0 ?
+					append_properties : NULL,
+				list[index]);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "o", &array);
+	dbus_message_iter_close_container(&iter, &array);
+
+	dbus_message_append_args(msg, DBUS_TYPE_UINT32, &total,
+							DBUS_TYPE_INVALID);
+
+	g_free(is_moved);
+	g_free(prev_index);
+
+	return msg;
+}
+
+static int message_size(DBusMessage *msg)
+{
+	char *buf;
+	int len;
+
+	dbus_message_set_serial(msg, 1);
+
+	if (!dbus_message_marshal(msg, &buf, &len))
+		return -1;
+
+	dbus_free(buf);
+
+	return len;
+}
+
+static void service_init(struct bench_service *service, GRand *rand, int n)
+{
+	service->path = g_strdup_printf(
+			"/net/connman/service/wifi_0123456789ab_%08x%08x"
+			"_managed_psk", g_rand_int(rand), n);
+	service->strength = g_rand_int_range(rand, 10, 90);
+}
+
+static void bench(int count, GRand *rand)
+{
+	struct bench_service *services, **list;
+	DBusMessage *msg;
+	double full_time = 0, delta_time = 0, start;
+	long full_size = 0, delta_size = 0, moved_total = 0;
+	int round, i, moved, changes;
+
+	services = g_new0(struct bench_service, count);
+	list = g_new0(struct bench_service *, count);
+
+	for (i = 0; i < count; i++) {
+		service_init(&services[i], rand, i);
+		list[i] = &services[i];
+	}
+
+	qsort(list, count, sizeof(*list), compare_strength);
+	for (i = 0; i < count; i++)
+		list[i]->notify_index = i;
+
+	changes = count * option_changed / 100;
+	if (changes < 1)
+		changes = 1;
+
+	for (round = 0; round < option_rounds; round++) {
+		for (i = 0; i < changes; i++) {
+			struct bench_service *service;
+			int strength;
+
+			service = &services[g_rand_int_range(rand, 0, count)];
+			strength = service->strength +
+					g_rand_int_range(rand, -5, 6);
+			service->strength = CLAMP(strength, 0, 100);
+		}
+
+		/* Networks going out of range and new ones showing up */
+		for (i = 0; i < option_replaced && i < count; i++) {
+			int n = g_rand_int_range(rand, 0, count);
+
+			g_free(services[n].path);
+			service_init(&services[n], rand, n);
+			services[n].notify_index = -1;
+		}
+
+		qsort(list, count, sizeof(*list), compare_strength);
+
+		start = cpu_time();
+		msg = build_changed(list, count);
+		full_size += message_size(msg);
+		dbus_message_unref(msg);
+		full_time += cpu_time() - start;
+
+		start = cpu_time();
+		msg = build_delta(list, count, &moved);
+		delta_size += message_size(msg);
+		dbus_message_unref(msg);
+		for (i = 0; i < count; i++)
+			list[i]->notify_index = i;
+		delta_time += cpu_time() - start;
+
+		moved_total += moved;
+	}
+
+	printf("%8d %8.1f %10ld %10ld %10.1f %10.1f\n", count,
+		(double) moved_total / option_rounds,
+		full_size / option_rounds, delta_size / option_rounds,
+		full_time * 1e6 / option_rounds,
+		delta_time * 1e6 / option_rounds);
+
+	for (i = 0; i < count; i++)
+		g_free(services[i].path);
+
+	g_free(services);
+	g_free(list);
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	GRand *rand;
+	char **counts;
+	int i;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_rounds < 1)
+		option_rounds = 1;
+
+	counts = g_strsplit(option_counts ? option_counts :
+					"25,50,100,200,400,800", ",", 0);
+
+	rand = g_rand_new_with_seed(1);
+
+	printf("%8s %8s %10s %10s %10s %10s\n", "services", "moved",
+		"full B", "delta B", "full us", "delta us");
+
+	for (i = 0; counts[i]; i++) {
+		int count = atoi(counts[i]);
+
+		if (count > 0)
+			bench(count, rand);
+	}
+
+	g_rand_free(rand);
+	g_strfreev(counts);
+	g_free(option_counts);
+
+	return 0;
+}
@@ -42,6 +42,8 @@
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include "src/shared/stats-history.h"
+
 #ifdef TEMP_FAILURE_RETRY
 #define TFR TEMP_FAILURE_RETRY
 #else
@@ -99,6 +101,9 @@ struct stats_iter {
 	struct stats_record *it;
 };
 
+#define BENCHMARK_INTERVAL 60
+#define BENCHMARK_QUERIES 1000000
+
 static gint option_create = 0;
 static gint option_interval = 3;
 static bool option_dump = false;
@@ -106,6 +111,7 @@ static bool option_summary = false;
 static char *option_info_file_name = NULL;
 static time_t option_start_ts = -1;
 static char *option_last_file_name = NULL;
+static bool option_benchmark = false;
 
 static bool parse_start_ts(const char *key, const char *value,
 					gpointer user_data, GError **error)
@@ -136,6 +142,9 @@ static GOptionEntry options[] = {
 			"(example 2010-11-05T23:00:12Z)", "TS"},
 	{ "last", 'l', 0, G_OPTION_ARG_FILENAME, &option_last_file_name,
 			  "Start values from last .data file" },
+	{ "benchmark", 'b', 0, G_OPTION_ARG_NONE, &option_benchmark,
+			"Write a year of data into a .history file and "
+			"measure append and range query cost" },
 	{ NULL },
 };
 
@@ -828,6 +837,117 @@ static void history_file_update(struct stats_file *data_file,
 	swap_and_close_files(history_file, &tempory_file);
 }
 
+static int history_bytes_since(const struct stats_history *history,
+				time_t since, uint64_t *bytes)
+{
+	struct stats_history_data data;
+	int err;
+
+	err = stats_history_get_since(history, since, &data);
+	if (err < 0)
+		return err;
+
+	*bytes = data.rx_bytes + data.tx_bytes;
+
+	return 0;
+}
+
+static int history_benchmark(const char *name)
+{
+	static const struct {
+		const char *name;
+		time_t span;
+	} ranges[] = {
+		{ "last hour", STATS_HOUR },
+		{ "last 24h", STATS_DAY },
+		{ "last 7 days", 7 * STATS_DAY },
+		{ "last 30 days", 30 * STATS_DAY },
+		{ "last 365 days", 365 * STATS_DAY },
+	};
+	struct stats_history *history;
+	struct stats_history_data delta;
+	time_t start, end, ts;
+	unsigned int i, j, nr = 0;
+	uint64_t bytes = 0;
+	GTimer *timer;
+	double elapsed;
+	int fd;
+
+	fd = TFR(open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+	if (fd < 0) {
+		fprintf(stderr, "open error %s for %s\n",
+			strerror(errno), name);
+		return -errno;
+	}
+
+	if (ftruncate(fd, sizeof(*history)) < 0) {
+		fprintf(stderr, "ftruncate error %s for %s\n",
+			strerror(errno), name);
+		close(fd);
+		return -errno;
+	}
+
+	history = mmap(NULL, sizeof(*history), PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	if (history == MAP_FAILED) {
+		fprintf(stderr, "mmap error %s for %s\n",
+			strerror(errno), name);
+		close(fd);
+		return -errno;
+	}
+
+	end = time(NULL);
+	start = end - 365 * STATS_DAY;
+
+	stats_history_init(history, start);
+
+	memset(&delta, 0, sizeof(delta));
+	timer = g_timer_new();
+
+	for (ts = start; ts <= end; ts += BENCHMARK_INTERVAL, nr++) {
+		delta.rx_packets = rand() % 100;
+		delta.tx_packets = rand() % 100;
+		delta.rx_bytes = delta.rx_packets * (rand() % 1500);
+		delta.tx_bytes = delta.tx_packets * (rand() % 1500);
+
+		stats_history_add(history, ts, &delta);
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+
+	printf("History file %s (%zd bytes)\n", name, sizeof(*history));
+	printf("  %u appends, one every %d seconds\n", nr,
+						BENCHMARK_INTERVAL);
+	printf("  append          %.1f ns\n\n", elapsed * 1e9 / nr);
+
+	printf("Range queries (%d each)\n", BENCHMARK_QUERIES);
+
+	for (i = 0; i < G_N_ELEMENTS(ranges); i++) {
+		g_timer_start(timer);
+
+		for (j = 0; j < BENCHMARK_QUERIES; j++) {
+			if (history_bytes_since(history,
+					end - ranges[i].span, &bytes) < 0)
+				break;
+		}
+
+		elapsed = g_timer_elapsed(timer, NULL);
+
+		if (j < BENCHMARK_QUERIES)
+			printf("  %-15s out of range\n", ranges[i].name);
+		else
+			printf("  %-15s %.1f ns, %llu bytes\n",
+				ranges[i].name, elapsed * 1e9 / j,
+				(unsigned long long) bytes);
+	}
+
+	g_timer_destroy(timer);
+	munmap(history, sizeof(*history));
+	close(fd);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
@@ -864,6 +984,9 @@ int main(int argc, char *argv[])
 		exit(0);
 	}
 
+	if (option_benchmark)
+		return history_benchmark(argv[1]) < 0 ? 1 : 0;
+
 	err = stats_open(data_file, argv[1]);
 	if (err < 0) {
 		fprintf(stderr, "failed open file %s\n", argv[1]);
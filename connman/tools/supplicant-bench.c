@@ -0,0 +1,498 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Measures how long it takes to get the properties of all the BSSs
+ * of a scan from wpa_supplicant. A child process owns the supplicant
+ * name on the session bus and answers GetAll for any number of fake
+ * BSSs. The properties are fetched one call at a time, with one
+ * asynchronous call per BSS as gsupplicant used to do, and with
+ * supplicant_dbus_property_get_all_batch().
+ *
+ * Run it on a private session bus, for example:
+ *	dbus-run-session -- tools/supplicant-bench --bss 500
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <gdbus.h>
+
+#include "../gsupplicant/dbus.h"
+
+#define BSS_PATH	SUPPLICANT_PATH "/Interfaces/0/BSSs/"
+
+struct bench_bss {
+	unsigned char bssid[6];
+	unsigned char ssid[32];
+	int ssid_len;
+	dbus_int16_t signal;
+	dbus_uint16_t frequency;
+	unsigned int keys;
+	bool done;
+};
+
+static int option_bss = 500;
+static int option_rounds = 5;
+
+static GOptionEntry options[] = {
+	{ "bss", 'b', 0, G_OPTION_ARG_INT, &option_bss,
+			"Number of BSSs reported by the scan", "N" },
+	{ "rounds", 'r', 0, G_OPTION_ARG_INT, &option_rounds,
+			"Number of rounds per method", "N" },
+	{ NULL },
+};
+
+static GMainLoop *main_loop;
+static struct bench_bss *bss_list;
+static char **bss_paths;
+static int bss_done;
+
+static void append_bytes(DBusMessageIter *dict, const char *key,
+				const unsigned char *data, int len)
+{
+	DBusMessageIter entry, value, array;
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "ay",
+								&value);
+	dbus_message_iter_open_container(&value, DBUS_TYPE_ARRAY,
+				DBUS_TYPE_BYTE_AS_STRING, &array);
+	dbus_message_iter_append_fixed_array(&array, DBUS_TYPE_BYTE,
+							&data, len);
+	dbus_message_iter_close_container(&value, &array);
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_basic(DBusMessageIter *dict, const char *key,
+						int type, void *val)
+{
+	DBusMessageIter entry, value;
+	const char sig[2] = { type, '\0' };
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, sig,
+								&value);
+	dbus_message_iter_append_basic(&value, type, val);
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static void append_security(DBusMessageIter *dict, const char *key)
+{
+	DBusMessageIter entry, value, sec, sec_entry, variant, array;
+	const char *keymgmt = "KeyMgmt", *pairwise = "Pairwise";
+	const char *group = "Group", *psk = "wpa-psk", *ccmp = "ccmp";
+
+	dbus_message_iter_open_container(dict, DBUS_TYPE_DICT_ENTRY,
+							NULL, &entry);
+	dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &key);
+	dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "a{sv}",
+								&value);
+	dbus_message_iter_open_container(&value, DBUS_TYPE_ARRAY, "{sv}",
+								&sec);
+
+	dbus_message_iter_open_container(&sec, DBUS_TYPE_DICT_ENTRY,
+							NULL, &sec_entry);
+	dbus_message_iter_append_basic(&sec_entry, DBUS_TYPE_STRING,
+								&keymgmt);
+	dbus_message_iter_open_container(&sec_entry, DBUS_TYPE_VARIANT, "as",
+								&variant);
+	dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s",
+								&array);
+	dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &psk);
+	dbus_message_iter_close_container(&variant, &array);
+	dbus_message_iter_close_container(&sec_entry, &variant);
+	dbus_message_iter_close_container(&sec, &sec_entry);
+
+	dbus_message_iter_open_container(&sec, DBUS_TYPE_DICT_ENTRY,
+							NULL, &sec_entry);
+	dbus_message_iter_append_basic(&sec_entry, DBUS_TYPE_STRING,
+								&pairwise);
+	dbus_message_iter_open_container(&sec_entry, DBUS_TYPE_VARIANT, "as",
+								&variant);
+	dbus_message_iter_open_container(&variant, DBUS_TYPE_ARRAY, "s",
+								&array);
+	dbus_message_iter_append_basic(&array, DBUS_TYPE_STRING, &ccmp);
+	dbus_message_iter_close_container(&variant, &array);
+	dbus_message_iter_close_container(&sec_entry, &variant);
+	dbus_message_iter_close_container(&sec, &sec_entry);
+
+	append_basic(&sec, group, DBUS_TYPE_STRING, &ccmp);
+
+	dbus_message_iter_close_container(&value, &sec);
+	dbus_message_iter_close_container(&entry, &value);
+	dbus_message_iter_close_container(dict, &entry);
+}
+
+static DBusMessage *mock_get_all(DBusMessage *msg, unsigned int index)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, dict;
+	unsigned char bssid[6] = { 0x02, 0x00, 0x00, 0x00,
+					index >> 8, index & 0xff };
+	unsigned char ies[200];
+	char ssid[32];
+	dbus_uint16_t frequency = index % 2 ? 5180 : 2412;
+	dbus_int16_t signal = -40 - (int) (index % 50);
+	dbus_bool_t privacy = TRUE;
+	const char *mode = "infrastructure";
+	int ssid_len;
+
+	memset(ies, 0xdd, sizeof(ies));
+	ssid_len = snprintf(ssid, sizeof(ssid), "bench-%u", index / 3);
+
+	reply = dbus_message_new_method_return(msg);
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{sv}",
+								&dict);
+
+	append_bytes(&dict, "BSSID", bssid, sizeof(bssid));
+	append_bytes(&dict, "SSID", (unsigned char *) ssid, ssid_len);
+	append_security(&dict, "WPA");
+	append_security(&dict, "RSN");
+	append_bytes(&dict, "IEs", ies, sizeof(ies));
+	append_basic(&dict, "Privacy", DBUS_TYPE_BOOLEAN, &privacy);
+	append_basic(&dict, "Mode", DBUS_TYPE_STRING, &mode);
+	append_basic(&dict, "Frequency", DBUS_TYPE_UINT16, &frequency);
+	append_basic(&dict, "Signal", DBUS_TYPE_INT16, &signal);
+
+	dbus_message_iter_close_container(&iter, &dict);
+
+	return reply;
+}
+
+static DBusHandlerResult mock_filter(DBusConnection *conn,
+					DBusMessage *msg, void *user_data)
+{
+	DBusMessage *reply;
+	const char *path;
+	unsigned int index;
+
+	if (!dbus_message_is_method_call(msg, DBUS_INTERFACE_PROPERTIES,
+								"GetAll"))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	path = dbus_message_get_path(msg);
+	if (!path || strncmp(path, BSS_PATH, strlen(BSS_PATH)) != 0)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	index = atoi(path + strlen(BSS_PATH));
+
+	reply = mock_get_all(msg, index);
+	dbus_connection_send(conn, reply, NULL);
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static void mock_run(int ready_fd)
+{
+	DBusConnection *conn;
+	DBusError error;
+	char c = 0;
+
+	dbus_error_init(&error);
+
+	conn = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+	if (!conn) {
+		fprintf(stderr, "mock: %s\n", error.message);
+		dbus_error_free(&error);
+		exit(1);
+	}
+
+	if (dbus_bus_request_name(conn, SUPPLICANT_SERVICE,
+				DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) !=
+				DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		fprintf(stderr, "mock: cannot own %s\n", SUPPLICANT_SERVICE);
+		exit(1);
+	}
+
+	dbus_connection_add_filter(conn, mock_filter, NULL, NULL);
+
+	if (write(ready_fd, &c, 1) < 0)
+		exit(1);
+	close(ready_fd);
+
+	while (dbus_connection_read_write_dispatch(conn, -1))
+		;
+
+	exit(0);
+}
+
+static void bss_property(const char *key, DBusMessageIter *iter,
+							void *user_data)
+{
+	struct bench_bss *bss = user_data;
+
+	if (!key) {
+		if (!bss->done) {
+			bss->done = true;
+			bss_done++;
+		}
+
+		if (bss_done == option_bss && main_loop)
+			g_main_loop_quit(main_loop);
+
+		return;
+	}
+
+	bss->keys++;
+
+	if (g_str_equal(key, "BSSID") || g_str_equal(key, "SSID")) {
+		DBusMessageIter array;
+		unsigned char *data;
+		int len;
+
+		dbus_message_iter_recurse(iter, &array);
+		dbus_message_iter_get_fixed_array(&array, &data, &len);
+
+		if (g_str_equal(key, "BSSID") && len == 6)
+			memcpy(bss->bssid, data, len);
+		else if (len > 0 && len <= 32) {
+			memcpy(bss->ssid, data, len);
+			bss->ssid_len = len;
+		}
+	} else if (g_str_equal(key, "Signal")) {
+		dbus_message_iter_get_basic(iter, &bss->signal);
+	} else if (g_str_equal(key, "Frequency")) {
+		dbus_message_iter_get_basic(iter, &bss->frequency);
+	} else if (g_str_equal(key, "RSN") || g_str_equal(key, "WPA")) {
+		supplicant_dbus_property_foreach(iter, NULL, bss);
+	}
+}
+
+static void reset_results(void)
+{
+	memset(bss_list, 0, sizeof(*bss_list) * option_bss);
+	bss_done = 0;
+}
+
+static bool check_results(void)
+{
+	int i;
+
+	for (i = 0; i < option_bss; i++)
+		if (!bss_list[i].done || bss_list[i].ssid_len == 0)
+			return false;
+
+	return true;
+}
+
+static void fetch_sequential(DBusConnection *conn)
+{
+	const char *interface = SUPPLICANT_INTERFACE ".BSS";
+	int i;
+
+	for (i = 0; i < option_bss; i++) {
+		DBusMessage *msg, *reply;
+		DBusMessageIter iter;
+
+		msg = dbus_message_new_method_call(SUPPLICANT_SERVICE,
+					bss_paths[i], DBUS_INTERFACE_PROPERTIES,
+					"GetAll");
+		dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface,
+							DBUS_TYPE_INVALID);
+
+		reply = dbus_connection_send_with_reply_and_block(conn, msg,
+								-1, NULL);
+		dbus_message_unref(msg);
+		if (!reply)
+			continue;
+
+		if (dbus_message_iter_init(reply, &iter)) {
+			supplicant_dbus_property_foreach(&iter, bss_property,
+								&bss_list[i]);
+			bss_property(NULL, NULL, &bss_list[i]);
+		}
+
+		dbus_message_unref(reply);
+	}
+}
+
+static void fetch_per_call(DBusConnection *conn)
+{
+	int i;
+
+	for (i = 0; i < option_bss; i++)
+		supplicant_dbus_property_get_all(bss_paths[i],
+					SUPPLICANT_INTERFACE ".BSS",
+					bss_property, &bss_list[i], NULL);
+
+	g_main_loop_run(main_loop);
+}
+
+static void batch_done(int result, void *user_data)
+{
+	if (result < 0)
+		fprintf(stderr, "batch failed: %s\n", strerror(-result));
+
+	g_main_loop_quit(main_loop);
+}
+
+static void fetch_batch(DBusConnection *conn)
+{
+	void **user_data;
+	int i;
+
+	user_data = g_new0(void *, option_bss);
+	for (i = 0; i < option_bss; i++)
+		user_data[i] = &bss_list[i];
+
+	if (supplicant_dbus_property_get_all_batch(SUPPLICANT_INTERFACE ".BSS",
+					(const char **) bss_paths, user_data,
+					option_bss, bss_property, batch_done,
+					NULL, NULL) == 0)
+		g_main_loop_run(main_loop);
+
+	g_free(user_data);
+}
+
+static void bench(DBusConnection *conn, const char *name,
+			void (*fetch)(DBusConnection *conn))
+{
+	gint64 start, total = 0, best = G_MAXINT64;
+	bool ok = true;
+	int round;
+
+	for (round = 0; round < option_rounds; round++) {
+		gint64 elapsed;
+
+		reset_results();
+
+		start = g_get_monotonic_time();
+		fetch(conn);
+		elapsed = g_get_monotonic_time() - start;
+
+		if (!check_results())
+			ok = false;
+
+		total += elapsed;
+		if (elapsed < best)
+			best = elapsed;
+	}
+
+	printf("%-12s %10.2f %10.2f %10.2f %s\n", name,
+		total / 1000.0 / option_rounds, best / 1000.0,
+		(double) total / option_rounds / option_bss,
+		ok ? "" : "(incomplete results)");
+}
+
+int main(int argc, char *argv[])
+{
+	GOptionContext *context;
+	GError *error = NULL;
+	DBusConnection *conn;
+	DBusError err;
+	int fds[2], i;
+	pid_t pid;
+	char c;
+
+	context = g_option_context_new(NULL);
+	g_option_context_add_main_entries(context, options, NULL);
+
+	if (!g_option_context_parse(context, &argc, &argv, &error)) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		exit(1);
+	}
+
+	g_option_context_free(context);
+
+	if (option_bss < 1)
+		option_bss = 1;
+	if (option_rounds < 1)
+		option_rounds = 1;
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		exit(1);
+	}
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		exit(1);
+	}
+
+	if (pid == 0) {
+		close(fds[0]);
+		mock_run(fds[1]);
+	}
+
+	close(fds[1]);
+
+	if (read(fds[0], &c, 1) != 1) {
+		fprintf(stderr, "Mock supplicant failed to start\n");
+		waitpid(pid, NULL, 0);
+		exit(1);
+	}
+	close(fds[0]);
+
+	dbus_error_init(&err);
+
+	conn = g_dbus_setup_bus(DBUS_BUS_SESSION, NULL, &err);
+	if (!conn) {
+		fprintf(stderr, "%s\n", err.message);
+		dbus_error_free(&err);
+		kill(pid, SIGTERM);
+		exit(1);
+	}
+
+	supplicant_dbus_setup(conn);
+	main_loop = g_main_loop_new(NULL, FALSE);
+
+	bss_list = g_new0(struct bench_bss, option_bss);
+	bss_paths = g_new0(char *, option_bss + 1);
+	for (i = 0; i < option_bss; i++)
+		bss_paths[i] = g_strdup_printf(BSS_PATH "%d", i);
+
+	printf("%d BSSs, %d rounds\n", option_bss, option_rounds);
+	printf("%-12s %10s %10s %10s\n", "method", "avg ms", "best ms",
+							"us/BSS");
+
+	bench(conn, "sequential", fetch_sequential);
+	bench(conn, "per-call", fetch_per_call);
+	bench(conn, "batch", fetch_batch);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	g_strfreev(bss_paths);
+	g_free(bss_list);
+	g_main_loop_unref(main_loop);
+	dbus_connection_unref(conn);
+
+	return 0;
+}
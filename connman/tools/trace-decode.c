@@ -0,0 +1,414 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Prints the debug messages stored by connmand --trace. The file can
+ * be read while connmand is running or after it has crashed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <glib.h>
+
+/* Must match src/log.c */
+#define TRACE_MAGIC		0x43525443
+#define TRACE_VERSION		1
+#define TRACE_TRUNCATED		0x0001
+#define TRACE_STRING_NULL	0xffff
+
+struct trace_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t records;
+	uint32_t strings_size;
+	uint32_t strings_used;
+	uint64_t head;
+	int64_t realtime_offset;
+	uint32_t pid;
+	uint8_t padding[20];
+};
+
+struct trace_record {
+	uint64_t seq;
+	uint64_t timestamp;
+	uint32_t format;
+	uint16_t length;
+	uint16_t flags;
+	uint8_t payload[];
+};
+
+struct payload {
+	const uint8_t *data;
+	size_t length;
+	size_t pos;
+};
+
+static bool get_int(struct payload *payload, int64_t *value)
+{
+	if (payload->pos + sizeof(*value) > payload->length)
+		return false;
+
+	memcpy(value, payload->data + payload->pos, sizeof(*value));
+	payload->pos += sizeof(*value);
+
+	return true;
+}
+
+static bool get_double(struct payload *payload, double *value)
+{
+	if (payload->pos + sizeof(*value) > payload->length)
+		return false;
+
+	memcpy(value, payload->data + payload->pos, sizeof(*value));
+	payload->pos += sizeof(*value);
+
+	return true;
+}
+
+static bool get_string(struct payload *payload, GString *out,
+							const char *spec)
+{
+	uint16_t len;
+	char *str;
+
+	if (payload->pos + sizeof(len) > payload->length)
+		return false;
+
+	memcpy(&len, payload->data + payload->pos, sizeof(len));
+	payload->pos += sizeof(len);
+
+	if (len == TRACE_STRING_NULL) {
+		g_string_append_printf(out, spec, NULL);
+		return true;
+	}
+
+	if (payload->pos + len > payload->length)
+		return false;
+
+	str = g_strndup((const char *) payload->data + payload->pos, len);
+	g_string_append_printf(out, spec, str);
+	g_free(str);
+
+	payload->pos += len;
+
+	return true;
+}
+
+static bool format_int(struct payload *payload, GString *out,
+				const char *spec, int longs, char size,
+				char conv)
+{
+	bool is_signed = conv == 'd' || conv == 'i';
+	int64_t value;
+
+	if (!get_int(payload, &value))
+		return false;
+
+	if (longs >= 2 || size == 'q' || size == 'L')
+		g_string_append_printf(out, spec, (long long) value);
+	else if (longs == 1)
+		g_string_append_printf(out, spec, (long) value);
+	else if (size == 'j')
+		g_string_append_printf(out, spec, (intmax_t) value);
+	else if (size == 'z')
+		g_string_append_printf(out, spec, (size_t) value);
+	else if (size == 't')
+		g_string_append_printf(out, spec, (ptrdiff_t) value);
+	else if (is_signed)
+		g_string_append_printf(out, spec, (int) value);
+	else
+		g_string_append_printf(out, spec, (unsigned int) value);
+
+	return true;
+}
+
+/*
+ * Walks the format the same way as trace_put_args() in src/log.c and
+ * prints each conversion on its own with the stored argument.
+ */
+static void format_message(GString *out, const char *format,
+				const uint8_t *data, size_t length,
+				bool truncated)
+{
+	struct payload payload = { data, length, 0 };
+	const char *p = format, *start;
+
+	while (*p) {
+		GString *spec;
+		int64_t width = 0, precision = 0;
+		bool has_width = false, has_precision = false;
+		int longs = 0;
+		char size = 0;
+		bool ok = true;
+
+		start = strchr(p, '%');
+		if (!start) {
+			g_string_append(out, p);
+			p += strlen(p);
+			break;
+		}
+
+		g_string_append_len(out, p, start - p);
+		p = start + 1;
+
+		if (*p == '%') {
+			g_string_append_c(out, '%');
+			p++;
+			continue;
+		}
+
+		spec = g_string_new("%");
+
+		while (*p && strchr("-+ #0'I", *p))
+			g_string_append_c(spec, *p++);
+
+		if (*p == '*') {
+			ok = get_int(&payload, &width);
+			has_width = true;
+			p++;
+		}
+		while (*p >= '0' && *p <= '9')
+			g_string_append_c(spec, *p++);
+
+		if (ok && *p == '.') {
+			g_string_append_c(spec, *p++);
+			if (*p == '*') {
+				ok = get_int(&payload, &precision);
+				has_precision = true;
+				p++;
+			}
+			while (*p >= '0' && *p <= '9')
+				g_string_append_c(spec, *p++);
+		}
+
+		if (has_width || has_precision) {
+			GString *fixed = g_string_new("%");
+
+			/* Put the stored values in place of the stars */
+			g_string_append_len(fixed, spec->str + 1,
+					strcspn(spec->str + 1, "."));
+			if (has_width)
+				g_string_append_printf(fixed, "%d",
+							(int) width);
+			g_string_append(fixed, spec->str + 1 +
+					strcspn(spec->str + 1, "."));
+			if (has_precision)
+				g_string_append_printf(fixed, "%d",
+							(int) precision);
+
+			g_string_free(spec, TRUE);
+			spec = fixed;
+		}
+
+		for (; *p && strchr("hlLqjzt", *p); p++) {
+			g_string_append_c(spec, *p);
+			if (*p == 'l')
+				longs++;
+			else
+				size = *p;
+		}
+
+		if (!*p || !ok) {
+			g_string_free(spec, TRUE);
+			break;
+		}
+
+		g_string_append_c(spec, *p);
+
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+		case 'c':
+			ok = format_int(&payload, out, spec->str, longs, size,
+									*p);
+			break;
+		case 'p': {
+			int64_t value;
+
+			ok = get_int(&payload, &value);
+			if (ok)
+				g_string_append_printf(out, spec->str,
+						(void *) (uintptr_t) value);
+			break;
+		}
+		case 's':
+			ok = get_string(&payload, out, spec->str);
+			break;
+		case 'e': case 'E': case 'f': case 'F':
+		case 'g': case 'G': case 'a': case 'A': {
+			double value;
+
+			/* Stored as a double even for %Lf */
+			if (size == 'L') {
+				g_string_truncate(spec, spec->len - 2);
+				g_string_append_c(spec, *p);
+			}
+
+			ok = get_double(&payload, &value);
+			if (ok)
+				g_string_append_printf(out, spec->str, value);
+			break;
+		}
+		case 'm': {
+			int64_t value;
+
+			ok = get_int(&payload, &value);
+			if (ok)
+				g_string_append(out, strerror(value));
+			break;
+		}
+		case 'n':
+			break;
+		default:
+			ok = false;
+			break;
+		}
+
+		g_string_free(spec, TRUE);
+
+		if (!ok)
+			break;
+
+		p++;
+	}
+
+	if (*p || truncated)
+		g_string_append(out, " [truncated]");
+}
+
+static void print_record(const struct trace_header *header,
+				const char *strings,
+				const struct trace_record *record,
+				GString *out)
+{
+	const char *file = "?", *format = NULL;
+	struct tm tm;
+	time_t sec;
+	int64_t ns;
+	size_t length;
+
+	ns = record->timestamp + header->realtime_offset;
+	sec = ns / 1000000000;
+	localtime_r(&sec, &tm);
+
+	if (record->format && record->format < header->strings_size) {
+		file = strings + record->format;
+		format = file + strlen(file) + 1;
+	}
+
+	length = record->length;
+	if (length > header->record_size - sizeof(*record))
+		length = header->record_size - sizeof(*record);
+
+	g_string_printf(out, "%02d:%02d:%02d.%06d %s:", tm.tm_hour,
+				tm.tm_min, tm.tm_sec,
+				(int) (ns % 1000000000 / 1000), file);
+
+	if (format)
+		format_message(out, format, record->payload, length,
+					record->flags & TRACE_TRUNCATED);
+	else
+		g_string_append(out, "<unknown format>");
+
+	printf("%s\n", out->str);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct trace_header *header;
+	const char *strings;
+	const uint8_t *records;
+	GMappedFile *file;
+	GError *error = NULL;
+	GString *out;
+	uint64_t seq, first, skipped = 0;
+	size_t length;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+		exit(1);
+	}
+
+	file = g_mapped_file_new(argv[1], FALSE, &error);
+	if (!file) {
+		fprintf(stderr, "%s\n", error->message);
+		g_error_free(error);
+		exit(1);
+	}
+
+	header = (const struct trace_header *) g_mapped_file_get_contents(file);
+	length = g_mapped_file_get_length(file);
+
+	if (length < sizeof(*header) || header->magic != TRACE_MAGIC ||
+			header->version != TRACE_VERSION ||
+			header->record_size <= sizeof(struct trace_record) ||
+			header->records == 0 ||
+			length < sizeof(*header) + header->strings_size +
+			(size_t) header->records * header->record_size) {
+		fprintf(stderr, "%s is not a connman trace file\n", argv[1]);
+		g_mapped_file_unref(file);
+		exit(1);
+	}
+
+	strings = (const char *) header + sizeof(*header);
+	records = (const uint8_t *) strings + header->strings_size;
+
+	printf("pid %u, %" G_GUINT64_FORMAT " messages\n", header->pid,
+								header->head);
+
+	first = header->head > header->records ?
+				header->head - header->records : 0;
+	out = g_string_new(NULL);
+
+	for (seq = first; seq < header->head; seq++) {
+		const struct trace_record *record;
+
+		record = (const struct trace_record *) (records +
+				(seq % header->records) * header->record_size);
+
+		/* Being written or already overwritten */
+		if (record->seq != seq + 1) {
+			skipped++;
+			continue;
+		}
+
+		print_record(header, strings, record, out);
+	}
+
+	if (skipped)
+		printf("%" G_GUINT64_FORMAT " incomplete messages skipped\n",
+								skipped);
+
+	g_string_free(out, TRUE);
+	g_mapped_file_unref(file);
+
+	return 0;
+}
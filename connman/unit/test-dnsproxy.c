@@ -78,28 +78,6 @@ int socket(int domain, int type, int protocol)
 	return -1;
 }
 
-GResolv *g_resolv_new(int index)
-{
-	return NULL;
-}
-
-bool g_resolv_set_address_family(GResolv *resolv, int family)
-{
-	return FALSE;
-}
-
-bool g_resolv_add_nameserver(GResolv *resolv, const char *address,
-					uint16_t port, unsigned long flags)
-{
-	return FALSE;
-}
-
-guint g_resolv_lookup_hostname(GResolv *resolv, const char *hostname,
-				GResolvResultFunc func, gpointer user_data)
-{
-	return 0;
-}
-
 int __connman_agent_request_connection(void *user_data)
 {
 	return -1;
@@ -125,6 +103,18 @@ int __connman_service_get_index(struct connman_service *service)
 	return -1;
 }
 
+const char *__connman_service_get_ident(struct connman_service *service)
+{
+	return NULL;
+}
+
+static char *test_storage_dir;
+
+const char *connman_storage_dir(void)
+{
+	return test_storage_dir;
+}
+
 bool __connman_service_index_is_default(int index)
 {
 	return FALSE;
@@ -154,6 +144,16 @@ void connman_notifier_unregister(struct connman_notifier *notifier)
 {
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	return 0;
+}
+
+bool connman_setting_get_bool(const char *key)
+{
+	return true;
+}
+
 int __connman_util_get_random(uint64_t *val)
 {
         if (!val)
@@ -198,12 +198,582 @@ static void server_creation_failure(void)
 	g_main_loop_unref(main_loop);
 }
 
+/* Build a UDP reply with one A record for the given host */
+static int build_a_reply(unsigned char *buf, const char *host, int ttl)
+{
+	struct domain_hdr *hdr = (void *) buf;
+	unsigned char *ptr;
+	int len;
+
+	memset(buf, 0, 12);
+	hdr->id = 0x1234;
+	hdr->qr = 1;
+	hdr->rd = 1;
+	hdr->ra = 1;
+	hdr->qdcount = htons(1);
+	hdr->ancount = htons(1);
+
+	ptr = buf + 12;
+	len = append_query(ptr, 256, host, NULL);
+	ptr += len;
+
+	/* question type A, class IN */
+	*ptr++ = 0; *ptr++ = 1; *ptr++ = 0; *ptr++ = 1;
+
+	/* answer: pointer to question name, type A, class IN, ttl */
+	*ptr++ = 0xc0; *ptr++ = 0x0c;
+	*ptr++ = 0; *ptr++ = 1; *ptr++ = 0; *ptr++ = 1;
+	*ptr++ = ttl >> 24; *ptr++ = ttl >> 16; *ptr++ = ttl >> 8; *ptr++ = ttl;
+	*ptr++ = 0; *ptr++ = 4;
+	*ptr++ = 10; *ptr++ = 0; *ptr++ = 0; *ptr++ = 1;
+
+	return ptr - buf;
+}
+
+static struct cache_entry *lookup_type(const char *host, uint16_t type)
+{
+	char key[256];
+
+	append_query((unsigned char *) key, sizeof(key), host, NULL);
+
+	return cache_lookup(key, type, ns_c_in);
+}
+
+static struct cache_entry *lookup_host(const char *host)
+{
+	return lookup_type(host, ns_t_a);
+}
+
+static void cache_lru_eviction(void)
+{
+	struct server_data srv;
+	unsigned char buf[512];
+	char host[32];
+	int i, len;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.protocol = IPPROTO_UDP;
+
+	cache_max_size = 4;
+	create_cache();
+
+	for (i = 0; i < 4; i++) {
+		snprintf(host, sizeof(host), "host%d.example.com", i);
+		len = build_a_reply(buf, host, 300 + i);
+		g_assert(cache_update(&srv, buf, len) == 0);
+	}
+
+	g_assert(cache_size == 4);
+	g_assert(cache_heap->len == 4);
+
+	/* host0 is used again so host1 is now the least recently used */
+	cache_entry_touch(lookup_host("host0.example.com"));
+
+	len = build_a_reply(buf, "host4.example.com", 300);
+	g_assert(cache_update(&srv, buf, len) == 0);
+
+	g_assert(cache_size == 4);
+	g_assert(lookup_host("host0.example.com"));
+	g_assert(!lookup_host("host1.example.com"));
+	g_assert(lookup_host("host4.example.com"));
+
+	/* Expired entries go before the least recently used ones */
+	lookup_host("host3.example.com")->data->cache_until = 1;
+	cache_entry_update(lookup_host("host3.example.com"));
+
+	len = build_a_reply(buf, "host5.example.com", 300);
+	g_assert(cache_update(&srv, buf, len) == 0);
+
+	g_assert(cache_size == 4);
+	g_assert(!lookup_host("host3.example.com"));
+	g_assert(lookup_host("host2.example.com"));
+
+	/* Memory budget is honoured too */
+	cache_max_bytes = lookup_host("host5.example.com")->size * 2;
+	len = build_a_reply(buf, "host6.example.com", 300);
+	g_assert(cache_update(&srv, buf, len) == 0);
+
+	g_assert(cache_bytes <= cache_max_bytes);
+	g_assert(lookup_host("host6.example.com"));
+
+	cache_max_bytes = 0;
+	cache_max_size = DEFAULT_CACHE_SIZE;
+	__sync_fetch_and_sub(&cache_refcount, 1);
+	destroy_cache();
+	g_assert(!cache_lru.length);
+}
+
+/* Build a UDP reply with one MX record pointing to mail.<host> */
+static int build_mx_reply(unsigned char *buf, const char *host)
+{
+	struct domain_hdr *hdr = (void *) buf;
+	unsigned char *ptr;
+	int len;
+
+	memset(buf, 0, 12);
+	hdr->id = 0x4321;
+	hdr->qr = 1;
+	hdr->qdcount = htons(1);
+	hdr->ancount = htons(1);
+
+	ptr = buf + 12;
+	len = append_query(ptr, 256, host, NULL);
+	ptr += len;
+
+	/* question type MX, class IN */
+	*ptr++ = 0; *ptr++ = ns_t_mx; *ptr++ = 0; *ptr++ = 1;
+
+	/* answer, the exchange is compressed and refers to the question */
+	*ptr++ = 0xc0; *ptr++ = 0x0c;
+	*ptr++ = 0; *ptr++ = ns_t_mx; *ptr++ = 0; *ptr++ = 1;
+	*ptr++ = 0; *ptr++ = 0; *ptr++ = 0x0e; *ptr++ = 0x10;
+	*ptr++ = 0; *ptr++ = 2 + 5 + 2;
+	*ptr++ = 0; *ptr++ = 10;
+	*ptr++ = 4; memcpy(ptr, "mail", 4); ptr += 4;
+	*ptr++ = 0xc0; *ptr++ = 0x0c;
+
+	return ptr - buf;
+}
+
+static void cache_rrsets(void)
+{
+	struct server_data srv;
+	struct cache_entry *entry;
+	unsigned char buf[512];
+	char exchange[NS_MAXDNAME];
+	unsigned char *rdata;
+	int len;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.protocol = IPPROTO_UDP;
+
+	create_cache();
+
+	len = build_a_reply(buf, "example.com", 600);
+	g_assert(cache_update(&srv, buf, len) == 0);
+
+	len = build_mx_reply(buf, "example.com");
+	g_assert(cache_update(&srv, buf, len) == 0);
+
+	g_assert(cache_size == 2);
+
+	entry = lookup_type("example.com", ns_t_mx);
+	g_assert(entry && entry->data);
+	g_assert(entry->data->answers == 1);
+
+	/*
+	 * The cached exchange name must not refer to the original
+	 * packet anymore. The cached data starts with the TCP length,
+	 * then header, question and the answer record (owner pointer,
+	 * fixed part, preference).
+	 */
+	rdata = entry->data->data + 2 + 12 + strlen("example.com") + 2 + 4 +
+							2 + 10 + 2;
+	g_assert(dn_expand(entry->data->data + 2,
+			entry->data->data + entry->data->data_len,
+			rdata, exchange, sizeof(exchange)) > 0);
+	g_assert_cmpstr(exchange, ==, "mail.example.com");
+
+	/* The RRsets of the same name expire independently */
+	lookup_type("example.com", ns_t_mx)->data->cache_until = 1;
+	cache_enforce_validity(lookup_type("example.com", ns_t_mx));
+
+	g_assert(!lookup_type("example.com", ns_t_mx)->data);
+	g_assert(lookup_host("example.com")->data);
+
+	__sync_fetch_and_sub(&cache_refcount, 1);
+	destroy_cache();
+}
+
+/* Build a TCP query for an A record of the given host */
+static int build_tcp_query(unsigned char *buf, const char *host)
+{
+	struct domain_hdr *hdr = (void *) (buf + 2);
+	unsigned char *ptr;
+	int len;
+
+	memset(buf, 0, 2 + 12);
+	hdr->id = 0x5678;
+	hdr->rd = 1;
+	hdr->qdcount = htons(1);
+
+	ptr = buf + 2 + 12;
+	len = append_query(ptr, 256, host, NULL);
+	ptr += len;
+	*ptr++ = 0; *ptr++ = 1; *ptr++ = 0; *ptr++ = 1;
+
+	len = ptr - buf;
+	buf[0] = (len - 2) >> 8;
+	buf[1] = (len - 2) & 0xff;
+
+	return len;
+}
+
+static void cache_prefetch_stale(void)
+{
+	struct server_data srv;
+	struct request_data req;
+	struct cache_entry *entry;
+	unsigned char buf[512], reply[512];
+	int sv[2], len;
+	uint32_t ttl;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.protocol = IPPROTO_UDP;
+
+	create_cache();
+
+	len = build_a_reply(buf, "popular.example.com", 600);
+	g_assert(cache_update(&srv, buf, len) == 0);
+
+	/* Popular entries are queued for prefetching */
+	entry = lookup_host("popular.example.com");
+	g_assert(entry && entry->data);
+	cache_entry_hit(entry);
+	cache_entry_hit(entry);
+	g_assert(!cache_prefetch.length);
+	cache_entry_hit(entry);
+	g_assert(cache_prefetch.length == 1);
+	g_assert(prefetch_timer);
+	g_assert(prefetch_due == entry->expire - PREFETCH_LEAD);
+
+	/* Expired data is kept but not used for normal answers */
+	len = build_tcp_query(buf, "popular.example.com");
+	entry->data->cache_until = time(NULL) - 60;
+	g_assert(!cache_check(buf, IPPROTO_TCP));
+	g_assert(entry->data);
+
+	/* It is used when the servers do not answer */
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+	memset(&req, 0, sizeof(req));
+	req.protocol = IPPROTO_TCP;
+	req.client_sk = sv[0];
+	req.srcid = 0x5678;
+
+	g_assert(cache_send_stale(&req, buf));
+	g_assert(dnsproxy_stats.stale_answers == 1);
+
+	len = recv(sv[1], reply, sizeof(reply), 0);
+	g_assert(len == entry->data->data_len);
+	g_assert(reply[2] == 0x78 && reply[3] == 0x56);
+
+	/* TTL of the answer after header, question and owner name */
+	memcpy(&ttl, reply + 2 + 12 + strlen("popular.example.com") + 2 +
+							4 + 2 + 4, 4);
+	g_assert(ntohl(ttl) == STALE_ANSWER_TTL);
+
+	/* Data older than the stale window is dropped */
+	entry->data->cache_until = time(NULL) - CACHE_STALE_TIME - 60;
+	g_assert(!cache_send_stale(&req, buf));
+	g_assert(!entry->data);
+	g_assert(dnsproxy_stats.stale_answers == 1);
+
+	close(sv[0]);
+	close(sv[1]);
+
+	__sync_fetch_and_sub(&cache_refcount, 1);
+	destroy_cache();
+	g_assert(!cache_prefetch.length);
+	g_assert(!prefetch_timer);
+}
+
+static void request_server_index(void)
+{
+	struct request_data req[3];
+	struct server_data srv[3];
+	int i;
+
+	memset(req, 0, sizeof(req));
+
+	for (i = 0; i < 3; i++) {
+		req[i].dstid = get_request_id();
+		req[i].altid = get_request_id();
+		request_add(&req[i]);
+	}
+
+	g_assert(request_queue.length == 3);
+
+	for (i = 0; i < 3; i++) {
+		g_assert(find_request(req[i].dstid) == &req[i]);
+		g_assert(find_request(req[i].altid) == &req[i]);
+	}
+
+	request_remove(&req[1]);
+	request_remove(&req[1]);
+	g_assert(request_queue.length == 2);
+	g_assert(!find_request(req[1].dstid));
+	g_assert(find_request(req[2].dstid) == &req[2]);
+
+	request_remove(&req[0]);
+	request_remove(&req[2]);
+	g_assert(!g_hash_table_size(request_table));
+
+	memset(srv, 0, sizeof(srv));
+	srv[0].index = 1;
+	srv[0].server = "192.0.2.1";
+	srv[0].protocol = IPPROTO_UDP;
+	srv[1] = srv[0];
+	srv[1].protocol = IPPROTO_TCP;
+	srv[2] = srv[1];
+
+	for (i = 0; i < 3; i++)
+		server_list_append(&srv[i]);
+
+	g_assert(find_server(1, "192.0.2.1", IPPROTO_UDP) == &srv[0]);
+	g_assert(find_server(1, "192.0.2.1", IPPROTO_TCP) == &srv[1]);
+	g_assert(!find_server(2, "192.0.2.1", IPPROTO_UDP));
+
+	/* The second TCP server takes over when the first one is gone */
+	server_list_remove(&srv[1]);
+	g_assert(find_server(1, "192.0.2.1", IPPROTO_TCP) == &srv[2]);
+
+	/* Fallback servers all have a negative index */
+	server_list_remove(&srv[0]);
+	srv[0].index = -1;
+	server_list_append(&srv[0]);
+	g_assert(find_server(-2, "192.0.2.1", IPPROTO_UDP) == &srv[0]);
+
+	server_list_remove(&srv[0]);
+	server_list_remove(&srv[2]);
+	g_assert(!server_list);
+	g_assert(!g_hash_table_size(server_table));
+}
+
+static void cache_snapshot(void)
+{
+	struct server_data srv;
+	unsigned char buf[512];
+	GByteArray *snapshot;
+	char *dir, *pathname;
+	time_t until;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.protocol = IPPROTO_UDP;
+
+	cache_partitions = g_hash_table_new_full(g_str_hash, g_str_equal,
+						g_free, cache_snapshot_free);
+	create_cache();
+	cache_partition_switch("wifi_home");
+
+	g_assert(cache_update(&srv, buf,
+			build_a_reply(buf, "home.example.com", 300)) == 0);
+	g_assert(cache_update(&srv, buf,
+			build_a_reply(buf, "old.example.com", 300)) == 0);
+	until = lookup_host("home.example.com")->data->cache_until;
+
+	/* Answers too old even for the stale window are not saved */
+	lookup_host("old.example.com")->data->cache_until = 1;
+	cache_entry_update(lookup_host("old.example.com"));
+
+	/* Leaving the network empties the cache, coming back restores it */
+	cache_partition_switch("wifi_other");
+	g_assert(!lookup_host("home.example.com") ||
+				!lookup_host("home.example.com")->data);
+
+	g_assert(cache_update(&srv, buf,
+			build_a_reply(buf, "other.example.com", 300)) == 0);
+
+	cache_partition_switch("wifi_home");
+	g_assert(lookup_host("home.example.com")->data);
+	g_assert(lookup_host("home.example.com")->data->cache_until == until);
+	g_assert(!lookup_host("old.example.com"));
+	g_assert(!lookup_host("other.example.com") ||
+				!lookup_host("other.example.com")->data);
+
+	/* Snapshots stored on disk survive the cache */
+	test_storage_dir = g_strdup("/tmp/test-dnsproxy-XXXXXX");
+	g_assert(mkdtemp(test_storage_dir));
+	dir = g_strdup_printf("%s/wifi_home", test_storage_dir);
+	g_assert(mkdir(dir, 0700) == 0);
+
+	snapshot = cache_snapshot_create();
+	cache_snapshot_write("wifi_home", snapshot);
+	cache_snapshot_free(snapshot);
+
+	__sync_fetch_and_sub(&cache_refcount, 1);
+	destroy_cache();
+
+	g_assert(cache_snapshot_read("wifi_home") == 1);
+	g_assert(lookup_host("home.example.com")->data->cache_until == until);
+
+	/* Only the most recently used answers that fit are restored */
+	g_assert(cache_update(&srv, buf,
+			build_a_reply(buf, "other.example.com", 300)) == 0);
+	snapshot = cache_snapshot_create();
+
+	__sync_fetch_and_sub(&cache_refcount, 1);
+	destroy_cache();
+
+	cache_max_size = 1;
+	g_assert(cache_snapshot_restore(snapshot->data, snapshot->len) == 1);
+	g_assert(lookup_host("other.example.com")->data);
+	g_assert(!lookup_host("home.example.com"));
+	cache_max_size = DEFAULT_CACHE_SIZE;
+
+	/* Answers with records running past the packet are skipped */
+	snapshot->data[snapshot->len - 6] = 0xff;
+
+	__sync_fetch_and_sub(&cache_refcount, 1);
+	destroy_cache();
+
+	g_assert(cache_snapshot_restore(snapshot->data, snapshot->len) == 1);
+	g_assert(lookup_host("home.example.com")->data);
+	g_assert(!lookup_host("other.example.com"));
+	cache_snapshot_free(snapshot);
+
+	/* A corrupt file is dropped */
+	pathname = cache_snapshot_path("wifi_home");
+	g_assert(g_file_set_contents(pathname, "garbage", -1, NULL));
+	g_assert(cache_snapshot_read("wifi_home") == -EINVAL);
+	g_assert(!g_file_test(pathname, G_FILE_TEST_EXISTS));
+	g_free(pathname);
+
+	rmdir(dir);
+	rmdir(test_storage_dir);
+	g_free(dir);
+	g_free(test_storage_dir);
+	test_storage_dir = NULL;
+
+	__sync_fetch_and_sub(&cache_refcount, 1);
+	destroy_cache();
+	cache_partitions_destroy();
+}
+
+static void server_rank(void)
+{
+	struct server_data srv[3];
+	struct upstream_attempt *attempt;
+	struct request_data req;
+	GSList *ranked = NULL;
+	int i;
+
+	memset(srv, 0, sizeof(srv));
+
+	/* Unknown servers start with the same cost */
+	g_assert(server_rank_compare(&srv[0], &srv[1]) == 0);
+	g_assert(server_rto(&srv[0]) == SERVER_INITIAL_RTO);
+
+	for (i = 0; i < 8; i++) {
+		server_update_rtt(&srv[0], 80000);
+		server_update_rtt(&srv[1], 20000);
+		server_update_rtt(&srv[2], 10000);
+	}
+
+	g_assert(srv[1].srtt > 10000 && srv[1].srtt <= 20000);
+	g_assert(server_rto(&srv[2]) == SERVER_MIN_RTO);
+
+	/* The fastest server falls behind once it keeps losing queries */
+	for (i = 0; i < 4; i++)
+		server_update_loss(&srv[2]);
+
+	for (i = 0; i < 3; i++)
+		ranked = g_slist_insert_sorted(ranked, &srv[i],
+						server_rank_compare);
+
+	g_assert(ranked->data == &srv[1]);
+	g_assert(g_slist_nth_data(ranked, 2) == &srv[2]);
+	g_assert(srv[2].timeouts == 4);
+	g_slist_free(ranked);
+
+	/* Karn's rule, only a query sent once gives an rtt sample */
+	attempt = g_new0(struct upstream_attempt, 1);
+	attempt->sent = 1000;
+	attempt->packets = 1;
+	g_assert(upstream_reply_rtt(attempt, 3000) == 2000);
+	attempt->packets = 2;
+	g_assert(upstream_reply_rtt(attempt, 3000) < 0);
+	attempt->packets = 1;
+	attempt->lost = true;
+	g_assert(upstream_reply_rtt(attempt, 3000) < 0);
+	g_free(attempt);
+
+	/* A lost server is not waited for anymore */
+	memset(&req, 0, sizeof(req));
+	attempt = g_new0(struct upstream_attempt, 1);
+	attempt->server = &srv[0];
+	attempt->sent = 1;
+	attempt->packets = 2;
+	req.upstreams = g_slist_append(NULL, attempt);
+	req.numserv = 3;
+
+	request_upstreams_lost(&req);
+	g_assert(attempt->lost && req.numserv == 1);
+	g_assert(srv[0].timeouts == 1);
+
+	request_upstreams_free(&req);
+	g_assert(!req.upstreams);
+}
+
+static void tcp_server_queue(void)
+{
+	struct server_data server;
+	unsigned char query[300], buf[sizeof(query)];
+	size_t received = 0;
+	int sv[2], i, size = 4096;
+	ssize_t len;
+
+	memset(&server, 0, sizeof(server));
+	server.server = "tcp.example.com";
+
+	g_assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv) == 0);
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	server.channel = g_io_channel_unix_new(sv[0]);
+	g_io_channel_set_close_on_unref(server.channel, TRUE);
+
+	/* Write more than the socket takes, the rest is queued in order */
+	for (i = 0; i < 200; i++) {
+		memset(query, i, sizeof(query));
+		g_assert(tcp_server_write(&server, query,
+					sizeof(query)) == sizeof(query));
+	}
+
+	g_assert(server.outgoing && server.outgoing->len > 0);
+	g_assert(server.out_watch > 0);
+
+	for (i = 0; i < 200; ) {
+		len = recv(sv[1], buf + received, sizeof(buf) - received, 0);
+		if (len < 0) {
+			g_assert(errno == EAGAIN);
+			g_main_context_iteration(NULL, TRUE);
+			continue;
+		}
+
+		received += len;
+		if (received < sizeof(buf))
+			continue;
+
+		memset(query, i, sizeof(query));
+		g_assert(!memcmp(buf, query, sizeof(buf)));
+		received = 0;
+		i++;
+	}
+
+	g_assert(server.outgoing->len == 0);
+	g_assert(server.out_watch == 0);
+
+	server_destroy_socket(&server);
+	g_assert(!server.outgoing);
+	close(sv[1]);
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
 
 	g_test_add_func("/dnsproxy/server-creation-failure",
 			server_creation_failure);
+	g_test_add_func("/dnsproxy/cache-lru-eviction",
+			cache_lru_eviction);
+	g_test_add_func("/dnsproxy/cache-rrsets", cache_rrsets);
+	g_test_add_func("/dnsproxy/cache-prefetch-stale",
+			cache_prefetch_stale);
+	g_test_add_func("/dnsproxy/request-server-index",
+			request_server_index);
+	g_test_add_func("/dnsproxy/cache-snapshot", cache_snapshot);
+	g_test_add_func("/dnsproxy/server-rank", server_rank);
+	g_test_add_func("/dnsproxy/tcp-server-queue", tcp_server_queue);
 
 	return g_test_run();
 }
@@ -23,6 +23,8 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
+
 #include <glib.h>
 
 #include "../src/connman.h"
@@ -436,6 +438,102 @@ static void test_case_6(void)
 	__connman_ippool_cleanup();
 }
 
+static void test_case_7(void)
+{
+	struct connman_ippool *pool1, *pool2;
+
+	__connman_ippool_init();
+
+	/* Removing an address keeps the blocks of overlapping ones used */
+	__connman_ippool_newaddr(25, "192.168.0.2", 24);
+	__connman_ippool_newaddr(26, "192.168.0.3", 22);
+	__connman_ippool_deladdr(26, "192.168.0.3", 22);
+
+	pool1 = __connman_ippool_create(23, 1, 100, NULL, NULL);
+	g_assert(pool1);
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool1), ==,
+							"192.168.1.1");
+
+	pool2 = __connman_ippool_create(23, 1, 100, NULL, NULL);
+	g_assert(pool2);
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool2), ==,
+							"192.168.2.1");
+
+	__connman_ippool_unref(pool1);
+	__connman_ippool_unref(pool2);
+
+	__connman_ippool_cleanup();
+}
+
+/*
+ * Uses up all blocks but the first ones of 10.0.0.0/8 and measures
+ * how long finding the first free block and then creating pools
+ * again and again takes. Only the smallest size runs unless the
+ * tests are run with -m perf.
+ */
+static void test_scaling(void)
+{
+	struct connman_ippool *pool;
+	unsigned int counts[] = { 256, 4096, 32768 };
+	unsigned int i, n, blocks;
+	char address[16];
+	double first, elapsed;
+
+	for (i = 0; i < G_N_ELEMENTS(counts); i++) {
+		if (counts[i] > 256 && !g_test_perf())
+			break;
+
+		__connman_ippool_init();
+
+		__connman_ippool_newaddr(1, "192.168.0.1", 16);
+		__connman_ippool_newaddr(2, "172.16.0.1", 12);
+
+		for (n = 0, blocks = 0; blocks < counts[i]; n++) {
+			/* x.x.255.0 blocks are never handed out */
+			if ((n & 0xff) == 0xff)
+				continue;
+
+			snprintf(address, sizeof(address), "10.%u.%u.1",
+							n >> 8, n & 0xff);
+			__connman_ippool_newaddr(n + 10, address, 24);
+			blocks++;
+		}
+
+		if ((n & 0xff) == 0xff)
+			n++;
+
+		snprintf(address, sizeof(address), "10.%u.%u.1",
+							n >> 8, n & 0xff);
+
+		g_test_timer_start();
+
+		pool = __connman_ippool_create(3, 1, 100, NULL, NULL);
+
+		first = g_test_timer_elapsed();
+
+		g_assert(pool);
+		g_assert_cmpstr(__connman_ippool_get_gateway(pool), ==,
+								address);
+		__connman_ippool_unref(pool);
+
+		g_test_timer_start();
+
+		for (n = 0; n < 1000; n++) {
+			pool = __connman_ippool_create(3, 1, 100, NULL, NULL);
+			g_assert(pool);
+			__connman_ippool_unref(pool);
+		}
+
+		elapsed = g_test_timer_elapsed();
+
+		g_test_message("%u used blocks: first pool %.2f us, "
+				"then %.2f us per pool", counts[i],
+				first * 1e6, elapsed * 1000);
+
+		__connman_ippool_cleanup();
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
@@ -446,6 +544,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/ippool/Test case 4", test_case_4);
 	g_test_add_func("/ippool/Test case 5", test_case_5);
 	g_test_add_func("/ippool/Test case 6", test_case_6);
+	g_test_add_func("/ippool/Test case 7", test_case_7);
+	g_test_add_func("/ippool/Scaling", test_scaling);
 
 	return g_test_run();
 }
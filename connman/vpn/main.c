@@ -400,6 +400,7 @@ int main(int argc, char *argv[])
 	__connman_plugin_cleanup();
 	__connman_task_cleanup();
 	__vpn_rtnl_cleanup();
+	__connman_inet_cleanup();
 	__vpn_ipconfig_cleanup();
 	__vpn_manager_cleanup();
 	__vpn_provider_cleanup();